@@ -17,7 +17,13 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <assert.h>
+#include <limits.h>
+#include <time.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
 
 #include "networking/http_server.h"
 #include "httpcontrol.h"
@@ -26,6 +32,10 @@
 #include "misc/string.h"
 #include "backend/backend.h"
 #include "ui/ui.h"
+#include "video/video_timing.h"
+#include "htsmsg/htsmsg_json.h"
+#include "blobcache.h"
+#include "fileaccess/fileaccess.h"
 
 #define STRINGIFY(A)  #A
 
@@ -59,6 +69,47 @@ hc_open(http_connection_t *hc, const char *remain, void *opaque,
 }
 
 
+/**
+ * Return content type of image by looking at the first bytes,
+ * NULL if it's not something we know
+ */
+static const char *
+image_content_type(const uint8_t *buf)
+{
+  if(buf[0] == 0xff && buf[1] == 0xd8)
+    return "image/jpeg";
+  if(!memcmp(buf, "\x89PNG", 4))
+    return "image/png";
+  if(!memcmp(buf, "GIF8", 4))
+    return "image/gif";
+  return NULL;
+}
+
+
+/**
+ * Open image whose original data is on local disk: Images fetched by
+ * fa_quickload() and kept in the blobcache, and local files
+ */
+static int
+image_open_local(const char *url)
+{
+  int fd;
+
+  if((fd = blobcache_get_fd(url, "fa_quickload", NULL)) != -1)
+    return fd;
+
+  if(!strncmp(url, "file://", 7))
+    url += 7;
+
+  if(url[0] != '/')
+    return -1;
+  return open(url, O_RDONLY);
+}
+
+
+/**
+ *
+ */
 static int
 hc_image(http_connection_t *hc, const char *remain, void *opaque,
 	http_cmd_t method)
@@ -67,6 +118,31 @@ hc_image(http_connection_t *hc, const char *remain, void *opaque,
   pixmap_t *pm;
   char errbuf[200];
   const char *content;
+  uint8_t hdr[4];
+  fa_handle_t *fh;
+  int fd;
+
+  if(remain == NULL)
+    return HTTP_STATUS_NOT_FOUND;
+
+  // Send straight from disk if we can, no need to load it
+  if((fd = image_open_local(remain)) != -1) {
+    off_t pos = lseek(fd, 0, SEEK_CUR);
+    if(pos != -1 && pread(fd, hdr, 4, pos) == 4 &&
+       (content = image_content_type(hdr)) != NULL)
+      return http_send_fd(hc, fd, content, 0);
+    close(fd);
+
+  } else if(strncmp(remain, "http", 4) &&
+	    (fh = fa_open(remain, errbuf, sizeof(errbuf))) != NULL) {
+    /* Stream it as is from wherever it is. Except for HTTP, those go
+       via fa_quickload() below so they end up in the blobcache */
+    if(fa_read(fh, hdr, 4) == 4 && fa_seek(fh, 0, SEEK_SET) == 0 &&
+       (content = image_content_type(hdr)) != NULL)
+      return http_send_fh(hc, fh, content, 0);
+    fa_close(fh);
+  }
+
   pm = backend_imageloader(remain, 0, NULL, errbuf, sizeof(errbuf));
   if(pm == NULL)
     return http_error(hc, 404, "Unable to load image %s : %s",
@@ -167,6 +243,442 @@ hc_prop(http_connection_t *hc, const char *remain, void *opaque,
 }
 
 
+/**
+ * Prop tree streaming
+ *
+ * /propstream/<path> subscribes to the prop subtree at <path> and
+ * sends changes as server-sent events. Each event carries a JSON
+ * object with the nodes removed and the values set since the last
+ * event: {"del": ["a/d"], "set": {"a/b": 1, "a/c": "foo"}}
+ *
+ * A client must apply "del" (each path and everything below it)
+ * before "set". A node that is removed and added again within one
+ * event shows up in both, and the values in "set" are the new ones:
+ * removing a node drops all pending values at or below its path, so
+ * everything left in "set" happened after every removal in "del".
+ *
+ * Paths are relative to the subscribed prop, the prop itself is ".".
+ * Directories are sent as {} and void values as null. Anonymous
+ * childs are named "#<n>". The first event is a full snapshot.
+ *
+ * All subscriptions are dispatched on a single thread. Changes are
+ * coalesced per stream and written at most every PS_INTERVAL ms. If a
+ * client is slow, changes keep accumulating until it catches up.
+ */
+
+#define PS_INTERVAL      100   // Coalesce changes for this many ms
+#define PS_PING          15    // Keepalive comment when idle (seconds)
+#define PS_MAX_NODES     4096
+#define PS_DEFAULT_DEPTH 4
+#define PS_MAX_DEPTH     8
+
+LIST_HEAD(ps_node_list, ps_node);
+LIST_HEAD(prop_stream_list, prop_stream);
+
+typedef struct ps_node {
+  LIST_ENTRY(ps_node) psn_link;
+  struct ps_node_list psn_childs;
+  struct prop_stream *psn_ps;
+  prop_t *psn_prop;
+  prop_sub_t *psn_sub;
+  char *psn_path;
+  int psn_depth;
+} ps_node_t;
+
+typedef struct prop_stream {
+  LIST_ENTRY(prop_stream) ps_link;
+  http_connection_t *ps_hc;
+  prop_t *ps_root;
+  ps_node_t *ps_top;
+  int ps_maxdepth;
+  int ps_nodes;
+  int ps_tally;
+  int ps_failed;
+  htsmsg_t *ps_set;
+  htsmsg_t *ps_del;
+  time_t ps_last_write;
+} prop_stream_t;
+
+static hts_mutex_t ps_mutex;
+static hts_cond_t ps_cond;
+static int ps_pending;
+static struct prop_stream_list ps_new;     // Protected by ps_mutex
+static struct prop_stream_list ps_active;  // Only touched by ps_thread
+static prop_courier_t *ps_courier;
+
+static void ps_cb(void *opaque, prop_event_t event, ...);
+
+
+/**
+ * Called with prop_mutex held, so just poke the thread
+ */
+static void
+ps_notify(void *opaque)
+{
+  hts_mutex_lock(&ps_mutex);
+  ps_pending = 1;
+  hts_cond_signal(&ps_cond);
+  hts_mutex_unlock(&ps_mutex);
+}
+
+
+/**
+ *
+ */
+static ps_node_t *
+ps_node_create(prop_stream_t *ps, ps_node_t *parent, prop_t *p)
+{
+  ps_node_t *psn = calloc(1, sizeof(ps_node_t));
+  const char *name = prop_get_name(p);
+  char id[16], path[512];
+
+  if(parent != NULL) {
+    if(name == NULL) {
+      snprintf(id, sizeof(id), "#%d", ++ps->ps_tally);
+      name = id;
+    }
+    if(parent->psn_depth == 0)
+      psn->psn_path = strdup(name);
+    else
+    {
+      snprintf(path, sizeof(path), "%s/%s", parent->psn_path, name);
+      psn->psn_path = strdup(path);
+    }
+    psn->psn_depth = parent->psn_depth + 1;
+    LIST_INSERT_HEAD(&parent->psn_childs, psn, psn_link);
+  } else {
+    psn->psn_path = strdup(".");
+  }
+
+  psn->psn_ps = ps;
+  psn->psn_prop = prop_ref_inc(p);
+  ps->ps_nodes++;
+
+  psn->psn_sub = prop_subscribe(0,
+				PROP_TAG_CALLBACK, ps_cb, psn,
+				PROP_TAG_ROOT, p,
+				PROP_TAG_COURIER, ps_courier,
+				NULL);
+  return psn;
+}
+
+
+/**
+ * Forget about all pending changes for the node and below.
+ * This is what makes it safe for clients to apply "del" before "set"
+ */
+static void
+ps_forget(prop_stream_t *ps, const char *path)
+{
+  htsmsg_field_t *f, *next;
+  int len = strlen(path);
+
+  for(f = TAILQ_FIRST(&ps->ps_set->hm_fields); f != NULL; f = next) {
+    next = TAILQ_NEXT(f, hmf_link);
+    if(!strncmp(f->hmf_name, path, len) &&
+       (f->hmf_name[len] == 0 || f->hmf_name[len] == '/'))
+      htsmsg_delete_field(ps->ps_set, f->hmf_name);
+  }
+}
+
+
+/**
+ *
+ */
+static void
+ps_node_destroy(ps_node_t *psn, int report)
+{
+  prop_stream_t *ps = psn->psn_ps;
+  ps_node_t *c;
+
+  if(report) {
+    ps_forget(ps, psn->psn_path);
+    htsmsg_add_str(ps->ps_del, NULL, psn->psn_path);
+  }
+
+  while((c = LIST_FIRST(&psn->psn_childs)) != NULL)
+    ps_node_destroy(c, 0);
+
+  if(psn->psn_depth > 0)
+    LIST_REMOVE(psn, psn_link);
+
+  prop_unsubscribe(psn->psn_sub);
+  prop_ref_dec(psn->psn_prop);
+  ps->ps_nodes--;
+  free(psn->psn_path);
+  free(psn);
+}
+
+
+/**
+ *
+ */
+static void
+ps_add_child(ps_node_t *psn, prop_t *p)
+{
+  prop_stream_t *ps = psn->psn_ps;
+
+  if(psn->psn_depth >= ps->ps_maxdepth || ps->ps_nodes >= PS_MAX_NODES)
+    return;
+  ps_node_create(ps, psn, p);
+}
+
+
+/**
+ *
+ */
+static void
+ps_del_child(ps_node_t *psn, prop_t *p)
+{
+  ps_node_t *c;
+
+  LIST_FOREACH(c, &psn->psn_childs, psn_link) {
+    if(c->psn_prop == p) {
+      ps_node_destroy(c, 1);
+      return;
+    }
+  }
+}
+
+
+/**
+ * Replace pending value for the node
+ */
+static htsmsg_t *
+ps_set(ps_node_t *psn)
+{
+  htsmsg_t *m = psn->psn_ps->ps_set;
+  htsmsg_delete_field(m, psn->psn_path);
+  return m;
+}
+
+
+/**
+ *
+ */
+static void
+ps_cb(void *opaque, prop_event_t event, ...)
+{
+  ps_node_t *psn = opaque;
+  prop_stream_t *ps = psn->psn_ps;
+  prop_vec_t *pv;
+  rstr_t *r;
+  va_list ap;
+  int i;
+
+  va_start(ap, event);
+
+  switch(event) {
+  case PROP_SET_VOID:
+    htsmsg_add_dbl(ps_set(psn), psn->psn_path, NAN); // Written as null
+    break;
+
+  case PROP_SET_RSTRING:
+    r = va_arg(ap, rstr_t *);
+    htsmsg_add_str(ps_set(psn), psn->psn_path, rstr_get(r));
+    break;
+
+  case PROP_SET_RLINK:
+    r = va_arg(ap, rstr_t *);
+    htsmsg_add_str(ps_set(psn), psn->psn_path, rstr_get(r));
+    break;
+
+  case PROP_SET_INT:
+    htsmsg_add_s32(ps_set(psn), psn->psn_path, va_arg(ap, int));
+    break;
+
+  case PROP_SET_FLOAT:
+    htsmsg_add_dbl(ps_set(psn), psn->psn_path, va_arg(ap, double));
+    break;
+
+  case PROP_SET_DIR:
+    htsmsg_add_msg(ps_set(psn), psn->psn_path, htsmsg_create_map());
+    break;
+
+  case PROP_ADD_CHILD:
+  case PROP_ADD_CHILD_BEFORE:
+    ps_add_child(psn, va_arg(ap, prop_t *));
+    break;
+
+  case PROP_ADD_CHILD_VECTOR:
+    pv = va_arg(ap, prop_vec_t *);
+    for(i = 0; i < pv->pv_length; i++)
+      ps_add_child(psn, pv->pv_vec[i]);
+    break;
+
+  case PROP_DEL_CHILD:
+    ps_del_child(psn, va_arg(ap, prop_t *));
+    break;
+
+  case PROP_DESTROYED:
+    if(psn == ps->ps_top)
+      ps->ps_failed = 1;
+    break;
+
+  default:
+    break;
+  }
+  va_end(ap);
+}
+
+
+/**
+ * Write pending changes, if the client can take them
+ */
+static void
+ps_flush(prop_stream_t *ps, time_t now)
+{
+  htsbuf_queue_t q;
+  char *data;
+  size_t len;
+  int r;
+
+  htsbuf_queue_init(&q, 0);
+
+  if(TAILQ_FIRST(&ps->ps_set->hm_fields) != NULL ||
+     TAILQ_FIRST(&ps->ps_del->hm_fields) != NULL) {
+
+    // "del" goes first, it must be applied first
+    htsbuf_append(&q, "data: {\"del\":", 13);
+    htsmsg_json_serialize(ps->ps_del, &q, 0);
+    htsbuf_append(&q, ",\"set\":", 7);
+    htsmsg_json_serialize(ps->ps_set, &q, 0);
+    htsbuf_append(&q, "}\n\n", 3);
+
+  } else if(now - ps->ps_last_write >= PS_PING) {
+    htsbuf_append(&q, ":\n\n", 3);
+  } else {
+    return;
+  }
+
+  len = q.hq_size;
+  data = malloc(len);
+  htsbuf_read(&q, data, len);
+  r = http_stream_send(ps->ps_hc, data, len, 1);
+  free(data);
+
+  if(r == -1) {
+    ps->ps_failed = 1;
+  } else if(r == 0) {
+    ps->ps_last_write = now;
+    htsmsg_destroy(ps->ps_set);
+    htsmsg_destroy(ps->ps_del);
+    ps->ps_set = htsmsg_create_map();
+    ps->ps_del = htsmsg_create_list();
+  }
+  // else: Client is lagging behind, try again with more changes later
+}
+
+
+/**
+ *
+ */
+static void
+ps_destroy(prop_stream_t *ps)
+{
+  LIST_REMOVE(ps, ps_link);
+  ps_node_destroy(ps->ps_top, 0);
+  prop_ref_dec(ps->ps_root);
+  htsmsg_destroy(ps->ps_set);
+  htsmsg_destroy(ps->ps_del);
+  http_stream_end(ps->ps_hc);
+  free(ps);
+}
+
+
+/**
+ *
+ */
+static void *
+ps_thread(void *aux)
+{
+  prop_stream_t *ps, *next;
+  struct prop_stream_list l;
+  time_t now;
+
+  hts_mutex_lock(&ps_mutex);
+
+  while(1) {
+    if(!ps_pending && LIST_FIRST(&ps_new) == NULL)
+      hts_cond_wait_timeout(&ps_cond, &ps_mutex, PS_PING * 1000);
+
+    ps_pending = 0;
+    LIST_INIT(&l);
+    while((ps = LIST_FIRST(&ps_new)) != NULL) {
+      LIST_REMOVE(ps, ps_link);
+      LIST_INSERT_HEAD(&l, ps, ps_link);
+    }
+    hts_mutex_unlock(&ps_mutex);
+
+    while((ps = LIST_FIRST(&l)) != NULL) {
+      LIST_REMOVE(ps, ps_link);
+      LIST_INSERT_HEAD(&ps_active, ps, ps_link);
+      ps->ps_top = ps_node_create(ps, NULL, ps->ps_root);
+    }
+
+    prop_courier_poll(ps_courier);
+
+    now = time(NULL);
+    for(ps = LIST_FIRST(&ps_active); ps != NULL; ps = next) {
+      next = LIST_NEXT(ps, ps_link);
+      if(!ps->ps_failed)
+	ps_flush(ps, now);
+      if(ps->ps_failed)
+	ps_destroy(ps);
+    }
+
+    if(LIST_FIRST(&ps_active) != NULL)
+      usleep(PS_INTERVAL * 1000);
+
+    hts_mutex_lock(&ps_mutex);
+  }
+  return NULL;
+}
+
+
+/**
+ *
+ */
+static int
+hc_propstream(http_connection_t *hc, const char *remain, void *opaque,
+	      http_cmd_t method)
+{
+  prop_stream_t *ps;
+  const char *v;
+  prop_t *p;
+  int depth = PS_DEFAULT_DEPTH;
+
+  if(method != HTTP_CMD_GET)
+    return HTTP_STATUS_METHOD_NOT_ALLOWED;
+
+  if(remain == NULL || (p = prop_from_path(remain)) == NULL)
+    return HTTP_STATUS_NOT_FOUND;
+
+  if((v = http_arg_get_req(hc, "depth")) != NULL)
+    depth = atoi(v);
+  if(depth < 0)
+    depth = 0;
+  if(depth > PS_MAX_DEPTH)
+    depth = PS_MAX_DEPTH;
+
+  ps = calloc(1, sizeof(prop_stream_t));
+  ps->ps_hc = hc;
+  ps->ps_root = p;
+  ps->ps_maxdepth = depth;
+  ps->ps_set = htsmsg_create_map();
+  ps->ps_del = htsmsg_create_list();
+  ps->ps_last_write = time(NULL);
+
+  http_stream_begin(hc, 0, "text/event-stream");
+
+  hts_mutex_lock(&ps_mutex);
+  LIST_INSERT_HEAD(&ps_new, ps, ps_link);
+  hts_cond_signal(&ps_cond);
+  hts_mutex_unlock(&ps_mutex);
+  return 0;
+}
+
+
 static int
 hc_action(http_connection_t *hc, const char *remain, void *opaque,
 	  http_cmd_t method)
@@ -208,6 +720,36 @@ hc_utf8(http_connection_t *hc, const char *remain, void *opaque,
 }
 
 
+/**
+ * Frame timing ring. ?clear=1 starts over, ?save=1 also writes it
+ * to a file in the cache directory
+ */
+static int
+hc_videotiming(http_connection_t *hc, const char *remain, void *opaque,
+	       http_cmd_t method)
+{
+  htsbuf_queue_t out;
+  char path[PATH_MAX];
+  char errbuf[128];
+  const char *v;
+
+  if((v = http_arg_get_req(hc, "save")) != NULL && atoi(v)) {
+    snprintf(path, sizeof(path), "%s/videotiming-%d.txt",
+	     showtime_cache_path, (int)time(NULL));
+    if(video_timing_dump(path, errbuf, sizeof(errbuf)))
+      return http_error(hc, 500, "Unable to write %s : %s", path, errbuf);
+  }
+
+  htsbuf_queue_init(&out, 0);
+  video_timing_format(&out);
+
+  if((v = http_arg_get_req(hc, "clear")) != NULL && atoi(v))
+    video_timing_clear();
+
+  return http_send_reply(hc, 0, "text/plain", NULL, NULL, 0, &out);
+}
+
+
 /**
  *
  */
@@ -219,4 +761,12 @@ httpcontrol_init(void)
   http_path_add("/prop", NULL, hc_prop);
   http_path_add("/input/action", NULL, hc_action);
   http_path_add("/input/utf8", NULL, hc_utf8);
+  http_path_add("/control/videotiming", NULL, hc_videotiming);
+
+  hts_mutex_init(&ps_mutex);
+  hts_cond_init(&ps_cond, &ps_mutex);
+  ps_courier = prop_courier_create_notify(ps_notify, NULL);
+  hts_thread_create_detached("propstream", ps_thread, NULL,
+			     THREAD_PRIO_LOW);
+  http_path_add("/propstream", NULL, hc_propstream);
 }
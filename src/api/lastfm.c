@@ -18,6 +18,7 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <htsmsg/htsmsg.h>
 #include <htsmsg/htsmsg_xml.h>
@@ -31,8 +32,25 @@ static prop_courier_t *lastfm_courier;
 static hts_mutex_t lastfm_mutex;
 #define LASTFM_APIKEY "e8fb67200bce49da092a9de1eb1c649c"
 
+/**
+ * All lookups are done by a single fetch thread. Requests for the same
+ * (artist, album) are coalesced into one lastfm_fetch, requests to
+ * last.fm are spaced out by LASTFM_REQUEST_INTERVAL and lookups that
+ * did not give anything are remembered for LASTFM_MISS_TTL seconds.
+ */
+#define LASTFM_REQUEST_INTERVAL 250000
+#define LASTFM_MISS_TTL         3600
+#define LASTFM_MISS_MAX         256
+
+#define LASTFM_ARTIST_IMAGES 1
+#define LASTFM_ALBUM_ART     2
+
 LIST_HEAD(album_art_cache_list, album_art_cache);
 TAILQ_HEAD(album_art_cache_queue, album_art_cache);
+LIST_HEAD(lastfm_prop_list, lastfm_prop);
+LIST_HEAD(lastfm_fetch_list, lastfm_fetch);
+TAILQ_HEAD(lastfm_fetch_queue, lastfm_fetch);
+TAILQ_HEAD(lastfm_miss_queue, lastfm_miss);
 
 #define AAC_HASHWIDTH 67
 
@@ -55,9 +73,45 @@ typedef struct lastfm_prop {
 
   rstr_t *lp_album;
   rstr_t *lp_artist;
+
+  struct lastfm_fetch *lp_fetch;
+  LIST_ENTRY(lastfm_prop) lp_fetch_link;
 } lastfm_prop_t;
 
 
+/**
+ * A lookup that is queued or in progress
+ */
+typedef struct lastfm_fetch {
+  LIST_ENTRY(lastfm_fetch) lf_link;
+  TAILQ_ENTRY(lastfm_fetch) lf_queue_link;
+  int lf_type;
+  rstr_t *lf_artist;
+  rstr_t *lf_album;
+  struct lastfm_prop_list lf_waiters;
+} lastfm_fetch_t;
+
+static struct lastfm_fetch_list lastfm_fetches;  // All, including current
+static struct lastfm_fetch_queue lastfm_fetchq;  // Not yet started
+static hts_cond_t lastfm_fetch_cond;
+
+
+/**
+ * Negative cache, only for lookups that last.fm actually answered.
+ * Failed requests are not remembered so they are retried next time
+ */
+typedef struct lastfm_miss {
+  TAILQ_ENTRY(lastfm_miss) lm_link;
+  int lm_type;
+  rstr_t *lm_artist;
+  rstr_t *lm_album;
+  time_t lm_expire;
+} lastfm_miss_t;
+
+static struct lastfm_miss_queue lastfm_misses;
+static int lastfm_nmisses;
+
+
 TAILQ_HEAD(artist_image_queue, artist_image);
 
 /**
@@ -69,6 +123,32 @@ typedef struct artist_image {
 } artist_image_t;
 
 
+/**
+ *
+ */
+static int
+lf_streq(rstr_t *a, rstr_t *b)
+{
+  if(a == NULL || b == NULL)
+    return a == b;
+  return !strcmp(rstr_get(a), rstr_get(b));
+}
+
+
+/**
+ * Strip the parts of a tag that confuses last.fm
+ */
+static rstr_t *
+lf_normalize(rstr_t *r, const char *stop)
+{
+  const char *s;
+
+  if(r == NULL)
+    return NULL;
+  s = rstr_get(r);
+  return rstr_allocl(s, strcspn(s, stop));
+}
+
 
 /**
  *
@@ -102,13 +182,66 @@ aac_insert(rstr_t *artist, rstr_t *album, rstr_t *url)
  *
  */
 static void
-lastfm_parse_artist_images(htsmsg_t *xml, prop_t *parent, int *totalpages,
+lastfm_miss_destroy(lastfm_miss_t *lm)
+{
+  TAILQ_REMOVE(&lastfm_misses, lm, lm_link);
+  rstr_release(lm->lm_artist);
+  rstr_release(lm->lm_album);
+  free(lm);
+  lastfm_nmisses--;
+}
+
+
+/**
+ *
+ */
+static void
+lastfm_miss_insert(int type, rstr_t *artist, rstr_t *album)
+{
+  lastfm_miss_t *lm = malloc(sizeof(lastfm_miss_t));
+
+  lm->lm_type = type;
+  lm->lm_artist = rstr_dup(artist);
+  lm->lm_album = rstr_dup(album);
+  lm->lm_expire = time(NULL) + LASTFM_MISS_TTL;
+  TAILQ_INSERT_TAIL(&lastfm_misses, lm, lm_link);
+
+  if(++lastfm_nmisses > LASTFM_MISS_MAX)
+    lastfm_miss_destroy(TAILQ_FIRST(&lastfm_misses));
+}
+
+
+/**
+ *
+ */
+static int
+lastfm_miss_find(int type, rstr_t *artist, rstr_t *album)
+{
+  lastfm_miss_t *lm;
+  time_t now = time(NULL);
+
+  // Oldest entries are first
+  while((lm = TAILQ_FIRST(&lastfm_misses)) != NULL && lm->lm_expire < now)
+    lastfm_miss_destroy(lm);
+
+  TAILQ_FOREACH(lm, &lastfm_misses, lm_link)
+    if(lm->lm_type == type &&
+       lf_streq(lm->lm_artist, artist) && lf_streq(lm->lm_album, album))
+      return 1;
+  return 0;
+}
+
+
+/**
+ *
+ */
+static void
+lastfm_parse_artist_images(htsmsg_t *xml, int *totalpages,
 			   struct artist_image_queue *q)
 {
   htsmsg_t *images, *image, *sizes, *size, *attr;
   htsmsg_field_t *f, *s;
   const char *url, *str;
-  prop_t *p;
   artist_image_t *ai;
 
   *totalpages = 1;
@@ -148,13 +281,6 @@ lastfm_parse_artist_images(htsmsg_t *xml, prop_t *parent, int *totalpages,
       if((url = htsmsg_get_str(size, "cdata")) == NULL)
 	continue;
 
-      p = prop_create_root(NULL);
-
-      prop_set_string(prop_create(p, "url"), url);
-
-      if(prop_set_parent(p, parent))
-	prop_destroy(p);
-
       ai = malloc(sizeof(artist_image_t));
       ai->url = strdup(url);
       TAILQ_INSERT_TAIL(q, ai, link);
@@ -164,10 +290,10 @@ lastfm_parse_artist_images(htsmsg_t *xml, prop_t *parent, int *totalpages,
 
 
 /**
- *
+ * Images are kept as a '\n' separated list of URLs
  */
-static void
-write_to_blobcache(const char *artist, struct artist_image_queue *q)
+static char *
+artist_images_to_blob(struct artist_image_queue *q, size_t *sizep)
 {
   artist_image_t *ai;
   int blobsize = 0;
@@ -178,7 +304,6 @@ write_to_blobcache(const char *artist, struct artist_image_queue *q)
 
   ptr = blob = malloc(blobsize);
 
-
   while((ai = TAILQ_FIRST(q)) != NULL) {
     TAILQ_REMOVE(q, ai, link);
     int l = strlen(ai->url);
@@ -189,118 +314,155 @@ write_to_blobcache(const char *artist, struct artist_image_queue *q)
     free(ai->url);
     free(ai);
   }
-  
-  blobcache_put(artist, "lastfm.artist.images", blob, blobsize, 86400);
-  free(blob);
+
+  *sizep = blobsize;
+  return blob;
 }
 
 
 /**
  *
  */
-static int
-load_from_blobcache(const char *artist, prop_t *parent)
+static void
+artist_images_to_prop(const char *blob, prop_t *parent)
 {
-  char *data, *s0, *s;
-  size_t size;
+  char *copy = strdup(blob), *s0 = copy, *s;
   prop_t *p;
 
-  s0 = data = blobcache_get(artist, "lastfm.artist.images", &size, 1);
-  if(data == NULL)
-    return 0;
-
   while((s = strsep(&s0, "\n")) != NULL) {
-      p = prop_create_root(NULL);
+    if(*s == 0)
+      continue;
+
+    p = prop_create_root(NULL);
 
-      prop_set_string(prop_create(p, "url"), s);
+    prop_set_string(prop_create(p, "url"), s);
 
-      if(prop_set_parent(p, parent))
-	prop_destroy(p);
+    if(prop_set_parent(p, parent))
+      prop_destroy(p);
   }
+  free(copy);
+}
+
+
+/**
+ *
+ */
+static int
+load_from_blobcache(rstr_t *artist, prop_t *parent)
+{
+  char *data;
+  size_t size;
+
+  data = blobcache_get(rstr_get(artist), "lastfm.artist.images", &size, 1);
+  if(data == NULL)
+    return 0;
+
+  artist_images_to_prop(data, parent);
   free(data);
   return 1;
 }
 
 
 /**
- *
+ * Only called from the fetch thread
  */
-static void
-lastfm_artistpics_query(lastfm_prop_t *lp)
+static int
+lastfm_http_request(const char **args, char **result, size_t *resultsize)
+{
+  static int64_t last_request;
+  char errbuf[100];
+  int64_t delay;
+  int n;
+
+  delay = last_request + LASTFM_REQUEST_INTERVAL - showtime_get_ts();
+  if(delay > 0)
+    usleep(delay);
+
+  n = http_request("http://ws.audioscrobbler.com/2.0/", args,
+		   result, resultsize, errbuf, sizeof(errbuf),
+		   NULL, NULL, HTTP_REQUEST_ESCAPE_PATH | HTTP_REQUEST_CACHE,
+		   NULL, NULL, NULL);
+
+  last_request = showtime_get_ts();
+
+  if(n)
+    TRACE(TRACE_DEBUG, "lastfm", "HTTP query to lastfm failed: %s",  errbuf);
+  return n;
+}
+
+
+/**
+ * Returns images as a blob or NULL if none was found.
+ * *failedp is set if we got nothing because the request failed
+ */
+static char *
+lastfm_artistpics_query(rstr_t *artist, size_t *sizep, int *failedp)
 {
   char *result;
   size_t resultsize;
   char errbuf[100];
-  int n, page = 1;
+  int page = 1;
   htsmsg_t *xml;
   char str[20];
-  char *artist = mystrdupa(rstr_get(lp->lp_artist));
   int totalpages;
   struct artist_image_queue q;
 
-  artist[strcspn(artist, ";:,-[]")] = 0;
-
-  if(load_from_blobcache(artist, lp->lp_prop))
-    return;
-
   TAILQ_INIT(&q);
-  TRACE(TRACE_DEBUG, "lastfm", "Loading images for artist %s", artist);
+  TRACE(TRACE_DEBUG, "lastfm", "Loading images for artist %s",
+	rstr_get(artist));
 
   while(1) {
 
     snprintf(str, sizeof(str), "%d", page);
-    n = http_request("http://ws.audioscrobbler.com/2.0/",
-		     (const char *[]){"method", "artist.getimages",
-			 "artist", artist,
-			 "api_key", LASTFM_APIKEY,
-			 "order", "popularity",
-			 "page", str,
-			 NULL, NULL},
-		     &result, &resultsize, errbuf, sizeof(errbuf),
-		     NULL, NULL, HTTP_REQUEST_ESCAPE_PATH, NULL, NULL, NULL);
-
-    if(n) {
-      TRACE(TRACE_DEBUG, "lastfm", "HTTP query to lastfm failed: %s",  errbuf);
-      return;
+    if(lastfm_http_request((const char *[]){"method", "artist.getimages",
+	    "artist", rstr_get(artist),
+	    "api_key", LASTFM_APIKEY,
+	    "order", "popularity",
+	    "page", str,
+	    NULL, NULL}, &result, &resultsize)) {
+      *failedp = 1;
+      break;
     }
 
-
     /* XML parser consumes 'buf' */
     if((xml = htsmsg_xml_deserialize(result, errbuf, sizeof(errbuf))) == NULL) {
       TRACE(TRACE_DEBUG, "lastfm", "lastfm xml parse failed: %s",  errbuf);
-      return;
+      *failedp = 1;
+      break;
     }
 
-    lastfm_parse_artist_images(xml, lp->lp_prop, &totalpages, &q);
+    lastfm_parse_artist_images(xml, &totalpages, &q);
 
     htsmsg_destroy(xml);
     
-    if(page == 5 || page == totalpages)
+    if(page == 5 || page >= totalpages)
       break;
 
     page++;
   }
 
-  write_to_blobcache(artist, &q);
+  if(TAILQ_FIRST(&q) == NULL)
+    return NULL;
+  *failedp = 0; // Keep what we got from the first pages
+  return artist_images_to_blob(&q, sizep);
 }
 
 
 /**
  *
  */
-static void
-lastfm_parse_coverart(htsmsg_t *xml, lastfm_prop_t *lp)
+static rstr_t *
+lastfm_parse_coverart(htsmsg_t *xml)
 {
   htsmsg_t *tags, *image;
   htsmsg_field_t *f;
   int curscore = -1, s;
   const char *size, *url, *best = NULL;
-  rstr_t *img;
 
   if((tags = htsmsg_get_map_multi(xml, "tags", "lfm", 
 				  "tags", "album", 
 				  "tags", NULL)) == NULL) {
-    return;
+    return NULL;
   }
 
   HTSMSG_FOREACH(f, tags) {
@@ -330,66 +492,55 @@ lastfm_parse_coverart(htsmsg_t *xml, lastfm_prop_t *lp)
     curscore = s;
     best = url;
   }
-  if(best == NULL)
-    return;
-
-  img = rstr_alloc(best);
-
-  aac_insert(lp->lp_artist, lp->lp_album, img);
-  prop_set_rstring(lp->lp_prop, img);
-  rstr_release(img);
+  return best ? rstr_alloc(best) : NULL;
 }
 
 
 /**
- *
+ * *failedp is set if the request failed
  */
-static void
-lastfm_albumart_query(lastfm_prop_t *lp)
+static rstr_t *
+lastfm_albumart_query(rstr_t *artist, rstr_t *album, int *failedp)
 {
   char *result;
   size_t resultsize;
   char errbuf[100];
-  int n;
   htsmsg_t *xml;
-  char *artist = mystrdupa(rstr_get(lp->lp_artist));
-  char *album  = mystrdupa(rstr_get(lp->lp_album));
-
-  artist[strcspn(artist, ";:,-[]")] = 0;
-  album[strcspn(album, "[]()")] = 0;
-
-  TRACE(TRACE_DEBUG, "lastfm", "Loading coverart for album %s", album);
+  rstr_t *img;
 
-  n = http_request("http://ws.audioscrobbler.com/2.0/",
-		   (const char *[]){"method", "album.getinfo",
-		       "artist", artist,
-		       "album", album,
-		       "api_key", LASTFM_APIKEY,
-		       NULL, NULL},
-		   &result, &resultsize, errbuf, sizeof(errbuf),
-		   NULL, NULL, HTTP_REQUEST_ESCAPE_PATH, NULL, NULL, NULL);
+  TRACE(TRACE_DEBUG, "lastfm", "Loading coverart for album %s",
+	rstr_get(album));
 
-  if(n) {
-    TRACE(TRACE_DEBUG, "lastfm", "HTTP query to lastfm failed: %s",  errbuf);
-    return;
+  if(lastfm_http_request((const char *[]){"method", "album.getinfo",
+	  "artist", rstr_get(artist),
+	  "album", rstr_get(album),
+	  "api_key", LASTFM_APIKEY,
+	  NULL, NULL}, &result, &resultsize)) {
+    *failedp = 1;
+    return NULL;
   }
 
   /* XML parser consumes 'buf' */
   if((xml = htsmsg_xml_deserialize(result, errbuf, sizeof(errbuf))) == NULL) {
     TRACE(TRACE_DEBUG, "lastfm", "lastfm xml parse failed: %s",  errbuf);
-    return;
+    *failedp = 1;
+    return NULL;
   }
 
-  lastfm_parse_coverart(xml, lp);
+  img = lastfm_parse_coverart(xml);
   htsmsg_destroy(xml);
+  return img;
 }
 
+
 /**
- *
+ * lastfm_mutex must be held
  */
 static void
 lp_destroy(lastfm_prop_t *lp)
 {
+  if(lp->lp_fetch != NULL)
+    LIST_REMOVE(lp, lp_fetch_link);
   prop_unsubscribe(lp->lp_sub);
   prop_ref_dec(lp->lp_prop);
   rstr_release(lp->lp_artist);
@@ -398,6 +549,130 @@ lp_destroy(lastfm_prop_t *lp)
 }
 
 
+/**
+ * Attach prop to a lookup for the same thing, or start a new one.
+ * lastfm_mutex must be held
+ */
+static void
+lastfm_fetch_enqueue(lastfm_prop_t *lp, int type)
+{
+  lastfm_fetch_t *lf;
+
+  LIST_FOREACH(lf, &lastfm_fetches, lf_link)
+    if(lf->lf_type == type &&
+       lf_streq(lf->lf_artist, lp->lp_artist) &&
+       lf_streq(lf->lf_album, lp->lp_album))
+      break;
+
+  if(lf == NULL) {
+    lf = calloc(1, sizeof(lastfm_fetch_t));
+    lf->lf_type = type;
+    lf->lf_artist = rstr_dup(lp->lp_artist);
+    lf->lf_album = rstr_dup(lp->lp_album);
+    LIST_INSERT_HEAD(&lastfm_fetches, lf, lf_link);
+    TAILQ_INSERT_TAIL(&lastfm_fetchq, lf, lf_queue_link);
+    hts_cond_signal(&lastfm_fetch_cond);
+  }
+
+  lp->lp_fetch = lf;
+  LIST_INSERT_HEAD(&lf->lf_waiters, lp, lp_fetch_link);
+}
+
+
+/**
+ * Hand out result to all waiters and cache it.
+ * lastfm_mutex must be held
+ */
+static void
+lastfm_fetch_complete(lastfm_fetch_t *lf, rstr_t *img,
+		      const char *blob, size_t blobsize, int failed)
+{
+  lastfm_prop_t *lp;
+
+  if(img != NULL) {
+    aac_insert(lf->lf_artist, lf->lf_album, img);
+  } else if(blob != NULL) {
+    blobcache_put(rstr_get(lf->lf_artist), "lastfm.artist.images",
+		  blob, blobsize, 86400);
+  } else if(!failed) {
+    // Failed requests are not remembered, next lookup will retry
+    lastfm_miss_insert(lf->lf_type, lf->lf_artist, lf->lf_album);
+  }
+
+  while((lp = LIST_FIRST(&lf->lf_waiters)) != NULL) {
+    if(failed) {
+      // Stay subscribed, next time the prop is wanted we try again
+      LIST_REMOVE(lp, lp_fetch_link);
+      lp->lp_fetch = NULL;
+      continue;
+    }
+    if(img != NULL)
+      prop_set_rstring(lp->lp_prop, img);
+    else if(blob != NULL)
+      artist_images_to_prop(blob, lp->lp_prop);
+    lp_destroy(lp);
+  }
+
+  LIST_REMOVE(lf, lf_link);
+  rstr_release(lf->lf_artist);
+  rstr_release(lf->lf_album);
+  free(lf);
+}
+
+
+/**
+ *
+ */
+static void *
+lastfm_fetch_thread(void *aux)
+{
+  lastfm_fetch_t *lf;
+  rstr_t *img;
+  char *blob;
+  size_t blobsize;
+  int failed;
+
+  hts_mutex_lock(&lastfm_mutex);
+
+  while(1) {
+
+    if((lf = TAILQ_FIRST(&lastfm_fetchq)) == NULL) {
+      hts_cond_wait(&lastfm_fetch_cond, &lastfm_mutex);
+      continue;
+    }
+
+    TAILQ_REMOVE(&lastfm_fetchq, lf, lf_queue_link);
+
+    if(LIST_FIRST(&lf->lf_waiters) == NULL) {
+      // Everyone lost interest while it was queued
+      LIST_REMOVE(lf, lf_link);
+      rstr_release(lf->lf_artist);
+      rstr_release(lf->lf_album);
+      free(lf);
+      continue;
+    }
+
+    hts_mutex_unlock(&lastfm_mutex);
+
+    img = NULL;
+    blob = NULL;
+    blobsize = 0;
+    failed = 0;
+
+    if(lf->lf_type == LASTFM_ALBUM_ART)
+      img = lastfm_albumart_query(lf->lf_artist, lf->lf_album, &failed);
+    else
+      blob = lastfm_artistpics_query(lf->lf_artist, &blobsize, &failed);
+
+    hts_mutex_lock(&lastfm_mutex);
+    lastfm_fetch_complete(lf, img, blob, blobsize, failed);
+    rstr_release(img);
+    free(blob);
+  }
+  return NULL;
+}
+
+
 /**
  *
  */
@@ -408,8 +683,17 @@ lastfm_prop_artist_cb(void *opaque, prop_event_t event, ...)
 
   switch(event) {
   case PROP_SUBSCRIPTION_MONITOR_ACTIVE:
-    lastfm_artistpics_query(lp);
-    // FALLTHRU
+    if(lp->lp_fetch != NULL)
+      break;
+
+    if(load_from_blobcache(lp->lp_artist, lp->lp_prop) ||
+       lastfm_miss_find(LASTFM_ARTIST_IMAGES, lp->lp_artist, NULL)) {
+      lp_destroy(lp);
+      break;
+    }
+    lastfm_fetch_enqueue(lp, LASTFM_ARTIST_IMAGES);
+    break;
+
   case PROP_DESTROYED:
     lp_destroy(lp);
     break;
@@ -454,9 +738,17 @@ lastfm_prop_album_cb(void *opaque, prop_event_t event, ...)
 
   switch(event) {
   case PROP_SUBSCRIPTION_MONITOR_ACTIVE:
-    if(lastfm_albumart_from_cache(lp))
-      lastfm_albumart_query(lp);
-    // FALLTHRU
+    if(lp->lp_fetch != NULL)
+      break;
+
+    if(!lastfm_albumart_from_cache(lp) ||
+       lastfm_miss_find(LASTFM_ALBUM_ART, lp->lp_artist, lp->lp_album)) {
+      lp_destroy(lp);
+      break;
+    }
+    lastfm_fetch_enqueue(lp, LASTFM_ALBUM_ART);
+    break;
+
   case PROP_DESTROYED:
     lp_destroy(lp);
     break;
@@ -478,7 +770,7 @@ lastfm_artistpics_init(prop_t *prop, rstr_t *artist)
   lastfm_prop_t *lp;
 
   lp = calloc(1, sizeof(lastfm_prop_t));
-  lp->lp_artist = rstr_dup(artist);
+  lp->lp_artist = lf_normalize(artist, ";:,-[]");
 
   lp->lp_prop = prop_ref_inc(prop);
 
@@ -500,8 +792,8 @@ lastfm_albumart_init(prop_t *prop, rstr_t *artist, rstr_t *album)
   lastfm_prop_t *lp;
 
   lp = calloc(1, sizeof(lastfm_prop_t));
-  lp->lp_artist = rstr_dup(artist);
-  lp->lp_album  = rstr_dup(album);
+  lp->lp_artist = lf_normalize(artist, ";:,-[]");
+  lp->lp_album  = lf_normalize(album, "[]()");
 
   lp->lp_prop = prop_ref_inc(prop);
 
@@ -521,6 +813,11 @@ void
 lastfm_init(void)
 {
   hts_mutex_init(&lastfm_mutex);
+  hts_cond_init(&lastfm_fetch_cond, &lastfm_mutex);
   TAILQ_INIT(&aacqueue);
+  TAILQ_INIT(&lastfm_fetchq);
+  TAILQ_INIT(&lastfm_misses);
   lastfm_courier = prop_courier_create_thread(&lastfm_mutex, "lastfm");
+  hts_thread_create_detached("lastfm fetch", lastfm_fetch_thread, NULL,
+			     THREAD_PRIO_LOW);
 }
@@ -20,7 +20,11 @@
 #define HTSATOMIC_H__
 
 /**
- * Atomically add 'incr' to *ptr and return the previous value
+ * Atomically add 'incr' to *ptr and return the previous value.
+ *
+ * atomic_add() does not order other loads and stores on all
+ * architectures (PPC and ARM), lock free code must use
+ * atomic_barrier() for that.
  */
 
 
@@ -33,6 +37,12 @@ atomic_add(volatile int *ptr, int incr)
   return __sync_fetch_and_add(ptr, incr);
 }
 
+static inline void
+atomic_barrier(void)
+{
+  __sync_synchronize();
+}
+
 #elif defined(__i386__) || defined(__x86_64__)
 static inline int
 atomic_add(volatile int *ptr, int incr)
@@ -42,6 +52,12 @@ atomic_add(volatile int *ptr, int incr)
 	       "=r"(r), "=m"(*ptr) : "0" (incr), "m" (*ptr) : "memory");
   return r;
 }
+
+static inline void
+atomic_barrier(void)
+{
+  asm volatile("mfence" ::: "memory");
+}
 #elif defined(WII)
 
 #include <ogc/machine/processor.h>
@@ -66,6 +82,13 @@ atomic_add(volatile int *ptr, int incr)
 
   return r;
 }
+
+/* Single core, only the compiler can reorder things */
+static inline void
+atomic_barrier(void)
+{
+  asm volatile("" ::: "memory");
+}
 #elif defined(__ppc__) || defined(__PPC__)
 
 /* somewhat based on code from darwin gcc  */
@@ -85,6 +108,12 @@ atomic_add (volatile int *ptr, int incr)
   return res;
 }
 
+static inline void
+atomic_barrier(void)
+{
+  asm volatile("sync" ::: "memory");
+}
+
 #elif defined(__arm__) 
 
 static inline int 
@@ -105,6 +134,19 @@ atomic_add(volatile int *ptr, int val)
   return a;
 }
 
+static inline void
+atomic_barrier(void)
+{
+#if defined(__ARM_ARCH_7__) || defined(__ARM_ARCH_7A__)
+  asm volatile("dmb" ::: "memory");
+#elif defined(__ARM_ARCH_6__) || defined(__ARM_ARCH_6K__) || \
+  defined(__ARM_ARCH_6Z__) || defined(__ARM_ARCH_6ZK__)
+  asm volatile("mcr p15, 0, %0, c7, c10, 5" :: "r" (0) : "memory");
+#else
+  asm volatile("" ::: "memory");
+#endif
+}
+
 #else
 #error Missing atomic ops
 #endif
@@ -28,6 +28,7 @@
 #include "audio_defs.h"
 #include "audio_fifo.h"
 #include "audio_decoder.h"
+#include "audio_mix.h"
 #include "notifications.h"
 
 audio_mode_t *audio_mode_current;
@@ -145,6 +146,7 @@ void
 audio_init(void)
 {
   audio_mastervol_init();
+  audio_mix_init();
 
   audio_settings_root = settings_add_dir(NULL, "Audio output", "sound", NULL);
   
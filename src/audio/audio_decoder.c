@@ -26,6 +26,8 @@
 #include "showtime.h"
 #include "audio_decoder.h"
 #include "audio_defs.h"
+#include "audio_mix.h"
+#include "audio_resampler.h"
 #include "event.h"
 #include "misc/strtab.h"
 
@@ -46,9 +48,6 @@ static void audio_mix2(audio_decoder_t *ad, audio_mode_t *am,
 
 static void close_resampler(audio_decoder_t *ad);
 
-static int resample(audio_decoder_t *ad, int16_t *dstmix, int dstavail,
-		    int *writtenp, int16_t *srcmix, int srcframes,
-		    int channels);
 
 static void ad_decode_buf(audio_decoder_t *ad, media_pipe_t *mp,
 			  media_queue_t *mq, media_buf_t *mb);
@@ -186,6 +185,8 @@ ad_thread(void *aux)
 
     case MB_END:
       mp_set_current_time(mp, AV_NOPTS_VALUE);
+      if(mp_is_primary(mp))
+	audio_fifo_end(thefifo);
       break;
 
     default:
@@ -209,7 +210,7 @@ audio_deliver_passthru(media_buf_t *mb, audio_decoder_t *ad, int format,
   audio_fifo_t *af = thefifo;
   audio_buf_t *ab;
 
-  ab = af_alloc(mb->mb_size, mp);
+  ab = af_alloc(af, mb->mb_size, mp);
   ab->ab_channels = 2;
   ab->ab_format   = format;
   ab->ab_samplerate= 48000;
@@ -439,7 +440,7 @@ astats(audio_decoder_t *ad, media_pipe_t *mp, int64_t pts, int epoch,
 {
   int v[8];
   float v0;
-  int i, j, x, b;
+  int i, j, b;
   int64_t delay;
   int steps;
   const char *n;
@@ -510,16 +511,7 @@ astats(audio_decoder_t *ad, media_pipe_t *mp, int64_t pts, int epoch,
   steps = ad->ad_odelay / (frames * 1000000 / rate);
 	 
   
-  for(j = 0; j < channels; j++)
-    v[j] = 0;
-
-  for(i = 0; i < frames; i++) {
-    for(j = 0; j < channels; j++) {
-      x = abs(*data++);
-      if(v[j] < x)
-	v[j] = x;
-    }
-  }
+  audio_mix_peak(data, frames, channels, v);
 
   i = ad->ad_peak_ptr;
   for(j = 0; j < channels; j++) {
@@ -634,36 +626,7 @@ audio_mix1(audio_decoder_t *ad, audio_mode_t *am,
    * 5.1 to stereo downmixing, coeffs are stolen from AAC spec
    */
   if(channels == 6 && audio_mode_stereo_only(am)) {
-
-    src = data0;
-    dst = data0;
-
-    for(i = 0; i < frames; i++) {
-
-      x = (src[0] * 26869) >> 16;
-      y = (src[1] * 26869) >> 16;
-
-      z = (src[4] * 19196) >> 16;
-      x += z;
-      y += z;
-
-      z = (src[5] * 13571) >> 16;
-      x += z;
-      y += z;
-
-      z = (src[2] * 13571) >> 16;
-      x -= z;
-      y += z;
-
-      z = (src[3] * 19196) >> 16;
-      x -= z;
-      y += z;
-
-      src += 6;
-
-      *dst++ = CLIP16(x);
-      *dst++ = CLIP16(y);
-    }
+    audio_mix_51_to_stereo(data0, data0, frames);
     channels = 2;
   }
 
@@ -734,22 +697,23 @@ audio_mix1(audio_decoder_t *ad, audio_mode_t *am,
     }
 
     if(ad->ad_resampler == NULL) {
-      ad->ad_resbuf = malloc(resbufsize * sizeof(int16_t) * 6);
-      ad->ad_resampler = av_resample_init(dstrate, rate, 16, 10, 0, 1.0);
+      ad->ad_resampler = audio_resampler_create(rate, dstrate, channels);
+      if(ad->ad_resampler == NULL)
+	return;
+      ad->ad_resbuf = malloc(resbufsize * sizeof(int16_t) * channels);
     }
 
+    /* If we have something buffered in the resampler, adjust PTS */
+    if(pts != AV_NOPTS_VALUE)
+      pts -= 1000000LL * audio_resampler_pending(ad->ad_resampler) / rate;
+
     src = data0;
     rate= dstrate;
 
-    /* If we have something in spill buffer, adjust PTS */
-    /* XXX: need this ?, it's very small */
-    if(pts != AV_NOPTS_VALUE)
-      pts -= 1000000LL * ad->ad_resampler_spill_size / rate;
-
     while(frames > 0) {
       consumed = 
-	resample(ad, ad->ad_resbuf, resbufsize,
-		 &written, src, frames, channels);
+	audio_resampler_process(ad->ad_resampler, ad->ad_resbuf, resbufsize,
+				&written, src, frames);
       src += consumed * channels;
       frames -= consumed;
 
@@ -932,7 +896,7 @@ audio_deliver(audio_decoder_t *ad, audio_mode_t *am, int16_t *src,
     }
 
     if(ab == NULL) {
-      ab = af_alloc(sizeof(int16_t) * channels * outsize, mp);
+      ab = af_alloc(af, sizeof(int16_t) * channels * outsize, mp);
       ab->ab_channels = channels;
       ab->ab_alloced = outsize;
       ab->ab_format = format;
@@ -987,102 +951,19 @@ audio_deliver(audio_decoder_t *ad, audio_mode_t *am, int16_t *src,
 static void
 close_resampler(audio_decoder_t *ad)
 {
-  int c;
-
   if(ad->ad_resampler == NULL) 
     return;
 
   free(ad->ad_resbuf);
   ad->ad_resbuf = NULL;
 
-  av_resample_close(ad->ad_resampler);
-  
-  for(c = 0; c < AUDIO_CHAN_MAX; c++) {
-    free(ad->ad_resampler_spill[c]);
-    ad->ad_resampler_spill[c] = NULL;
-  }
+  audio_resampler_destroy(ad->ad_resampler);
 
-  ad->ad_resampler_spill_size = 0;
   ad->ad_resampler_channels = 0;
   ad->ad_resampler = NULL;
 }
 
 
-/**
- *
- */
-static int
-resample(audio_decoder_t *ad, int16_t *dstmix, int dstavail,
-	 int *writtenp, int16_t *srcmix, int srcframes, int channels)
-{
-  int c, i, j;
-  int16_t *src;
-  int16_t *dst;
-  int written = 0;
-  int consumed;
-  int srcsize;
-  int spill = ad->ad_resampler_spill_size;
-  
-   if(spill > srcframes)
-     srcframes = 0;
-
-   dst = malloc(dstavail * sizeof(uint16_t));
-
-   for(c = 0; c < channels; c++) {
-
-     if(ad->ad_resampler_spill[c] != NULL) {
-
-       srcsize = spill + srcframes;
-
-       src = malloc(srcsize * sizeof(uint16_t));
-
-       j = 0;
-
-       for(i = 0; i < spill; i++)
-	 src[j++] = ad->ad_resampler_spill[c][i];
-
-       for(i = 0; i < srcframes; i++)
-	 src[j++] = srcmix[i * channels + c];
-
-       free(ad->ad_resampler_spill[c]);
-       ad->ad_resampler_spill[c] = NULL;
-
-     } else {
-
-       srcsize = srcframes;
-
-       src = malloc(srcsize * sizeof(uint16_t));
-
-       for(i = 0; i < srcframes; i++)
-	 src[i] = srcmix[i * channels + c];
-
-     }
-
-     written = av_resample(ad->ad_resampler, dst, src, &consumed, 
-			   srcsize, dstavail, c == channels - 1);
-
-     if(consumed != srcsize) {
-       ad->ad_resampler_spill_size = srcsize - consumed;
-
-       ad->ad_resampler_spill[c] = 
-	 malloc(ad->ad_resampler_spill_size * sizeof(uint16_t));
-
-       memcpy(ad->ad_resampler_spill[c], src + consumed, 
-	      ad->ad_resampler_spill_size * sizeof(uint16_t));
-     }
-
-     for(i = 0; i < written; i++)
-       dstmix[i * channels + c] = dst[i];
-
-     free(src);
-   }
-
-   *writtenp = written;
-
-   free(dst);
-
-   return srcframes;
- }
 
 
 
@@ -41,9 +41,7 @@ typedef struct audio_decoder {
   int ad_do_flush;
   int ad_send_flush;
 
-  struct AVResampleContext *ad_resampler;
-  int16_t *ad_resampler_spill[AUDIO_CHAN_MAX];
-  int ad_resampler_spill_size;
+  struct audio_resampler *ad_resampler;
   int ad_resampler_channels;
   int ad_resampler_srcrate;
   int ad_resampler_dstrate;
@@ -25,18 +25,63 @@
 #include "showtime.h"
 #include "audio_fifo.h"
 #include "audio_defs.h"
+#include "arch/atomic.h"
 
 extern audio_mode_t *audio_mode_current;
 
+#define AF_POOL_BUFSIZE (8 * 1024 * sizeof(int16_t))
+
 
 /**
- *
+ * Read a variable shared with the other side of the ring. The
+ * barriers order it against everything before (for the store / load
+ * handshakes on af_busy, af_ctrl and af_waiters) and after it (slot
+ * accesses must not be done before we've seen head / tail move)
+ */
+static inline int
+af_load(volatile int *p)
+{
+  int v;
+  atomic_barrier();
+  v = *p;
+  atomic_barrier();
+  return v;
+}
+
+
+/**
+ * Buffers that fit in AF_POOL_BUFSIZE are taken from a fixed pool.
+ * A slot is claimed by being the one that increments its counter
+ * from zero. Memory for a slot is allocated the first time it is used
+ * and then kept for the lifetime of the fifo
  */
 audio_buf_t *
-af_alloc(size_t size, media_pipe_t *mp)
+af_alloc(audio_fifo_t *af, size_t size, media_pipe_t *mp)
 {
-  audio_buf_t *ab;
-  ab = malloc(size + sizeof(audio_buf_t));
+  audio_buf_t *ab = NULL;
+  int i, j;
+
+  if(size <= AF_POOL_BUFSIZE) {
+    for(i = 0; i < af->af_pool_size; i++) {
+      j = (af->af_pool_hint + i) % af->af_pool_size;
+      if(atomic_add(&af->af_pool_inuse[j], 1) == 0) {
+	atomic_barrier();
+	if(af->af_pool[j] == NULL)
+	  af->af_pool[j] = malloc(AF_POOL_BUFSIZE + sizeof(audio_buf_t));
+	ab = af->af_pool[j];
+	ab->ab_pool = &af->af_pool_inuse[j];
+	af->af_pool_hint = j + 1;
+	break;
+      }
+      atomic_add(&af->af_pool_inuse[j], -1);
+    }
+  }
+
+  if(ab == NULL) {
+    ab = malloc(size + sizeof(audio_buf_t));
+    ab->ab_pool = NULL;
+  }
+
   ab->ab_flush = 0;
   ab->ab_tmp = 0;
   ab->ab_mp = mp;
@@ -46,58 +91,126 @@ af_alloc(size_t size, media_pipe_t *mp)
   return ab;
 }
 
+
 /**
  *
  */
-void
-af_enq(audio_fifo_t *af, audio_buf_t *ab)
+static void
+af_export_stats(audio_fifo_t *af)
 {
-  hts_mutex_lock(&af->af_lock);
+  int v = af->af_underruns;
 
-  while(af->af_len > af->af_maxlen)
-    hts_cond_wait(&af->af_cond, &af->af_lock);
-
-  af->af_len += ab->ab_frames;
+  if(v == af->af_underruns_exported)
+    return;
+  af->af_underruns_exported = v;
+  prop_set_int(af->af_prop_underruns, v);
+}
 
-  TAILQ_INSERT_TAIL(&af->af_queue, ab, link);
-  hts_cond_broadcast(&af->af_cond);
 
-  hts_mutex_unlock(&af->af_lock);
+/**
+ * Must be called with af_lock held and room in the ring.
+ * The tail has been read with af_load() when checking for room so the
+ * consumer is done with the slot. The slot must be visible before the
+ * consumer sees the head move, thus the barrier
+ */
+static void
+af_push(audio_fifo_t *af, audio_buf_t *ab)
+{
+  af->af_ring[af->af_head & af->af_ring_mask] = ab;
+  af->af_ended = 0;
+  atomic_barrier();
+  atomic_add(&af->af_len, ab->ab_frames);
+  atomic_add(&af->af_head, 1);
 }
 
 
 /**
  *
  */
-audio_buf_t *
-af_peek(audio_fifo_t *af)
+static int
+af_ring_full(audio_fifo_t *af)
 {
-  audio_buf_t *ab;
+  return af->af_head - af_load(&af->af_tail) > af->af_ring_mask;
+}
+
 
-  ab = TAILQ_FIRST(&af->af_queue);
+/**
+ *
+ */
+static int
+af_full(audio_fifo_t *af)
+{
+  return af_load(&af->af_len) > af->af_maxlen || af_ring_full(af);
+}
 
-  if(af->af_hysteresis) {
 
-    if(ab == NULL)
-      af->af_satisfied = 0;
-    else if(af->af_len < af->af_hysteresis && af->af_satisfied == 0)
-      ab = NULL;
-    else
-      af->af_satisfied = 1;
+/**
+ * Wait until 'full' says there is room. Must be called with af_lock held
+ */
+static void
+af_wait_room(audio_fifo_t *af, int (*full)(audio_fifo_t *af))
+{
+  while(full(af)) {
+    /* The output thread wakes us without holding af_lock so we
+       might miss a wakeup. Thus the timeout */
+    atomic_add(&af->af_waiters, 1);
+    if(full(af))
+      hts_cond_wait_timeout(&af->af_cond, &af->af_lock, 100);
+    atomic_add(&af->af_waiters, -1);
   }
-  
-  return ab;
 }
 
+
 /**
  *
  */
-static void
-af_remove(audio_fifo_t *af, audio_buf_t *ab)
+void
+af_enq(audio_fifo_t *af, audio_buf_t *ab)
 {
-  af->af_len -= ab->ab_frames;
-  TAILQ_REMOVE(&af->af_queue, ab, link);
-  hts_cond_broadcast(&af->af_cond);
+  hts_mutex_lock(&af->af_lock);
+
+  af_wait_room(af, af_full);
+  af_push(af, ab);
+
+  if(af->af_waiters)
+    hts_cond_broadcast(&af->af_cond);
+
+  hts_mutex_unlock(&af->af_lock);
+
+  af_export_stats(af);
+}
+
+
+/**
+ * Only called by the consumer, either on the lock free path or with
+ * af_lock held
+ */
+static audio_buf_t *
+af_pop(audio_fifo_t *af)
+{
+  audio_buf_t *ab;
+  int tail = af->af_tail;
+
+  if(af_load(&af->af_head) == tail) {
+    // Running dry after the end of the stream is not an underrun
+    if(af->af_satisfied && !af->af_ended)
+      af->af_underruns++;
+    af->af_satisfied = 0;
+    return NULL;
+  }
+
+  if(af->af_hysteresis && !af->af_satisfied &&
+     af_load(&af->af_len) < af->af_hysteresis)
+    return NULL;
+
+  af->af_satisfied = 1;
+
+  ab = af->af_ring[tail & af->af_ring_mask];
+  // Done with the slot before the producer may reuse it
+  atomic_barrier();
+  atomic_add(&af->af_len, -ab->ab_frames);
+  atomic_add(&af->af_tail, 1);
+  return ab;
 }
 
 
@@ -108,6 +221,26 @@ audio_buf_t *
 af_deq2(audio_fifo_t *af, int wait, struct audio_mode *am)
 {
   audio_buf_t *ab = NULL;
+  int ctrl;
+
+  if(am != audio_mode_current)
+    return AF_EXIT;
+
+  atomic_add(&af->af_busy, 1);
+  ctrl = af_load(&af->af_ctrl);
+  if(!ctrl)
+    ab = af_pop(af);
+  atomic_barrier();
+  atomic_add(&af->af_busy, -1);
+
+  if(ab != NULL) {
+    if(af_load(&af->af_waiters))
+      hts_cond_broadcast(&af->af_cond);
+    return ab;
+  }
+
+  if(!ctrl && !wait)
+    return NULL;
 
   af_lock(af);
   while(1) {
@@ -117,15 +250,17 @@ af_deq2(audio_fifo_t *af, int wait, struct audio_mode *am)
       return AF_EXIT;
     }
 
-    ab = af_peek(af);
+    ab = af_pop(af);
     
     if(ab != NULL || !wait)
       break;
+    atomic_add(&af->af_waiters, 1);
     hts_cond_wait(&af->af_cond, &af->af_lock);
+    atomic_add(&af->af_waiters, -1);
   }
 
-  if(ab != NULL)
-    af_remove(af, ab);
+  if(ab != NULL && af->af_waiters)
+    hts_cond_broadcast(&af->af_cond);
 
   af_unlock(af);
   return ab;
@@ -139,7 +274,11 @@ ab_free(audio_buf_t *ab)
 {
   if(ab->ab_mp != NULL)
     mp_ref_dec(ab->ab_mp);
-  free(ab);
+  if(ab->ab_pool != NULL) {
+    atomic_barrier();
+    atomic_add(ab->ab_pool, -1);
+  } else
+    free(ab);
 }
 
 
@@ -149,15 +288,71 @@ ab_free(audio_buf_t *ab)
 void
 audio_fifo_init(audio_fifo_t *af, int maxlen, int hysteresis)
 {
+  prop_t *p;
+  int rs = 64;
+
   hts_mutex_init(&af->af_lock);
   hts_cond_init(&af->af_cond, &af->af_lock);
-  TAILQ_INIT(&af->af_queue);
   af->af_satisfied = 0;
+  af->af_ended = 0;
   af->af_hysteresis = hysteresis;
   af->af_len = 0;
   af->af_maxlen = maxlen;
+
+  af->af_busy = 0;
+  af->af_ctrl = 0;
+  af->af_waiters = 0;
+
+  /* Enough buffers to fill the fifo with small packets, plus the ones
+     held by decoders and the output device */
+  af->af_pool_size = maxlen / 256 + 16;
+  af->af_pool = calloc(af->af_pool_size, sizeof(audio_buf_t *));
+  af->af_pool_inuse = calloc(af->af_pool_size, sizeof(int));
+  af->af_pool_hint = 0;
+
+  while(rs < af->af_pool_size * 2)
+    rs <<= 1;
+  af->af_ring = calloc(rs, sizeof(audio_buf_t *));
+  af->af_ring_mask = rs - 1;
+  af->af_head = 0;
+  af->af_tail = 0;
+
+  p = prop_create(prop_create(prop_get_global(), "audio"), "fifo");
+  af->af_prop_underruns = prop_create(p, "underruns");
+  af->af_underruns = 0;
+  af->af_underruns_exported = 0;
+  prop_set_int(af->af_prop_underruns, 0);
 }
 
+
+/**
+ * Take exclusive access to the ring. Once af_ctrl is raised the
+ * consumer will not enter the lock free path, so we just have to wait
+ * for it to leave if it's already there
+ */
+static void
+af_ctrl_begin(audio_fifo_t *af)
+{
+  hts_mutex_lock(&af->af_lock);
+  atomic_add(&af->af_ctrl, 1);
+  // af_load() makes sure af_ctrl is visible before we read af_busy
+  while(af_load(&af->af_busy))
+    usleep(100);
+}
+
+
+/**
+ *
+ */
+static void
+af_ctrl_end(audio_fifo_t *af)
+{
+  atomic_add(&af->af_ctrl, -1);
+  hts_cond_broadcast(&af->af_cond);
+  hts_mutex_unlock(&af->af_lock);
+}
+
+
 /**
  * Remove all buffer entries from the given reference and
  * optionally put them on queue 'q'
@@ -165,16 +360,20 @@ audio_fifo_init(audio_fifo_t *af, int maxlen, int hysteresis)
 void
 audio_fifo_purge(audio_fifo_t *af, void *ref, struct audio_buf_queue *q)
 {
-  audio_buf_t *ab, *n;
+  audio_buf_t *ab;
+  int i, w;
 
-  hts_mutex_lock(&af->af_lock);
+  af_ctrl_begin(af);
 
-  for(ab = TAILQ_FIRST(&af->af_queue); ab != NULL; ab = n) {
-    n = TAILQ_NEXT(ab, link);
-    if(ref != NULL && ab->ab_ref != ref)
+  w = af->af_tail;
+  for(i = af->af_tail; i != af->af_head; i++) {
+    ab = af->af_ring[i & af->af_ring_mask];
+
+    if(ref != NULL && ab->ab_ref != ref) {
+      af->af_ring[w++ & af->af_ring_mask] = ab;
       continue;
+    }
 
-    TAILQ_REMOVE(&af->af_queue, ab, link);
     af->af_len -= ab->ab_frames;
 
     if(q != NULL) {
@@ -183,31 +382,53 @@ audio_fifo_purge(audio_fifo_t *af, void *ref, struct audio_buf_queue *q)
       ab_free(ab);
     }
   }
+  af->af_head = w;
 
-  hts_cond_broadcast(&af->af_cond);
-  hts_mutex_unlock(&af->af_lock);  
+  /* Don't count the purge as an underrun */
+  if(af->af_head == af->af_tail)
+    af->af_satisfied = 0;
+
+  af_ctrl_end(af);
 }
 
 
 /**
- * Remove all buffer entries from the given reference and
- * optionally put them on queue 'q'
+ * Put buffers previously removed with audio_fifo_purge() back.
+ *
+ * They are queued even if that takes us above af_maxlen (they were in
+ * the fifo before), but if the ring itself is full we wait for the
+ * output to make room rather than dropping audio
  */
 void
 audio_fifo_reinsert(audio_fifo_t *af, struct audio_buf_queue *q)
 {
   audio_buf_t *ab;
 
+  if(TAILQ_FIRST(q) == NULL)
+    return;
+
   hts_mutex_lock(&af->af_lock);
 
   while((ab = TAILQ_FIRST(q)) != NULL) {
+    af_wait_room(af, af_ring_full);
     TAILQ_REMOVE(q, ab, link);
-    af->af_len += ab->ab_frames;
-    TAILQ_INSERT_TAIL(&af->af_queue, ab, link);
+    af_push(af, ab);
   }
 
   hts_cond_broadcast(&af->af_cond);
-  hts_mutex_unlock(&af->af_lock);  
+  hts_mutex_unlock(&af->af_lock);
+}
+
+
+/**
+ * The producer will not queue anything more for now (end of stream),
+ * so running dry should not be counted as an underrun. Reset by the
+ * next af_enq()
+ */
+void
+audio_fifo_end(audio_fifo_t *af)
+{
+  af->af_ended = 1;
 }
 
 
@@ -36,27 +36,50 @@ typedef struct audio_buf {
   int ab_frames;
   int ab_alloced;
   int ab_tmp;    // For output devices only
+  volatile int *ab_pool; // Pool slot claim, NULL if malloced
   char ab_data[0];
 } audio_buf_t;
 
 
 typedef struct audio_fifo {
 
+  /**
+   * Producers (audio decoders) and control operations (purge, reinsert)
+   * serialize on af_lock. The output thread never takes it as long
+   * as there are buffers to play and no control operation is running
+   */
   hts_mutex_t af_lock;
   hts_cond_t af_cond;
 
-  struct audio_buf_queue af_queue;
+  audio_buf_t **af_ring;
+  int af_ring_mask;
+  volatile int af_head;      // Written by producers
+  volatile int af_tail;      // Written by consumer
 
-  int af_len;
+  volatile int af_len;
   int af_maxlen;
   int af_hysteresis;
   int af_satisfied;
+  volatile int af_ended;     // End of stream, running dry is expected
+
+  volatile int af_busy;      // Consumer is on the lock free path
+  volatile int af_ctrl;      // Control operation in progress
+  volatile int af_waiters;   // Threads sleeping on af_cond
+
+  volatile int *af_pool_inuse;
+  audio_buf_t **af_pool;
+  int af_pool_size;
+  int af_pool_hint;
+
+  int af_underruns;
+  int af_underruns_exported;
+  prop_t *af_prop_underruns;
 
 } audio_fifo_t;
 
 #define ab_dataptr(ab) ((void *)&(ab)->af_data[0])
 
-audio_buf_t *af_alloc(size_t size, media_pipe_t *mp);
+audio_buf_t *af_alloc(audio_fifo_t *af, size_t size, media_pipe_t *mp);
 
 void af_enq(audio_fifo_t *af, audio_buf_t *ab);
 
@@ -64,10 +87,6 @@ void af_enq(audio_fifo_t *af, audio_buf_t *ab);
 
 #define af_unlock(af) hts_mutex_unlock(&(af)->af_lock);
 
-audio_buf_t *af_peek(audio_fifo_t *af);
-
-audio_buf_t *af_wait(audio_fifo_t *af);
-
 struct audio_mode;
 audio_buf_t *af_deq2(audio_fifo_t *af, int wait, struct audio_mode *am);
 
@@ -81,6 +100,8 @@ void audio_fifo_purge(audio_fifo_t *af, void *ref, struct audio_buf_queue *q);
 
 void audio_fifo_reinsert(audio_fifo_t *af, struct audio_buf_queue *q);
 
+void audio_fifo_end(audio_fifo_t *af);
+
 void audio_fifo_clear_queue(struct audio_buf_queue *q);
 
 
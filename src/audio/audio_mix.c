@@ -0,0 +1,429 @@
+/*
+ *  Audio mixing kernels
+ *  Copyright (C) 2011 Andreas Öman
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "showtime.h"
+#include "audio_mix.h"
+#include "audio_defs.h"
+
+#if defined(__ARM_NEON__) && defined(__linux__) && defined(__GLIBC__) && \
+  (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 16))
+#include <sys/auxv.h>
+#define MIX_HWCAP_NEON (1 << 12)
+#endif
+
+/**
+ * The vector kernels are only built when the compiler targets an ISA
+ * that has them (SSE2 is baseline on x86_64, NEON comes via the --cpu
+ * flags on ARM). Which kernels to use is still decided at runtime by
+ * audio_mix_init() since a NEON build may end up on a core without it.
+ *
+ * Vector and scalar code must produce bit-identical results.
+ */
+#if defined(__SSE2__)
+
+#include <emmintrin.h>
+
+#define MIX_VECTOR 1
+
+typedef __m128i v16_t;
+#define v16_load(p)   _mm_loadu_si128((const __m128i *)(p))
+#define v16_store(p, v) _mm_storeu_si128((__m128i *)(p), v)
+#define v16_zero()    _mm_setzero_si128()
+#define v16_max(a, b) _mm_max_epi16(a, b)
+#define v16_min(a, b) _mm_min_epi16(a, b)
+
+#elif defined(__ARM_NEON__)
+
+#include <arm_neon.h>
+
+#define MIX_VECTOR 1
+
+typedef int16x8_t v16_t;
+#define v16_load(p)   vld1q_s16(p)
+#define v16_store(p, v) vst1q_s16(p, v)
+#define v16_zero()    vdupq_n_s16(0)
+#define v16_max(a, b) vmaxq_s16(a, b)
+#define v16_min(a, b) vminq_s16(a, b)
+
+#endif
+
+
+/**
+ * 5.1 to stereo downmixing, coeffs are stolen from AAC spec
+ */
+static void
+mix_51_to_stereo_c(int16_t *dst, const int16_t *src, int frames)
+{
+  int i, x, y, z;
+
+  for(i = 0; i < frames; i++) {
+
+    x = (src[0] * 26869) >> 16;
+    y = (src[1] * 26869) >> 16;
+
+    z = (src[4] * 19196) >> 16;
+    x += z;
+    y += z;
+
+    z = (src[5] * 13571) >> 16;
+    x += z;
+    y += z;
+
+    z = (src[2] * 13571) >> 16;
+    x -= z;
+    y += z;
+
+    z = (src[3] * 19196) >> 16;
+    x -= z;
+    y += z;
+
+    src += 6;
+
+    *dst++ = CLIP16(x);
+    *dst++ = CLIP16(y);
+  }
+}
+
+
+#if defined(__SSE2__)
+
+#define SHUF(p, q, a, b, c, d) \
+  _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(p), _mm_castsi128_ps(q), \
+				  _MM_SHUFFLE(d, c, b, a)))
+
+#define LO32(v) _mm_srai_epi32(_mm_slli_epi32(v, 16), 16)
+#define HI32(v) _mm_srai_epi32(v, 16)
+
+/**
+ * Four frames per iteration. Each frame is viewed as three 32 bit
+ * channel pairs (L|R, SL|SR, C|LFE) which are deinterleaved into
+ * one register each
+ */
+static void
+mix_51_to_stereo_v(int16_t *dst, const int16_t *src, int frames)
+{
+  const __m128i kf = _mm_set1_epi16(26869);
+  const __m128i ks = _mm_set1_epi32((19196 << 16) | 13571);
+  const __m128i kc = _mm_set1_epi32((13571 << 16) | 19196);
+  __m128i a, b, c, f, s, m, side, common, x, y;
+
+  for(; frames >= 4; frames -= 4) {
+    a = v16_load(src);
+    b = v16_load(src + 8);
+    c = v16_load(src + 16);
+
+    f = SHUF(SHUF(a, a, 0, 0, 3, 3), SHUF(b, c, 2, 2, 1, 1), 0, 2, 0, 2);
+    s = SHUF(SHUF(a, b, 1, 1, 0, 0), SHUF(b, c, 3, 3, 2, 2), 0, 2, 0, 2);
+    m = SHUF(SHUF(a, b, 2, 2, 1, 1), SHUF(c, c, 0, 0, 3, 3), 0, 2, 0, 2);
+
+    f = _mm_mulhi_epi16(f, kf);
+    s = _mm_mulhi_epi16(s, ks);
+    m = _mm_mulhi_epi16(m, kc);
+
+    side   = _mm_add_epi32(LO32(s), HI32(s));
+    common = _mm_add_epi32(LO32(m), HI32(m));
+
+    x = _mm_sub_epi32(_mm_add_epi32(LO32(f), common), side);
+    y = _mm_add_epi32(_mm_add_epi32(HI32(f), common), side);
+
+    x = _mm_packs_epi32(x, x);
+    y = _mm_packs_epi32(y, y);
+    v16_store(dst, _mm_unpacklo_epi16(x, y));
+
+    src += 24;
+    dst += 8;
+  }
+  mix_51_to_stereo_c(dst, src, frames);
+}
+
+#elif defined(__ARM_NEON__)
+
+/**
+ * Four frames per iteration, vld3 deinterleaves the channel pairs
+ */
+static void
+mix_51_to_stereo_v(int16_t *dst, const int16_t *src, int frames)
+{
+  int32x4x3_t v;
+  int32x4_t side, common, x, y;
+  int16x4x2_t o;
+
+  for(; frames >= 4; frames -= 4) {
+    v = vld3q_s32((const int32_t *)src);
+
+    side = vaddq_s32(vshrq_n_s32(vmull_n_s16(vmovn_s32(v.val[1]),
+					      13571), 16),
+		     vshrq_n_s32(vmull_n_s16(vshrn_n_s32(v.val[1], 16),
+					      19196), 16));
+
+    common = vaddq_s32(vshrq_n_s32(vmull_n_s16(vmovn_s32(v.val[2]),
+						19196), 16),
+		       vshrq_n_s32(vmull_n_s16(vshrn_n_s32(v.val[2], 16),
+						13571), 16));
+
+    x = vshrq_n_s32(vmull_n_s16(vmovn_s32(v.val[0]), 26869), 16);
+    y = vshrq_n_s32(vmull_n_s16(vshrn_n_s32(v.val[0], 16), 26869), 16);
+
+    x = vsubq_s32(vaddq_s32(x, common), side);
+    y = vaddq_s32(vaddq_s32(y, common), side);
+
+    o.val[0] = vqmovn_s32(x);
+    o.val[1] = vqmovn_s32(y);
+    vst2_s16(dst, o);
+
+    src += 24;
+    dst += 8;
+  }
+  mix_51_to_stereo_c(dst, src, frames);
+}
+
+#endif
+
+
+/**
+ *
+ */
+static void
+mix_peak_c(const int16_t *data, int frames, int channels, int *peak)
+{
+  int i, j, x;
+
+  for(i = 0; i < frames; i++) {
+    for(j = 0; j < channels; j++) {
+      x = abs(*data++);
+      if(peak[j] < x)
+	peak[j] = x;
+    }
+  }
+}
+
+
+#ifdef MIX_VECTOR
+/**
+ * Keep lane wise min and max over blocks that are a multiple of
+ * both the vector width and the number of channels so every lane
+ * always sees the same channel
+ */
+static void
+mix_peak_v(const int16_t *data, int frames, int channels, int *peak)
+{
+  v16_t mx[8], mn[8], v;
+  int16_t tmax[64], tmin[64];
+  int blk = channels, nvec, nblk, i, k, x;
+
+  if(channels > 8) {
+    mix_peak_c(data, frames, channels, peak);
+    return;
+  }
+
+  while(blk & 7)
+    blk += channels;
+  nvec = blk / 8;
+  nblk = frames * channels / blk;
+
+  if(nblk > 0) {
+    for(k = 0; k < nvec; k++)
+      mx[k] = mn[k] = v16_zero();
+
+    for(i = 0; i < nblk; i++) {
+      for(k = 0; k < nvec; k++) {
+	v = v16_load(data + k * 8);
+	mx[k] = v16_max(mx[k], v);
+	mn[k] = v16_min(mn[k], v);
+      }
+      data += blk;
+    }
+
+    for(k = 0; k < nvec; k++) {
+      v16_store(tmax + k * 8, mx[k]);
+      v16_store(tmin + k * 8, mn[k]);
+    }
+
+    for(i = 0; i < blk; i++) {
+      x = -tmin[i];
+      if(x < tmax[i])
+	x = tmax[i];
+      if(peak[i % channels] < x)
+	peak[i % channels] = x;
+    }
+    frames -= nblk * blk / channels;
+  }
+  mix_peak_c(data, frames, channels, peak);
+}
+#endif
+
+
+/**
+ * Kernels in use, scalar until audio_mix_init() says otherwise
+ */
+static void (*mix_51_to_stereo)(int16_t *dst, const int16_t *src,
+				int frames) = mix_51_to_stereo_c;
+
+static void (*mix_peak)(const int16_t *data, int frames, int channels,
+			int *peak) = mix_peak_c;
+
+
+/**
+ *
+ */
+static void
+mix_select(void)
+{
+#ifdef MIX_VECTOR
+#ifdef MIX_HWCAP_NEON
+  if(!(getauxval(AT_HWCAP) & MIX_HWCAP_NEON))
+    return;
+#endif
+  mix_51_to_stereo = mix_51_to_stereo_v;
+  mix_peak = mix_peak_v;
+#endif
+}
+
+
+/**
+ *
+ */
+void
+audio_mix_init(void)
+{
+  mix_select();
+  TRACE(TRACE_DEBUG, "audio", "Mixing kernels: %s",
+	mix_51_to_stereo == mix_51_to_stereo_c ? "scalar" : "vector");
+}
+
+
+/**
+ *
+ */
+void
+audio_mix_51_to_stereo(int16_t *dst, const int16_t *src, int frames)
+{
+  mix_51_to_stereo(dst, src, frames);
+}
+
+
+/**
+ *
+ */
+void
+audio_mix_peak(const int16_t *data, int frames, int channels, int *peak)
+{
+  int j;
+
+  for(j = 0; j < channels; j++)
+    peak[j] = 0;
+
+  mix_peak(data, frames, channels, peak);
+}
+
+
+/**
+ * Time the kernels in use against the scalar ones on a few seconds
+ * worth of noise and check that they agree. Run via --audio-mix-bench
+ */
+#define MIX_BENCH_FRAMES 48000
+#define MIX_BENCH_ROUNDS 100
+
+static int64_t
+mix_bench_51(void (*fn)(int16_t *, const int16_t *, int),
+	     int16_t *dst, const int16_t *src)
+{
+  int64_t ts;
+  int i;
+
+  fn(dst, src, MIX_BENCH_FRAMES); // Warm up caches
+  ts = showtime_get_ts();
+  for(i = 0; i < MIX_BENCH_ROUNDS; i++)
+    fn(dst, src, MIX_BENCH_FRAMES);
+  return showtime_get_ts() - ts;
+}
+
+
+static int64_t
+mix_bench_peak(void (*fn)(const int16_t *, int, int, int *),
+	       const int16_t *src, int channels, int *peak)
+{
+  int64_t ts;
+  int i, j;
+
+  fn(src, MIX_BENCH_FRAMES * 6 / channels, channels, peak);
+  ts = showtime_get_ts();
+  for(i = 0; i < MIX_BENCH_ROUNDS; i++) {
+    for(j = 0; j < channels; j++)
+      peak[j] = 0;
+    fn(src, MIX_BENCH_FRAMES * 6 / channels, channels, peak);
+  }
+  return showtime_get_ts() - ts;
+}
+
+
+static void
+mix_bench_print(const char *name, int64_t c, int64_t v, int ok)
+{
+  printf("%-20s scalar %8"PRId64" us  in use %8"PRId64" us  %5.2fx  %s\n",
+	 name, c, v, v ? (double)c / v : 0.0, ok ? "OK" : "MISMATCH");
+}
+
+
+int
+audio_mix_bench(void)
+{
+  int16_t *src = malloc(MIX_BENCH_FRAMES * 6 * sizeof(int16_t));
+  int16_t *d0  = malloc(MIX_BENCH_FRAMES * 2 * sizeof(int16_t));
+  int16_t *d1  = malloc(MIX_BENCH_FRAMES * 2 * sizeof(int16_t));
+  static const int chs[] = {2, 6, 8};
+  int p0[8], p1[8], i, ok, errors = 0;
+  unsigned int seed = 1;
+  int64_t c, v;
+  char name[32];
+
+  mix_select();
+
+  printf("Mixing kernels: %s, %d frames x %d rounds\n",
+	 mix_51_to_stereo == mix_51_to_stereo_c ? "scalar" : "vector",
+	 MIX_BENCH_FRAMES, MIX_BENCH_ROUNDS);
+
+  for(i = 0; i < MIX_BENCH_FRAMES * 6; i++) {
+    seed = seed * 1664525 + 1013904223;
+    src[i] = seed >> 16;
+  }
+
+  c = mix_bench_51(mix_51_to_stereo_c, d0, src);
+  v = mix_bench_51(mix_51_to_stereo, d1, src);
+  ok = !memcmp(d0, d1, MIX_BENCH_FRAMES * 2 * sizeof(int16_t));
+  errors += !ok;
+  mix_bench_print("5.1 downmix", c, v, ok);
+
+  for(i = 0; i < sizeof(chs) / sizeof(chs[0]); i++) {
+    c = mix_bench_peak(mix_peak_c, src, chs[i], p0);
+    v = mix_bench_peak(mix_peak, src, chs[i], p1);
+    ok = !memcmp(p0, p1, chs[i] * sizeof(int));
+    errors += !ok;
+    snprintf(name, sizeof(name), "peak %d channels", chs[i]);
+    mix_bench_print(name, c, v, ok);
+  }
+
+  free(src);
+  free(d0);
+  free(d1);
+  return errors;
+}
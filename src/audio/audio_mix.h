@@ -0,0 +1,46 @@
+/*
+ *  Audio mixing kernels
+ *  Copyright (C) 2011 Andreas Öman
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef AUDIO_MIX_H
+#define AUDIO_MIX_H
+
+#include <stdint.h>
+
+/**
+ * Pick vector or scalar kernels depending on what the CPU can do
+ */
+void audio_mix_init(void);
+
+/**
+ * 5.1 (L R SL SR C LFE) to stereo downmix. Can operate in place
+ */
+void audio_mix_51_to_stereo(int16_t *dst, const int16_t *src, int frames);
+
+/**
+ * Peak absolute sample value per channel
+ */
+void audio_mix_peak(const int16_t *data, int frames, int channels,
+		    int *peak);
+
+/**
+ * Compare kernels in use with the scalar ones, returns number of
+ * mismatches
+ */
+int audio_mix_bench(void);
+
+#endif /* AUDIO_MIX_H */
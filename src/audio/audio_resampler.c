@@ -0,0 +1,277 @@
+/*
+ *  Polyphase audio resampler
+ *  Copyright (C) 2011 Andreas Öman
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "audio_resampler.h"
+#include "audio_defs.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#define RESAMPLER_TAPS        16
+#define RESAMPLER_CENTER      (RESAMPLER_TAPS / 2 - 1)
+#define RESAMPLER_PHASE_SHIFT 10
+#define RESAMPLER_PHASES      (1 << RESAMPLER_PHASE_SHIFT)
+#define RESAMPLER_FILTER_BITS 15
+
+/* Number of source frames we buffer per channel */
+#define RESAMPLER_BUFSIZE     1024
+
+
+/**
+ * All buffers are allocated when the resampler is created. Source
+ * frames are deinterleaved into one history buffer per channel so the
+ * filter can run over contiguous samples
+ */
+struct audio_resampler {
+  int ar_channels;
+  int ar_srcrate;
+  int ar_dstrate;
+
+  int ar_incr_div;  // Source frames advanced per output frame
+  int ar_incr_mod;  // .. and the remainder, in units of 1 / ar_dstrate
+
+  int ar_index;     // Position of first tap in history buffers
+  int ar_frac;      // Fractional position, in units of 1 / ar_dstrate
+  int ar_buffered;  // Number of frames in history buffers
+
+  int16_t *ar_filter;
+  int16_t *ar_buf[AUDIO_CHAN_MAX];
+};
+
+
+/**
+ * Modified Bessel function of the first kind, order 0
+ */
+static double
+bessel_i0(double x)
+{
+  double v = 1, lastv = 0, t = 1;
+  int i;
+
+  x = x * x / 4;
+  for(i = 1; v != lastv; i++) {
+    lastv = v;
+    t *= x / (i * i);
+    v += t;
+  }
+  return v;
+}
+
+
+/**
+ * Kaiser windowed sinc, normalized to unity gain for each phase
+ */
+static void
+build_filter(int16_t *filter, double factor)
+{
+  double tab[RESAMPLER_TAPS];
+  double x, w, norm, beta = 9;
+  int p, k, v;
+
+  for(p = 0; p < RESAMPLER_PHASES; p++) {
+    norm = 0;
+    for(k = 0; k < RESAMPLER_TAPS; k++) {
+      x = k - RESAMPLER_CENTER - (double)p / RESAMPLER_PHASES;
+
+      w = 2.0 * x / RESAMPLER_TAPS;
+      w = 1 - w * w;
+      w = bessel_i0(beta * sqrt(w > 0 ? w : 0)) / bessel_i0(beta);
+
+      x *= M_PI * factor;
+      tab[k] = (x == 0 ? 1.0 : sin(x) / x) * w;
+      norm += tab[k];
+    }
+
+    for(k = 0; k < RESAMPLER_TAPS; k++) {
+      v = lrint(tab[k] * (1 << RESAMPLER_FILTER_BITS) / norm);
+      filter[p * RESAMPLER_TAPS + k] = CLIP16(v);
+    }
+  }
+}
+
+
+/**
+ *
+ */
+audio_resampler_t *
+audio_resampler_create(int srcrate, int dstrate, int channels)
+{
+  audio_resampler_t *ar;
+  int c;
+
+  /* The filter must always cover the step between two output frames */
+  if(channels < 1 || channels > AUDIO_CHAN_MAX ||
+     srcrate <= 0 || dstrate <= 0 || srcrate / dstrate >= RESAMPLER_TAPS)
+    return NULL;
+
+  ar = calloc(1, sizeof(audio_resampler_t));
+  ar->ar_channels = channels;
+  ar->ar_srcrate  = srcrate;
+  ar->ar_dstrate  = dstrate;
+  ar->ar_incr_div = srcrate / dstrate;
+  ar->ar_incr_mod = srcrate % dstrate;
+
+  ar->ar_filter = malloc(RESAMPLER_PHASES * RESAMPLER_TAPS * sizeof(int16_t));
+  build_filter(ar->ar_filter, dstrate < srcrate ?
+	       (double)dstrate / srcrate : 1.0);
+
+  for(c = 0; c < channels; c++)
+    ar->ar_buf[c] = calloc(RESAMPLER_BUFSIZE + RESAMPLER_TAPS,
+			   sizeof(int16_t));
+
+  /* Prime with silence so first output frame is centered on the
+     first source frame */
+  ar->ar_buffered = RESAMPLER_CENTER;
+  return ar;
+}
+
+
+/**
+ *
+ */
+void
+audio_resampler_destroy(audio_resampler_t *ar)
+{
+  int c;
+
+  for(c = 0; c < ar->ar_channels; c++)
+    free(ar->ar_buf[c]);
+  free(ar->ar_filter);
+  free(ar);
+}
+
+
+/**
+ *
+ */
+int
+audio_resampler_pending(const audio_resampler_t *ar)
+{
+  int r = ar->ar_buffered - ar->ar_index - RESAMPLER_CENTER;
+  return r > 0 ? r : 0;
+}
+
+
+/**
+ * Dot product of RESAMPLER_TAPS samples and filter coefficients
+ */
+static inline int
+filter_dot(const int16_t *s, const int16_t *f)
+{
+#if defined(__SSE2__)
+  __m128i a, b;
+
+  a = _mm_madd_epi16(_mm_loadu_si128((const __m128i *)s),
+		     _mm_loadu_si128((const __m128i *)f));
+  b = _mm_madd_epi16(_mm_loadu_si128((const __m128i *)(s + 8)),
+		     _mm_loadu_si128((const __m128i *)(f + 8)));
+  a = _mm_add_epi32(a, b);
+  a = _mm_add_epi32(a, _mm_shuffle_epi32(a, _MM_SHUFFLE(1, 0, 3, 2)));
+  a = _mm_add_epi32(a, _mm_shuffle_epi32(a, _MM_SHUFFLE(2, 3, 0, 1)));
+  return _mm_cvtsi128_si32(a);
+#elif defined(__ARM_NEON__)
+  int32x4_t a;
+  int32x2_t b;
+
+  a = vmull_s16(vld1_s16(s), vld1_s16(f));
+  a = vmlal_s16(a, vld1_s16(s + 4),  vld1_s16(f + 4));
+  a = vmlal_s16(a, vld1_s16(s + 8),  vld1_s16(f + 8));
+  a = vmlal_s16(a, vld1_s16(s + 12), vld1_s16(f + 12));
+  b = vadd_s32(vget_low_s32(a), vget_high_s32(a));
+  b = vpadd_s32(b, b);
+  return vget_lane_s32(b, 0);
+#else
+  int k, acc = 0;
+
+  for(k = 0; k < RESAMPLER_TAPS; k++)
+    acc += s[k] * f[k];
+  return acc;
+#endif
+}
+
+
+/**
+ *
+ */
+int
+audio_resampler_process(audio_resampler_t *ar,
+			int16_t *dst, int dstframes, int *writtenp,
+			const int16_t *src, int srcframes)
+{
+  const int channels = ar->ar_channels;
+  const int16_t *f;
+  int c, i, n, x, phase, written = 0;
+
+  /* Drop history that no longer is in reach of the filter */
+  if(ar->ar_index > 0) {
+    n = ar->ar_buffered - ar->ar_index;
+    for(c = 0; c < channels; c++)
+      memmove(ar->ar_buf[c], ar->ar_buf[c] + ar->ar_index,
+	      n * sizeof(int16_t));
+    ar->ar_buffered -= ar->ar_index;
+    ar->ar_index = 0;
+  }
+
+  /* Deinterleave as much as fits */
+  n = RESAMPLER_BUFSIZE + RESAMPLER_TAPS - ar->ar_buffered;
+  if(n > srcframes)
+    n = srcframes;
+
+  if(n > 0) {
+    for(c = 0; c < channels; c++) {
+      int16_t *d = ar->ar_buf[c] + ar->ar_buffered;
+      const int16_t *s = src + c;
+      for(i = 0; i < n; i++) {
+	d[i] = *s;
+	s += channels;
+      }
+    }
+    ar->ar_buffered += n;
+  }
+
+  while(written < dstframes &&
+	ar->ar_index + RESAMPLER_TAPS <= ar->ar_buffered) {
+
+    phase = ((int64_t)ar->ar_frac << RESAMPLER_PHASE_SHIFT) / ar->ar_dstrate;
+    f = ar->ar_filter + phase * RESAMPLER_TAPS;
+
+    for(c = 0; c < channels; c++) {
+      x = filter_dot(ar->ar_buf[c] + ar->ar_index, f);
+      x = (x + (1 << (RESAMPLER_FILTER_BITS - 1))) >> RESAMPLER_FILTER_BITS;
+      *dst++ = CLIP16(x);
+    }
+    written++;
+
+    ar->ar_index += ar->ar_incr_div;
+    ar->ar_frac  += ar->ar_incr_mod;
+    if(ar->ar_frac >= ar->ar_dstrate) {
+      ar->ar_frac -= ar->ar_dstrate;
+      ar->ar_index++;
+    }
+  }
+
+  *writtenp = written;
+  return n;
+}
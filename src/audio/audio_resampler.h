@@ -0,0 +1,46 @@
+/*
+ *  Polyphase audio resampler
+ *  Copyright (C) 2011 Andreas Öman
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef AUDIO_RESAMPLER_H
+#define AUDIO_RESAMPLER_H
+
+#include <stdint.h>
+
+typedef struct audio_resampler audio_resampler_t;
+
+audio_resampler_t *audio_resampler_create(int srcrate, int dstrate,
+					  int channels);
+
+void audio_resampler_destroy(audio_resampler_t *ar);
+
+/**
+ * Resample interleaved 'src' into interleaved 'dst'.
+ *
+ * Returns number of source frames consumed, number of frames written
+ * to 'dst' is returned in *writtenp
+ */
+int audio_resampler_process(audio_resampler_t *ar,
+			    int16_t *dst, int dstframes, int *writtenp,
+			    const int16_t *src, int srcframes);
+
+/**
+ * Number of source frames buffered but not yet resampled
+ */
+int audio_resampler_pending(const audio_resampler_t *ar);
+
+#endif /* AUDIO_RESAMPLER_H */
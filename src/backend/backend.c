@@ -37,6 +37,9 @@ LIST_HEAD(backend_list, backend);
 
 static struct backend_list backends;
 
+static hts_mutex_t search_mutex;
+static hts_cond_t search_cond;
+
 /**
  *
  */
@@ -55,6 +58,9 @@ backend_init(void)
 {
   backend_t *be;
 
+  hts_mutex_init(&search_mutex);
+  hts_cond_init(&search_cond, &search_mutex);
+
   LIST_FOREACH(be, &backends, be_global_link)
     if(be->be_init != NULL)
       be->be_init();
@@ -263,15 +269,186 @@ backend_resolve_item(const char *url, prop_t *item)
 }
 
 
+/**
+ * A search is fanned out to all providers in parallel. Some of them
+ * (spotify for instance) may block for quite some time before they
+ * return so we don't want anyone to wait for them
+ */
+#define SEARCH_DEADLINE 15 // seconds
+
+typedef struct search_query {
+  int sq_refcount;
+  int sq_pending;
+  int sq_cancelled;
+  char *sq_query;
+  prop_t *sq_model;
+  prop_t *sq_loading;
+  prop_courier_t *sq_pc;
+  prop_sub_t *sq_sub;
+} search_query_t;
+
+
+typedef struct search_provider {
+  search_query_t *sp_query;
+  backend_t *sp_backend;
+} search_provider_t;
+
+
+/**
+ * Must be called with search_mutex locked
+ */
+static void
+search_query_release(search_query_t *sq)
+{
+  if(--sq->sq_refcount > 0)
+    return;
+
+  prop_ref_dec(sq->sq_model);
+  prop_ref_dec(sq->sq_loading);
+  free(sq->sq_query);
+  free(sq);
+}
+
+
+/**
+ *
+ */
+static void
+search_query_destroyed(void *opaque, prop_event_t event, ...)
+{
+  search_query_t *sq = opaque;
+
+  if(event != PROP_DESTROYED)
+    return;
+
+  hts_mutex_lock(&search_mutex);
+  sq->sq_cancelled = 1;
+  hts_mutex_unlock(&search_mutex);
+}
+
+
+/**
+ * For providers that keep working after be_search() has returned
+ */
+void
+backend_search_hold(search_query_t *sq)
+{
+  hts_mutex_lock(&search_mutex);
+  sq->sq_refcount++;
+  sq->sq_pending++;
+  hts_mutex_unlock(&search_mutex);
+}
+
+
+/**
+ * Provider has delivered what it has (or given up)
+ */
+void
+backend_search_done(search_query_t *sq)
+{
+  hts_mutex_lock(&search_mutex);
+  sq->sq_pending--;
+  hts_cond_broadcast(&search_cond);
+  search_query_release(sq);
+  hts_mutex_unlock(&search_mutex);
+}
+
+
+/**
+ *
+ */
+static void *
+search_provider_thread(void *aux)
+{
+  search_provider_t *sp = aux;
+  search_query_t *sq = sp->sp_query;
+
+  if(!sq->sq_cancelled)
+    sp->sp_backend->be_search(sq->sq_model, sq->sq_query, sq);
+
+  backend_search_done(sq);
+  free(sp);
+  return NULL;
+}
+
+
+/**
+ * Keep the model in loading state until all providers are done,
+ * the deadline has passed or the user went away
+ */
+static void *
+search_scheduler_thread(void *aux)
+{
+  search_query_t *sq = aux;
+  int64_t deadline = showtime_get_ts() + SEARCH_DEADLINE * 1000000LL;
+
+  hts_mutex_lock(&search_mutex);
+
+  while(sq->sq_pending > 0 && !sq->sq_cancelled &&
+	showtime_get_ts() < deadline) {
+    hts_cond_wait_timeout(&search_cond, &search_mutex, 250);
+
+    hts_mutex_unlock(&search_mutex);
+    prop_courier_poll(sq->sq_pc);
+    hts_mutex_lock(&search_mutex);
+  }
+
+  if(sq->sq_pending > 0 && !sq->sq_cancelled)
+    TRACE(TRACE_DEBUG, "search", "%s: %d providers still busy after %d seconds",
+	  sq->sq_query, sq->sq_pending, SEARCH_DEADLINE);
+
+  hts_mutex_unlock(&search_mutex);
+
+  prop_set_int(sq->sq_loading, 0);
+  prop_unsubscribe(sq->sq_sub);
+  prop_courier_destroy(sq->sq_pc);
+
+  hts_mutex_lock(&search_mutex);
+  search_query_release(sq);
+  hts_mutex_unlock(&search_mutex);
+  return NULL;
+}
+
+
 /**
  *
  */
 void
 backend_search(prop_t *model, const char *url)
 {
+  search_query_t *sq = calloc(1, sizeof(search_query_t));
+  search_provider_t *sp;
   backend_t *be;
 
-  LIST_FOREACH(be, &backends, be_global_link)
-    if(be->be_search != NULL)
-      be->be_search(model, url);
+  sq->sq_query = strdup(url);
+  sq->sq_model = prop_ref_inc(model);
+  sq->sq_loading = prop_ref_inc(prop_create(model, "loading"));
+  prop_set_int(sq->sq_loading, 1);
+
+  sq->sq_pc = prop_courier_create_passive();
+  sq->sq_sub = prop_subscribe(PROP_SUB_TRACK_DESTROY,
+			      PROP_TAG_CALLBACK, search_query_destroyed, sq,
+			      PROP_TAG_ROOT, model,
+			      PROP_TAG_COURIER, sq->sq_pc,
+			      NULL);
+
+  hts_mutex_lock(&search_mutex);
+  sq->sq_refcount = 1;
+
+  LIST_FOREACH(be, &backends, be_global_link) {
+    if(be->be_search == NULL)
+      continue;
+
+    sp = malloc(sizeof(search_provider_t));
+    sp->sp_query = sq;
+    sp->sp_backend = be;
+    sq->sq_refcount++;
+    sq->sq_pending++;
+    hts_thread_create_detached("search", search_provider_thread, sp,
+			       THREAD_PRIO_NORMAL);
+  }
+  hts_mutex_unlock(&search_mutex);
+
+  hts_thread_create_detached("search scheduler", search_scheduler_thread, sq,
+			     THREAD_PRIO_LOW);
 }
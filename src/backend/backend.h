@@ -25,6 +25,7 @@ struct pixmap;
 struct media_pipe;
 struct navigator;
 struct event;
+struct search_query;
 
 /**
  * Kept in sync with service_status_t
@@ -73,7 +74,8 @@ typedef struct backend {
 
   int (*be_probe)(const char *url, char *errbuf, size_t errlen);
 
-  void (*be_search)(struct prop *model, const char *query);
+  void (*be_search)(struct prop *model, const char *query,
+		    struct search_query *sq);
 
   int (*be_resolve_item)(const char *url, prop_t *item);
 
@@ -126,6 +128,16 @@ int backend_resolve_item(const char *url, prop_t *item)
 
 void backend_search(prop_t *model, const char *url);
 
+/**
+ * A provider that is still working when be_search() returns must take
+ * a hold on the query and call backend_search_done() when it has
+ * delivered its results. The model stays in loading state until then
+ */
+void backend_search_hold(struct search_query *sq);
+
+void backend_search_done(struct search_query *sq);
+
+
 #define BE_REGISTER(name) \
   static void  __attribute__((constructor)) backend_init_ ## name(void) {\
   static int cnt;							\
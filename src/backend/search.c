@@ -30,6 +30,7 @@
 #include "backend/backend.h"
 #include "backend/backend_prop.h"
 #include "backend/search.h"
+#include "misc/callout.h"
 
 
 /**
@@ -68,6 +69,139 @@ search_class_create(prop_t *parent, prop_t **nodesp, prop_t **entriesp,
 }
 
 
+/**
+ * Flush when we have this many hits or when the oldest one has been
+ * waiting for SEARCH_BATCH_DELAY. The latter is done from a callout
+ * so the last few hits don't have to wait for the provider to finish.
+ *
+ * The callout only ever touches batches on search_batches, under
+ * search_batch_mutex, so a batch can be destroyed at any time.
+ */
+#define SEARCH_BATCH_SIZE  25
+#define SEARCH_BATCH_DELAY 100000
+
+struct search_batch {
+  LIST_ENTRY(search_batch) sb_link;
+  prop_t *sb_nodes;
+  prop_t *sb_entries;
+  prop_vec_t *sb_vec;
+  int64_t sb_first;
+};
+
+static LIST_HEAD(, search_batch) search_batches;
+static hts_mutex_t search_batch_mutex;
+static callout_t search_batch_callout;
+
+
+/**
+ *
+ */
+search_batch_t *
+search_batch_create(prop_t *nodes, prop_t *entries)
+{
+  search_batch_t *sb = calloc(1, sizeof(search_batch_t));
+  sb->sb_nodes = prop_ref_inc(nodes);
+  sb->sb_entries = prop_ref_inc(entries);
+  return sb;
+}
+
+
+/**
+ * Must be called with search_batch_mutex locked
+ */
+static void
+search_batch_flush0(search_batch_t *sb)
+{
+  if(sb->sb_vec == NULL)
+    return;
+
+  LIST_REMOVE(sb, sb_link);
+  prop_add_int(sb->sb_entries, prop_vec_len(sb->sb_vec));
+  prop_set_parent_vector(sb->sb_vec, sb->sb_nodes);
+  prop_vec_release(sb->sb_vec);
+  sb->sb_vec = NULL;
+}
+
+
+/**
+ *
+ */
+static void
+search_batch_timer(callout_t *c, void *aux)
+{
+  int64_t now = showtime_get_ts(), next = 0;
+  search_batch_t *sb, *n;
+
+  hts_mutex_lock(&search_batch_mutex);
+
+  for(sb = LIST_FIRST(&search_batches); sb != NULL; sb = n) {
+    n = LIST_NEXT(sb, sb_link);
+    if(now - sb->sb_first >= SEARCH_BATCH_DELAY)
+      search_batch_flush0(sb);
+    else if(next == 0 || sb->sb_first < next)
+      next = sb->sb_first;
+  }
+
+  if(next)
+    callout_arm_hires(&search_batch_callout, search_batch_timer, NULL,
+		      next + SEARCH_BATCH_DELAY - now);
+
+  hts_mutex_unlock(&search_batch_mutex);
+}
+
+
+/**
+ *
+ */
+void
+search_batch_flush(search_batch_t *sb)
+{
+  hts_mutex_lock(&search_batch_mutex);
+  search_batch_flush0(sb);
+  hts_mutex_unlock(&search_batch_mutex);
+}
+
+
+/**
+ *
+ */
+void
+search_batch_add(search_batch_t *sb, prop_t *p)
+{
+  hts_mutex_lock(&search_batch_mutex);
+
+  if(sb->sb_vec == NULL) {
+    sb->sb_vec = prop_vec_create(SEARCH_BATCH_SIZE);
+    sb->sb_first = showtime_get_ts();
+    LIST_INSERT_HEAD(&search_batches, sb, sb_link);
+
+    if(!callout_isarmed(&search_batch_callout))
+      callout_arm_hires(&search_batch_callout, search_batch_timer, NULL,
+			SEARCH_BATCH_DELAY);
+  }
+
+  sb->sb_vec = prop_vec_append(sb->sb_vec, p);
+
+  if(prop_vec_len(sb->sb_vec) >= SEARCH_BATCH_SIZE)
+    search_batch_flush0(sb);
+
+  hts_mutex_unlock(&search_batch_mutex);
+}
+
+
+/**
+ *
+ */
+void
+search_batch_destroy(search_batch_t *sb)
+{
+  search_batch_flush(sb);
+  prop_ref_dec(sb->sb_nodes);
+  prop_ref_dec(sb->sb_entries);
+  free(sb);
+}
+
+
 /**
  *
  */
@@ -130,14 +264,28 @@ search_open(prop_t *page, const char *url0)
 
   prop_nf_release(pnf);
 
+  prop_link(prop_create(source, "loading"), prop_create(model, "loading"));
+
   backend_search(source, url);
   return 0;
 }
 
+/**
+ *
+ */
+static int
+search_init(void)
+{
+  hts_mutex_init(&search_batch_mutex);
+  return 0;
+}
+
+
 /**
  *
  */
 static backend_t be_search = {
+  .be_init = search_init,
   .be_canhandle = search_canhandle,
   .be_open = search_open,
 };
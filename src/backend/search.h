@@ -24,4 +24,17 @@ prop_t *search_get_settings(void);
 int search_class_create(prop_t *parent, prop_t **nodesp, prop_t **entriesp,
 			const char *title, const char *icon);
 
+/**
+ * Collects search hits and adds them to a search class as a vector
+ */
+typedef struct search_batch search_batch_t;
+
+search_batch_t *search_batch_create(prop_t *nodes, prop_t *entries);
+
+void search_batch_add(search_batch_t *sb, prop_t *p);
+
+void search_batch_flush(search_batch_t *sb);
+
+void search_batch_destroy(search_batch_t *sb);
+
 #endif // SEARCH_H__
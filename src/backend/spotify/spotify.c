@@ -310,6 +310,7 @@ typedef struct {
 typedef struct spotify_search {
   int ss_ref;
   char *ss_query;
+  struct search_query *ss_sq; // Until initial search has completed
 
   spotify_search_request_t ss_reqs[3];
 
@@ -500,6 +501,19 @@ spotify_get_image_fail(spotify_image_t *si)
 }
 
 
+/**
+ *
+ */
+static void
+search_initial_done(spotify_search_t *ss)
+{
+  if(ss->ss_sq == NULL)
+    return;
+  backend_search_done(ss->ss_sq);
+  ss->ss_sq = NULL;
+}
+
+
 /**
  *
  */
@@ -511,6 +525,8 @@ search_release(spotify_search_t *ss)
   if(ss->ss_ref > 0)
     return;
 
+  search_initial_done(ss);
+
   for(i = 0; i < 3; i++) {
     prop_unsubscribe(ss->ss_reqs[i].ssr_sub);
     prop_ref_dec(ss->ss_reqs[i].ssr_nodes);
@@ -3012,6 +3028,7 @@ spotify_search_done(sp_search *result, void *userdata)
   ss_fill_albums(result,  &ss->ss_reqs[SS_ALBUMS]);
   ss_fill_artists(result, &ss->ss_reqs[SS_ARTISTS]);
 
+  search_initial_done(ss);
   search_release(ss);
 }
 
@@ -3897,7 +3914,7 @@ spotify_shutdown_late(void *opaque, int exitcode)
  *
  */
 static void
-be_spotify_search(prop_t *source, const char *query)
+be_spotify_search(prop_t *source, const char *query, struct search_query *sq)
 {
   if(spotify_start(NULL, 0, 0))
     return;
@@ -3927,6 +3944,8 @@ be_spotify_search(prop_t *source, const char *query)
   }
 
   ss->ss_query = strdup(query);
+  ss->ss_sq = sq;
+  backend_search_hold(sq);
   
   spotify_msg_enq(spotify_msg_build(SPOTIFY_SEARCH, ss));
 }
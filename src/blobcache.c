@@ -165,6 +165,47 @@ blobcache_get(const char *key, const char *stash, size_t *sizep, int pad)
 }
 
 
+/**
+ * Like blobcache_get() but return a file descriptor positioned at the
+ * start of the data instead of loading it, -1 if not found.
+ * blobcache_put() never rewrites an existing file so the data stays
+ * intact for as long as the descriptor is open
+ */
+int
+blobcache_get_fd(const char *key, const char *stash, size_t *sizep)
+{
+  char path[PATH_MAX];
+  struct stat st;
+  uint8_t d[20], buf[4];
+  time_t exp;
+  int fd;
+
+  digest_key(key, stash, d);
+
+  digest_to_path(d, path, sizeof(path));
+
+  if((fd = open(path, O_RDONLY, 0)) == -1)
+    return -1;
+
+  if(fstat(fd, &st) || st.st_size < 4 || read(fd, buf, 4) != 4) {
+    close(fd);
+    return -1;
+  }
+
+  exp = buf[0] << 24 | buf[1] << 16 | buf[2] << 8 | buf[3];
+
+  if(exp < time(NULL)) {
+    // Expired, blobcache_get() or the pruner will remove it
+    close(fd);
+    return -1;
+  }
+
+  if(sizep != NULL)
+    *sizep = st.st_size - 4;
+  return fd;
+}
+
+
 /**
  *
  */
@@ -228,6 +269,9 @@ blobcache_put(const char *key, const char *stash,
 
   digest_to_path(d, path, sizeof(path));
 
+  // Start with a new file, the old one may be open by blobcache_get_fd()
+  unlink(path);
+
   if((fd = open(path, O_CREAT | O_WRONLY, 0666)) == -1)
     return;
 
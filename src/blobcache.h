@@ -22,6 +22,8 @@
 
 void *blobcache_get(const char *key, const char *stash, size_t *sizep, int pad);
 
+int blobcache_get_fd(const char *key, const char *stash, size_t *sizep);
+
 void blobcache_put(const char *key, const char *stash, const void *data,
 		   size_t size, int maxage);
 
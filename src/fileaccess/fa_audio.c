@@ -201,6 +201,247 @@ seekflush(media_pipe_t *mp, media_buf_t **mbp)
   }
 }
 
+/**
+ * Preroll of the next track
+ *
+ * When the current track is about to end the next URL on the media
+ * pipe (set by the playqueue) is opened and probed in a separate
+ * thread. The next be_file_playaudio() picks it up from here and thus
+ * its packets can be queued right after the last packets of the
+ * current track without any I/O delay in between.
+ */
+#define PREROLL_TIME (10 * 1000000LL)
+
+/* Packets left queued when returning at EOF with a prerolled next
+   track. Enough to cover the switch to the next track */
+#define PREROLL_QUEUE_TAIL 4
+
+static hts_mutex_t preroll_mutex;
+static hts_cond_t preroll_cond;
+static char *preroll_url;
+static AVFormatContext *preroll_fctx;
+static int preroll_loading;
+
+
+/**
+ *
+ */
+void
+fa_audio_init(void)
+{
+  hts_mutex_init(&preroll_mutex);
+  hts_cond_init(&preroll_cond, &preroll_mutex);
+}
+
+
+/**
+ *
+ */
+static AVFormatContext *
+fa_audio_open(const char *url, char *errbuf, size_t errlen)
+{
+  AVFormatContext *fctx;
+  char faurl[URL_MAX];
+  int i;
+
+  snprintf(faurl, sizeof(faurl), "showtime:%s", url);
+
+  if(av_open_input_file(&fctx, faurl, NULL, 0, NULL) != 0) {
+    snprintf(errbuf, errlen, "Unable to open input file (FFmpeg)");
+    return NULL;
+  }
+
+  /* Containers with headers (mkv, mp4, ...) already know the stream
+     types here. Don't let the stream info probing read video data */
+  for(i = 0; i < fctx->nb_streams; i++)
+    if(fctx->streams[i]->codec->codec_type != CODEC_TYPE_AUDIO &&
+       fctx->streams[i]->codec->codec_type != CODEC_TYPE_UNKNOWN)
+      fctx->streams[i]->discard = AVDISCARD_ALL;
+
+  if(av_find_stream_info(fctx) < 0) {
+    av_close_input_file(fctx);
+    snprintf(errbuf, errlen, "Unable to find stream info");
+    return NULL;
+  }
+  return fctx;
+}
+
+
+#if ENABLE_LIBOPENSPC || ENABLE_LIBGME
+/**
+ * Return non-zero if the file header belongs to a format that is
+ * played by something else than libavformat
+ */
+static int
+fa_audio_is_special(const char *pb)
+{
+#if ENABLE_LIBGME
+  if(*gme_identify_header(pb))
+    return 1;
+#endif
+
+#if ENABLE_LIBOPENSPC
+  if(!memcmp(pb, "SNES-SPC700 Sound File Data", 27))
+    return 1;
+#endif
+  return 0;
+}
+#endif
+
+
+/**
+ * Must be called with preroll_mutex held
+ */
+static void
+preroll_flush(void)
+{
+  if(preroll_fctx != NULL)
+    av_close_input_file(preroll_fctx);
+  preroll_fctx = NULL;
+  free(preroll_url);
+  preroll_url = NULL;
+}
+
+
+/**
+ *
+ */
+static void *
+preroll_thread(void *aux)
+{
+  char *url = aux;
+  char errbuf[128];
+  AVFormatContext *fctx = NULL;
+
+#if ENABLE_LIBOPENSPC || ENABLE_LIBGME
+  char pb[128];
+  void *fh;
+
+  if((fh = fa_open(url, errbuf, sizeof(errbuf))) == NULL)
+    goto done;
+
+  // Don't hand these to libavformat, be_file_playaudio() would not
+  if(fa_read(fh, pb, sizeof(pb)) == sizeof(pb) && fa_audio_is_special(pb)) {
+    fa_close(fh);
+    snprintf(errbuf, sizeof(errbuf), "Not a libavformat file");
+    goto done;
+  }
+  fa_close(fh);
+#endif
+
+  fctx = fa_audio_open(url, errbuf, sizeof(errbuf));
+
+#if ENABLE_LIBOPENSPC || ENABLE_LIBGME
+ done:
+#endif
+  if(fctx == NULL)
+    TRACE(TRACE_DEBUG, "Audio", "Unable to preroll %s -- %s", url, errbuf);
+
+  hts_mutex_lock(&preroll_mutex);
+  preroll_loading = 0;
+  if(preroll_url != NULL && !strcmp(preroll_url, url))
+    preroll_fctx = fctx;
+  else if(fctx != NULL)
+    av_close_input_file(fctx);
+  hts_cond_broadcast(&preroll_cond);
+  hts_mutex_unlock(&preroll_mutex);
+
+  free(url);
+  return NULL;
+}
+
+
+/**
+ * Start opening the next track, if we know about one and it is
+ * something we can open (not spotify:, etc)
+ *
+ * Returns 0 if there is no such next track
+ */
+static int
+preroll_start(media_pipe_t *mp)
+{
+  char *url = mp_get_preroll_url(mp);
+  char errbuf[128];
+
+  if(url == NULL)
+    return 0;
+
+  if(!fa_can_handle(url, errbuf, sizeof(errbuf))) {
+    free(url);
+    return 0;
+  }
+
+  hts_mutex_lock(&preroll_mutex);
+
+  if(preroll_loading || 
+     (preroll_url != NULL && !strcmp(preroll_url, url))) {
+    hts_mutex_unlock(&preroll_mutex);
+    free(url);
+    return 1;
+  }
+
+  preroll_flush();
+  preroll_url = strdup(url);
+  preroll_loading = 1;
+  hts_mutex_unlock(&preroll_mutex);
+
+  TRACE(TRACE_DEBUG, "Audio", "Prerolling %s", url);
+  hts_thread_create_detached("audio preroll", preroll_thread, url,
+			     THREAD_PRIO_LOW);
+  return 1;
+}
+
+
+/**
+ * Return non-zero if the next track has been opened successfully,
+ * i.e. be_file_playaudio() will be able to start it right away
+ */
+static int
+preroll_ready(media_pipe_t *mp)
+{
+  char *url = mp_get_preroll_url(mp);
+  int r;
+
+  if(url == NULL)
+    return 0;
+
+  hts_mutex_lock(&preroll_mutex);
+  r = !preroll_loading && preroll_fctx != NULL &&
+    preroll_url != NULL && !strcmp(preroll_url, url);
+  hts_mutex_unlock(&preroll_mutex);
+  free(url);
+  return r;
+}
+
+
+/**
+ * Return a prerolled format context for 'url', if any
+ */
+static AVFormatContext *
+preroll_take(const char *url)
+{
+  AVFormatContext *fctx = NULL;
+
+  hts_mutex_lock(&preroll_mutex);
+
+  if(preroll_url != NULL && !strcmp(preroll_url, url)) {
+
+    while(preroll_loading)
+      hts_cond_wait(&preroll_cond, &preroll_mutex);
+
+    fctx = preroll_fctx;
+    preroll_fctx = NULL;
+    preroll_flush();
+
+  } else if(!preroll_loading) {
+    preroll_flush();
+  }
+
+  hts_mutex_unlock(&preroll_mutex);
+  return fctx;
+}
+
+
 /**
  *
  */
@@ -218,58 +459,52 @@ be_file_playaudio(const char *url, media_pipe_t *mp,
   event_ts_t *ets;
   int64_t ts, pts4seek = 0;
   media_codec_t *cw;
-  char faurl[URL_MAX];
   event_t *e;
   int lost_focus = 0;
+  int prerolled = 0;
 
   mp_set_playstatus_by_hold(mp, hold, NULL);
 
-  // First we need to check for a few other formats
+  fctx = preroll_take(url);
+
+  // First we need to check for a few other formats, unless prerolled
 #if ENABLE_LIBOPENSPC || ENABLE_LIBGME
+  if(fctx == NULL) {
 
-  char pb[128];
-  void *fh;
-  size_t psiz;
+    char pb[128];
+    void *fh;
+    size_t psiz;
 
-  if((fh = fa_open(url, errbuf, errlen)) == NULL)
-    return NULL;
-  
-  psiz = fa_read(fh, pb, sizeof(pb));
-  if(psiz < sizeof(pb)) {
-    fa_close(fh);
-    snprintf(errbuf, errlen, "Fill too small");
-    return NULL;
-  }
+    if((fh = fa_open(url, errbuf, errlen)) == NULL)
+      return NULL;
+
+    psiz = fa_read(fh, pb, sizeof(pb));
+    if(psiz < sizeof(pb)) {
+      fa_close(fh);
+      snprintf(errbuf, errlen, "Fill too small");
+      return NULL;
+    }
 
 #if ENABLE_LIBGME
-  if(*gme_identify_header(pb)) {
-    fa_seek(fh, 0, SEEK_SET);
-    e = fa_gme_playfile(mp, fh, errbuf, errlen, hold);
-    fa_close(fh);
-    return e;
-  }
+    if(*gme_identify_header(pb)) {
+      fa_seek(fh, 0, SEEK_SET);
+      e = fa_gme_playfile(mp, fh, errbuf, errlen, hold);
+      fa_close(fh);
+      return e;
+    }
 #endif
 
 #if ENABLE_LIBOPENSPC
-  if(!memcmp(pb, "SNES-SPC700 Sound File Data", 27))
-    return openspc_play(mp, fh, errbuf, errlen);
+    if(!memcmp(pb, "SNES-SPC700 Sound File Data", 27))
+      return openspc_play(mp, fh, errbuf, errlen);
 #endif
 
-  fa_close(fh);
-#endif
-
-  snprintf(faurl, sizeof(faurl), "showtime:%s", url);
-
-  if(av_open_input_file(&fctx, faurl, NULL, 0, NULL) != 0) {
-    snprintf(errbuf, errlen, "Unable to open input file (FFmpeg)");
-    return NULL;
+    fa_close(fh);
   }
+#endif
 
-  if(av_find_stream_info(fctx) < 0) {
-    av_close_input_file(fctx);
-    snprintf(errbuf, errlen, "Unable to find stream info");
+  if(fctx == NULL && (fctx = fa_audio_open(url, errbuf, errlen)) == NULL)
     return NULL;
-  }
 
   TRACE(TRACE_DEBUG, "Audio", "Starting playback of %s", url);
 
@@ -281,17 +516,25 @@ be_file_playaudio(const char *url, media_pipe_t *mp,
   fw = media_format_create(fctx);
 
   cw = NULL;
-  for(i = 0; i < fctx->nb_streams; i++) {
-    ctx = fctx->streams[i]->codec;
-
-    if(ctx->codec_type != CODEC_TYPE_AUDIO)
-      continue;
+#if LIBAVFORMAT_VERSION_INT >= AV_VERSION_INT(52, 91, 0)
+  i = av_find_best_stream(fctx, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
+#else
+  for(i = 0; i < fctx->nb_streams; i++)
+    if(fctx->streams[i]->codec->codec_type == CODEC_TYPE_AUDIO)
+      break;
+#endif
 
+  if(i >= 0 && i < fctx->nb_streams) {
+    ctx = fctx->streams[i]->codec;
     cw = media_codec_create(ctx->codec_id, ctx->codec_type, 0, fw, ctx, NULL,
 			    mp);
     mp->mp_audio.mq_stream = i;
-    break;
   }
+
+  // Let the demuxer skip everything else
+  for(i = 0; i < fctx->nb_streams; i++)
+    fctx->streams[i]->discard =
+      i == mp->mp_audio.mq_stream ? AVDISCARD_DEFAULT : AVDISCARD_ALL;
   
   if(cw == NULL) {
     media_format_deref(fw);
@@ -311,7 +554,15 @@ be_file_playaudio(const char *url, media_pipe_t *mp,
 
       if((r = av_read_frame(fctx, &pkt)) < 0) {
 
-	while((e = mp_wait_for_empty_queues(mp, 0)) != NULL) {
+	/* If the next track is already opened we only wait for the
+	   queue to drain down to a short tail before returning. The
+	   next track's packets are then queued right after ours
+	   (gapless playback) while the playqueue does not switch
+	   metadata until our audio is almost played out. */
+	preroll_start(mp);
+
+	while((e = mp_wait_for_empty_queues(mp, preroll_ready(mp) ?
+					    PREROLL_QUEUE_TAIL : 0)) != NULL) {
 	  if(event_is_type(e, EVENT_PLAYQUEUE_JUMP) ||
 	     event_is_action(e, ACTION_PREV_TRACK) ||
 	     event_is_action(e, ACTION_NEXT_TRACK) ||
@@ -364,6 +615,11 @@ be_file_playaudio(const char *url, media_pipe_t *mp,
 	else
 	  mb->mb_time = mb->mb_pts - fctx->start_time;
 	pts4seek = mb->mb_time;
+
+	if(!prerolled && fctx->duration != AV_NOPTS_VALUE &&
+	   mb->mb_time > fctx->duration - PREROLL_TIME)
+	  prerolled = preroll_start(mp);
+
       } else
 	mb->mb_time = AV_NOPTS_VALUE;
 
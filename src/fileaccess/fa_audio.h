@@ -22,6 +22,8 @@
 #include "media.h"
 struct backend;
 
+void fa_audio_init(void);
+
 event_t *be_file_playaudio(const char *url, media_pipe_t *mp,
 			   char *errbuf, size_t errlen, int hold);
 
@@ -31,6 +31,8 @@
 #include "showtime.h"
 #include "htsmsg/htsmsg_xml.h"
 #include "misc/string.h"
+#include "blobcache.h"
+#include "prop/prop.h"
 
 static int http_tokenize(char *buf, char **vec, int vecsize, int delimiter);
 
@@ -79,6 +81,36 @@ http_ctime(time_t *tp, const char *d)
 }
 
 
+/**
+ * Number of seconds a response may be cached, 'def' if the response
+ * doesn't say. Returns -1 if it must not be stored at all
+ */
+static int
+http_response_max_age(struct http_header_list *headers, int def)
+{
+  const char *s, *s2;
+  time_t expires, sdate;
+  int age = def;
+
+  if((s  = http_header_get(headers, "date")) != NULL && 
+     (s2 = http_header_get(headers, "expires")) != NULL &&
+     !http_ctime(&sdate, s) && !http_ctime(&expires, s2))
+    age = expires - sdate;
+
+  if((s = http_header_get(headers, "cache-control")) != NULL) {
+    if((s2 = strstr(s, "max-age=")) != NULL)
+      age = atoi(s2 + strlen("max-age="));
+
+    if(strstr(s, "no-cache"))
+      age = 0;
+
+    if(strstr(s, "no-store"))
+      return -1;
+  }
+  return age < 0 ? 0 : age;
+}
+
+
 
 
 /**
@@ -588,6 +620,61 @@ http_read_content(http_file_t *hf)
 }
 
 
+/**
+ * Read content and pass it on to 'cb' as it arrives.
+ * Returns -1 if connection is lost or whatever 'cb' returned if it
+ * returned non-zero. In both cases the connection can not be reused
+ */
+typedef int (http_content_cb_t)(void *opaque, const void *data, size_t len);
+
+static int
+http_read_content_cb(http_file_t *hf, http_content_cb_t *cb, void *opaque)
+{
+  int csize, n, r;
+  char buf[8192];
+  char chunkheader[100];
+  http_connection_t *hc = hf->hf_connection;
+
+  if(hf->hf_chunked_transfer) {
+
+    while(1) {
+      if(tcp_read_line(hc->hc_tc, chunkheader, sizeof(chunkheader),
+		       &hc->hc_spill) < 0)
+	break;
+ 
+      if((csize = strtol(chunkheader, NULL, 16)) == 0)
+	return 0;
+
+      while(csize > 0) {
+	n = MIN(csize, sizeof(buf));
+	if(tcp_read_data(hc->hc_tc, buf, n, &hc->hc_spill))
+	  goto lost;
+	if((r = cb(opaque, buf, n)) != 0)
+	  return r;
+	csize -= n;
+      }
+
+      if(tcp_read_data(hc->hc_tc, chunkheader, 2, &hc->hc_spill))
+	break;
+    }
+  lost:
+    hf->hf_chunked_transfer = 0;
+    return -1;
+  }
+
+  while(hf->hf_rsize > 0) {
+    n = MIN(hf->hf_rsize, sizeof(buf));
+    if(tcp_read_data(hc->hc_tc, buf, n, &hc->hc_spill))
+      return -1;
+    hf->hf_rsize -= n;
+    if((r = cb(opaque, buf, n)) != 0)
+      return r;
+  }
+  hf->hf_rsize = 0;
+  return 0;
+}
+
+
 /**
  *
  */
@@ -1489,7 +1576,7 @@ http_quickload(struct fa_protocol *fap, const char *url,
     return NULL;
 
   if(fs != NULL) {
-    const char *s, *s2;
+    const char *s;
 
     memset(fs, 0, sizeof(struct fa_stat));
     fs->fs_type = CONTENT_FILE;
@@ -1498,24 +1585,7 @@ http_quickload(struct fa_protocol *fap, const char *url,
     if((s = http_header_get(&headers, "last-modified")) != NULL)
       http_ctime(&fs->fs_mtime, s);
 
-    fs->fs_cache_age = 3600;
-
-    if((s  = http_header_get(&headers, "date")) != NULL && 
-       (s2 = http_header_get(&headers, "expires")) != NULL) {
-      time_t expires, sdate;
-      if(!http_ctime(&sdate, s) && !http_ctime(&expires, s2))
-	fs->fs_cache_age = expires - sdate;
-    }
-
-    if((s = http_header_get(&headers, "cache-control")) != NULL) {
-      if((s2 = strstr(s, "max-age=")) != NULL) {
-	fs->fs_cache_age = atoi(s2 + strlen("max-age="));
-      }
-
-      if(strstr(s, "no-cache") || strstr(s, "no-store")) {
-	fs->fs_cache_age = 0;
-      }
-    }
+    fs->fs_cache_age = FFMAX(http_response_max_age(&headers, 3600), 0);
   }
   http_headers_free(&headers);
   return res;
@@ -1618,152 +1688,211 @@ get_cdata_by_tag(htsmsg_t *tags, const char *name)
 
 
 /**
- * Parse WEBDAV PROPFIND results
+ * WEBDAV PROPFIND results are parsed as they arrive, one
+ * <DAV:response> at a time
  */
-static int
-parse_propfind(http_file_t *hf, htsmsg_t *xml, fa_dir_t *fd,
-	       char *errbuf, size_t errlen)
+typedef struct propfind {
+  http_file_t *pf_hf;
+  fa_dir_t *pf_fd;
+  htsmsg_xml_parser_t *pf_xp;
+  int pf_found;
+
+  char pf_errbuf[128];
+
+  char pf_rpath[URL_MAX];
+  char pf_path[URL_MAX];
+  char pf_fname[URL_MAX];
+  char pf_ehref[URL_MAX]; // Escaped href
+} propfind_t;
+
+
+/**
+ * Parse a single DAV:response
+ */
+static void
+propfind_response(void *opaque, const char *name, htsmsg_t *m)
 {
-  htsmsg_t *m, *c, *c2;
-  htsmsg_field_t *f;
+  propfind_t *pf = opaque;
+  http_file_t *hf = pf->pf_hf;
+  fa_dir_t *fd = pf->pf_fd;
+  char *path = pf->pf_path, *fname = pf->pf_fname;
+  htsmsg_t *c, *c2;
   const char *href, *d, *q;
-  int isdir, i, r;
-  char *rpath = malloc(URL_MAX);
-  char *path  = malloc(URL_MAX);
-  char *fname = malloc(URL_MAX);
-  char *ehref = malloc(URL_MAX); // Escaped href
+  int isdir, i;
   fa_dir_entry_t *fde;
 
-  // We need to compare paths and to do so, we must deescape the
-  // possible URL encoding. Do the searched-for path once
-  snprintf(rpath, URL_MAX, "%s", hf->hf_path);
-  http_deescape(rpath);
+  if(strcmp(name, "DAV:response") || pf->pf_found)
+    goto done;
 
-  if((m = htsmsg_get_map_multi(xml, "tags", 
-			       "DAV:multistatus", "tags", NULL)) == NULL) {
-    snprintf(errbuf, errlen, "WEBDAV: DAV:multistatus not found in XML");
-    goto err;
+  if((c = htsmsg_get_map(m, "tags")) == NULL)
+    goto done;
+    
+  if((c2 = htsmsg_get_map(c, "DAV:href")) == NULL)
+    goto done;
+
+  /* Some DAV servers seams to send an empty href tag for root path "/" */
+  if((href = htsmsg_get_str(c2, "cdata")) == NULL)
+    href = "/";
+  else {
+    snprintf(pf->pf_ehref, URL_MAX, "%s", href);
+    http_deescape(pf->pf_ehref);
   }
 
-  HTSMSG_FOREACH(f, m) {
-    if(strcmp(f->hmf_name, "DAV:response"))
-      continue;
-    if((c = htsmsg_get_map_by_field(f)) == NULL)
-      continue;
+  if((c = htsmsg_get_map_multi(c, "DAV:propstat", "tags",
+			       "DAV:prop", "tags", NULL)) == NULL)
+    goto done;
 
-    if((c = htsmsg_get_map(c, "tags")) == NULL)
-      continue;
-    
-    if((c2 = htsmsg_get_map(c, "DAV:href")) == NULL)
-      continue;
+  isdir = !!htsmsg_get_map_multi(c, "DAV:resourcetype", "tags",
+				 "DAV:collection", NULL);
 
-    /* Some DAV servers seams to send an empty href tag for root path "/" */
-    if((href = htsmsg_get_str(c2, "cdata")) == NULL)
-      href = "/";
-    else {
-      snprintf(ehref, URL_MAX, "%s", href);
-      http_deescape(ehref);
-    }
+  if(fd != NULL) {
 
-    if((c = htsmsg_get_map_multi(c, "DAV:propstat", "tags",
-				 "DAV:prop", "tags", NULL)) == NULL)
-      continue;
+    if(strcmp(pf->pf_rpath, pf->pf_ehref)) {
+      http_connection_t *hc = hf->hf_connection;
+
+      if(hc->hc_port != 80) {
+	snprintf(path, URL_MAX, "webdav://%s:%d%s", 
+		 hc->hc_hostname, hc->hc_port, href);
+      } else {
+	snprintf(path, URL_MAX, "webdav://%s%s", 
+		 hc->hc_hostname, href);
+      }
 
-    isdir = !!htsmsg_get_map_multi(c, "DAV:resourcetype", "tags",
-				   "DAV:collection", NULL);
+      if((q = strrchr(path, '/')) != NULL) {
+	q++;
 
-    if(fd != NULL) {
+	if(*q == 0) {
+	  /* We have a trailing slash, can't piggy back filename
+	     on path (we want to keep the trailing '/' in the URL
+	     since some webdav servers require it and will force us
+	     to 301/redirect if we don't come back with it */
+	  q--;
+	  while(q != path && q[-1] != '/')
+	    q--;
 
-      if(strcmp(rpath, ehref)) {
-	http_connection_t *hc = hf->hf_connection;
+	  for(i = 0; i < URL_MAX - 1 && q[i] != '/'; i++)
+	    fname[i] = q[i];
+	  fname[i] = 0;
 
-	if(hc->hc_port != 80) {
-	  snprintf(path, URL_MAX, "webdav://%s:%d%s", 
-		   hc->hc_hostname, hc->hc_port, href);
 	} else {
-	  snprintf(path, URL_MAX, "webdav://%s%s", 
-		   hc->hc_hostname, href);
+	  snprintf(fname, URL_MAX, "%s", q);
 	}
+	http_deescape(fname);
+	  
+	fde = fa_dir_add(fd, path, fname, 
+			 isdir ? CONTENT_DIR : CONTENT_FILE);
 
-	if((q = strrchr(path, '/')) != NULL) {
-	  q++;
-
-	  if(*q == 0) {
-	    /* We have a trailing slash, can't piggy back filename
-	       on path (we want to keep the trailing '/' in the URL
-	       since some webdav servers require it and will force us
-	       to 301/redirect if we don't come back with it */
-	    q--;
-	    while(q != path && q[-1] != '/')
-	      q--;
+	if(fde != NULL && !isdir) {
 
-	    for(i = 0; i < URL_MAX - 1 && q[i] != '/'; i++)
-	      fname[i] = q[i];
-	    fname[i] = 0;
+	  fde->fde_statdone = 1;
 
-	  } else {
-	    snprintf(fname, URL_MAX, "%s", q);
-	  }
-	  http_deescape(fname);
+	  if((d = get_cdata_by_tag(c, "DAV:getcontentlength")) != NULL)
+	    fde->fde_stat.fs_size = strtoll(d, NULL, 10);
+	  else
+	    fde->fde_statdone = 0;
 	  
-	  fde = fa_dir_add(fd, path, fname, 
-			   isdir ? CONTENT_DIR : CONTENT_FILE);
+	  if((d = get_cdata_by_tag(c, "DAV:getlastmodified")) == NULL ||
+	     http_ctime(&fde->fde_stat.fs_mtime, d))
+	    fde->fde_statdone = 1;
 
-	  if(fde != NULL && !isdir) {
+	}
+      }
+    }
+  } else {
+    /* single entry stat(2) */
 
-	    fde->fde_statdone = 1;
+    snprintf(fname, URL_MAX, "%s", href);
+    http_deescape(fname);
 
-	    if((d = get_cdata_by_tag(c, "DAV:getcontentlength")) != NULL)
-	      fde->fde_stat.fs_size = strtoll(d, NULL, 10);
-	    else
-	      fde->fde_statdone = 0;
-	  
-	    if((d = get_cdata_by_tag(c, "DAV:getlastmodified")) == NULL ||
-	       http_ctime(&fde->fde_stat.fs_mtime, d))
-	      fde->fde_statdone = 1;
+    if(!strcmp(pf->pf_rpath, fname)) {
+      /* This is the path we asked for */
 
-	  }
-	}
+      hf->hf_isdir = isdir;
+
+      if(!isdir) {
+	if((d = get_cdata_by_tag(c, "DAV:getcontentlength")) != NULL)
+	  hf->hf_filesize = strtoll(d, NULL, 10);
+
+	hf->hf_mtime = 0;
+	if((d = get_cdata_by_tag(c, "DAV:getlastmodified")) != NULL)
+	  http_ctime(&hf->hf_mtime, d);
       }
-    } else {
-      /* single entry stat(2) */
+      pf->pf_found = 1;
+    } 
+  }
+ done:
+  htsmsg_destroy(m);
+}
 
-      snprintf(fname, URL_MAX, "%s", href);
-      http_deescape(fname);
 
-      if(!strcmp(rpath, fname)) {
-	/* This is the path we asked for */
+/**
+ *
+ */
+static int
+propfind_feed(void *opaque, const void *data, size_t len)
+{
+  propfind_t *pf = opaque;
+  return htsmsg_xml_parser_feed(pf->pf_xp, data, len,
+				pf->pf_errbuf, sizeof(pf->pf_errbuf)) ? 1 : 0;
+}
 
-	hf->hf_isdir = isdir;
 
-	if(!isdir) {
-	  if((d = get_cdata_by_tag(c, "DAV:getcontentlength")) != NULL)
-	    hf->hf_filesize = strtoll(d, NULL, 10);
+/**
+ * Parse WEBDAV PROPFIND results
+ */
+static int
+parse_propfind(http_file_t *hf, fa_dir_t *fd, char *errbuf, size_t errlen)
+{
+  propfind_t *pf = calloc(1, sizeof(propfind_t));
+  htsmsg_t *xml = NULL;
+  int r;
 
-	  hf->hf_mtime = 0;
-	  if((d = get_cdata_by_tag(c, "DAV:getlastmodified")) != NULL)
-	    http_ctime(&hf->hf_mtime, d);
-	}
-	goto ok;
-      } 
-    }
+  pf->pf_hf = hf;
+  pf->pf_fd = fd;
+
+  // We need to compare paths and to do so, we must deescape the
+  // possible URL encoding. Do the searched-for path once
+  snprintf(pf->pf_rpath, URL_MAX, "%s", hf->hf_path);
+  http_deescape(pf->pf_rpath);
+
+  pf->pf_xp = htsmsg_xml_parser_create_tree(2, propfind_response, pf);
+
+  r = http_read_content_cb(hf, propfind_feed, pf);
+
+  if(r == -1) {
+    http_detach(hf, 0);
+    snprintf(errbuf, errlen, "Connection lost");
+    goto out;
   }
 
-  if(fd == NULL) {
-    /* We should have returned earlier, server did not include the file 
-       we asked for in its reply. The server is probably broken. 
+  if(r || htsmsg_xml_parser_finish(pf->pf_xp, pf->pf_errbuf,
+				   sizeof(pf->pf_errbuf))) {
+    if(r)
+      http_detach(hf, 0); // Rest of response is still pending
+    snprintf(errbuf, errlen,
+	     "WEBDAV/PROPFIND: XML parsing failed:\n%s", pf->pf_errbuf);
+    r = -1;
+    goto out;
+  }
+
+  xml = htsmsg_xml_parser_get_tree(pf->pf_xp);
+
+  if(htsmsg_get_map_multi(xml, "tags", "DAV:multistatus", NULL) == NULL) {
+    snprintf(errbuf, errlen, "WEBDAV: DAV:multistatus not found in XML");
+    r = -1;
+  } else if(fd == NULL && !pf->pf_found) {
+    /* Server did not include the file we asked for in its reply.
+       The server is probably broken. 
        (It should respond with a 404 or something) */
     snprintf(errbuf, errlen, "WEBDAV: File not found in XML reply");
-  err:
     r = -1;
-  } else {
-  ok:
-    r = 0;
   }
-  free(rpath);
-  free(path);
-  free(fname);
-  free(ehref);
+
+ out:
+  if(xml != NULL)
+    htsmsg_destroy(xml);
+  htsmsg_xml_parser_destroy(pf->pf_xp);
+  free(pf);
   return r;
 }
 
@@ -1775,12 +1904,9 @@ static int
 dav_propfind(http_file_t *hf, fa_dir_t *fd, char *errbuf, size_t errlen,
 	     int *non_interactive)
 {
-  int code, retval;
+  int code;
   htsbuf_queue_t q;
-  char *buf;
-  htsmsg_t *xml;
   int redircount = 0;
-  char err0[128];
   int i;
 
   for(i = 0; i < 5; i++) {
@@ -1817,20 +1943,7 @@ dav_propfind(http_file_t *hf, fa_dir_t *fd, char *errbuf, size_t errlen,
     switch(code) {
       
     case 207: /* 207 Multi-part */
-      if((buf = http_read_content(hf)) == NULL) {
-	snprintf(errbuf, errlen, "Connection lost");
-	return -1;
-      }
-
-      /* XML parser consumes 'buf' */
-      if((xml = htsmsg_xml_deserialize(buf, err0, sizeof(err0))) == NULL) {
-	snprintf(errbuf, errlen,
-		 "WEBDAV/PROPFIND: XML parsing failed:\n%s", err0);
-	return -1;
-      }
-      retval = parse_propfind(hf, xml, fd, errbuf, errlen);
-      htsmsg_destroy(xml);
-      return retval;
+      return parse_propfind(hf, fd, errbuf, errlen);
 
     case 301:
     case 302:
@@ -1928,16 +2041,21 @@ static fa_protocol_t fa_protocol_webdav = {
 FAP_REGISTER(webdav);
 
 
+/**
+ * Internal flag, a 304 reply makes http_request0() return 1
+ */
+#define HTTP_REQUEST_CONDITIONAL 0x10000
+
 /**
  *
  */
-int
-http_request(const char *url, const char **arguments, 
-	     char **result, size_t *result_sizep,
-	     char *errbuf, size_t errlen,
-	     htsbuf_queue_t *postdata, const char *postcontenttype,
-	     int flags, struct http_header_list *headers_out,
-	     struct http_header_list *headers_in, const char *method)
+static int
+http_request0(const char *url, const char **arguments, 
+	      char **result, size_t *result_sizep,
+	      char *errbuf, size_t errlen,
+	      htsbuf_queue_t *postdata, const char *postcontenttype,
+	      int flags, struct http_header_list *headers_out,
+	      struct http_header_list *headers_in, const char *method)
 {
   http_file_t *hf = calloc(1, sizeof(http_file_t));
   htsbuf_queue_t q;
@@ -2047,6 +2165,12 @@ http_request(const char *url, const char **arguments,
     }
     goto retry;
 
+  case 304:
+    if(flags & HTTP_REQUEST_CONDITIONAL) {
+      http_destroy(hf);
+      return 1;
+    }
+    // FALLTHRU
   default:
     snprintf(errbuf, errlen, "HTTP error: %d", code);
     http_destroy(hf);
@@ -2145,3 +2269,313 @@ http_request(const char *url, const char **arguments,
   http_destroy(hf);
   return 0;
 }
+
+
+/**
+ * HTTP response cache
+ *
+ * Responses to GET requests made with HTTP_REQUEST_CACHE are stored in
+ * the blobcache together with their headers. As long as a response is
+ * fresh (according to Cache-Control or Expires) it's returned without
+ * asking the server. Stale responses that carry a validator (ETag or
+ * Last-Modified) are kept for another HTTP_CACHE_STALE_KEEP seconds
+ * and revalidated with a conditional GET.
+ *
+ * Blob layout: "<fresh until>\n", the response headers as "key:value\n"
+ * lines, an empty line and then the body.
+ *
+ * Counters are exported in global.httpcache
+ */
+#define HTTP_CACHE_STASH      "httpcache"
+#define HTTP_CACHE_STALE_KEEP (86400 * 7)
+
+typedef struct http_cache_entry {
+  time_t hce_expire;
+  struct http_header_list hce_headers;
+  char *hce_body;
+  size_t hce_size;
+} http_cache_entry_t;
+
+
+/**
+ *
+ */
+static void
+http_cache_stat(const char *what)
+{
+  prop_add_int(prop_create(prop_create(prop_get_global(), "httpcache"),
+			   what), 1);
+}
+
+
+/**
+ * Headers that only make sense for the connection they arrived on
+ */
+static int
+http_cache_skip_header(const char *key)
+{
+  return !strcasecmp(key, "connection") ||
+    !strcasecmp(key, "keep-alive") ||
+    !strcasecmp(key, "transfer-encoding") ||
+    !strcasecmp(key, "content-length") ||
+    !strcasecmp(key, "set-cookie");
+}
+
+
+/**
+ *
+ */
+static char *
+http_cache_key(const char *url, const char **arguments)
+{
+  htsbuf_queue_t q;
+  char prefix = '?';
+  char *r;
+
+  htsbuf_queue_init(&q, 0);
+  htsbuf_append(&q, url, strlen(url));
+
+  if(arguments != NULL) {
+    while(arguments[0] != NULL) {
+      htsbuf_append(&q, &prefix, 1);
+      htsbuf_append_and_escape_url(&q, arguments[0]);
+      htsbuf_append(&q, "=", 1);
+      htsbuf_append_and_escape_url(&q, arguments[1]);
+      arguments += 2;
+      prefix = '&';
+    }
+  }
+
+  r = malloc(q.hq_size + 1);
+  r[q.hq_size] = 0;
+  htsbuf_read(&q, r, q.hq_size);
+  return r;
+}
+
+
+/**
+ *
+ */
+static int
+http_cache_load(const char *key, http_cache_entry_t *hce)
+{
+  char *blob, *s, *e, *c;
+  http_header_t *hh, *last = NULL;
+  size_t size;
+
+  if((blob = blobcache_get(key, HTTP_CACHE_STASH, &size, 1)) == NULL)
+    return -1;
+
+  LIST_INIT(&hce->hce_headers);
+  hce->hce_expire = strtol(blob, &s, 10);
+
+  if(*s++ != '\n')
+    goto bad;
+
+  while((e = strchr(s, '\n')) != NULL) {
+    *e = 0;
+
+    if(*s == 0) {
+      // End of headers, move body to start of blob (including pad)
+      s = e + 1;
+      hce->hce_size = size - (s - blob);
+      memmove(blob, s, hce->hce_size + 1);
+      hce->hce_body = blob;
+      return 0;
+    }
+
+    if((c = strchr(s, ':')) == NULL)
+      break;
+    *c = 0;
+
+    // Keep the order of the headers
+    hh = malloc(sizeof(http_header_t));
+    hh->hh_key   = strdup(s);
+    hh->hh_value = strdup(c + 1);
+    if(last == NULL)
+      LIST_INSERT_HEAD(&hce->hce_headers, hh, hh_link);
+    else
+      LIST_INSERT_AFTER(last, hh, hh_link);
+    last = hh;
+    s = e + 1;
+  }
+
+ bad:
+  http_headers_free(&hce->hce_headers);
+  free(blob);
+  return -1;
+}
+
+
+/**
+ *
+ */
+static void
+http_cache_store(const char *key, struct http_header_list *headers,
+		 const char *body, size_t size)
+{
+  int maxage = http_response_max_age(headers, 0);
+  int validator;
+  htsbuf_queue_t q;
+  http_header_t *hh;
+  char *blob;
+  size_t len;
+
+  if(maxage == -1)
+    return;
+
+  validator = http_header_get(headers, "etag") != NULL ||
+    http_header_get(headers, "last-modified") != NULL;
+
+  if(maxage == 0 && !validator)
+    return;
+
+  htsbuf_queue_init(&q, 0);
+  htsbuf_qprintf(&q, "%ld\n", (long)(time(NULL) + maxage));
+
+  LIST_FOREACH(hh, headers, hh_link)
+    if(!http_cache_skip_header(hh->hh_key))
+      htsbuf_qprintf(&q, "%s:%s\n", hh->hh_key, hh->hh_value);
+
+  htsbuf_append(&q, "\n", 1);
+  htsbuf_append(&q, body, size);
+
+  len = q.hq_size;
+  blob = malloc(len);
+  htsbuf_read(&q, blob, len);
+  blobcache_put(key, HTTP_CACHE_STASH, blob, len,
+		maxage + (validator ? HTTP_CACHE_STALE_KEEP : 0));
+  free(blob);
+  http_cache_stat("stored");
+}
+
+
+/**
+ * Update the cached headers with what came in a 304 reply
+ */
+static void
+http_cache_merge_headers(struct http_header_list *dst,
+			 struct http_header_list *src)
+{
+  http_header_t *hh, *d;
+
+  LIST_FOREACH(hh, src, hh_link) {
+    if(http_cache_skip_header(hh->hh_key))
+      continue;
+
+    LIST_FOREACH(d, dst, hh_link)
+      if(!strcasecmp(d->hh_key, hh->hh_key))
+	break;
+
+    if(d != NULL)
+      mystrset(&d->hh_value, hh->hh_value);
+    else
+      http_header_add(dst, hh->hh_key, hh->hh_value);
+  }
+}
+
+
+/**
+ *
+ */
+static void
+http_cache_deliver(http_cache_entry_t *hce, char **result,
+		   size_t *result_sizep, struct http_header_list *headers_out)
+{
+  *result = hce->hce_body;
+  *result_sizep = hce->hce_size;
+
+  if(headers_out != NULL) {
+    LIST_MOVE(headers_out, &hce->hce_headers, hh_link);
+    LIST_INIT(&hce->hce_headers);
+  } else {
+    http_headers_free(&hce->hce_headers);
+  }
+}
+
+
+/**
+ *
+ */
+int
+http_request(const char *url, const char **arguments, 
+	     char **result, size_t *result_sizep,
+	     char *errbuf, size_t errlen,
+	     htsbuf_queue_t *postdata, const char *postcontenttype,
+	     int flags, struct http_header_list *headers_out,
+	     struct http_header_list *headers_in, const char *method)
+{
+  http_cache_entry_t hce;
+  struct http_header_list headers, cond;
+  http_header_t *hh;
+  const char *v;
+  char *key;
+  int r, cached;
+
+  if(!(flags & HTTP_REQUEST_CACHE) || postdata != NULL || result == NULL ||
+     (method != NULL && strcmp(method, "GET")))
+    return http_request0(url, arguments, result, result_sizep, errbuf, errlen,
+			 postdata, postcontenttype, flags, headers_out,
+			 headers_in, method);
+
+  if(headers_out != NULL)
+    LIST_INIT(headers_out);
+
+  key = http_cache_key(url, arguments);
+  cached = !http_cache_load(key, &hce);
+
+  if(cached && hce.hce_expire > time(NULL)) {
+    http_cache_deliver(&hce, result, result_sizep, headers_out);
+    http_cache_stat("hits");
+    free(key);
+    return 0;
+  }
+
+  LIST_INIT(&cond);
+  if(headers_in != NULL)
+    LIST_FOREACH(hh, headers_in, hh_link)
+      http_header_add(&cond, hh->hh_key, hh->hh_value);
+
+  if(cached) {
+    if((v = http_header_get(&hce.hce_headers, "etag")) != NULL)
+      http_header_add(&cond, "If-None-Match", v);
+    if((v = http_header_get(&hce.hce_headers, "last-modified")) != NULL)
+      http_header_add(&cond, "If-Modified-Since", v);
+    flags |= HTTP_REQUEST_CONDITIONAL;
+  }
+
+  LIST_INIT(&headers);
+  r = http_request0(url, arguments, result, result_sizep, errbuf, errlen,
+		    NULL, NULL, flags, &headers, &cond, method);
+  http_headers_free(&cond);
+
+  if(r == 1) {
+    // Not modified
+    http_cache_merge_headers(&hce.hce_headers, &headers);
+    http_cache_store(key, &hce.hce_headers, hce.hce_body, hce.hce_size);
+    http_cache_deliver(&hce, result, result_sizep, headers_out);
+    http_cache_stat("revalidated");
+    r = 0;
+
+  } else {
+
+    if(r == 0) {
+      http_cache_store(key, &headers, *result, *result_sizep);
+      http_cache_stat("misses");
+
+      if(headers_out != NULL) {
+	LIST_MOVE(headers_out, &headers, hh_link);
+	LIST_INIT(&headers);
+      }
+    }
+
+    if(cached) {
+      http_headers_free(&hce.hce_headers);
+      free(hce.hce_body);
+    }
+  }
+
+  http_headers_free(&headers);
+  free(key);
+  return r;
+}
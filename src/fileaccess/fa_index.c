@@ -0,0 +1,1202 @@
+/*
+ *  Inverted index over local media files
+ *  Copyright (C) 2011 Andreas Öman
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+
+#include "showtime.h"
+#include "fileaccess.h"
+#include "fa_probe.h"
+#include "fa_index.h"
+#include "service.h"
+#include "misc/string.h"
+#include "htsmsg/htsmsg.h"
+#include "htsmsg/htsmsg_binary.h"
+
+/**
+ * Each document (a media file) is split into tokens per field. A token
+ * is a casefolded run of letters and digits. Every token keeps a list
+ * of postings, (docid << 2 | field), which is sorted by docid since
+ * documents are only appended. Removed documents are just flagged dead
+ * and the whole thing is compacted once enough of them has piled up.
+ *
+ * On disk we only keep the documents, tokens are rebuilt on load.
+ */
+
+#define FAI_FIELD_TITLE    0
+#define FAI_FIELD_ARTIST   1
+#define FAI_FIELD_ALBUM    2
+#define FAI_FIELD_FILENAME 3
+
+#define FAI_TOKEN_MAX      64
+#define FAI_MAX_TERMS      16
+#define FAI_HASH_SIZE      4099
+
+#define FAI_FILE_VERSION   1
+
+#define FAI_SAVE_INTERVAL  60
+#define FAI_CRAWL_INTERVAL (12 * 3600)
+
+static const int fai_field_weight[4] = {
+  [FAI_FIELD_TITLE]    = 8,
+  [FAI_FIELD_ARTIST]   = 6,
+  [FAI_FIELD_ALBUM]    = 4,
+  [FAI_FIELD_FILENAME] = 2,
+};
+
+LIST_HEAD(fai_doc_list, fai_doc);
+LIST_HEAD(fai_token_list, fai_token);
+LIST_HEAD(fai_dir_list, fai_dir);
+
+/**
+ * A directory that has documents somewhere below it. Lets us find
+ * everything under a removed directory without scanning all documents.
+ * Refcounted by the docs and subdirectories directly in it.
+ */
+typedef struct fai_dir {
+  LIST_ENTRY(fai_dir) fdr_hash_link;
+  LIST_ENTRY(fai_dir) fdr_parent_link;
+  struct fai_dir *fdr_parent;
+  struct fai_dir_list fdr_childs;
+  struct fai_doc_list fdr_docs;
+  char *fdr_url;
+  int fdr_refcount;
+} fai_dir_t;
+
+/**
+ *
+ */
+typedef struct fai_doc {
+  LIST_ENTRY(fai_doc) fid_hash_link;
+  LIST_ENTRY(fai_doc) fid_dir_link;
+  fai_dir_t *fid_dir;
+  char *fid_url;
+  char *fid_title;
+  char *fid_artist;
+  char *fid_album;
+  int fid_type;
+  int fid_dead;
+  int fid_generation;
+  time_t fid_mtime;
+} fai_doc_t;
+
+/**
+ *
+ */
+typedef struct fai_token {
+  LIST_ENTRY(fai_token) fit_hash_link;
+  char *fit_str;
+  int fit_len;
+  uint32_t *fit_postings;
+  int fit_num;
+  int fit_capacity;
+} fai_token_t;
+
+
+static hts_mutex_t fai_mutex;
+
+static fai_doc_t **fai_docs;
+static int fai_ndocs;
+static int fai_docs_capacity;
+static int fai_ndead;
+static struct fai_doc_list fai_doc_hash[FAI_HASH_SIZE];
+static struct fai_dir_list fai_dir_hash[FAI_HASH_SIZE];
+
+static fai_token_t **fai_tokens;
+static int fai_ntokens;
+static int fai_tokens_capacity;
+static int fai_tokens_sorted;
+static struct fai_token_list fai_token_hash[FAI_HASH_SIZE];
+
+static int fai_generation;
+static int fai_dirty;
+static int fai_loaded;
+
+
+/**
+ * Only these are ever presented as search results
+ */
+static int
+fai_searchable(int type)
+{
+  return type == CONTENT_AUDIO || type == CONTENT_VIDEO || type == CONTENT_DVD;
+}
+
+
+/**
+ *
+ */
+static int
+fai_streq(const char *a, const char *b)
+{
+  if(a == NULL || b == NULL)
+    return a == b;
+  return !strcmp(a, b);
+}
+
+
+/**
+ * Split string into casefolded tokens. ASCII characters that are not
+ * letters or digits act as separators, everything else is kept
+ */
+static void
+fai_tokenize(const char *s, void (*cb)(void *opaque, const char *str, int len),
+	     void *opaque)
+{
+  char buf[FAI_TOKEN_MAX + 8];
+  int c, len = 0;
+
+  while(1) {
+    c = utf8_get(&s);
+
+    if(c == 0 || (c < 128 && !isalnum(c))) {
+      if(len > 0) {
+	buf[len] = 0;
+	cb(opaque, buf, len);
+	len = 0;
+      }
+      if(c == 0)
+	break;
+      continue;
+    }
+
+    if(len < FAI_TOKEN_MAX)
+      len += utf8_put(buf + len, unicode_casefold(c));
+  }
+}
+
+
+/**
+ * Filename without path and extension
+ */
+static void
+fai_filename(const char *url, char *buf, size_t size)
+{
+  const char *s = strrchr(url, '/');
+  char *e;
+
+  snprintf(buf, size, "%s", s ? s + 1 : url);
+  if((e = strrchr(buf, '.')) != NULL && e != buf)
+    *e = 0;
+}
+
+
+/**
+ *
+ */
+static fai_token_t *
+fai_token_get(const char *str, int len)
+{
+  unsigned int hash = mystrhash(str) % FAI_HASH_SIZE;
+  fai_token_t *fit;
+
+  LIST_FOREACH(fit, &fai_token_hash[hash], fit_hash_link)
+    if(!strcmp(fit->fit_str, str))
+      return fit;
+
+  fit = calloc(1, sizeof(fai_token_t));
+  fit->fit_str = strdup(str);
+  fit->fit_len = len;
+  LIST_INSERT_HEAD(&fai_token_hash[hash], fit, fit_hash_link);
+
+  if(fai_ntokens == fai_tokens_capacity) {
+    fai_tokens_capacity = fai_tokens_capacity * 2 ?: 1024;
+    fai_tokens = realloc(fai_tokens,
+			 fai_tokens_capacity * sizeof(fai_token_t *));
+  }
+  fai_tokens[fai_ntokens++] = fit;
+  fai_tokens_sorted = 0;
+  return fit;
+}
+
+
+/**
+ *
+ */
+static void
+fai_add_posting(void *opaque, const char *str, int len)
+{
+  uint32_t v = *(uint32_t *)opaque;
+  fai_token_t *fit = fai_token_get(str, len);
+
+  if(fit->fit_num > 0 && fit->fit_postings[fit->fit_num - 1] == v)
+    return;
+
+  if(fit->fit_num == fit->fit_capacity) {
+    fit->fit_capacity = fit->fit_capacity * 2 ?: 4;
+    fit->fit_postings = realloc(fit->fit_postings,
+				fit->fit_capacity * sizeof(uint32_t));
+  }
+  fit->fit_postings[fit->fit_num++] = v;
+}
+
+
+/**
+ *
+ */
+static void
+fai_index_field(int docid, int field, const char *str)
+{
+  uint32_t v = docid << 2 | field;
+
+  if(str != NULL)
+    fai_tokenize(str, fai_add_posting, &v);
+}
+
+
+/**
+ *
+ */
+static void
+fai_doc_index(int docid)
+{
+  fai_doc_t *fid = fai_docs[docid];
+  char buf[256];
+
+  if(!fai_searchable(fid->fid_type))
+    return;
+
+  fai_filename(fid->fid_url, buf, sizeof(buf));
+
+  fai_index_field(docid, FAI_FIELD_TITLE,    fid->fid_title);
+  fai_index_field(docid, FAI_FIELD_ARTIST,   fid->fid_artist);
+  fai_index_field(docid, FAI_FIELD_ALBUM,    fid->fid_album);
+  fai_index_field(docid, FAI_FIELD_FILENAME, buf);
+}
+
+
+/**
+ *
+ */
+static fai_doc_t *
+fai_doc_find(const char *url)
+{
+  unsigned int hash = mystrhash(url) % FAI_HASH_SIZE;
+  fai_doc_t *fid;
+
+  LIST_FOREACH(fid, &fai_doc_hash[hash], fid_hash_link)
+    if(!strcmp(fid->fid_url, url))
+      return fid;
+  return NULL;
+}
+
+
+/**
+ * Only local files are indexed, the crawler can't sweep anything else
+ */
+static int
+fai_local(const char *url)
+{
+  return !strncmp(url, "file://", strlen("file://"));
+}
+
+
+/**
+ *
+ */
+static fai_dir_t *
+fai_dir_find(const char *url)
+{
+  unsigned int hash = mystrhash(url) % FAI_HASH_SIZE;
+  fai_dir_t *fdr;
+
+  LIST_FOREACH(fdr, &fai_dir_hash[hash], fdr_hash_link)
+    if(!strcmp(fdr->fdr_url, url))
+      return fdr;
+  return NULL;
+}
+
+
+/**
+ * Return (a reference to) the directory holding url
+ *
+ * "file:///a/b" lives in "file:///a" which lives in "file:///"
+ */
+static fai_dir_t *
+fai_dir_get(const char *url)
+{
+  const char *s = strrchr(url, '/');
+  fai_dir_t *fdr;
+  size_t len;
+  char *dir;
+
+  if(s == NULL || s == url)
+    return NULL;
+
+  len = s - url;
+  if(s[-1] == '/')
+    len++; // Root, keep the slash
+
+  if(len == strlen(url))
+    return NULL;
+
+  dir = alloca(len + 1);
+  memcpy(dir, url, len);
+  dir[len] = 0;
+
+  if((fdr = fai_dir_find(dir)) != NULL) {
+    fdr->fdr_refcount++;
+    return fdr;
+  }
+
+  fdr = calloc(1, sizeof(fai_dir_t));
+  fdr->fdr_url = strdup(dir);
+  fdr->fdr_refcount = 1;
+
+  LIST_INSERT_HEAD(&fai_dir_hash[mystrhash(dir) % FAI_HASH_SIZE],
+		   fdr, fdr_hash_link);
+
+  if((fdr->fdr_parent = fai_dir_get(fdr->fdr_url)) != NULL)
+    LIST_INSERT_HEAD(&fdr->fdr_parent->fdr_childs, fdr, fdr_parent_link);
+  return fdr;
+}
+
+
+/**
+ *
+ */
+static void
+fai_dir_release(fai_dir_t *fdr)
+{
+  fai_dir_t *parent;
+
+  while(fdr != NULL && --fdr->fdr_refcount == 0) {
+    parent = fdr->fdr_parent;
+    LIST_REMOVE(fdr, fdr_hash_link);
+    if(parent != NULL)
+      LIST_REMOVE(fdr, fdr_parent_link);
+    free(fdr->fdr_url);
+    free(fdr);
+    fdr = parent;
+  }
+}
+
+
+/**
+ *
+ */
+static void
+fai_doc_create(const char *url, int type, time_t mtime,
+	       const char *title, const char *artist, const char *album)
+{
+  fai_doc_t *fid = calloc(1, sizeof(fai_doc_t));
+
+  fid->fid_url    = strdup(url);
+  fid->fid_title  = title  ? strdup(title)  : NULL;
+  fid->fid_artist = artist ? strdup(artist) : NULL;
+  fid->fid_album  = album  ? strdup(album)  : NULL;
+  fid->fid_type   = type;
+  fid->fid_mtime  = mtime;
+  fid->fid_generation = fai_generation;
+
+  LIST_INSERT_HEAD(&fai_doc_hash[mystrhash(url) % FAI_HASH_SIZE],
+		   fid, fid_hash_link);
+
+  if((fid->fid_dir = fai_dir_get(url)) != NULL)
+    LIST_INSERT_HEAD(&fid->fid_dir->fdr_docs, fid, fid_dir_link);
+
+  if(fai_ndocs == fai_docs_capacity) {
+    fai_docs_capacity = fai_docs_capacity * 2 ?: 1024;
+    fai_docs = realloc(fai_docs, fai_docs_capacity * sizeof(fai_doc_t *));
+  }
+  fai_docs[fai_ndocs] = fid;
+  fai_doc_index(fai_ndocs);
+  fai_ndocs++;
+}
+
+
+/**
+ * Postings stay around until next compaction, so keep the doc struct
+ */
+static void
+fai_doc_kill(fai_doc_t *fid)
+{
+  LIST_REMOVE(fid, fid_hash_link);
+  if(fid->fid_dir != NULL) {
+    LIST_REMOVE(fid, fid_dir_link);
+    fai_dir_release(fid->fid_dir);
+    fid->fid_dir = NULL;
+  }
+  free(fid->fid_url);
+  free(fid->fid_title);
+  free(fid->fid_artist);
+  free(fid->fid_album);
+  fid->fid_url = fid->fid_title = fid->fid_artist = fid->fid_album = NULL;
+  fid->fid_dead = 1;
+  fai_ndead++;
+  fai_dirty = 1;
+}
+
+
+/**
+ * Kill everything in and below a directory
+ */
+static void
+fai_dir_purge(fai_dir_t *fdr)
+{
+  fai_doc_t *fid;
+
+  fdr->fdr_refcount++;
+
+  while(LIST_FIRST(&fdr->fdr_childs) != NULL)
+    fai_dir_purge(LIST_FIRST(&fdr->fdr_childs));
+
+  while((fid = LIST_FIRST(&fdr->fdr_docs)) != NULL)
+    fai_doc_kill(fid);
+
+  fai_dir_release(fdr);
+}
+
+
+/**
+ * Drop dead documents and rebuild all tokens
+ */
+static void
+fai_compact(void)
+{
+  fai_token_t *fit;
+  int i, n = 0;
+
+  if(fai_ndead < 1024 || fai_ndead < fai_ndocs / 2)
+    return;
+
+  for(i = 0; i < fai_ntokens; i++) {
+    fit = fai_tokens[i];
+    free(fit->fit_str);
+    free(fit->fit_postings);
+    free(fit);
+  }
+  fai_ntokens = 0;
+  for(i = 0; i < FAI_HASH_SIZE; i++)
+    LIST_INIT(&fai_token_hash[i]);
+
+  for(i = 0; i < fai_ndocs; i++) {
+    if(fai_docs[i]->fid_dead)
+      free(fai_docs[i]);
+    else
+      fai_docs[n++] = fai_docs[i];
+  }
+  fai_ndocs = n;
+  fai_ndead = 0;
+
+  for(i = 0; i < fai_ndocs; i++)
+    fai_doc_index(i);
+}
+
+
+/**
+ * Called by the prober for everything it sees
+ */
+void
+fa_index_update(const char *url, int type, time_t mtime,
+		const char *title, const char *artist, const char *album)
+{
+  fai_doc_t *fid;
+
+  if(!fai_local(url))
+    return;
+
+  hts_mutex_lock(&fai_mutex);
+
+  if((fid = fai_doc_find(url)) != NULL) {
+    if(fid->fid_type == type && fid->fid_mtime == mtime &&
+       fai_streq(fid->fid_title, title) &&
+       fai_streq(fid->fid_artist, artist) &&
+       fai_streq(fid->fid_album, album)) {
+      fid->fid_generation = fai_generation;
+      hts_mutex_unlock(&fai_mutex);
+      return;
+    }
+    fai_doc_kill(fid);
+  }
+
+  fai_doc_create(url, type, mtime, title, artist, album);
+  fai_dirty = 1;
+  fai_compact();
+  hts_mutex_unlock(&fai_mutex);
+}
+
+
+/**
+ * Remove url and, if it is a directory, everything below it
+ */
+void
+fa_index_remove(const char *url)
+{
+  fai_doc_t *fid;
+  fai_dir_t *fdr;
+
+  if(!fai_local(url))
+    return;
+
+  hts_mutex_lock(&fai_mutex);
+
+  if((fid = fai_doc_find(url)) != NULL)
+    fai_doc_kill(fid);
+
+  if((fdr = fai_dir_find(url)) != NULL)
+    fai_dir_purge(fdr);
+
+  fai_compact();
+  hts_mutex_unlock(&fai_mutex);
+}
+
+
+/**
+ *
+ */
+static int
+fai_token_cmp(const void *A, const void *B)
+{
+  const fai_token_t *a = *(const fai_token_t **)A;
+  const fai_token_t *b = *(const fai_token_t **)B;
+  return strcmp(a->fit_str, b->fit_str);
+}
+
+
+/**
+ * First token that is >= str
+ */
+static int
+fai_token_lower_bound(const char *str)
+{
+  int lo = 0, hi = fai_ntokens, mid;
+
+  while(lo < hi) {
+    mid = (lo + hi) / 2;
+    if(strcmp(fai_tokens[mid]->fit_str, str) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+
+/**
+ *
+ */
+typedef struct fai_query {
+  int fq_nterms;
+  int fq_len[FAI_MAX_TERMS];
+  char fq_term[FAI_MAX_TERMS][FAI_TOKEN_MAX + 8];
+} fai_query_t;
+
+
+/**
+ *
+ */
+static void
+fai_add_term(void *opaque, const char *str, int len)
+{
+  fai_query_t *fq = opaque;
+
+  if(fq->fq_nterms == FAI_MAX_TERMS)
+    return;
+  memcpy(fq->fq_term[fq->fq_nterms], str, len + 1);
+  fq->fq_len[fq->fq_nterms] = len;
+  fq->fq_nterms++;
+}
+
+
+/**
+ *
+ */
+typedef struct fai_candidate {
+  int fc_docid;
+  int fc_score;
+} fai_candidate_t;
+
+
+/**
+ *
+ */
+static int
+fai_candidate_cmp(const void *A, const void *B)
+{
+  const fai_candidate_t *a = A;
+  const fai_candidate_t *b = B;
+  const fai_doc_t *da, *db;
+
+  if(a->fc_score != b->fc_score)
+    return b->fc_score - a->fc_score;
+
+  da = fai_docs[a->fc_docid];
+  db = fai_docs[b->fc_docid];
+  return dictcmp(da->fid_title ?: da->fid_url, db->fid_title ?: db->fid_url);
+}
+
+
+/**
+ * Every query term must match (as a prefix) in some field. Scores are
+ * summed over all matching fields and exact token matches count twice
+ */
+int
+fa_index_search(const char *query, fa_index_hit_t **hitsp, int maxhits)
+{
+  fai_query_t fq;
+  fai_candidate_t *fc;
+  fa_index_hit_t *hits;
+  fai_token_t *fit;
+  fai_doc_t *fid;
+  uint8_t *matched;
+  int *score;
+  int i, j, t, n, docid, field;
+
+  *hitsp = NULL;
+
+  fq.fq_nterms = 0;
+  fai_tokenize(query, fai_add_term, &fq);
+
+  hts_mutex_lock(&fai_mutex);
+
+  if(!fai_loaded || fai_ndocs == fai_ndead) {
+    hts_mutex_unlock(&fai_mutex);
+    return -1;
+  }
+
+  if(fq.fq_nterms == 0) {
+    hts_mutex_unlock(&fai_mutex);
+    return 0;
+  }
+
+  if(!fai_tokens_sorted) {
+    qsort(fai_tokens, fai_ntokens, sizeof(fai_token_t *), fai_token_cmp);
+    fai_tokens_sorted = 1;
+  }
+
+  matched = calloc(fai_ndocs, sizeof(uint8_t));
+  score   = calloc(fai_ndocs, sizeof(int));
+
+  for(t = 0; t < fq.fq_nterms; t++) {
+    for(i = fai_token_lower_bound(fq.fq_term[t]); i < fai_ntokens; i++) {
+      fit = fai_tokens[i];
+      if(strncmp(fit->fit_str, fq.fq_term[t], fq.fq_len[t]))
+	break;
+
+      for(j = 0; j < fit->fit_num; j++) {
+	docid = fit->fit_postings[j] >> 2;
+	field = fit->fit_postings[j] & 3;
+
+	// Must have matched all previous terms
+	if(matched[docid] < t || fai_docs[docid]->fid_dead)
+	  continue;
+
+	matched[docid] = t + 1;
+	score[docid] += fai_field_weight[field] *
+	  (fit->fit_len == fq.fq_len[t] ? 2 : 1);
+      }
+    }
+  }
+
+  fc = malloc(fai_ndocs * sizeof(fai_candidate_t));
+  n = 0;
+  for(i = 0; i < fai_ndocs; i++) {
+    if(matched[i] == fq.fq_nterms) {
+      fc[n].fc_docid = i;
+      fc[n].fc_score = score[i];
+      n++;
+    }
+  }
+
+  free(matched);
+  free(score);
+
+  qsort(fc, n, sizeof(fai_candidate_t), fai_candidate_cmp);
+
+  if(n > maxhits)
+    n = maxhits;
+
+  hits = n > 0 ? malloc(n * sizeof(fa_index_hit_t)) : NULL;
+  for(i = 0; i < n; i++) {
+    fid = fai_docs[fc[i].fc_docid];
+    hits[i].fih_url    = strdup(fid->fid_url);
+    hits[i].fih_title  = fid->fid_title  ? strdup(fid->fid_title)  : NULL;
+    hits[i].fih_artist = fid->fid_artist ? strdup(fid->fid_artist) : NULL;
+    hits[i].fih_album  = fid->fid_album  ? strdup(fid->fid_album)  : NULL;
+    hits[i].fih_type   = fid->fid_type;
+    hits[i].fih_score  = fc[i].fc_score;
+  }
+
+  hts_mutex_unlock(&fai_mutex);
+
+  free(fc);
+  *hitsp = hits;
+  return n;
+}
+
+
+/**
+ *
+ */
+void
+fa_index_hits_free(fa_index_hit_t *hits, int num)
+{
+  int i;
+
+  for(i = 0; i < num; i++) {
+    free(hits[i].fih_url);
+    free(hits[i].fih_title);
+    free(hits[i].fih_artist);
+    free(hits[i].fih_album);
+  }
+  free(hits);
+}
+
+
+/**
+ *
+ */
+static void
+fai_path(char *path, size_t size)
+{
+  snprintf(path, size, "%s/searchindex", showtime_cache_path);
+}
+
+
+/**
+ * Must be called with fai_mutex locked
+ */
+static void
+fai_load(void)
+{
+  char path[PATH_MAX];
+  struct stat st;
+  htsmsg_t *m, *list, *d;
+  htsmsg_field_t *f;
+  const char *url;
+  int64_t mtime;
+  char *mem;
+  int fd, n;
+
+  fai_path(path, sizeof(path));
+
+  if((fd = open(path, O_RDONLY)) == -1)
+    return;
+
+  if(fstat(fd, &st)) {
+    close(fd);
+    return;
+  }
+
+  mem = malloc(st.st_size);
+  n = read(fd, mem, st.st_size);
+  close(fd);
+
+  if(n != st.st_size || n < 4) {
+    free(mem);
+    return;
+  }
+
+  // Skip length header written by htsmsg_binary_serialize()
+  if((m = htsmsg_binary_deserialize(mem + 4, n - 4, mem)) == NULL) {
+    TRACE(TRACE_ERROR, "FA", "Search index %s is corrupt", path);
+    return;
+  }
+
+  if(htsmsg_get_u32_or_default(m, "version", 0) == FAI_FILE_VERSION &&
+     (list = htsmsg_get_list(m, "docs")) != NULL) {
+
+    HTSMSG_FOREACH(f, list) {
+      if((d = htsmsg_get_map_by_field(f)) == NULL ||
+	 (url = htsmsg_get_str(d, "url")) == NULL)
+	continue;
+
+      // Might already have been probed while we were loading.
+      // Older versions also indexed remote files, drop those
+      if(!fai_local(url) || fai_doc_find(url) != NULL)
+	continue;
+
+      if(htsmsg_get_s64(d, "mtime", &mtime))
+	mtime = 0;
+
+      fai_doc_create(url, htsmsg_get_s32_or_default(d, "type", 0), mtime,
+		     htsmsg_get_str(d, "title"),
+		     htsmsg_get_str(d, "artist"),
+		     htsmsg_get_str(d, "album"));
+    }
+  }
+
+  htsmsg_destroy(m);
+
+  TRACE(TRACE_DEBUG, "FA", "Search index loaded, %d files, %d tokens",
+	fai_ndocs, fai_ntokens);
+}
+
+
+/**
+ *
+ */
+static void
+fai_save(void)
+{
+  char path[PATH_MAX];
+  char tmp[PATH_MAX];
+  htsmsg_t *m, *list, *d;
+  fai_doc_t *fid;
+  void *data;
+  size_t len;
+  int i, fd, ok;
+
+  hts_mutex_lock(&fai_mutex);
+  if(!fai_dirty) {
+    hts_mutex_unlock(&fai_mutex);
+    return;
+  }
+  fai_dirty = 0;
+
+  list = htsmsg_create_list();
+  for(i = 0; i < fai_ndocs; i++) {
+    fid = fai_docs[i];
+    if(fid->fid_dead)
+      continue;
+
+    d = htsmsg_create_map();
+    htsmsg_add_str(d, "url", fid->fid_url);
+    htsmsg_add_s32(d, "type", fid->fid_type);
+    htsmsg_add_s64(d, "mtime", fid->fid_mtime);
+    if(fid->fid_title != NULL)
+      htsmsg_add_str(d, "title", fid->fid_title);
+    if(fid->fid_artist != NULL)
+      htsmsg_add_str(d, "artist", fid->fid_artist);
+    if(fid->fid_album != NULL)
+      htsmsg_add_str(d, "album", fid->fid_album);
+    htsmsg_add_msg(list, NULL, d);
+  }
+  hts_mutex_unlock(&fai_mutex);
+
+  m = htsmsg_create_map();
+  htsmsg_add_u32(m, "version", FAI_FILE_VERSION);
+  htsmsg_add_msg(m, "docs", list);
+
+  ok = !htsmsg_binary_serialize(m, &data, &len, INT32_MAX);
+  htsmsg_destroy(m);
+  if(!ok)
+    return;
+
+  fai_path(path, sizeof(path));
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+  if((fd = open(tmp, O_CREAT | O_TRUNC | O_WRONLY, 0666)) == -1) {
+    TRACE(TRACE_ERROR, "FA", "Unable to create %s -- %s",
+	  tmp, strerror(errno));
+    free(data);
+    return;
+  }
+
+  ok = write(fd, data, len) == len;
+  close(fd);
+  free(data);
+
+  if(ok && rename(tmp, path) == 0)
+    return;
+
+  TRACE(TRACE_ERROR, "FA", "Unable to write %s -- %s", path, strerror(errno));
+  unlink(tmp);
+}
+
+
+/**
+ * Returns 1 if we already know about this revision of the file
+ */
+static int
+fai_touch(const char *url, time_t mtime)
+{
+  fai_doc_t *fid;
+  int r;
+
+  hts_mutex_lock(&fai_mutex);
+  fid = fai_doc_find(url);
+  r = fid != NULL && fid->fid_mtime == mtime;
+  if(r)
+    fid->fid_generation = fai_generation;
+  hts_mutex_unlock(&fai_mutex);
+  return r;
+}
+
+
+/**
+ * Remove everything below prefix that was not seen during last crawl
+ */
+static void
+fai_sweep(const char *prefix, int generation)
+{
+  size_t len = strlen(prefix);
+  int slash = len > 0 && prefix[len - 1] == '/';
+  fai_doc_t *fid;
+  int i;
+
+  hts_mutex_lock(&fai_mutex);
+
+  for(i = 0; i < fai_ndocs; i++) {
+    fid = fai_docs[i];
+    if(!fid->fid_dead && fid->fid_generation < generation &&
+       !strncmp(fid->fid_url, prefix, len) &&
+       (slash || fid->fid_url[len] == '/' || fid->fid_url[len] == 0))
+      fai_doc_kill(fid);
+  }
+
+  fai_compact();
+  hts_mutex_unlock(&fai_mutex);
+}
+
+
+/**
+ * Only probe files we don't know about or that has changed.
+ * The prober will feed the result back via fa_index_update()
+ */
+static void
+fai_crawl_entry(fa_dir_entry_t *fde)
+{
+  int type;
+
+  if(fa_dir_entry_stat(fde) || fai_touch(fde->fde_url, fde->fde_stat.fs_mtime))
+    return;
+
+  // No proproot, we don't want any props or artist/album art lookups
+  type = fa_probe(NULL, fde->fde_url, NULL, 0, NULL, 0, &fde->fde_stat);
+
+  // Remember files we can't make sense of so we don't probe them again
+  if(type == CONTENT_UNKNOWN)
+    fa_index_update(fde->fde_url, CONTENT_UNKNOWN, fde->fde_stat.fs_mtime,
+		    NULL, NULL, NULL);
+}
+
+
+/**
+ * Directories are crawled one at a time from an explicit stack.
+ * Symlinks are followed (fs_scandir() uses stat()) so we remember
+ * each directory we have been in to not loop forever, and cap the
+ * depth for good measure.
+ */
+#define FAI_CRAWL_MAX_DEPTH 32
+#define FAI_VISITED_HASH    257
+
+LIST_HEAD(fai_visited_list, fai_visited);
+
+typedef struct fai_visited {
+  LIST_ENTRY(fai_visited) fv_link;
+  dev_t fv_dev;
+  ino_t fv_ino;
+} fai_visited_t;
+
+typedef struct fai_pending {
+  char *fp_url;
+  int fp_level;
+} fai_pending_t;
+
+typedef struct fai_crawler {
+  fai_pending_t *fc_stack;
+  int fc_depth;
+  int fc_size;
+  struct fai_visited_list fc_visited[FAI_VISITED_HASH];
+} fai_crawler_t;
+
+
+/**
+ * Returns 1 if we've already been in this directory
+ */
+static int
+fai_visited(fai_crawler_t *fc, const char *url)
+{
+  struct stat st;
+  fai_visited_t *fv;
+  unsigned int hash;
+
+  if(stat(url + strlen("file://"), &st))
+    return 0; // Let fa_scandir() fail on it
+
+  hash = (unsigned int)(st.st_ino ^ st.st_dev) % FAI_VISITED_HASH;
+
+  LIST_FOREACH(fv, &fc->fc_visited[hash], fv_link)
+    if(fv->fv_dev == st.st_dev && fv->fv_ino == st.st_ino)
+      return 1;
+
+  fv = malloc(sizeof(fai_visited_t));
+  fv->fv_dev = st.st_dev;
+  fv->fv_ino = st.st_ino;
+  LIST_INSERT_HEAD(&fc->fc_visited[hash], fv, fv_link);
+  return 0;
+}
+
+
+/**
+ *
+ */
+static void
+fai_crawler_reset(fai_crawler_t *fc)
+{
+  fai_visited_t *fv;
+  int i;
+
+  while(fc->fc_depth > 0)
+    free(fc->fc_stack[--fc->fc_depth].fp_url);
+
+  for(i = 0; i < FAI_VISITED_HASH; i++) {
+    while((fv = LIST_FIRST(&fc->fc_visited[i])) != NULL) {
+      LIST_REMOVE(fv, fv_link);
+      free(fv);
+    }
+  }
+}
+
+
+/**
+ * Scan a single directory. Subdirectories are pushed on the stack
+ * instead of being descended into so we never hold more than one
+ * directory listing in memory.
+ *
+ * Returns -1 if the directory could not be read
+ */
+static int
+fai_crawl_dir(fai_crawler_t *fc, const char *url, int level)
+{
+  fa_dir_t *fd;
+  fa_dir_entry_t *fde;
+  fai_pending_t *fp;
+
+  if(fai_visited(fc, url))
+    return 0;
+
+  if((fd = fa_scandir(url, NULL, 0)) == NULL)
+    return -1;
+
+  TAILQ_FOREACH(fde, &fd->fd_entries, fde_link) {
+    if(fde->fde_filename[0] == '.')
+      continue;
+
+    if(fde->fde_type != CONTENT_DIR) {
+      fai_crawl_entry(fde);
+      continue;
+    }
+
+    fa_probe_dir(NULL, fde->fde_url);
+
+    if(level + 1 >= FAI_CRAWL_MAX_DEPTH)
+      continue;
+
+    if(fc->fc_depth == fc->fc_size) {
+      fc->fc_size = fc->fc_size * 2 ?: 64;
+      fc->fc_stack = realloc(fc->fc_stack,
+			     fc->fc_size * sizeof(fai_pending_t));
+    }
+    fp = &fc->fc_stack[fc->fc_depth++];
+    fp->fp_url = strdup(fde->fde_url);
+    fp->fp_level = level + 1;
+  }
+  fa_dir_free(fd);
+  return 0;
+}
+
+
+/**
+ * Walk all local file services
+ */
+static void
+fai_crawl(void)
+{
+  char **roots = NULL;
+  fai_crawler_t fc = {0};
+  fai_pending_t fp;
+  service_t *s;
+  int i, generation, failed;
+
+  hts_mutex_lock(&service_mutex);
+  LIST_FOREACH(s, &services, s_link)
+    if(s->s_url != NULL && !strncmp(s->s_url, "file://", strlen("file://")))
+      strvec_addp(&roots, s->s_url);
+  hts_mutex_unlock(&service_mutex);
+
+  if(roots == NULL)
+    return;
+
+  for(i = 0; roots[i] != NULL; i++) {
+
+    hts_mutex_lock(&fai_mutex);
+    generation = ++fai_generation;
+    hts_mutex_unlock(&fai_mutex);
+
+    // If the root is gone (unmounted, etc) we keep what we have
+    if(fai_crawl_dir(&fc, roots[i], 0)) {
+      fai_crawler_reset(&fc);
+      continue;
+    }
+
+    failed = 0;
+    while(fc.fc_depth > 0) {
+      fp = fc.fc_stack[--fc.fc_depth];
+      failed |= fai_crawl_dir(&fc, fp.fp_url, fp.fp_level);
+      free(fp.fp_url);
+    }
+    fai_crawler_reset(&fc);
+
+    // Don't throw away a subtree just because we could not read it
+    if(!failed)
+      fai_sweep(roots[i], generation);
+  }
+  free(fc.fc_stack);
+  strvec_free(roots);
+}
+
+
+/**
+ *
+ */
+static void *
+fai_thread(void *aux)
+{
+  time_t last_crawl = 0;
+
+  hts_mutex_lock(&fai_mutex);
+  if(showtime_cache_path != NULL)
+    fai_load();
+  fai_loaded = 1;
+  hts_mutex_unlock(&fai_mutex);
+
+  while(1) {
+    sleep(FAI_SAVE_INTERVAL);
+
+    if(time(NULL) - last_crawl >= FAI_CRAWL_INTERVAL) {
+      fai_crawl();
+      last_crawl = time(NULL);
+    }
+
+    if(showtime_cache_path != NULL)
+      fai_save();
+  }
+  return NULL;
+}
+
+
+/**
+ *
+ */
+void
+fa_index_init(void)
+{
+  hts_mutex_init(&fai_mutex);
+  hts_thread_create_detached("fa index", fai_thread, NULL, THREAD_PRIO_LOW);
+}
@@ -0,0 +1,51 @@
+/*
+ *  Inverted index over local media files
+ *  Copyright (C) 2011 Andreas Öman
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FA_INDEX_H
+#define FA_INDEX_H
+
+#include <time.h>
+
+/**
+ * A search result, all strings are owned by the hit
+ */
+typedef struct fa_index_hit {
+  char *fih_url;
+  char *fih_title;
+  char *fih_artist;
+  char *fih_album;
+  int fih_type;
+  int fih_score;
+} fa_index_hit_t;
+
+void fa_index_init(void);
+
+void fa_index_update(const char *url, int type, time_t mtime,
+		     const char *title, const char *artist, const char *album);
+
+void fa_index_remove(const char *url);
+
+/**
+ * Returns number of hits (sorted by rank) or -1 if the index is not
+ * populated yet
+ */
+int fa_index_search(const char *query, fa_index_hit_t **hitsp, int maxhits);
+
+void fa_index_hits_free(fa_index_hit_t *hits, int num);
+
+#endif /* FA_INDEX_H */
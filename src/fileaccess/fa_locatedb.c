@@ -1,5 +1,5 @@
 /*
- *  Backend using file I/O - Search using locate(1)
+ *  Backend using file I/O - Search using local index or locate(1)
  *  Copyright (C) 2010 Magnus Edenhill
  *
  *  This program is free software: you can redistribute it and/or modify
@@ -33,11 +33,14 @@
 #include "fileaccess.h"
 #include "fa_probe.h"
 #include "fa_search.h"
+#include "fa_index.h"
 #include "service.h"
 #include "settings.h"
 
 /* FIXME: utf-8 support? */
 
+#define FA_INDEX_MAX_HITS 500
+
 static int locatedb_enabled;
 
 typedef struct fa_search_s {
@@ -47,12 +50,15 @@ typedef struct fa_search_s {
   FILE                 *fas_fp;
   prop_courier_t       *fas_pc;
   int                   fas_run;
+  struct search_query  *fas_sq;
 } fa_search_t;
 
 
 static void
 fa_search_destroy (fa_search_t *fas)
 {
+  backend_search_done(fas->fas_sq);
+
   free(fas->fas_query);
 
   if (fas->fas_pc)
@@ -201,6 +207,7 @@ fa_locate_searcher (fa_search_t *fas)
 
   prop_t *entries[2] = {NULL, NULL};
   prop_t *nodes[2] = {NULL, NULL};
+  search_batch_t *sb[2] = {NULL, NULL};
   int t, i;
 
   if (fa_create_paths_regex(&preg) == -1)
@@ -293,13 +300,13 @@ fa_locate_searcher (fa_search_t *fas)
     }
 
 
-    if(nodes[t] == NULL)
+    if(nodes[t] == NULL) {
       if(search_class_create(fas->fas_nodes, &nodes[t], &entries[t],
 			     t ? "Local video files" : "Local audio files",
 			     FA_LOCALFILES_ICON))
 	break;
-
-    prop_add_int(entries[t], 1);
+      sb[t] = search_batch_create(nodes[t], entries[t]);
+    }
 
     if ((type = content2type(ctype)) == NULL)
       continue; /* Unlikely.. */
@@ -313,13 +320,12 @@ fa_locate_searcher (fa_search_t *fas)
     prop_set_string(prop_create(p, "url"), url);
     prop_set_string(prop_create(p, "type"), type);
 
-    if(prop_set_parent(p, nodes[t])) {
-      prop_destroy(p);
-      break;
-    }
+    search_batch_add(sb[t], p);
   }
   
   for(i = 0; i < 2; i++) {
+    if(sb[i])
+      search_batch_destroy(sb[i]);
     if(nodes[i])
       prop_ref_dec(nodes[i]);
     if(entries[i])
@@ -333,11 +339,91 @@ fa_locate_searcher (fa_search_t *fas)
 }
 
 
+/**
+ * Feed ranked results from the local index in batches
+ */
+static void
+fa_index_searcher(fa_search_t *fas, const fa_index_hit_t *hits, int num)
+{
+  prop_t *entries[2] = {NULL, NULL};
+  prop_t *nodes[2] = {NULL, NULL};
+  search_batch_t *sb[2] = {NULL, NULL};
+  const fa_index_hit_t *h;
+  const char *title;
+  prop_t *p, *metadata;
+  int i, t;
+
+  for(i = 0; i < num && fas->fas_run; i++) {
+    h = &hits[i];
+    t = h->fih_type == CONTENT_AUDIO ? 0 : 1;
+
+    if(nodes[t] == NULL) {
+      if(search_class_create(fas->fas_nodes, &nodes[t], &entries[t],
+			     t ? "Local video files" : "Local audio files",
+			     FA_LOCALFILES_ICON))
+	break;
+      sb[t] = search_batch_create(nodes[t], entries[t]);
+    }
+
+    if((title = h->fih_title) == NULL)
+      title = (title = strrchr(h->fih_url, '/')) ? title + 1 : h->fih_url;
+
+    p = prop_create_root(NULL);
+    prop_set_string(prop_create(p, "url"), h->fih_url);
+    prop_set_string(prop_create(p, "type"), content2type(h->fih_type));
+
+    metadata = prop_create(p, "metadata");
+    prop_set_string(prop_create(metadata, "title"), title);
+    if(h->fih_artist != NULL)
+      prop_set_string(prop_create(metadata, "artist"), h->fih_artist);
+    if(h->fih_album != NULL)
+      prop_set_string(prop_create(metadata, "album"), h->fih_album);
+
+    search_batch_add(sb[t], p);
+    prop_courier_poll(fas->fas_pc);
+  }
+
+  for(t = 0; t < 2; t++) {
+    if(sb[t])
+      search_batch_destroy(sb[t]);
+    if(nodes[t])
+      prop_ref_dec(nodes[t]);
+    if(entries[t])
+      prop_ref_dec(entries[t]);
+  }
+
+  TRACE(TRACE_DEBUG, "FA", "Searcher: %s: %d hits from index",
+	fas->fas_query, num);
+}
+
+
+/**
+ *
+ */
 static void *
 fa_searcher (void *aux)
 {
   fa_search_t *fas = aux;
+  fa_index_hit_t *hits;
   char cmd[PATH_MAX];
+  int n;
+
+  fas->fas_pc = prop_courier_create_passive();
+  fas->fas_sub = 
+    prop_subscribe(PROP_SUB_TRACK_DESTROY,
+		   PROP_TAG_CALLBACK, fa_search_nodesub, fas,
+		   PROP_TAG_ROOT, fas->fas_nodes,
+		   PROP_TAG_COURIER, fas->fas_pc,
+		   NULL);
+
+  /* The index is populated in the background, until that is done
+     (or if it is empty) we fall back to locate(1) */
+  if((n = fa_index_search(fas->fas_query, &hits, FA_INDEX_MAX_HITS)) >= 0) {
+    fa_index_searcher(fas, hits, n);
+    fa_index_hits_free(hits, n);
+    fa_search_destroy(fas);
+    return NULL;
+  }
 
   /* FIXME: We should have some sort of priority here. E.g.:
    *         1) User defined search command.
@@ -358,14 +444,6 @@ fa_searcher (void *aux)
     return NULL;
   }
 
-  fas->fas_pc = prop_courier_create_passive();
-  fas->fas_sub = 
-    prop_subscribe(PROP_SUB_TRACK_DESTROY,
-		   PROP_TAG_CALLBACK, fa_search_nodesub, fas,
-		   PROP_TAG_ROOT, fas->fas_nodes,
-		   PROP_TAG_COURIER, fas->fas_pc,
-		   NULL);
-
   fa_locate_searcher(fas);
 
   return NULL;
@@ -373,7 +451,7 @@ fa_searcher (void *aux)
 
 
 static void
-locatedb_search(prop_t *model, const char *query)
+locatedb_search(prop_t *model, const char *query, struct search_query *sq)
 {
   if (!locatedb_enabled)
     return;
@@ -389,6 +467,8 @@ locatedb_search(prop_t *model, const char *query)
 
   fas->fas_run = 1;
   fas->fas_nodes = prop_ref_inc(prop_create(model, "nodes"));
+  fas->fas_sq = sq;
+  backend_search_hold(sq);
 
   hts_thread_create_detached("fa search", fa_searcher, fas,
 			     THREAD_PRIO_NORMAL);
@@ -404,7 +484,7 @@ locatedb_init(void)
   htsmsg_t *store = htsmsg_store_load("locatedb") ?: htsmsg_create_map();
   prop_t *s = search_get_settings();
 
-  settings_create_bool(s, "enable", "Search using Unix locatedb", 1, 
+  settings_create_bool(s, "enable", "Search local media files", 1, 
 		       store, settings_generic_set_bool, &locatedb_enabled,
 		       SETTINGS_INITIAL_UPDATE, NULL,
 		       settings_generic_save_settings, (void *)"locatedb");
@@ -35,6 +35,7 @@
 #include "showtime.h"
 #include "fileaccess.h"
 #include "fa_probe.h"
+#include "fa_index.h"
 #include "navigator.h"
 #include "api/lastfm.h"
 #include "media.h"
@@ -864,6 +865,9 @@ fa_probe_set_from_cache(const metadata_t *md, prop_t *proproot,
 
 /**
  * Probe a file for its type
+ *
+ * If proproot is NULL only the type is returned, no metadata props
+ * (and thus no artist/album art lookups) are created
  */
 unsigned int
 fa_probe(prop_t *proproot, const char *url, char *newurl, size_t newurlsize,
@@ -911,7 +915,16 @@ fa_probe(prop_t *proproot, const char *url, char *newurl, size_t newurlsize,
     }
   }
 
-  r = fa_probe_set_from_cache(md, proproot, newurl, newurlsize);
+  if(proproot != NULL) {
+    r = fa_probe_set_from_cache(md, proproot, newurl, newurlsize);
+  } else {
+    if(md->md_redirect != NULL && newurl != NULL)
+      av_strlcpy(newurl, md->md_redirect, newurlsize);
+    r = md->md_type;
+  }
+
+  fa_index_update(url, r, md->md_mtime, rstr_get(md->md_title),
+		  rstr_get(md->md_artist), rstr_get(md->md_album));
 
   hts_mutex_unlock(&metadata_mutex);
   return r;
@@ -953,6 +966,9 @@ fa_probe_dir(prop_t *proproot, const char *url)
       type = CONTENT_DVD;
   }
 
+  if(type == CONTENT_DVD)
+    fa_index_update(url, type, 0, NULL, NULL, NULL);
+
   return type;
 }
 
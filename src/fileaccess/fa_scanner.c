@@ -28,6 +28,7 @@
 #include "navigator.h"
 #include "fileaccess.h"
 #include "fa_probe.h"
+#include "fa_index.h"
 #include "playqueue.h"
 #include "misc/strtab.h"
 #include "prop/prop_nodefilter.h"
@@ -329,6 +330,7 @@ scanner_notification(void *opaque, fa_notify_op_t op, const char *filename,
 
     if(fde != NULL)
       scanner_entry_destroy(s, fde);
+    fa_index_remove(url);
     break;
 
   case FA_NOTIFY_ADD:
@@ -366,6 +368,7 @@ rescan(scanner_t *s)
     } else {
       changed = 1;
       // Exists in old but not in new
+      fa_index_remove(a->fde_url);
       scanner_entry_destroy(s, a);
     }
   }
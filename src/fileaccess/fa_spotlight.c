@@ -35,11 +35,14 @@ typedef struct fa_search_s {
   prop_sub_t           *fas_sub;
   prop_courier_t       *fas_pc;
   int                   fas_run;
+  struct search_query  *fas_sq;
 } fa_search_t;
 
 static void
 fa_search_destroy(fa_search_t *fas)
 {
+  backend_search_done(fas->fas_sq);
+
   free(fas->fas_query);
   
   if (fas->fas_pc)
@@ -113,6 +116,7 @@ spotlight_searcher(void *aux)
   CFIndex query_index;
   prop_t *entries[2] = {NULL, NULL};
   prop_t *nodes[2] = {NULL, NULL};
+  search_batch_t *sb[2] = {NULL, NULL};
   int i, t;
 
   fas->fas_pc = prop_courier_create_passive();
@@ -204,15 +208,15 @@ spotlight_searcher(void *aux)
       continue;
     }
     
-    if(nodes[t] == NULL)
+    if(nodes[t] == NULL) {
       if(search_class_create(fas->fas_nodes, &nodes[t], &entries[t],
 			     t ? "Local video files" : "Local audio files",
                              FA_LOCALFILES_ICON)) {
 	free(path);
 	break;
       }
-
-    prop_add_int(entries[t], 1);
+      sb[t] = search_batch_create(nodes[t], entries[t]);
+    }
 
     if((type = content2type(ctype)) == NULL)
       continue; /* Unlikely.. */
@@ -226,13 +230,12 @@ spotlight_searcher(void *aux)
     free(path);
     prop_set_string(prop_create(p, "type"), type);
 
-    if(prop_set_parent(p, nodes[t])) {
-      prop_destroy(p);
-      break;
-    }
+    search_batch_add(sb[t], p);
   }
 
   for(i = 0; i < 2; i++) { 
+    if(sb[i])
+      search_batch_destroy(sb[i]);
     if(nodes[i]) 
       prop_ref_dec(nodes[i]); 
     if(entries[i]) 
@@ -248,7 +251,7 @@ spotlight_searcher(void *aux)
 }
 
 static void
-spotlight_search(prop_t *model, const char *query)
+spotlight_search(prop_t *model, const char *query, struct search_query *sq)
 {
   if(!spotlight_enabled)
     return;
@@ -259,6 +262,8 @@ spotlight_search(prop_t *model, const char *query)
   fas->fas_query = s = strdup(query);
   fas->fas_run = 1;
   fas->fas_nodes = prop_ref_inc(prop_create(model, "nodes"));
+  fas->fas_sq = sq;
+  backend_search_hold(sq);
   
   hts_thread_create_detached("spotlight search", spotlight_searcher, fas);
 }
@@ -172,6 +172,22 @@ video_seek(AVFormatContext *fctx, media_pipe_t *mp, media_buf_t **mbp,
 }
 
 
+/**
+ * Let the demuxer skip packets for all streams we are not using
+ */
+static void
+update_discard(AVFormatContext *fctx, media_pipe_t *mp)
+{
+  int i;
+
+  for(i = 0; i < fctx->nb_streams; i++)
+    fctx->streams[i]->discard =
+      i == mp->mp_video.mq_stream ||
+      i == mp->mp_video.mq_stream2 ||
+      i == mp->mp_audio.mq_stream ? AVDISCARD_DEFAULT : AVDISCARD_ALL;
+}
+
+
 /**
  * Thread for reading from lavf and sending to lavc
  */
@@ -198,6 +214,8 @@ video_player_loop(AVFormatContext *fctx, media_codec_t **cwvec,
   mp->mp_audio.mq_seektarget = AV_NOPTS_VALUE;
   mp_set_playstatus_by_hold(mp, 0, NULL);
 
+  update_discard(fctx, mp);
+
   while(1) {
     /**
      * Need to fetch a new packet ?
@@ -466,6 +484,7 @@ video_player_loop(AVFormatContext *fctx, media_codec_t **cwvec,
 
 	sub = subtitles_load(est->id);
       }
+      update_discard(fctx, mp);
 
     } else if(event_is_type(e, EVENT_EXIT) ||
 	      event_is_type(e, EVENT_PLAY_URL)) {
@@ -40,6 +40,8 @@
 
 #include "fa_proto.h"
 #include "fa_probe.h"
+#include "fa_index.h"
+#include "fa_audio.h"
 #include "blobcache.h"
 
 struct fa_protocol_list fileaccess_all_protocols;
@@ -226,12 +228,23 @@ fa_fsize(void *fh_)
  */
 int
 fa_stat(const char *url, struct fa_stat *buf, char *errbuf, size_t errsize)
+{
+  return fa_stat_vpaths(url, NULL, buf, errbuf, errsize);
+}
+
+
+/**
+ *
+ */
+int
+fa_stat_vpaths(const char *url, const char **vpaths, struct fa_stat *buf,
+	       char *errbuf, size_t errsize)
 {
   fa_protocol_t *fap;
   char *filename;
   int r;
 
-  if((filename = fa_resolve_proto(url, &fap, NULL, errbuf, errsize)) == NULL)
+  if((filename = fa_resolve_proto(url, &fap, vpaths, errbuf, errsize)) == NULL)
     return AVERROR_NOENT;
 
   r = fap->fap_stat(fap, filename, buf, errbuf, errsize, 0);
@@ -547,6 +560,8 @@ fileaccess_init(void)
 {
   fa_protocol_t *fap;
   fa_probe_init();
+  fa_index_init();
+  fa_audio_init();
 
   LIST_FOREACH(fap, &fileaccess_all_protocols, fap_link)
     if(fap->fap_init != NULL)
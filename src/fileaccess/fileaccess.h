@@ -133,6 +133,8 @@ int fa_read(void *fh, void *buf, size_t size);
 int64_t fa_seek(void *fh, int64_t pos, int whence);
 int64_t fa_fsize(void *fh);
 int fa_stat(const char *url, struct fa_stat *buf, char *errbuf, size_t errsize);
+int fa_stat_vpaths(const char *url, const char **vpaths, struct fa_stat *buf,
+		   char *errbuf, size_t errsize);
 int fa_findfile(const char *path, const char *file, 
 		char *fullpath, size_t fullpathlen);
 
@@ -168,6 +170,7 @@ struct htsbuf_queue;
 
 #define HTTP_REQUEST_ESCAPE_PATH 0x1
 #define HTTP_REQUEST_DEBUG 0x2
+#define HTTP_REQUEST_CACHE 0x4  // Use response cache for GET requests
 
 int http_request(const char *url, const char **arguments, 
 		 char **result, size_t *result_sizep,
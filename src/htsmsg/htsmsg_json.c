@@ -22,6 +22,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 
 #include "htsmsg_json.h"
 #include "htsbuf.h"
@@ -61,17 +62,16 @@ htsmsg_json_encode_string(const char *str, htsbuf_queue_t *hq)
 
 
 /*
- * Note to future:
- * If your about to add support for numbers with decimal point,
- * remember to always serialize them with '.' as decimal point character
- * no matter what current locale says. This is according to the JSON spec.
+ * Numbers with decimal point are always serialized with '.' as
+ * decimal point character no matter what current locale says.
+ * This is according to the JSON spec.
  */
 static void
 htsmsg_json_write(htsmsg_t *msg, htsbuf_queue_t *hq, int isarray,
 		  int indent, int pretty)
 {
   htsmsg_field_t *f;
-  char buf[30];
+  char buf[30], *p;
   static const char *indentor = "\n\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t";
 
   htsbuf_append(hq, isarray ? "[" : "{", 1);
@@ -108,6 +108,17 @@ htsmsg_json_write(htsmsg_t *msg, htsbuf_queue_t *hq, int isarray,
       htsbuf_append(hq, buf, strlen(buf));
       break;
 
+    case HMF_DBL:
+      if(!isfinite(f->hmf_dbl)) {
+	htsbuf_append(hq, "null", 4);
+	break;
+      }
+      snprintf(buf, sizeof(buf), "%.9g", f->hmf_dbl);
+      if((p = strchr(buf, ',')) != NULL)
+	*p = '.'; // Decimal point is always '.' in JSON
+      htsbuf_append(hq, buf, strlen(buf));
+      break;
+
     default:
       abort();
     }
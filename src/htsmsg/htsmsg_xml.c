@@ -24,6 +24,10 @@
  * Parses of UTF-8 and ISO-8859-1 (Latin 1) encoded XML and output as
  * htsmsg's with UTF-8 encoded payloads
  *
+ * The parser is incremental. Input can be fed in pieces as it arrives
+ * and results are delivered via callbacks. htsmsg_xml_deserialize()
+ * builds a tree on top of this
+ *
  *  Supports:                             Example:
  *  
  *  Comments                              <!--  a comment               -->
@@ -50,19 +54,17 @@
 #include <stdlib.h>
 #include <string.h>
 
-#include <libavutil/common.h>
-
 #include "htsmsg_xml.h"
 #include "htsbuf.h"
 #include "misc/string.h"
-
-TAILQ_HEAD(cdata_content_queue, cdata_content);
+#include "misc/queue.h"
 
 LIST_HEAD(xmlns_list, xmlns);
 
 typedef struct xmlns {
-  LIST_ENTRY(xmlns) xmlns_global_link;
-  LIST_ENTRY(xmlns) xmlns_scope_link;
+  LIST_ENTRY(xmlns) xmlns_link;
+
+  int xmlns_depth;  // Depth of element that declared it
 
   char *xmlns_prefix;
   unsigned int xmlns_prefix_len;
@@ -72,118 +74,161 @@ typedef struct xmlns {
 
 } xmlns_t;
 
-typedef struct xmlparser {
+
+/**
+ * Tree builder state, one frame per open element. Frame 0 is the
+ * document itself
+ */
+typedef struct xml_tree_frame {
+  htsmsg_t *xtf_msg;
+  htsmsg_t *xtf_tags;
+  char *xtf_cdata;
+  size_t xtf_cdata_len;
+  size_t xtf_cdata_size;
+} xml_tree_frame_t;
+
+typedef struct xml_tree {
+  xml_tree_frame_t *xt_frames;
+  int xt_depth;
+  int xt_size;
+
+  int xt_split;
+  htsmsg_xml_element_cb_t *xt_cb;
+  void *xt_opaque;
+} xml_tree_t;
+
+
+struct htsmsg_xml_parser {
+  const htsmsg_xml_callbacks_t *xp_cb;
+  void *xp_opaque;
+
   enum {
     XML_ENCODING_UTF8,
     XML_ENCODING_8859_1,
   } xp_encoding;
 
+  enum {
+    XP_RUN,
+    XP_DONE,    // Document element closed, rest of input is ignored
+    XP_ERROR,
+  } xp_state;
+
   char xp_errmsg[128];
 
-  int xp_srcdataused;
+  int xp_in_cdata;       // Inside a <![CDATA[ section
+  int xp_in_text;        // Leading whitespace has been skipped
+  int xp_seen_element;
 
-  struct xmlns_list xp_namespaces;
+  /* Input not yet consumed is kept here */
+  char *xp_buf;
+  size_t xp_len;
+  size_t xp_size;
+  size_t xp_off;
 
-} xmlparser_t;
+  /* Open elements */
+  char **xp_names;
+  int xp_depth;
+  int xp_names_size;
 
-#define xmlerr(xp, fmt...) \
- snprintf((xp)->xp_errmsg, sizeof((xp)->xp_errmsg), fmt)
+  struct xmlns_list xp_namespaces;
 
+  xml_tree_t *xp_tree;
+};
 
-typedef struct cdata_content {
-  TAILQ_ENTRY(cdata_content) cc_link;
-  char *cc_start, *cc_end; /* end points to byte AFTER last char */
-  int cc_encoding;
-  char cc_buf[0];
-} cdata_content_t;
+#define xmlerr(xp, fmt...) do {						\
+    snprintf((xp)->xp_errmsg, sizeof((xp)->xp_errmsg), fmt);		\
+    (xp)->xp_state = XP_ERROR;						\
+  } while(0)
 
-static char *htsmsg_xml_parse_cd(xmlparser_t *xp, 
-				 htsmsg_t *parent, char *src);
 
 /**
  *
  */
-static void
-add_unicode(struct cdata_content_queue *ccq, int c)
+static inline int
+is_xmlws(char c)
 {
-  cdata_content_t *cc;
-  char *q;
-  uint8_t tmp;
+  return c > 0 && c <= 32;
+  //  return c == 32 || c == 9 || c = 10 || c = 13;
+}
 
-  cc = malloc(sizeof(cdata_content_t) + 6);
-  cc->cc_encoding = XML_ENCODING_UTF8;
-  q = cc->cc_buf;
 
-  TAILQ_INSERT_TAIL(ccq, cc, cc_link);
-  cc->cc_start = cc->cc_buf;
+/**
+ * Find 'needle' in [s, s + len)
+ */
+static char *
+find_str(char *s, size_t len, const char *needle)
+{
+  size_t nl = strlen(needle);
 
-  PUT_UTF8(c, tmp, *q++ = tmp;)
-  cc->cc_end = q;
+  for(; len >= nl; s++, len--)
+    if(*s == *needle && !memcmp(s, needle, nl))
+      return s;
+  return NULL;
 }
 
+
 /**
  *
  */
-static int
-decode_character_reference(char **src)
+static void
+xp_emit_cdata(htsmsg_xml_parser_t *xp, const char *s, size_t len)
 {
-  int v = 0;
-  char c;
-
-  if(**src == 'x') {
-    /* hexadecimal */
-    (*src)++;
-
-    /* decimal */
-    while(1) {
-      c = **src;
-      switch(c) {
-      case '0' ... '9':
-	v = v * 0x10 + c - '0';
-	break;
-      case 'a' ... 'f':
-	v = v * 0x10 + c - 'a' + 10;
-	break;
-      case 'A' ... 'F':
-	v = v * 0x10 + c - 'A' + 10;
-	break;
-      case ';':
-	(*src)++;
-	return v;
-      default:
-	return 0;
-      }
-      (*src)++;
+  char tmp[1024];
+  size_t i, o;
+
+  if(len == 0 || xp->xp_cb->xc_cdata == NULL)
+    return;
+
+  if(xp->xp_encoding == XML_ENCODING_UTF8) {
+    xp->xp_cb->xc_cdata(xp->xp_opaque, s, len);
+    return;
+  }
+
+  for(i = o = 0; i < len; i++) {
+    o += utf8_put(tmp + o, (uint8_t)s[i]);
+    if(o > sizeof(tmp) - 2) {
+      xp->xp_cb->xc_cdata(xp->xp_opaque, tmp, o);
+      o = 0;
     }
+  }
+  if(o > 0)
+    xp->xp_cb->xc_cdata(xp->xp_opaque, tmp, o);
+}
 
-  } else {
 
-    /* decimal */
-    while(1) {
-      c = **src;
-      switch(c) {
-      case '0' ... '9':
-	v = v * 10 + c - '0';
-	(*src)++;
-	break;
-      case ';':
-	(*src)++;
-	return v;
-      default:
-	return 0;
-      }
+/**
+ * Emit text, the first non whitespace char of each segment (text
+ * between markup) starts the actual payload
+ */
+static void
+xp_text(htsmsg_xml_parser_t *xp, const char *s, size_t len)
+{
+  if(!xp->xp_in_text) {
+    while(len > 0 && is_xmlws(*s)) {
+      s++;
+      len--;
     }
+    if(len == 0)
+      return;
+    xp->xp_in_text = 1;
   }
+  if(xp->xp_state == XP_RUN)
+    xp_emit_cdata(xp, s, len);
 }
 
+
 /**
  *
  */
-static inline int
-is_xmlws(char c)
+static void
+xp_unicode(htsmsg_xml_parser_t *xp, int c)
 {
-  return c > 0 && c <= 32;
-  //  return c == 32 || c == 9 || c = 10 || c = 13;
+  char tmp[8];
+  int l = utf8_put(tmp, c);
+
+  xp->xp_in_text = 1;
+  if(xp->xp_cb->xc_cdata != NULL && xp->xp_state == XP_RUN)
+    xp->xp_cb->xc_cdata(xp->xp_opaque, tmp, l);
 }
 
 
@@ -193,24 +238,24 @@ is_xmlws(char c)
 static void
 xmlns_destroy(xmlns_t *ns)
 {
-  LIST_REMOVE(ns, xmlns_global_link);
-  LIST_REMOVE(ns, xmlns_scope_link);
+  LIST_REMOVE(ns, xmlns_link);
   free(ns->xmlns_prefix);
   free(ns->xmlns_norm);
   free(ns);
 }
 
+
 /**
- *
+ * Parse one attribute from a NUL terminated string.
+ * If 'depth' is > 0, xmlns declarations are added to the namespace
+ * list instead of the message
  */
 static char *
-htsmsg_xml_parse_attrib(xmlparser_t *xp, htsmsg_t *msg, char *src,
-			struct xmlns_list *xmlns_scope_list)
+xp_parse_attrib(htsmsg_xml_parser_t *xp, htsmsg_t *msg, char *src, int depth)
 {
   char *attribname, *payload;
   int attriblen, payloadlen;
   char quote;
-  htsmsg_field_t *f;
   xmlns_t *ns;
 
   attribname = src;
@@ -273,13 +318,13 @@ htsmsg_xml_parse_attrib(xmlparser_t *xp, htsmsg_t *msg, char *src,
   while(is_xmlws(*src))
     src++;
 
-  if(xmlns_scope_list != NULL && 
-     attriblen > 6 && !memcmp(attribname, "xmlns:", 6)) {
+  if(depth > 0 && attriblen > 6 && !memcmp(attribname, "xmlns:", 6)) {
 
     attribname += 6;
     attriblen  -= 6;
 
     ns = malloc(sizeof(xmlns_t));
+    ns->xmlns_depth = depth;
 
     ns->xmlns_prefix = malloc(attriblen + 1);
     memcpy(ns->xmlns_prefix, attribname, attriblen);
@@ -291,574 +336,689 @@ htsmsg_xml_parse_attrib(xmlparser_t *xp, htsmsg_t *msg, char *src,
     ns->xmlns_norm[payloadlen] = 0;
     ns->xmlns_norm_len = payloadlen;
 
-    LIST_INSERT_HEAD(&xp->xp_namespaces, ns, xmlns_global_link);
-    LIST_INSERT_HEAD(xmlns_scope_list,   ns, xmlns_scope_link);
+    LIST_INSERT_HEAD(&xp->xp_namespaces, ns, xmlns_link);
     return src;
   }
 
-  xp->xp_srcdataused = 1;
   attribname[attriblen] = 0;
   payload[payloadlen] = 0;
 
-  f = htsmsg_field_add(msg, attribname, HMF_STR, 0);
-  f->hmf_str = payload;
+  htsmsg_add_str(msg, attribname, payload);
   return src;
 }
 
+
 /**
- *
+ * Expand namespace prefix, returns a malloced string
  */
 static char *
-htsmsg_xml_parse_tag(xmlparser_t *xp, htsmsg_t *parent, char *src)
+xp_resolve_name(htsmsg_xml_parser_t *xp, const char *tagname, int taglen)
 {
-  htsmsg_t *m, *attrs;
-  struct xmlns_list nslist;
-  char *tagname;
-  int taglen, empty = 0, i;
   xmlns_t *ns;
+  char *n;
+  int i, llen;
 
-  tagname = src;
+  for(i = 0; i < taglen - 1; i++) {
+    if(tagname[i] != ':')
+      continue;
 
-  LIST_INIT(&nslist);
+    LIST_FOREACH(ns, &xp->xp_namespaces, xmlns_link) {
+      if(ns->xmlns_prefix_len == i && 
+	 !memcmp(ns->xmlns_prefix, tagname, ns->xmlns_prefix_len)) {
 
-  while(1) {
-    if(*src == 0) {
-      xmlerr(xp, "Unexpected end of file during tag name parsing");
-      return NULL;
+	llen = taglen - i - 1;
+	n = malloc(ns->xmlns_norm_len + llen + 1);
+	n[ns->xmlns_norm_len + llen] = 0;
+	memcpy(n, ns->xmlns_norm, ns->xmlns_norm_len);
+	memcpy(n + ns->xmlns_norm_len, tagname + i + 1, llen);
+	return n;
+      }
     }
-    if(is_xmlws(*src) || *src == '>' || *src == '/')
-      break;
-    src++;
   }
 
+  n = malloc(taglen + 1);
+  memcpy(n, tagname, taglen);
+  n[taglen] = 0;
+  return n;
+}
+
+
+/**
+ *
+ */
+static void
+xp_end_element(htsmsg_xml_parser_t *xp)
+{
+  xmlns_t *ns;
+  char *name;
+
+  assert(xp->xp_depth > 0);
+
+  name = xp->xp_names[--xp->xp_depth];
+  if(xp->xp_cb->xc_end != NULL)
+    xp->xp_cb->xc_end(xp->xp_opaque, name);
+  free(name);
+
+  while((ns = LIST_FIRST(&xp->xp_namespaces)) != NULL &&
+	ns->xmlns_depth > xp->xp_depth)
+    xmlns_destroy(ns);
+
+  if(xp->xp_depth == 0)
+    xp->xp_state = XP_DONE;
+}
+
+
+/**
+ * Start tag, 'src' is the NUL terminated contents between '<' and '>'
+ */
+static void
+xp_start_element(htsmsg_xml_parser_t *xp, char *src)
+{
+  htsmsg_t *attrs;
+  char *tagname, *name;
+  int taglen, empty = 0, len = strlen(src);
+
+  if(len > 0 && src[len - 1] == '/') {
+    empty = 1;
+    src[len - 1] = 0;
+  }
+
+  tagname = src;
+
+  while(*src != 0 && !is_xmlws(*src))
+    src++;
+
   taglen = src - tagname;
   if(taglen < 1 || taglen > 65535) {
     xmlerr(xp, "Invalid tag name");
-    return NULL;
+    return;
   }
 
   attrs = htsmsg_create_map();
 
   while(1) {
-
     while(is_xmlws(*src))
       src++;
 
-    if(*src == 0) {
-      htsmsg_destroy(attrs);
-      xmlerr(xp, "Unexpected end of file in tag");
-      return NULL;
-    }
-
-    if(src[0] == '/' && src[1] == '>') {
-      empty = 1;
-      src += 2;
-      break;
-    }
-
-    if(*src == '>') {
-      src++;
+    if(*src == 0)
       break;
-    }
 
-    if((src = htsmsg_xml_parse_attrib(xp, attrs, src, &nslist)) == NULL) {
+    if((src = xp_parse_attrib(xp, attrs, src, xp->xp_depth + 1)) == NULL) {
       htsmsg_destroy(attrs);
-      return NULL;
+      return;
     }
   }
 
-  m = htsmsg_create_map();
-
-  if(TAILQ_FIRST(&attrs->hm_fields) != NULL) {
-    htsmsg_add_msg_extname(m, "attrib", attrs);
-  } else {
+  if(TAILQ_FIRST(&attrs->hm_fields) == NULL) {
     htsmsg_destroy(attrs);
+    attrs = NULL;
   }
 
-  if(!empty)
-    src = htsmsg_xml_parse_cd(xp, m, src);
+  name = xp_resolve_name(xp, tagname, taglen);
 
-  for(i = 0; i < taglen - 1; i++) {
-    if(tagname[i] == ':') {
-
-      LIST_FOREACH(ns, &xp->xp_namespaces, xmlns_global_link) {
-	if(ns->xmlns_prefix_len == i && 
-	   !memcmp(ns->xmlns_prefix, tagname, ns->xmlns_prefix_len)) {
-
-	  int llen = taglen - i - 1;
-	  char *n = malloc(ns->xmlns_norm_len + llen + 1);
-
-	  n[ns->xmlns_norm_len + llen] = 0;
-	  memcpy(n, ns->xmlns_norm, ns->xmlns_norm_len);
-	  memcpy(n + ns->xmlns_norm_len, tagname + i + 1, llen);
-	  htsmsg_add_msg(parent, n, m);
-	  free(n);
-	  goto done;
-	}
-      }
-    }
+  if(xp->xp_depth == xp->xp_names_size) {
+    xp->xp_names_size = xp->xp_names_size * 2 + 16;
+    xp->xp_names = realloc(xp->xp_names,
+			   xp->xp_names_size * sizeof(char *));
   }
+  xp->xp_names[xp->xp_depth++] = name;
+  xp->xp_seen_element = 1;
 
-  xp->xp_srcdataused = 1;
-  tagname[taglen] = 0;
-  htsmsg_add_msg_extname(parent, tagname, m);
+  if(xp->xp_cb->xc_start != NULL)
+    xp->xp_cb->xc_start(xp->xp_opaque, name, attrs);
+  else if(attrs != NULL)
+    htsmsg_destroy(attrs);
 
- done:
-  while((ns = LIST_FIRST(&nslist)) != NULL)
-    xmlns_destroy(ns);
-  return src;
+  if(empty)
+    xp_end_element(xp);
 }
 
 
-
-
-
 /**
- *
+ * Processing instruction, 'src' is the NUL terminated contents
+ * between '<?' and '?>'
  */
-static char *
-htsmsg_xml_parse_pi(xmlparser_t *xp, htsmsg_t *parent, char *src)
+static void
+xp_pi(htsmsg_xml_parser_t *xp, char *src)
 {
   htsmsg_t *attrs;
-  char *s = src;
-  char *piname;
-  int l;
-
-  while(1) {
-    if(*src == 0) {
-      xmlerr(xp, "Unexpected end of file during parsing of "
-	     "Processing instructions");
-      return NULL;
-    }
+  char *piname = src;
+  const char *encoding;
 
-    if(is_xmlws(*src) || *src == '?')
-      break;
+  while(*src != 0 && !is_xmlws(*src))
     src++;
-  }
 
-  l = src - s;
-  if(l < 1 || l > 65536) {
+  if(src == piname) {
     xmlerr(xp, "Invalid 'Processing instructions' name");
-    return NULL;
+    return;
   }
-  piname = alloca(l + 1);
-  memcpy(piname, s, l);
-  piname[l] = 0;
+
+  if(*src != 0)
+    *src++ = 0;
+
+  /* The only one we care about is <?xml ... ?> in the prolog */
+  if(strcmp(piname, "xml") || xp->xp_seen_element)
+    return;
 
   attrs = htsmsg_create_map();
 
   while(1) {
-
     while(is_xmlws(*src))
       src++;
 
-    if(*src == 0) {
-      htsmsg_destroy(attrs);
-      xmlerr(xp, "Unexpected end of file during parsing of "
-	     "Processing instructions");
-      return NULL;
-    }
-
-    if(src[0] == '?' && src[1] == '>') {
-      src += 2;
+    if(*src == 0)
       break;
-    }
 
-    if((src = htsmsg_xml_parse_attrib(xp, attrs, src, NULL)) == NULL) {
+    if((src = xp_parse_attrib(xp, attrs, src, 0)) == NULL) {
       htsmsg_destroy(attrs);
-      return NULL;
+      return;
     }
   }
 
-
-  if(TAILQ_FIRST(&attrs->hm_fields) != NULL && parent != NULL) {
-    htsmsg_add_msg(parent, piname, attrs);
-  } else {
-    htsmsg_destroy(attrs);
+  if((encoding = htsmsg_get_str(attrs, "encoding")) != NULL) {
+    if(!strcasecmp(encoding, "iso-8859-1") ||
+       !strcasecmp(encoding, "iso-8859_1") ||
+       !strcasecmp(encoding, "iso_8859-1") ||
+       !strcasecmp(encoding, "iso_8859_1")) {
+      xp->xp_encoding = XML_ENCODING_8859_1;
+    }
   }
-  return src;
+  htsmsg_destroy(attrs);
 }
 
 
 /**
- *
+ * Find '>' that ends a tag, skipping quoted attribute values
  */
 static char *
-xml_parse_comment(xmlparser_t *xp, char *src)
+find_tag_end(char *s, size_t len)
 {
-  /* comment */
-  while(1) {
-    if(*src == 0) { /* EOF inside comment is invalid */
-      xmlerr(xp, "Unexpected end of file inside a comment");
-      return NULL;
+  char quote = 0;
+
+  for(; len > 0; s++, len--) {
+    if(quote) {
+      if(*s == quote)
+	quote = 0;
+    } else if(*s == '"' || *s == '\'') {
+      quote = *s;
+    } else if(*s == '>') {
+      return s;
     }
-
-    if(src[0] == '-' && src[1] == '-' && src[2] == '>')
-      return src + 3;
-    src++;
   }
+  return NULL;
 }
 
+
 /**
- *
+ * Markup starting with '<'. Returns number of bytes consumed or 0 if
+ * more data is needed
  */
-static char *
-decode_label_reference(xmlparser_t *xp, 
-		       struct cdata_content_queue *ccq, char *src)
+static size_t
+xp_markup(htsmsg_xml_parser_t *xp, char *s, size_t len, int eof)
 {
-  char *s = src;
-  int l;
-  char *label;
-  int code;
+  char *e;
 
-  while(*src != 0 && *src != ';')
-    src++;
-  if(*src == 0) {
-    xmlerr(xp, "Unexpected end of file during parsing of label reference");
-    return NULL;
-  }
+  xp->xp_in_text = 0;
 
-  l = src - s;
-  if(l < 1 || l > 65535)
-    return NULL;
-  label = alloca(l + 1);
-  memcpy(label, s, l);
-  label[l] = 0;
-  src++;
-  
-  code = html_entity_lookup(label);
-  if(code != -1)
-    add_unicode(ccq, code);
-  else {
-    xmlerr(xp, "Unknown label referense: \"&%s;\"\n", label);
-    return NULL;
-  }
+  if(len < 2)
+    goto more;
 
-  return src;
-}
+  if(s[1] == '?') {
+    if((e = find_str(s + 2, len - 2, "?>")) == NULL) {
+      if(eof)
+	xmlerr(xp, "Unexpected end of file during parsing of "
+	       "Processing instructions");
+      return 0;
+    }
+    *e = 0;
+    xp_pi(xp, s + 2);
+    return e + 2 - s;
+  }
 
-/**
- *
- */
-static char *
-htsmsg_xml_parse_cd0(xmlparser_t *xp, 
-		     struct cdata_content_queue *ccq, htsmsg_t *tags,
-		     htsmsg_t *pis, char *src, int raw)
-{
-  cdata_content_t *cc = NULL;
-  int c;
+  if(s[1] == '!') {
 
-  while(src != NULL && *src != 0) {
+    if(len < 9 && !eof &&
+       (!memcmp(s, "<!--", len < 4 ? len : 4) ||
+	!memcmp(s, "<![CDATA[", len) ||
+	!memcmp(s, "<!DOCTYPE", len)))
+      return 0;
 
-    if(raw && src[0] == ']' && src[1] == ']' && src[2] == '>') {
-      if(cc != NULL)
-	cc->cc_end = src;
-      cc = NULL;
-      src += 3;
-      break;
+    if(len >= 4 && !memcmp(s, "<!--", 4)) {
+      if((e = find_str(s + 4, len - 4, "-->")) == NULL) {
+	if(eof)
+	  xmlerr(xp, "Unexpected end of file inside a comment");
+	return 0;
+      }
+      return e + 3 - s;
     }
 
-    if(*src == '<' && !raw) {
-
-      if(cc != NULL)
-	cc->cc_end = src;
-      cc = NULL;
+    if(len >= 9 && !memcmp(s, "<![CDATA[", 9)) {
+      xp->xp_in_cdata = 1;
+      return 9;
+    }
 
-      src++;
-      if(*src == '?') {
-	src++;
-	src = htsmsg_xml_parse_pi(xp, pis, src);
-	continue;
+    if(len >= 9 && !memcmp(s, "<!DOCTYPE", 9) && !xp->xp_seen_element) {
+      if((e = memchr(s, '>', len)) == NULL) {
+	if(eof)
+	  xmlerr(xp, "Unexpected end of file inside DOCTYPE");
+	return 0;
       }
+      return e + 1 - s;
+    }
 
-      if(src[0] == '!') {
+    xmlerr(xp, "Unknown syntatic element: <!%.10s", s + 2);
+    return 0;
+  }
 
-	src++;
+  if(s[1] == '/') {
+    /* End-tag, we don't verify that it matches the start-tag */
+    if((e = memchr(s, '>', len)) == NULL) {
+      if(eof)
+	xmlerr(xp, "Unexpected end of file inside close tag");
+      return 0;
+    }
+    if(xp->xp_depth > 0)
+      xp_end_element(xp);
+    else
+      xp->xp_state = XP_DONE;
+    return e + 1 - s;
+  }
 
-	if(src[0] == '-' && src[1] == '-') {
-	  src = xml_parse_comment(xp, src + 2);
-	  continue;
-	}
+  if((e = find_tag_end(s + 1, len - 1)) == NULL) {
+    if(eof)
+      xmlerr(xp, "Unexpected end of file in tag");
+    return 0;
+  }
+  *e = 0;
+  xp_start_element(xp, s + 1);
+  return e + 1 - s;
+
+ more:
+  if(eof)
+    xmlerr(xp, "Unexpected end of file");
+  return 0;
+}
 
-	if(!strncmp(src, "[CDATA[", 7)) {
-	  src += 7;
-	  src = htsmsg_xml_parse_cd0(xp, ccq, tags, pis, src, 1);
-	  continue;
-	}
-	xmlerr(xp, "Unknown syntatic element: <!%.10s", src);
-	return NULL;
-      }
 
-      if(*src == '/') {
-	/* End-tag */
-	src++;
-	while(*src != '>') {
-	  if(*src == 0) { /* EOF inside endtag */
-	    xmlerr(xp, "Unexpected end of file inside close tag");
-	    return NULL;
-	  }
-	  src++;
-	}
-	src++;
-	break;
-      }
+/**
+ * Character or label reference starting with '&'
+ */
+static size_t
+xp_reference(htsmsg_xml_parser_t *xp, char *s, size_t len, int eof)
+{
+  char *e = memchr(s, ';', len < 64 ? len : 64);
+  int c = 0;
 
-      src = htsmsg_xml_parse_tag(xp, tags, src);
-      continue;
+  if(e == NULL) {
+    if(eof || len >= 64)
+      xmlerr(xp, "Unterminated reference");
+    return 0;
+  }
+  *e = 0;
+
+  if(s[1] == '#') {
+    char *x = s + 2, *end;
+    if(*x == 'x')
+      c = strtol(x + 1, &end, 16);
+    else
+      c = strtol(x, &end, 10);
+    if(end != e || c <= 0) {
+      xmlerr(xp, "Invalid character reference");
+      return 0;
     }
-    
-    if(*src == '&' && !raw) {
-      if(cc != NULL)
-	cc->cc_end = src;
-      cc = NULL;
+  } else if(e - s < 2 || (c = html_entity_lookup(s + 1)) == -1) {
+    xmlerr(xp, "Unknown label referense: \"&%s;\"", s + 1);
+    return 0;
+  }
 
-      src++;
+  xp_unicode(xp, c);
+  return e + 1 - s;
+}
 
-      if(*src == '#') {
-	src++;
-	/* Character reference */
-	if((c = decode_character_reference(&src)) != 0)
-	  add_unicode(ccq, c);
-	else {
-	  xmlerr(xp, "Invalid character reference");
-	  return NULL;
-	}
-      } else {
-	/* Label references */
-	src = decode_label_reference(xp, ccq, src);
-      }
-      continue;
-    }
 
-    if(cc == NULL) {
-      if(*src <= 32) {
-	src++;
-	continue;
-      }
-      cc = malloc(sizeof(cdata_content_t));
-      cc->cc_encoding = xp->xp_encoding;
-      TAILQ_INSERT_TAIL(ccq, cc, cc_link);
-      cc->cc_start = src;
-    }
-    src++;
-  }
+/**
+ * Inside <![CDATA[ ... ]]>
+ */
+static size_t
+xp_cdata_section(htsmsg_xml_parser_t *xp, char *s, size_t len, int eof)
+{
+  char *e = find_str(s, len, "]]>");
 
-  if(cc != NULL) {
-    assert(src != NULL);
-    cc->cc_end = src;
+  if(e != NULL) {
+    xp_text(xp, s, e - s);
+    xp->xp_in_cdata = 0;
+    xp->xp_in_text = 0;
+    return e + 3 - s;
   }
-  return src;
+
+  /* Keep what might be the start of the terminator */
+  if(!eof)
+    len = len > 2 ? len - 2 : 0;
+  xp_text(xp, s, len);
+  return len;
 }
 
+
 /**
  *
  */
-static char *
-htsmsg_xml_parse_cd(xmlparser_t *xp, htsmsg_t *parent, char *src)
+static void
+xp_process(htsmsg_xml_parser_t *xp, int eof)
 {
-  struct cdata_content_queue ccq;
-  htsmsg_field_t *f;
-  cdata_content_t *cc;
-  int c = 0, l, y = 0;
-  char *body;
-  char *x;
-  htsmsg_t *tags = htsmsg_create_map();
-  uint8_t tmp;
-  
-  TAILQ_INIT(&ccq);
-  src = htsmsg_xml_parse_cd0(xp, &ccq, tags, NULL, src, 0);
+  char *s, *e;
+  size_t len, r;
+
+  while(xp->xp_state == XP_RUN && xp->xp_off < xp->xp_len) {
+
+    s = xp->xp_buf + xp->xp_off;
+    len = xp->xp_len - xp->xp_off;
+
+    if(xp->xp_in_cdata) {
+      r = xp_cdata_section(xp, s, len, eof);
+    } else if(*s == '<') {
+      r = xp_markup(xp, s, len, eof);
+    } else if(*s == '&') {
+      r = xp_reference(xp, s, len, eof);
+    } else {
+      for(e = s; e < s + len && *e != '<' && *e != '&'; e++) {}
+      r = e - s;
+      xp_text(xp, s, r);
+    }
+    if(r == 0)
+      break;
+    xp->xp_off += r;
+  }
+}
 
-  /* Assemble body */
 
-  TAILQ_FOREACH(cc, &ccq, cc_link) {
+/**
+ *
+ */
+static int
+xp_error(htsmsg_xml_parser_t *xp, char *errbuf, size_t errlen)
+{
+  int i;
 
-    switch(cc->cc_encoding) {
-    case XML_ENCODING_UTF8:
-      c += cc->cc_end - cc->cc_start;
-      y++;
-      break;
+  if(xp->xp_state != XP_ERROR)
+    return 0;
 
-    case XML_ENCODING_8859_1:
-      l = 0;
-      for(x = cc->cc_start; x < cc->cc_end; x++)
-	l += 1 + (*x >= 0x80);
+  snprintf(errbuf, errlen, "%s", xp->xp_errmsg);
 
-      c += l;
-      y += 1 + (l != cc->cc_end - cc->cc_start);
+  /* Remove any odd chars inside of errmsg */
+  for(i = 0; i < errlen; i++) {
+    if(errbuf[i] < 32) {
+      errbuf[i] = 0;
       break;
     }
   }
+  return -1;
+}
 
-  if(y == 1 && c > 0) {
-    /* One segment UTF-8 (or 7bit ASCII),
-       use data directly from source */
 
-    cc = TAILQ_FIRST(&ccq);
+/**
+ *
+ */
+htsmsg_xml_parser_t *
+htsmsg_xml_parser_create(const htsmsg_xml_callbacks_t *xc, void *opaque)
+{
+  htsmsg_xml_parser_t *xp = calloc(1, sizeof(htsmsg_xml_parser_t));
+  xp->xp_cb = xc;
+  xp->xp_opaque = opaque;
+  xp->xp_encoding = XML_ENCODING_UTF8;
+  xp->xp_state = XP_RUN;
+  LIST_INIT(&xp->xp_namespaces);
+  return xp;
+}
 
-    assert(cc != NULL);
-    assert(TAILQ_NEXT(cc, cc_link) == NULL);
-    
-    f = htsmsg_field_add(parent, "cdata", HMF_STR, 0);
-    f->hmf_str = cc->cc_start;
-    *cc->cc_end = 0;
-    free(cc);
 
-  } else if(c > 1) {
-    body = malloc(c + 1);
-    c = 0;
+/**
+ * Only input not yet consumed is buffered, so memory usage is bounded
+ * by the largest single tag (text is passed on as it arrives)
+ */
+int
+htsmsg_xml_parser_feed(htsmsg_xml_parser_t *xp, const void *data, size_t len,
+		       char *errbuf, size_t errlen)
+{
+  if(xp->xp_state != XP_RUN)
+    return xp_error(xp, errbuf, errlen);
 
-    while((cc = TAILQ_FIRST(&ccq)) != NULL) {
+  if(xp->xp_off > 0) {
+    xp->xp_len -= xp->xp_off;
+    memmove(xp->xp_buf, xp->xp_buf + xp->xp_off, xp->xp_len);
+    xp->xp_off = 0;
+  }
 
-      switch(cc->cc_encoding) {
-      case XML_ENCODING_UTF8:
-	l = cc->cc_end - cc->cc_start;
-	memcpy(body + c, cc->cc_start, l);
-	c += l;
-	break;
+  if(xp->xp_len + len > xp->xp_size) {
+    xp->xp_size = xp->xp_len + len;
+    if(xp->xp_size < 4096)
+      xp->xp_size = 4096;
+    xp->xp_buf = realloc(xp->xp_buf, xp->xp_size);
+  }
+  memcpy(xp->xp_buf + xp->xp_len, data, len);
+  xp->xp_len += len;
 
-      case XML_ENCODING_8859_1:
-	for(x = cc->cc_start; x < cc->cc_end; x++) {
-	  PUT_UTF8(*x, tmp, body[c++] = tmp;)
-	    }
-	break;
-      }
-      
-      TAILQ_REMOVE(&ccq, cc, cc_link);
-      free(cc);
-    }
-    body[c] = 0;
+  xp_process(xp, 0);
+  return xp_error(xp, errbuf, errlen);
+}
 
-    f = htsmsg_field_add(parent, "cdata", HMF_STR, HMF_ALLOCED);
-    f->hmf_str = body;
 
-  } else {
+/**
+ * Parse remaining input. Elements still open are closed
+ */
+int
+htsmsg_xml_parser_finish(htsmsg_xml_parser_t *xp, char *errbuf, size_t errlen)
+{
+  xp_process(xp, 1);
 
-    while((cc = TAILQ_FIRST(&ccq)) != NULL) {
-      TAILQ_REMOVE(&ccq, cc, cc_link);
-      free(cc);
-    }
-  }
+  if(xp->xp_state == XP_ERROR)
+    return xp_error(xp, errbuf, errlen);
 
+  while(xp->xp_depth > 0)
+    xp_end_element(xp);
+  return 0;
+}
 
-  if(src == NULL) {
-    htsmsg_destroy(tags);
-    return NULL;
-  }
 
-  if(TAILQ_FIRST(&tags->hm_fields) != NULL) {
-    htsmsg_add_msg_extname(parent, "tags", tags);
+/**
+ *
+ */
+static void
+xml_tree_frame_finish(xml_tree_frame_t *xtf)
+{
+  htsmsg_field_t *f;
+
+  if(xtf->xtf_cdata_len > 0) {
+    xtf->xtf_cdata[xtf->xtf_cdata_len] = 0;
+    f = htsmsg_field_add(xtf->xtf_msg, "cdata", HMF_STR, HMF_ALLOCED);
+    f->hmf_str = xtf->xtf_cdata;
   } else {
-    htsmsg_destroy(tags);
+    free(xtf->xtf_cdata);
   }
+  xtf->xtf_cdata = NULL;
+  xtf->xtf_cdata_len = xtf->xtf_cdata_size = 0;
 
-  return src;
+  if(xtf->xtf_tags != NULL)
+    htsmsg_add_msg(xtf->xtf_msg, "tags", xtf->xtf_tags);
+  xtf->xtf_tags = NULL;
 }
 
 
 /**
  *
  */
-static char *
-htsmsg_parse_prolog(xmlparser_t *xp, char *src)
+static void
+xml_tree_start(void *opaque, const char *name, htsmsg_t *attrib)
 {
-  htsmsg_t *pis = htsmsg_create_map();
-  htsmsg_t *xmlpi;
-  const char *encoding;
+  xml_tree_t *xt = opaque;
+  xml_tree_frame_t *xtf;
 
-  while(1) {
-    if(*src == 0)
-      break;
+  if(xt->xt_depth + 1 == xt->xt_size) {
+    xt->xt_size = xt->xt_size * 2 + 16;
+    xt->xt_frames = realloc(xt->xt_frames,
+			    xt->xt_size * sizeof(xml_tree_frame_t));
+  }
 
-    while(is_xmlws(*src))
-      src++;
-    
-    if(!strncmp(src, "<?", 2)) {
-      src += 2;
-      src = htsmsg_xml_parse_pi(xp, pis, src);
-      continue;
-    }
+  xtf = &xt->xt_frames[++xt->xt_depth];
+  memset(xtf, 0, sizeof(xml_tree_frame_t));
+  xtf->xtf_msg = htsmsg_create_map();
+  if(attrib != NULL)
+    htsmsg_add_msg(xtf->xtf_msg, "attrib", attrib);
+}
 
-    if(!strncmp(src, "<!--", 4)) {
-      src = xml_parse_comment(xp, src + 4);
-      continue;
-    }
 
-    if(!strncmp(src, "<!DOCTYPE", 9)) {
-      while(*src != 0) {
-	if(*src == '>') {
-	  src++;
-	  break;
-	}
-	src++;
-      }
-      continue;
-    }
-    break;
-  }
+/**
+ *
+ */
+static void
+xml_tree_end(void *opaque, const char *name)
+{
+  xml_tree_t *xt = opaque;
+  xml_tree_frame_t *xtf = &xt->xt_frames[xt->xt_depth];
+  xml_tree_frame_t *parent = xtf - 1;
 
-  if((xmlpi = htsmsg_get_map(pis, "xml")) != NULL) {
+  xml_tree_frame_finish(xtf);
 
-    if((encoding = htsmsg_get_str(xmlpi, "encoding")) != NULL) {
-      if(!strcasecmp(encoding, "iso-8859-1") ||
-	 !strcasecmp(encoding, "iso-8859_1") ||
-	 !strcasecmp(encoding, "iso_8859-1") ||
-	 !strcasecmp(encoding, "iso_8859_1")) {
-	xp->xp_encoding = XML_ENCODING_8859_1;
-      }
-    }
+  if(xt->xt_cb != NULL && xt->xt_depth == xt->xt_split) {
+    xt->xt_cb(xt->xt_opaque, name, xtf->xtf_msg);
+  } else {
+    if(parent->xtf_tags == NULL)
+      parent->xtf_tags = htsmsg_create_map();
+    htsmsg_add_msg(parent->xtf_tags, name, xtf->xtf_msg);
   }
+  xt->xt_depth--;
+}
 
-  htsmsg_destroy(pis);
 
-  return src;
+/**
+ *
+ */
+static void
+xml_tree_cdata(void *opaque, const char *str, size_t len)
+{
+  xml_tree_t *xt = opaque;
+  xml_tree_frame_t *xtf = &xt->xt_frames[xt->xt_depth];
+
+  if(xtf->xtf_cdata_len + len + 1 > xtf->xtf_cdata_size) {
+    xtf->xtf_cdata_size = xtf->xtf_cdata_len + len + 1;
+    if(xtf->xtf_cdata_size < 2 * xtf->xtf_cdata_len)
+      xtf->xtf_cdata_size = 2 * xtf->xtf_cdata_len;
+    xtf->xtf_cdata = realloc(xtf->xtf_cdata, xtf->xtf_cdata_size);
+  }
+  memcpy(xtf->xtf_cdata + xtf->xtf_cdata_len, str, len);
+  xtf->xtf_cdata_len += len;
 }
 
 
+static const htsmsg_xml_callbacks_t xml_tree_callbacks = {
+  .xc_start = xml_tree_start,
+  .xc_end   = xml_tree_end,
+  .xc_cdata = xml_tree_cdata,
+};
+
 
 /**
  *
  */
+htsmsg_xml_parser_t *
+htsmsg_xml_parser_create_tree(int depth, htsmsg_xml_element_cb_t *cb,
+			      void *opaque)
+{
+  xml_tree_t *xt = calloc(1, sizeof(xml_tree_t));
+  htsmsg_xml_parser_t *xp;
+
+  xt->xt_size = 16;
+  xt->xt_frames = calloc(xt->xt_size, sizeof(xml_tree_frame_t));
+  xt->xt_frames[0].xtf_msg = htsmsg_create_map();
+  xt->xt_split = depth;
+  xt->xt_cb = cb;
+  xt->xt_opaque = opaque;
+
+  xp = htsmsg_xml_parser_create(&xml_tree_callbacks, xt);
+  xp->xp_tree = xt;
+  return xp;
+}
+
+
+/**
+ * Return what is left of the tree once parsing is finished. Ownership
+ * is passed to the caller
+ */
 htsmsg_t *
-htsmsg_xml_deserialize(char *src, char *errbuf, size_t errbufsize)
+htsmsg_xml_parser_get_tree(htsmsg_xml_parser_t *xp)
 {
+  xml_tree_t *xt = xp->xp_tree;
   htsmsg_t *m;
-  xmlparser_t xp;
-  char *src0 = src;
-  int i;
 
-  xp.xp_errmsg[0] = 0;
-  xp.xp_encoding = XML_ENCODING_UTF8;
-  LIST_INIT(&xp.xp_namespaces);
+  assert(xt != NULL && xt->xt_depth == 0);
 
-  if((src = htsmsg_parse_prolog(&xp, src)) == NULL)
-    goto err;
+  xml_tree_frame_finish(&xt->xt_frames[0]);
+  m = xt->xt_frames[0].xtf_msg;
+  xt->xt_frames[0].xtf_msg = NULL;
+  return m;
+}
 
-  m = htsmsg_create_map();
 
-  if(htsmsg_xml_parse_cd(&xp, m, src) == NULL) {
-    htsmsg_destroy(m);
-    goto err;
-  }
+/**
+ *
+ */
+static void
+xml_tree_destroy(xml_tree_t *xt)
+{
+  int i;
 
-  if(xp.xp_srcdataused) {
-    m->hm_data = src0;
-  } else {
-    free(src0);
+  for(i = 0; i <= xt->xt_depth; i++) {
+    xml_tree_frame_t *xtf = &xt->xt_frames[i];
+    if(xtf->xtf_msg != NULL)
+      htsmsg_destroy(xtf->xtf_msg);
+    if(xtf->xtf_tags != NULL)
+      htsmsg_destroy(xtf->xtf_tags);
+    free(xtf->xtf_cdata);
   }
+  free(xt->xt_frames);
+  free(xt);
+}
 
-  return m;
 
- err:
-  free(src);
-  snprintf(errbuf, errbufsize, "%s", xp.xp_errmsg);
-  
-  /* Remove any odd chars inside of errmsg */
-  for(i = 0; i < errbufsize; i++) {
-    if(errbuf[i] < 32) {
-      errbuf[i] = 0;
-      break;
-    }
-  }
+/**
+ *
+ */
+void
+htsmsg_xml_parser_destroy(htsmsg_xml_parser_t *xp)
+{
+  xmlns_t *ns;
+  int i;
 
-  return NULL;
+  for(i = 0; i < xp->xp_depth; i++)
+    free(xp->xp_names[i]);
+  free(xp->xp_names);
+
+  while((ns = LIST_FIRST(&xp->xp_namespaces)) != NULL)
+    xmlns_destroy(ns);
+
+  if(xp->xp_tree != NULL)
+    xml_tree_destroy(xp->xp_tree);
+
+  free(xp->xp_buf);
+  free(xp);
+}
+
+
+/**
+ * Parse a complete document. 'src' is consumed and used directly as
+ * parse buffer
+ */
+htsmsg_t *
+htsmsg_xml_deserialize(char *src, char *errbuf, size_t errbufsize)
+{
+  htsmsg_xml_parser_t *xp = htsmsg_xml_parser_create_tree(0, NULL, NULL);
+  htsmsg_t *m = NULL;
+
+  xp->xp_buf = src;
+  xp->xp_len = xp->xp_size = strlen(src);
+
+  if(!htsmsg_xml_parser_finish(xp, errbuf, errbufsize))
+    m = htsmsg_xml_parser_get_tree(xp);
+
+  htsmsg_xml_parser_destroy(xp);
+  return m;
 }
@@ -27,4 +27,55 @@ int html_entity_lookup(const char *name);
 
 htsmsg_t *htsmsg_xml_deserialize(char *src, char *errbuf, size_t errbufsize);
 
+
+/**
+ * Incremental (SAX style) parser. Data can be fed in arbitrary pieces
+ * and callbacks are invoked as soon as enough data has arrived
+ */
+typedef struct htsmsg_xml_parser htsmsg_xml_parser_t;
+
+typedef struct htsmsg_xml_callbacks {
+  /**
+   * Element names have their namespace prefix expanded, just as in the
+   * messages produced by htsmsg_xml_deserialize(). Ownership of
+   * 'attrib' is passed to the callee, it is NULL if there are no
+   * attributes
+   */
+  void (*xc_start)(void *opaque, const char *name, htsmsg_t *attrib);
+  void (*xc_end)(void *opaque, const char *name);
+
+  /**
+   * Character data, always UTF-8. Text may be delivered in several
+   * pieces
+   */
+  void (*xc_cdata)(void *opaque, const char *str, size_t len);
+} htsmsg_xml_callbacks_t;
+
+htsmsg_xml_parser_t *htsmsg_xml_parser_create(const htsmsg_xml_callbacks_t *xc,
+					      void *opaque);
+
+int htsmsg_xml_parser_feed(htsmsg_xml_parser_t *xp, const void *data,
+			   size_t len, char *errbuf, size_t errlen);
+
+int htsmsg_xml_parser_finish(htsmsg_xml_parser_t *xp,
+			     char *errbuf, size_t errlen);
+
+void htsmsg_xml_parser_destroy(htsmsg_xml_parser_t *xp);
+
+
+/**
+ * Called for elements at the requested depth (1 is the document
+ * element) once they are complete. The element has the same layout as
+ * in htsmsg_xml_deserialize(). Ownership of 'element' is passed to
+ * the callee and the element is not added to the tree
+ */
+typedef void (htsmsg_xml_element_cb_t)(void *opaque, const char *name,
+				       htsmsg_t *element);
+
+htsmsg_xml_parser_t *htsmsg_xml_parser_create_tree(int depth,
+						   htsmsg_xml_element_cb_t *cb,
+						   void *opaque);
+
+htsmsg_t *htsmsg_xml_parser_get_tree(htsmsg_xml_parser_t *xp);
+
 #endif /* HTSMSG_XML_H_ */
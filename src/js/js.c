@@ -361,6 +361,7 @@ js_sleep(JSContext *cx, JSObject *obj,
   if (!JS_ConvertArguments(cx, argc, argv, "u", &msec))
     return JS_FALSE;
 
+  js_page_flush_items(cx);
   jsrefcount s = JS_SuspendRequest(cx);
   usleep(msec * 1000);
   JS_ResumeRequest(cx, s);
@@ -637,6 +638,8 @@ js_init(void)
 
   runtime = JS_NewRuntime(0x1000000);
 
+  js_page_init();
+
   cx = js_newctx();
 
   JS_BeginRequest(cx);
@@ -54,7 +54,10 @@ struct backend;
 
 int js_backend_open(prop_t *page, const char *url);
 
-void js_backend_search(struct prop *model, const char *query);
+struct search_query;
+
+void js_backend_search(struct prop *model, const char *query,
+		       struct search_query *sq);
 
 int js_plugin_load(const char *id, const char *url,
 		   char *errbuf, size_t errlen);
@@ -65,6 +68,10 @@ void js_prop_set_from_jsval(JSContext *cx, prop_t *p, jsval value, int recurse);
 
 void js_page_flush_from_plugin(JSContext *cx, js_plugin_t *jp);
 
+void js_page_flush_items(JSContext *cx);
+
+void js_page_init(void);
+
 JSObject *js_object_from_prop(JSContext *cx, prop_t *p);
 
 JSBool js_wait_for_value(JSContext *cx, prop_t *root, const char *subname,
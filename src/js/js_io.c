@@ -208,11 +208,12 @@ js_http_request(JSContext *cx, JSObject *obj, uintN argc,
 
   struct http_header_list response_headers;
 
+  js_page_flush_items(cx);
   jsrefcount s = JS_SuspendRequest(cx);
   int n = http_request(url, (const char **)httpargs, 
 		       &result, &resultsize, errbuf, sizeof(errbuf),
 		       postdata, postcontenttype,
-		       0,
+		       HTTP_REQUEST_CACHE,
 		       &response_headers, NULL, NULL);
   JS_ResumeRequest(cx, s);
 
@@ -298,6 +299,7 @@ js_readFile(JSContext *cx, JSObject *obj, uintN argc,
   if(!JS_ConvertArguments(cx, argc, argv, "s", &url))
     return JS_FALSE;
 
+  js_page_flush_items(cx);
   jsrefcount s = JS_SuspendRequest(cx);
   result = fa_quickload(url, &fs, NULL, errbuf, sizeof(errbuf));
   JS_ResumeRequest(cx, s);
@@ -33,10 +33,23 @@
 
 LIST_HEAD(js_event_handler_list, js_event_handler);
 LIST_HEAD(js_item_list, js_item);
+TAILQ_HEAD(js_model_queue, js_model);
 
 static struct js_route_list js_routes;
 static struct js_searcher_list js_searchers;
 
+/**
+ * Models are executed by a bounded pool of workers, each with its own
+ * long lived JSContext. Workers are started on demand
+ */
+#define JS_MODEL_WORKERS 4
+
+static hts_mutex_t js_model_mutex;
+static hts_cond_t js_model_cond;
+static struct js_model_queue js_model_runq;
+static int js_model_workers;
+static int js_model_idle;
+
 /**
  *
  */
@@ -101,11 +114,20 @@ typedef struct js_model {
   prop_courier_t *jm_pc;
   prop_sub_t *jm_nodesub;
 
+  TAILQ_ENTRY(js_model) jm_run_link;
+  char jm_queued;   // On js_model_runq
+  char jm_running;  // Being executed by a worker
+  char jm_pending;  // Notified while running
+  char jm_opened;   // Open function has been invoked
+
+  prop_vec_t *jm_pending_items;  // Appended but not yet attached to jm_nodes
+  int64_t jm_pending_first;
+
   prop_sub_t *jm_eventsub;
 
   jsval jm_paginator;
   
-  JSContext *jm_cx;
+  JSContext *jm_cx;  // Context of worker currently executing the model
 
   struct js_event_handler_list jm_event_handlers;
 
@@ -113,11 +135,15 @@ typedef struct js_model {
 
   int jm_subs;
 
+  struct search_query *jm_sq; // Search we are part of, until opened
+
 } js_model_t;
 
 
 static JSObject *make_model_object(JSContext *cx, js_model_t *jm);
 
+static void *js_model_worker(void *aux);
+
 /**
  *
  */
@@ -195,6 +221,9 @@ js_model_create(jsval openfunc)
 static void
 js_model_destroy(js_model_t *jm)
 {
+  if(jm->jm_sq != NULL)
+    backend_search_done(jm->jm_sq);
+
   if(jm->jm_args)
     strvec_free(jm->jm_args);
 
@@ -216,6 +245,11 @@ js_model_destroy(js_model_t *jm)
   if(jm->jm_pc != NULL)
     prop_courier_destroy(jm->jm_pc);
 
+  if(jm->jm_pending_items != NULL) {
+    prop_vec_destroy_entries(jm->jm_pending_items);
+    prop_vec_release(jm->jm_pending_items);
+  }
+
   free(jm);
 }
 
@@ -231,6 +265,72 @@ js_model_release(js_model_t *jm)
 }
 
 
+/**
+ * Items appended by the plugin are collected and attached to the
+ * model's node list in a single prop_set_parent_vector() so
+ * subscribers get one PROP_ADD_CHILD_VECTOR instead of one
+ * PROP_ADD_CHILD per item.
+ *
+ * The batch is flushed when the plugin returns control to us, when it
+ * modifies other parts of the model, when it blocks (see
+ * js_page_flush_items()) and when a new item arrives and the oldest
+ * one has been waiting for more than JS_APPEND_DELAY
+ */
+#define JS_APPEND_DELAY 250000
+
+static void
+js_model_flush_items(js_model_t *jm)
+{
+  if(jm->jm_pending_items == NULL)
+    return;
+
+  prop_set_parent_vector(jm->jm_pending_items, jm->jm_nodes);
+  prop_vec_release(jm->jm_pending_items);
+  jm->jm_pending_items = NULL;
+}
+
+
+/**
+ *
+ */
+static void
+js_model_add_item(js_model_t *jm, prop_t *item)
+{
+  if(jm->jm_pending_items == NULL) {
+    jm->jm_pending_items = prop_vec_create(32);
+    jm->jm_pending_first = showtime_get_ts();
+  }
+  jm->jm_pending_items = prop_vec_append(jm->jm_pending_items, item);
+}
+
+
+/**
+ * Called by native functions that are about to block (sleep, http
+ * requests, etc) so items collected so far are not held back while
+ * the plugin waits
+ */
+void
+js_page_flush_items(JSContext *cx)
+{
+  js_model_t *jm = JS_GetContextPrivate(cx);
+
+  if(jm != NULL)
+    js_model_flush_items(jm);
+}
+
+
+/**
+ *
+ */
+static void
+js_model_maybe_flush_items(js_model_t *jm)
+{
+  if(jm->jm_pending_items != NULL &&
+     showtime_get_ts() - jm->jm_pending_first > JS_APPEND_DELAY)
+    js_model_flush_items(jm);
+}
+
+
 /**
  *
  */
@@ -238,6 +338,7 @@ static JSBool
 js_setEntries(JSContext *cx, JSObject *obj, jsval idval, jsval *vp)
 {
   js_model_t *jm = JS_GetPrivate(cx, obj);
+  js_model_flush_items(jm);
   js_prop_set_from_jsval(cx, jm->jm_entries, *vp, 0);
   return JS_TRUE;
 }
@@ -292,6 +393,7 @@ js_setLoading(JSContext *cx, JSObject *obj, jsval idval, jsval *vp)
   if(!JS_ValueToBoolean(cx, *vp, &on))
     return JS_FALSE;
 
+  js_model_flush_items(jm);
   prop_set_int(jm->jm_loading, on);
   return JS_TRUE;
 }
@@ -413,6 +515,7 @@ js_item_destroy(JSContext *cx, JSObject *obj,
 		uintN argc, jsval *argv, jsval *rval)
 {
   js_item_t *ji = JS_GetPrivate(cx, obj);
+  js_model_flush_items(ji->ji_model);
   prop_destroy(ji->ji_root);
   *rval = JSVAL_VOID;
   return JS_TRUE;
@@ -428,6 +531,47 @@ static JSFunctionSpec item_functions[] = {
 };
 
 
+/**
+ * Create an item and queue it for insertion into the model.
+ * Returns NULL if the item could not be resolved
+ */
+static JSObject *
+js_item_create(JSContext *cx, js_model_t *model, const char *url,
+	       const char *type, JSObject *metaobj)
+{
+  JSObject *robj;
+  js_item_t *ji;
+  prop_t *item = prop_create_root(NULL);
+
+  prop_set_string(prop_create(item, "url"), url);
+
+  if(type != NULL) {
+    prop_set_string(prop_create(item, "type"), type);
+
+    if(metaobj)
+      js_prop_from_object(cx, metaobj, prop_create(item, "metadata"), 0);
+
+  } else {
+
+    if(backend_resolve_item(url, item)) {
+      prop_destroy(item);
+      return NULL;
+    }
+  }
+
+  js_model_add_item(model, item);
+
+  robj = JS_NewObjectWithGivenProto(cx, &item_class, NULL, NULL);
+  JS_DefineFunctions(cx, robj, item_functions);
+  ji = calloc(1, sizeof(js_item_t));
+  ji->ji_model = model;
+  ji->ji_root =  prop_ref_inc(item);
+  LIST_INSERT_HEAD(&model->jm_items, ji, ji_link);
+  JS_SetPrivate(cx, robj, ji);
+  return robj;
+}
+
+
 /**
  *
  */
@@ -438,41 +582,79 @@ js_appendItem(JSContext *cx, JSObject *obj, uintN argc,
   const char *url;
   const char *type = NULL;
   JSObject *metaobj = NULL;
+  JSObject *robj;
   js_model_t *model = JS_GetPrivate(cx, obj);
 
   if(!JS_ConvertArguments(cx, argc, argv, "s/so", &url, &type, &metaobj))
     return JS_FALSE;
 
-  prop_t *item = prop_create_root(NULL);
-  prop_set_string(prop_create(item, "url"), url);
+  js_model_maybe_flush_items(model);
 
-  *rval = JSVAL_VOID;
+  robj = js_item_create(cx, model, url, type, metaobj);
+  *rval = robj ? OBJECT_TO_JSVAL(robj) : JSVAL_VOID;
+  return JS_TRUE;
+}
 
-  if(type != NULL) {
-    prop_set_string(prop_create(item, "type"), type);
 
-    if(metaobj)
-      js_prop_from_object(cx, metaobj, prop_create(item, "metadata"), 0);
+/**
+ * appendItems([{url: ..., type: ..., metadata: {...}}, ...])
+ *
+ * Returns an array with the created item objects. Items that could
+ * not be resolved are undefined
+ */
+static JSBool 
+js_appendItems(JSContext *cx, JSObject *obj, uintN argc,
+	       jsval *argv, jsval *rval)
+{
+  js_model_t *model = JS_GetPrivate(cx, obj);
+  JSObject *arr, *res, *o, *robj;
+  jsval v, url, type, meta;
+  jsuint i, len;
 
-  } else {
+  if(!JS_ConvertArguments(cx, argc, argv, "o", &arr))
+    return JS_FALSE;
 
-    if(backend_resolve_item(url, item)) {
-      prop_destroy(item);
-      return JS_TRUE;
-    }
+  if(arr == NULL || !JS_IsArrayObject(cx, arr) ||
+     !JS_GetArrayLength(cx, arr, &len)) {
+    JS_ReportError(cx, "Argument is not an array");
+    return JS_FALSE;
   }
-  
-  if(prop_set_parent(item, model->jm_nodes)) {
-    prop_destroy(item);
-  } else {
-    JSObject *robj = JS_NewObjectWithGivenProto(cx, &item_class, NULL, NULL);
-    *rval =  OBJECT_TO_JSVAL(robj);
-    JS_DefineFunctions(cx, robj, item_functions);
-    js_item_t *ji = calloc(1, sizeof(js_item_t));
-    ji->ji_model = model;
-    ji->ji_root =  prop_ref_inc(item);
-    LIST_INSERT_HEAD(&model->jm_items, ji, ji_link);
-    JS_SetPrivate(cx, robj, ji);
+
+  js_model_maybe_flush_items(model);
+
+  res = JS_NewArrayObject(cx, 0, NULL);
+  *rval = OBJECT_TO_JSVAL(res);
+
+  for(i = 0; i < len; i++) {
+    if(!JS_GetElement(cx, arr, i, &v))
+      return JS_FALSE;
+
+    if(!JSVAL_IS_OBJECT(v) || JSVAL_IS_NULL(v)) {
+      JS_ReportError(cx, "Item %d is not an object", i);
+      return JS_FALSE;
+    }
+
+    o = JSVAL_TO_OBJECT(v);
+
+    if(!JS_GetProperty(cx, o, "url", &url) ||
+       !JS_GetProperty(cx, o, "type", &type) ||
+       !JS_GetProperty(cx, o, "metadata", &meta))
+      return JS_FALSE;
+
+    if(!JSVAL_IS_STRING(url)) {
+      JS_ReportError(cx, "Item %d has no url", i);
+      return JS_FALSE;
+    }
+
+    robj = js_item_create(cx, model, JS_GetStringBytes(JSVAL_TO_STRING(url)),
+			  JSVAL_IS_STRING(type) ?
+			  JS_GetStringBytes(JSVAL_TO_STRING(type)) : NULL,
+			  JSVAL_IS_OBJECT(meta) && !JSVAL_IS_NULL(meta) ?
+			  JSVAL_TO_OBJECT(meta) : NULL);
+
+    v = robj ? OBJECT_TO_JSVAL(robj) : JSVAL_VOID;
+    if(!JS_SetElement(cx, res, i, &v))
+      return JS_FALSE;
   }
   return JS_TRUE;
 }
@@ -521,6 +703,9 @@ js_appendModel(JSContext *cx, JSObject *obj, uintN argc,
   if(!JS_ConvertArguments(cx, argc, argv, "s/o", &type, &metaobj))
     return JS_FALSE;
 
+  // Keep order of items and models
+  js_model_flush_items(parent);
+
   item = prop_create_root(NULL);
 
   backend_prop_make(item, url, sizeof(url));
@@ -681,6 +866,7 @@ js_page_wfv(JSContext *cx, JSObject *obj, uintN argc,
  */
 static JSFunctionSpec model_functions[] = {
     JS_FS("appendItem",         js_appendItem,   1, 0, 0),
+    JS_FS("appendItems",        js_appendItems,  1, 0, 0),
     JS_FS("appendModel",        js_appendModel,  2, 0, 0),
     JS_FS_END
 };
@@ -757,8 +943,11 @@ js_model_nodesub(void *opaque, prop_event_t event, ...)
     break;
 
   case PROP_WANT_MORE_CHILDS:
-    if(js_model_fill(jm->jm_cx, jm))
+    if(js_model_fill(jm->jm_cx, jm)) {
+      // The new items must be in place before we ask for more
+      js_model_flush_items(jm);
       prop_have_more_childs(jm->jm_nodes);
+    }
     break;
   }
   va_end(ap);
@@ -880,33 +1069,125 @@ js_open_invoke(JSContext *cx, js_model_t *jm)
 
 
 
+/**
+ * Put model on run queue unless it's already there.
+ * js_model_mutex must be held
+ */
+static void
+js_model_schedule(js_model_t *jm)
+{
+  if(jm->jm_running) {
+    // Worker will requeue the model when it's done with it
+    jm->jm_pending = 1;
+    return;
+  }
+
+  if(jm->jm_queued)
+    return;
+
+  jm->jm_queued = 1;
+  TAILQ_INSERT_TAIL(&js_model_runq, jm, jm_run_link);
+
+  if(js_model_idle > 0) {
+    hts_cond_signal(&js_model_cond);
+  } else if(js_model_workers < JS_MODEL_WORKERS) {
+    js_model_workers++;
+    hts_thread_create_detached("jsmodel", js_model_worker, NULL,
+			       THREAD_PRIO_NORMAL);
+  }
+}
+
+
+/**
+ * Called from prop dispatch (with prop_mutex held) when there are
+ * notifications pending on the model's courier
+ */
+static void
+js_model_notify(void *opaque)
+{
+  js_model_t *jm = opaque;
+
+  hts_mutex_lock(&js_model_mutex);
+  js_model_schedule(jm);
+  hts_mutex_unlock(&js_model_mutex);
+}
+
+
+/**
+ * Invoke open function or dispatch pending notifications
+ */
+static void
+js_model_run(JSContext *cx, js_model_t *jm)
+{
+  JS_BeginRequest(cx);
+  jm->jm_cx = cx;
+  JS_SetContextPrivate(cx, jm);
+
+  if(!jm->jm_opened) {
+    jm->jm_opened = 1;
+    js_open_invoke(cx, jm);
+  } else {
+    prop_courier_poll(jm->jm_pc);
+  }
+
+  js_model_flush_items(jm);
+
+  // Whatever the open function produced is out now
+  if(jm->jm_sq != NULL) {
+    backend_search_done(jm->jm_sq);
+    jm->jm_sq = NULL;
+  }
+
+  JS_SetContextPrivate(cx, NULL);
+  JS_ClearPendingException(cx);
+  JS_MaybeGC(cx);
+  JS_EndRequest(cx);
+}
+
+
 /**
  *
  */
 static void *
-js_open_trampoline(void *arg)
+js_model_worker(void *aux)
 {
-  js_model_t *jm = arg;
-  
   JSContext *cx = js_newctx();
-  JS_BeginRequest(cx);
+  js_model_t *jm;
 
-  js_open_invoke(cx, jm);
+  hts_mutex_lock(&js_model_mutex);
 
-  jm->jm_cx = cx;
+  while(1) {
 
-  while(jm->jm_subs) {
-    struct prop_notify_queue exp, nor;
-    jsrefcount s = JS_SuspendRequest(cx);
-    prop_courier_wait(jm->jm_pc, &nor, &exp);
-    JS_ResumeRequest(cx, s);
-    prop_notify_dispatch(&exp);
-    prop_notify_dispatch(&nor);
+    if((jm = TAILQ_FIRST(&js_model_runq)) == NULL) {
+      js_model_idle++;
+      hts_cond_wait(&js_model_cond, &js_model_mutex);
+      js_model_idle--;
+      continue;
+    }
 
-  }
-  js_model_release(jm);
+    TAILQ_REMOVE(&js_model_runq, jm, jm_run_link);
+    jm->jm_queued = 0;
+    jm->jm_running = 1;
+    jm->jm_pending = 0;
+    hts_mutex_unlock(&js_model_mutex);
+
+    js_model_run(cx, jm);
+
+    if(jm->jm_subs == 0) {
+      /*
+       * Nothing can notify us anymore, so the model is left flagged
+       * as running. The remaining references are held by JS objects
+       */
+      js_model_release(jm);
+      hts_mutex_lock(&js_model_mutex);
+      continue;
+    }
 
-  JS_DestroyContext(cx);
+    hts_mutex_lock(&js_model_mutex);
+    jm->jm_running = 0;
+    if(jm->jm_pending)
+      js_model_schedule(jm);
+  }
   return NULL;
 }
 
@@ -917,11 +1198,24 @@ js_open_trampoline(void *arg)
 static void
 model_launch(js_model_t *jm)
 {
-  jm->jm_pc = prop_courier_create_waitable();
-
-  hts_thread_create_detached("jsmodel", js_open_trampoline, jm,
-			     THREAD_PRIO_NORMAL);
+  jm->jm_pc = prop_courier_create_notify(js_model_notify, jm);
   prop_set_int(jm->jm_loading, 1);
+
+  hts_mutex_lock(&js_model_mutex);
+  js_model_schedule(jm);
+  hts_mutex_unlock(&js_model_mutex);
+}
+
+
+/**
+ *
+ */
+void
+js_page_init(void)
+{
+  hts_mutex_init(&js_model_mutex);
+  hts_cond_init(&js_model_cond, &js_model_mutex);
+  TAILQ_INIT(&js_model_runq);
 }
 
 /**
@@ -969,7 +1263,8 @@ js_backend_open(prop_t *page, const char *url)
  *
  */
 void
-js_backend_search(struct prop *model, const char *query)
+js_backend_search(struct prop *model, const char *query,
+		  struct search_query *sq)
 {
   js_searcher_t *jss;
   prop_t *parent = prop_create(model, "nodes");
@@ -985,6 +1280,9 @@ js_backend_search(struct prop *model, const char *query)
     search_class_create(parent, &jm->jm_nodes, &jm->jm_entries, 
 			jss->jss_title, jss->jss_icon);
 
+    jm->jm_sq = sq;
+    backend_search_hold(sq);
+
     model_launch(jm);
   }
 }
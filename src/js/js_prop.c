@@ -181,6 +181,7 @@ js_wait_for_value(JSContext *cx, prop_t *root, const char *subname,
   while(!wfv.done) {
 
     struct prop_notify_queue exp, nor;
+    js_page_flush_items(cx);
     jsrefcount s = JS_SuspendRequest(cx);
     prop_courier_wait(pc, &nor, &exp);
     JS_ResumeRequest(cx, s);
@@ -31,6 +31,7 @@
 #include "arch/arch.h"
 
 #include "audio/audio_defs.h"
+#include "audio/audio_mix.h"
 #include "backend/backend.h"
 #include "navigator.h"
 #include "settings.h"
@@ -49,6 +50,7 @@
 #include "blobcache.h"
 #include "i18n.h"
 #include "misc/string.h"
+#include "video/video_timing.h"
 
 #if ENABLE_HTTPSERVER
 #include "networking/http_server.h"
@@ -200,6 +202,7 @@ main(int argc, char **argv)
 #if ENABLE_SERDEV
 	     "   --serdev          - Probe service ports for devices.\n"
 #endif
+	     "   --audio-mix-bench - Time audio mixing kernels and exit.\n"
 	     "\n"
 	     "  URL is any URL-type supported by Showtime, "
 	     "e.g., \"file:///...\"\n"
@@ -233,6 +236,8 @@ main(int argc, char **argv)
       argc -= 1; argv += 1;
       continue;
 #endif
+    } else if(!strcmp(argv[0], "--audio-mix-bench")) {
+      exit(audio_mix_bench() ? 1 : 0);
     } else if(!strcmp(argv[0], "--with-standby")) {
       can_standby = 1;
       argc -= 1; argv += 1;
@@ -325,6 +330,9 @@ main(int argc, char **argv)
   /* Initialize media subsystem */
   media_init();
 
+  /* Video frame timing telemetry */
+  video_timing_init();
+
   /* Service handling */
   service_init();
 
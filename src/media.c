@@ -271,6 +271,7 @@ mp_destroy(media_pipe_t *mp)
   hts_mutex_destroy(&mp->mp_mutex);
   hts_mutex_destroy(&mp->mp_clock_mutex);
 
+  free(mp->mp_preroll_url);
   free(mp);
 }
 
@@ -1214,6 +1215,35 @@ mp_set_url(media_pipe_t *mp, const char *url)
   prop_set_string(mp->mp_prop_url, url);
 }
 
+
+/**
+ * Set URL of the entry that will be played after the current one.
+ * Backends may use this to open it ahead of time
+ */
+void
+mp_set_preroll_url(media_pipe_t *mp, const char *url)
+{
+  hts_mutex_lock(&mp->mp_mutex);
+  free(mp->mp_preroll_url);
+  mp->mp_preroll_url = url != NULL ? strdup(url) : NULL;
+  hts_mutex_unlock(&mp->mp_mutex);
+}
+
+
+/**
+ * Returns a copy that must be free'd by caller
+ */
+char *
+mp_get_preroll_url(media_pipe_t *mp)
+{
+  char *r;
+
+  hts_mutex_lock(&mp->mp_mutex);
+  r = mp->mp_preroll_url != NULL ? strdup(mp->mp_preroll_url) : NULL;
+  hts_mutex_unlock(&mp->mp_mutex);
+  return r;
+}
+
 /**
  *
  */
@@ -244,6 +244,8 @@ typedef struct media_pipe {
 
   struct vdpau_dev *mp_vdpau_dev;
 
+  char *mp_preroll_url; // URL expected to be played next, for preroll
+
 } media_pipe_t;
 
 
@@ -348,6 +350,10 @@ void mp_set_playstatus_stop(media_pipe_t *mp);
 
 void mp_set_url(media_pipe_t *mp, const char *url);
 
+void mp_set_preroll_url(media_pipe_t *mp, const char *url);
+
+char *mp_get_preroll_url(media_pipe_t *mp);
+
 #define MP_PLAY_CAPS_SEEK 0x1
 #define MP_PLAY_CAPS_PAUSE 0x2
 #define MP_PLAY_CAPS_EJECT 0x4
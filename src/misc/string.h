@@ -42,6 +42,8 @@ int hex2bin(uint8_t *buf, size_t buflen, const char *str);
 
 void unicode_init(void);
 
+int unicode_casefold(unsigned int i);
+
 char *utf8_from_ISO_8859_1(const char *str, int len);
 
 char *url_resolve_relative(const char *proto, const char *hostname, int port,
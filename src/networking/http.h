@@ -32,6 +32,7 @@ typedef enum {
 
 
 #define HTTP_STATUS_OK           200
+#define HTTP_STATUS_PARTIAL_CONTENT 206
 #define HTTP_STATUS_FOUND        302
 #define HTTP_STATUS_BAD_REQUEST  400
 #define HTTP_STATUS_UNAUTHORIZED 401
@@ -39,6 +40,7 @@ typedef enum {
 #define HTTP_STATUS_METHOD_NOT_ALLOWED 405
 #define HTTP_STATUS_PRECONDITION_FAILED 412
 #define HTTP_STATUS_UNSUPPORTED_MEDIA_TYPE 415
+#define HTTP_STATUS_RANGE_NOT_SATISFIABLE 416
 
 
 LIST_HEAD(http_header_list, http_header);
@@ -20,6 +20,7 @@
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <poll.h>
@@ -29,14 +30,51 @@
 
 #if ENABLE_POSIX_NETWORKING
 #include <netinet/tcp.h>  // for TCP_ defines
+#include <sys/uio.h>
+#endif
+
+#if ENABLE_EPOLL
+#include <sys/epoll.h>
+#endif
+
+#if ENABLE_SENDFILE
+#include <sys/sendfile.h>
+#include <signal.h>
 #endif
 
 #include "http.h"
 #include "http_server.h"
+#include "fileaccess/fileaccess.h"
+
+/**
+ * Number of threads executing request handlers. All socket I/O and
+ * request parsing is done on the server thread
+ */
+#define HTTP_WORKERS 4
+
+/**
+ * Max number of buffers passed to each writev()
+ */
+#define HTTP_MAX_IOV 16
+
+/**
+ * Max number of bytes a worker may have queued for a connection
+ * before it is blocked when streaming a reply
+ */
+#define HTTP_STREAM_MAX (256 * 1024)
+
+/**
+ * Size of each read from a fileaccess handle sent with http_send_fh().
+ * The next read is started when less than this is left to write
+ */
+#define HTTP_FH_CHUNK (64 * 1024)
 
 int http_server_port;
 static LIST_HEAD(, http_path) http_paths;
 LIST_HEAD(http_connection_list, http_connection); 
+TAILQ_HEAD(http_connection_queue, http_connection); 
+
+struct http_server;
 
 /**
  *
@@ -44,9 +82,58 @@ LIST_HEAD(http_connection_list, http_connection);
 struct http_connection {
   
   LIST_ENTRY(http_connection) hc_link;
+  struct http_server *hc_server;
   int hc_fd;
   int hc_events;
 
+  /**
+   * A connection is busy while its request is being handled by a
+   * worker. During that time the worker owns the request fields and
+   * hc_reply, everything else is only ever touched by the server
+   * thread. Pipelined requests are left in hc_input until the
+   * connection is no longer busy so replies are sent in order
+   */
+  TAILQ_ENTRY(http_connection) hc_work_link;
+  char hc_busy;
+  char hc_zombie;   // Connection failed while busy, close when done
+  char hc_linger;   // Close once hc_output has been written
+
+  struct http_path *hc_path;
+  char *hc_remain;
+  http_cmd_t hc_method;
+
+  /**
+   * Reply body sent from a local file by the server thread once
+   * hc_output has been written. Or, if hc_file_fh is set, read from a
+   * fileaccess handle by a worker, one HTTP_FH_CHUNK at a time, as the
+   * client drains the output. hc_file_remain is -1 if the size is not
+   * known, in which case we read until EOF
+   */
+  int hc_file_fd;
+  struct fa_handle *hc_file_fh;
+  int64_t hc_file_offset;
+  int64_t hc_file_remain;
+
+  /**
+   * Reply data streamed by a worker. hc_stream and hc_stream_pending
+   * are protected by hs_mutex. hc_stream_pending is the number of
+   * bytes handed over but not yet written to the socket
+   */
+  TAILQ_ENTRY(http_connection) hc_flush_link;
+  htsbuf_queue_t hc_stream;
+  int hc_stream_pending;
+  char hc_stream_queued;
+  char hc_chunked;
+
+  /**
+   * Streamed replies. Protected by hs_mutex. The connection is handed
+   * back to the server thread by whoever comes last of the worker
+   * returning from the handler and http_stream_end()
+   */
+  char hc_detached;    // Reply is being sent by http_stream_send()
+  char hc_stream_done; // http_stream_end() has been called
+  char hc_exec_done;   // Handler has returned
+
   int hc_state;
 #define HCS_COMMAND 0
 #define HCS_HEADERS 1
@@ -58,6 +145,7 @@ struct http_connection {
 
   htsbuf_queue_t hc_input;
   htsbuf_queue_t hc_output;
+  htsbuf_queue_t hc_reply;
 
   http_cmd_t hc_cmd;
 
@@ -121,11 +209,28 @@ typedef struct http_server {
   int hs_numcon;
   int hs_fd;
 
+#if ENABLE_EPOLL
+  int hs_epfd;
+#else
   int hs_fds_size;
   struct pollfd *hs_fds;
+#endif
 
   struct http_connection_list hs_connections;
 
+  /**
+   * Workers pick connections from hs_work and put them back on
+   * hs_done when the handler has returned. The server thread is woken
+   * up via hs_pipe to pick up the replies
+   */
+  hts_mutex_t hs_mutex;
+  hts_cond_t hs_work_cond;
+  struct http_connection_queue hs_work;
+  struct http_connection_queue hs_done;
+  struct http_connection_queue hs_flush;
+  hts_cond_t hs_stream_cond;
+  int hs_pipe[2];
+
 } http_server_t;
 
 
@@ -224,6 +329,7 @@ http_rc2str(int code)
 {
   switch(code) {
   case HTTP_STATUS_OK:              return "Ok";
+  case HTTP_STATUS_PARTIAL_CONTENT: return "Partial content";
   case HTTP_STATUS_NOT_FOUND:       return "Not found";
   case HTTP_STATUS_UNAUTHORIZED:    return "Unauthorized";
   case HTTP_STATUS_BAD_REQUEST:     return "Bad request";
@@ -231,6 +337,7 @@ http_rc2str(int code)
   case HTTP_STATUS_METHOD_NOT_ALLOWED: return "Method not allowed";
   case HTTP_STATUS_PRECONDITION_FAILED: return "Precondition failed";
   case HTTP_STATUS_UNSUPPORTED_MEDIA_TYPE: return "Unsupported media type";
+  case HTTP_STATUS_RANGE_NOT_SATISFIABLE: return "Range not satisfiable";
   default:
     return "Unknown returncode";
     break;
@@ -240,11 +347,14 @@ http_rc2str(int code)
 
 /**
  * Transmit a HTTP reply
+ *
+ * If 'contentlen' is -1 the body is sent using chunked transfer
+ * encoding, or delimited by closing the connection for HTTP/1.0
  */
 static void
 http_send_header(http_connection_t *hc, int rc, const char *content, 
-		 int contentlen, const char *encoding, const char *location, 
-		 int maxage, const char *range)
+		 int64_t contentlen, const char *encoding,
+		 const char *location, int maxage, const char *range)
 {
   struct tm tm0, *tm;
   htsbuf_queue_t hdrs;
@@ -293,6 +403,11 @@ http_send_header(http_connection_t *hc, int rc, const char *content,
     htsbuf_qprintf(&hdrs, "Cache-Control: max-age=%d\r\n", maxage);
   }
 
+  if(contentlen == -1 && hc->hc_version == HTTP_VERSION_1_0)
+    hc->hc_keep_alive = 0;
+
+  hc->hc_chunked = contentlen == -1 && hc->hc_version == HTTP_VERSION_1_1;
+
   htsbuf_qprintf(&hdrs, "Connection: %s\r\n", 
 		 hc->hc_keep_alive ? "Keep-Alive" : "Close");
 
@@ -305,14 +420,20 @@ http_send_header(http_connection_t *hc, int rc, const char *content,
   if(content != NULL)
     htsbuf_qprintf(&hdrs, "Content-Type: %s\r\n", content);
 
-  htsbuf_qprintf(&hdrs, "Content-Length: %d\r\n", contentlen);
+  if(range != NULL)
+    htsbuf_qprintf(&hdrs, "Content-Range: %s\r\n", range);
+
+  if(contentlen != -1)
+    htsbuf_qprintf(&hdrs, "Content-Length: %"PRId64"\r\n", contentlen);
+  else if(hc->hc_version == HTTP_VERSION_1_1)
+    htsbuf_qprintf(&hdrs, "Transfer-Encoding: chunked\r\n");
 
   LIST_FOREACH(hh, &hc->hc_response_headers, hh_link)
     htsbuf_qprintf(&hdrs, "%s: %s\r\n", hh->hh_key, hh->hh_value);
   
   htsbuf_qprintf(&hdrs, "\r\n");
   
-  htsbuf_appendq(&hc->hc_output, &hdrs);
+  htsbuf_appendq(&hc->hc_reply, &hdrs);
 }
 
 
@@ -326,18 +447,373 @@ http_send_reply(http_connection_t *hc, int rc, const char *content,
 {
 
   http_send_header(hc, rc ?: 200, content, output ? output->hq_size : 0,
-		   encoding, location, maxage, 0);
+		   encoding, location, maxage, NULL);
 
   if(output != NULL) {
     if(hc->hc_no_output)
       htsbuf_queue_flush(output);
     else
-      htsbuf_appendq(&hc->hc_output, output);
+      htsbuf_appendq(&hc->hc_reply, output);
+  }
+  return 0;
+}
+
+
+/**
+ * Parse a single "bytes=" range and figure out which part of a
+ * 'size' bytes large body to send. Returns the HTTP status code
+ */
+static int
+http_parse_range(http_connection_t *hc, int64_t size,
+		 int64_t *startp, int64_t *lenp, char *crange, size_t crangelen)
+{
+  const char *r = http_header_get(&hc->hc_request_headers, "Range");
+  int64_t start, end;
+  char *e;
+
+  *startp = 0;
+  *lenp = size;
+
+  if(r == NULL || strncmp(r, "bytes=", 6) || strchr(r, ',') != NULL)
+    return HTTP_STATUS_OK; // Multiple ranges are not supported
+
+  r += 6;
+  if(*r == '-') {
+    // Suffix range, ie. last N bytes
+    end = strtoll(r + 1, &e, 10);
+    if(*e || end <= 0)
+      goto bad;
+    start = end > size ? 0 : size - end;
+    end = size - 1;
+  } else {
+    start = strtoll(r, &e, 10);
+    if(*e != '-')
+      goto bad;
+    if(e[1] == 0) {
+      end = size - 1;
+    } else {
+      end = strtoll(e + 1, &e, 10);
+      if(*e || end < start)
+	goto bad;
+      if(end >= size)
+	end = size - 1;
+    }
+  }
+
+  if(start >= size)
+    goto bad;
+
+  *startp = start;
+  *lenp = end - start + 1;
+  snprintf(crange, crangelen, "bytes %"PRId64"-%"PRId64"/%"PRId64,
+	   start, end, size);
+  return HTTP_STATUS_PARTIAL_CONTENT;
+
+ bad:
+  snprintf(crange, crangelen, "bytes */%"PRId64, size);
+  return HTTP_STATUS_RANGE_NOT_SATISFIABLE;
+}
+
+
+/**
+ * Send HTTP reply with body read from a local file descriptor, from
+ * its current position to the end of the file.
+ *
+ * The file is sent by the server thread (using sendfile(2) where
+ * available) once the header has been written. Byte range requests
+ * are handled. The file descriptor is always consumed
+ */
+int
+http_send_fd(http_connection_t *hc, int fd, const char *content, int maxage)
+{
+  struct stat st;
+  int64_t start, len;
+  off_t base;
+  char crange[100];
+  int rc;
+
+  if(fstat(fd, &st) || (base = lseek(fd, 0, SEEK_CUR)) == -1) {
+    close(fd);
+    return http_error(hc, HTTP_STATUS_NOT_FOUND, "%s", strerror(errno));
+  }
+
+  http_set_response_hdr(hc, "Accept-Ranges", "bytes");
+
+  rc = http_parse_range(hc, st.st_size - base, &start, &len,
+			crange, sizeof(crange));
+  if(rc == HTTP_STATUS_RANGE_NOT_SATISFIABLE) {
+    close(fd);
+    http_send_header(hc, rc, NULL, 0, NULL, NULL, 0, crange);
+    return 0;
+  }
+
+  http_send_header(hc, rc, content, len, NULL, NULL, maxage,
+		   rc == HTTP_STATUS_PARTIAL_CONTENT ? crange : NULL);
+
+  if(hc->hc_no_output || len == 0) {
+    close(fd);
+    return 0;
+  }
+
+  hc->hc_file_fd = fd;
+  hc->hc_file_offset = base + start;
+  hc->hc_file_remain = len;
+  return 0;
+}
+
+
+/**
+ * Wake up server thread unless it already has been.
+ * hs_mutex must be held
+ */
+static void
+http_wakeup(http_server_t *hs)
+{
+  char c = 0;
+
+  if(TAILQ_FIRST(&hs->hs_flush) != NULL || TAILQ_FIRST(&hs->hs_done) != NULL)
+    return;
+
+  if(write(hs->hs_pipe[1], &c, 1) != 1)
+    TRACE(TRACE_ERROR, "HTTPSRV", "Unable to wakeup server thread");
+}
+
+
+/**
+ * Hand over data streamed from a worker (or other thread) to the
+ * server thread. The queue is always consumed.
+ *
+ * 'block' decides what to do if too much data is pending:
+ *   1 - Wait for the server thread to write it
+ *   0 - Return 1 without queueing anything
+ *  -1 - Queue it anyway
+ *
+ * Returns -1 if the connection has been closed
+ */
+static int
+http_stream_queue(http_connection_t *hc, htsbuf_queue_t *q, int block)
+{
+  http_server_t *hs = hc->hc_server;
+
+  hts_mutex_lock(&hs->hs_mutex);
+
+  while(block == 1 && !hc->hc_zombie &&
+	hc->hc_stream_pending > HTTP_STREAM_MAX)
+    hts_cond_wait(&hs->hs_stream_cond, &hs->hs_mutex);
+
+  if(hc->hc_zombie || (block == 0 && hc->hc_stream_pending > HTTP_STREAM_MAX)) {
+    hts_mutex_unlock(&hs->hs_mutex);
+    htsbuf_queue_flush(q);
+    return hc->hc_zombie ? -1 : 1;
+  }
+
+  // Header must go first
+  hc->hc_stream_pending += hc->hc_reply.hq_size + q->hq_size;
+  htsbuf_appendq(&hc->hc_stream, &hc->hc_reply);
+  htsbuf_appendq(&hc->hc_stream, q);
+
+  if(!hc->hc_stream_queued) {
+    hc->hc_stream_queued = 1;
+    http_wakeup(hs);
+    TAILQ_INSERT_TAIL(&hs->hs_flush, hc, hc_flush_link);
+  }
+  hts_mutex_unlock(&hs->hs_mutex);
+  return 0;
+}
+
+
+/**
+ * Append a piece of the reply body, as a chunk if chunked transfer
+ * encoding is used
+ */
+static void
+http_append_chunk(http_connection_t *hc, htsbuf_queue_t *q,
+		  const void *data, size_t len)
+{
+  if(hc->hc_chunked) {
+    htsbuf_qprintf(q, "%x\r\n", (int)len);
+    htsbuf_append(q, data, len);
+    htsbuf_append(q, "\r\n", 2);
+  } else {
+    htsbuf_append(q, data, len);
+  }
+}
+
+
+/**
+ * Stream a piece of the reply body
+ */
+static int
+http_stream_chunk(http_connection_t *hc, const void *data, size_t len,
+		  int block)
+{
+  htsbuf_queue_t q;
+
+  htsbuf_queue_init(&q, 0);
+  http_append_chunk(hc, &q, data, len);
+  return http_stream_queue(hc, &q, block);
+}
+
+
+/**
+ * Reply has been produced, hand connection back to the server thread.
+ * hs_mutex must be held
+ */
+static void
+http_request_finished(http_connection_t *hc)
+{
+  http_server_t *hs = hc->hc_server;
+
+  http_wakeup(hs);
+  hc->hc_detached = 0;
+  hc->hc_stream_done = 0;
+  hc->hc_exec_done = 0;
+  TAILQ_INSERT_TAIL(&hs->hs_done, hc, hc_work_link);
+}
+
+
+/**
+ * Start a reply of unknown length that will be sent incrementally
+ * from any thread using http_stream_send(). The connection is held
+ * until http_stream_end() is called
+ */
+int
+http_stream_begin(http_connection_t *hc, int rc, const char *content)
+{
+  htsbuf_queue_t q;
+
+  http_send_header(hc, rc ?: HTTP_STATUS_OK, content, -1, NULL, NULL, 0, NULL);
+
+  hts_mutex_lock(&hc->hc_server->hs_mutex);
+  hc->hc_detached = 1;
+  hts_mutex_unlock(&hc->hc_server->hs_mutex);
+
+  // Push out the header right away
+  htsbuf_queue_init(&q, 0);
+  return http_stream_queue(hc, &q, -1);
+}
+
+
+/**
+ * Returns 0 if data was queued, 1 if 'nonblock' is set and too much
+ * data is already pending or -1 if the connection is gone, in which
+ * case http_stream_end() should be called as soon as possible
+ */
+int
+http_stream_send(http_connection_t *hc, const void *data, size_t len,
+		 int nonblock)
+{
+  if(hc->hc_no_output || len == 0)
+    return hc->hc_zombie ? -1 : 0;
+  return http_stream_chunk(hc, data, len, !nonblock);
+}
+
+
+/**
+ * Mark streamed reply as complete. If the handler that started it
+ * has already returned the connection is handed back here, otherwise
+ * that is done by the worker once it does. 'hc' must not be touched
+ * after this
+ */
+void
+http_stream_end(http_connection_t *hc)
+{
+  http_server_t *hs = hc->hc_server;
+
+  if(hc->hc_chunked && !hc->hc_no_output) {
+    htsbuf_queue_t q;
+    htsbuf_queue_init(&q, 0);
+    htsbuf_append(&q, "0\r\n\r\n", 5);
+    http_stream_queue(hc, &q, -1);
   }
+
+  hts_mutex_lock(&hs->hs_mutex);
+  hc->hc_stream_done = 1;
+  if(hc->hc_exec_done)
+    http_request_finished(hc);
+  hts_mutex_unlock(&hs->hs_mutex);
+}
+
+
+/**
+ * Send HTTP reply with body read from a fileaccess handle.
+ *
+ * If the size of the file is known byte range requests are handled,
+ * otherwise chunked encoding is used. The data is read by the workers
+ * in HTTP_FH_CHUNK pieces, started by the server thread as the client
+ * drains the output, so a slow client never holds a worker. The
+ * handle is always closed
+ */
+int
+http_send_fh(http_connection_t *hc, fa_handle_t *fh, const char *content,
+	     int maxage)
+{
+  int64_t size = fa_fsize(fh), start = 0, len = -1;
+  int rc = HTTP_STATUS_OK;
+  char crange[100];
+
+  if(size >= 0) {
+    http_set_response_hdr(hc, "Accept-Ranges", "bytes");
+    rc = http_parse_range(hc, size, &start, &len, crange, sizeof(crange));
+
+    if(rc == HTTP_STATUS_RANGE_NOT_SATISFIABLE) {
+      fa_close(fh);
+      http_send_header(hc, rc, NULL, 0, NULL, NULL, 0, crange);
+      return 0;
+    }
+
+    if(start > 0 && fa_seek(fh, start, SEEK_SET) != start) {
+      fa_close(fh);
+      return http_error(hc, HTTP_STATUS_NOT_FOUND, "Unable to seek");
+    }
+  }
+
+  http_send_header(hc, rc, content, len, NULL, NULL, maxage,
+		   rc == HTTP_STATUS_PARTIAL_CONTENT ? crange : NULL);
+
+  if(hc->hc_no_output || len == 0) {
+    fa_close(fh);
+    return 0;
+  }
+
+  hc->hc_file_fh = fh;
+  hc->hc_file_remain = len;
   return 0;
 }
 
 
+/**
+ * Read the next piece of a http_send_fh() reply. Runs on a worker
+ */
+static void
+http_fh_read(http_connection_t *hc)
+{
+  char *buf = malloc(HTTP_FH_CHUNK);
+  int r;
+
+  r = fa_read(hc->hc_file_fh, buf, hc->hc_file_remain >= 0 &&
+	      hc->hc_file_remain < HTTP_FH_CHUNK ?
+	      hc->hc_file_remain : HTTP_FH_CHUNK);
+
+  if(r > 0) {
+    http_append_chunk(hc, &hc->hc_reply, buf, r);
+    if(hc->hc_file_remain > 0)
+      hc->hc_file_remain -= r;
+  }
+
+  if(r <= 0 || hc->hc_file_remain == 0) {
+    if(hc->hc_file_remain > 0)
+      hc->hc_keep_alive = 0; // Short read, client must detect it
+    else if(hc->hc_chunked)
+      htsbuf_append(&hc->hc_reply, "0\r\n\r\n", 5);
+
+    fa_close(hc->hc_file_fh);
+    hc->hc_file_fh = NULL;
+  }
+  free(buf);
+}
+
+
 /**
  * Send HTTP error back
  */
@@ -426,6 +902,84 @@ http_exec(http_connection_t *hc, http_path_t *hp, char *remain,
 }
 
 
+/**
+ * Move reply produced by the request to the output queue
+ */
+static void
+http_request_done(http_connection_t *hc)
+{
+  htsbuf_appendq(&hc->hc_output, &hc->hc_stream);
+  hc->hc_stream_pending = 0;
+  htsbuf_appendq(&hc->hc_output, &hc->hc_reply);
+  if(!hc->hc_keep_alive)
+    hc->hc_linger = 1;
+}
+
+
+/**
+ * Hand over request to the worker threads
+ */
+static void
+http_dispatch(http_connection_t *hc, http_path_t *hp, char *remain,
+	      http_cmd_t method)
+{
+  http_server_t *hs = hc->hc_server;
+
+  hc->hc_path = hp;
+  hc->hc_remain = remain;
+  hc->hc_method = method;
+  hc->hc_busy = 1;
+
+  hts_mutex_lock(&hs->hs_mutex);
+  TAILQ_INSERT_TAIL(&hs->hs_work, hc, hc_work_link);
+  hts_cond_signal(&hs->hs_work_cond);
+  hts_mutex_unlock(&hs->hs_mutex);
+}
+
+
+/**
+ * Have a worker read the next piece of a http_send_fh() body
+ */
+static void
+http_dispatch_fh_read(http_connection_t *hc)
+{
+  http_dispatch(hc, NULL, NULL, 0);
+}
+
+
+/**
+ *
+ */
+static void *
+http_worker(void *aux)
+{
+  http_server_t *hs = aux;
+  http_connection_t *hc;
+
+  hts_mutex_lock(&hs->hs_mutex);
+  while(1) {
+    if((hc = TAILQ_FIRST(&hs->hs_work)) == NULL) {
+      hts_cond_wait(&hs->hs_work_cond, &hs->hs_mutex);
+      continue;
+    }
+    TAILQ_REMOVE(&hs->hs_work, hc, hc_work_link);
+    hts_mutex_unlock(&hs->hs_mutex);
+
+    if(hc->hc_path == NULL)
+      http_fh_read(hc);
+    else
+      http_exec(hc, hc->hc_path, hc->hc_remain, hc->hc_method);
+
+    hts_mutex_lock(&hs->hs_mutex);
+    // Detached replies are finished by http_stream_end() unless done
+    hc->hc_exec_done = 1;
+    if(!hc->hc_detached || hc->hc_stream_done)
+      http_request_finished(hc);
+  }
+  return NULL;
+}
+
+
 /**
  * De-escape HTTP URL
  */
@@ -577,13 +1131,14 @@ http_cmd_get(http_connection_t *hc, http_cmd_t method)
   hp = http_resolve(hc, &remain, &args);
   if(hp == NULL) {
     http_error(hc, HTTP_STATUS_NOT_FOUND, NULL);
+    http_request_done(hc);
     return 0;
   }
 
   if(args != NULL)
     http_parse_get_args(hc, args);
 
-  http_exec(hc, hp, remain, method);
+  http_dispatch(hc, hp, remain, method);
   return 0;
 }
 
@@ -618,11 +1173,13 @@ http_read_post(http_connection_t *hc)
   v = mystrdupa(http_header_get(&hc->hc_request_headers, "Content-Type"));
   if(v == NULL) {
     http_error(hc, HTTP_STATUS_BAD_REQUEST, "Content-Type missing");
+    http_request_done(hc);
     return 0;
   }
   n = http_tokenize(v, argv, 2, ';');
   if(n == 0) {
     http_error(hc, HTTP_STATUS_BAD_REQUEST, "Content-Type malformed");
+    http_request_done(hc);
     return 0;
   }
 
@@ -632,9 +1189,10 @@ http_read_post(http_connection_t *hc)
   hp = http_resolve(hc, &remain, &args);
   if(hp == NULL) {
     http_error(hc, HTTP_STATUS_NOT_FOUND, NULL);
+    http_request_done(hc);
     return 0;
   }
-  http_exec(hc, hp, remain, HTTP_CMD_POST);
+  http_dispatch(hc, hp, remain, HTTP_CMD_POST);
   return 0;
 }
 
@@ -748,6 +1306,10 @@ http_handle_input(http_connection_t *hc)
 
   while(1) {
 
+    if(hc->hc_busy || hc->hc_linger || hc->hc_file_fd != -1 ||
+       hc->hc_file_fh != NULL)
+      return 0;
+
     switch(hc->hc_state) {
     case HCS_COMMAND:
       free(hc->hc_post_data);
@@ -816,36 +1378,165 @@ http_handle_input(http_connection_t *hc)
 static int
 http_write(http_connection_t *hc)
 {
+  htsbuf_queue_t *q = &hc->hc_output;
   htsbuf_data_t *hd;
-  int l, r = 0;
+  ssize_t r;
+  size_t len;
+#if ENABLE_POSIX_NETWORKING
+  struct iovec iov[HTTP_MAX_IOV];
+  int i;
+#endif
 
-  htsbuf_queue_t *q = &hc->hc_output;
-  
   while((hd = TAILQ_FIRST(&q->hq_q)) != NULL) {
 
-    l = hd->hd_data_len - hd->hd_data_off;
-    r = write(hc->hc_fd, hd->hd_data + hd->hd_data_off, l);
+#if ENABLE_POSIX_NETWORKING
+    len = 0;
+    i = 0;
+    TAILQ_FOREACH(hd, &q->hq_q, hd_link) {
+      iov[i].iov_base = hd->hd_data     + hd->hd_data_off;
+      iov[i].iov_len  = hd->hd_data_len - hd->hd_data_off;
+      len += iov[i].iov_len;
+      if(++i == HTTP_MAX_IOV)
+	break;
+    }
+#ifdef MSG_NOSIGNAL
+    struct msghdr msg = {0};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = i;
+    r = sendmsg(hc->hc_fd, &msg, MSG_NOSIGNAL);
+#else
+    r = writev(hc->hc_fd, iov, i);
+#endif
+#else
+    len = hd->hd_data_len - hd->hd_data_off;
+    r = write(hc->hc_fd, hd->hd_data + hd->hd_data_off, len);
+#endif
 
     if(r == -1 && (errno == EWOULDBLOCK || errno == EAGAIN))
-      r = 0;
+      return 0;
 
     if(r == -1)
       return -1;
 
-    q->hq_size -= r;
+    htsbuf_drop(q, r);
 
-    if(r != l) {
-      // Failed to write it all
-      hd->hd_data_off += r;
-      hc->hc_events |= POLLOUT;
+    if(r != len)
+      return 0; // Failed to write it all
+  }
+  return 0;
+}
+
+
+/**
+ * Send (part of) file body once everything else has been written
+ */
+static int
+http_write_file(http_connection_t *hc)
+{
+  ssize_t r;
+
+  while(hc->hc_file_remain > 0) {
+
+#if ENABLE_SENDFILE
+    off_t off = hc->hc_file_offset;
+    r = sendfile(hc->hc_fd, hc->hc_file_fd, &off,
+		 hc->hc_file_remain > 1024 * 1024 ?
+		 1024 * 1024 : hc->hc_file_remain);
+#else
+    char buf[16384];
+    r = pread(hc->hc_file_fd, buf,
+	      hc->hc_file_remain > sizeof(buf) ?
+	      sizeof(buf) : hc->hc_file_remain, hc->hc_file_offset);
+    if(r > 0)
+#ifdef MSG_NOSIGNAL
+      r = send(hc->hc_fd, buf, r, MSG_NOSIGNAL);
+#else
+      r = write(hc->hc_fd, buf, r);
+#endif
+#endif
+
+    if(r == -1 && (errno == EWOULDBLOCK || errno == EAGAIN))
       return 0;
-    }
 
-    TAILQ_REMOVE(&q->hq_q, hd, hd_link);
-    free(hd->hd_data);
-    free(hd);
+    if(r <= 0)
+      return -1; // Error or file truncated underneath us
+
+    hc->hc_file_offset += r;
+    hc->hc_file_remain -= r;
   }
-  hc->hc_events &= ~POLLOUT;
+
+  close(hc->hc_file_fd);
+  hc->hc_file_fd = -1;
+  return 0;
+}
+
+
+/**
+ * Update the set of events we wait for on the connection
+ */
+static void
+http_set_events(http_server_t *hs, http_connection_t *hc, int events)
+{
+  if(hc->hc_events == events)
+    return;
+  hc->hc_events = events;
+
+#if ENABLE_EPOLL
+  struct epoll_event e = {0};
+  e.events = (events & POLLIN ? EPOLLIN : 0) |
+    (events & POLLOUT ? EPOLLOUT : 0);
+  e.data.ptr = hc;
+  epoll_ctl(hs->hs_epfd, EPOLL_CTL_MOD, hc->hc_fd, &e);
+#endif
+}
+
+
+/**
+ * Write what we can and figure out what to wait for next.
+ * Returns non-zero if connection should be closed
+ */
+static int
+http_service(http_server_t *hs, http_connection_t *hc)
+{
+  int events = 0;
+
+  if(http_write(hc))
+    return 1;
+
+  if(hc->hc_busy && hc->hc_stream_pending) {
+    // Let the worker know it can stream more data
+    hts_mutex_lock(&hs->hs_mutex);
+    hc->hc_stream_pending = hc->hc_output.hq_size + hc->hc_stream.hq_size;
+    if(hc->hc_stream_pending <= HTTP_STREAM_MAX)
+      hts_cond_broadcast(&hs->hs_stream_cond);
+    hts_mutex_unlock(&hs->hs_mutex);
+  }
+
+  // Worker owns the file fields until the request is done
+  if(!hc->hc_busy && hc->hc_file_fd != -1 && !hc->hc_output.hq_size) {
+    if(http_write_file(hc))
+      return 1;
+
+    // Body sent, continue with any pipelined requests
+    if(hc->hc_file_fd == -1 && (http_handle_input(hc) || http_write(hc)))
+      return 1;
+  }
+
+  if(!hc->hc_busy && hc->hc_file_fh != NULL &&
+     hc->hc_output.hq_size < HTTP_FH_CHUNK)
+    http_dispatch_fh_read(hc);
+
+  if(hc->hc_output.hq_size || (!hc->hc_busy && hc->hc_file_fd != -1))
+    events |= POLLOUT;
+  else if(hc->hc_linger && !hc->hc_busy)
+    return 1;
+
+  // Don't read more input until the current request has been dealt with
+  if(!hc->hc_busy && !hc->hc_linger && hc->hc_file_fd == -1 &&
+     hc->hc_file_fh == NULL)
+    events |= POLLIN;
+
+  http_set_events(hs, hc, events);
   return 0;
 }
 
@@ -854,27 +1545,27 @@ http_write(http_connection_t *hc)
  *
  */
 static int
-http_io(http_connection_t *hc, int revents)
+http_io(http_server_t *hs, http_connection_t *hc, int revents)
 {
   int r;
   if(revents & (POLLHUP | POLLERR))
     return 1;
 
   if(revents & POLLIN) {
-    char *mem = malloc(1000);
+    char *mem = malloc(4096);
     
-    r = read(hc->hc_fd, mem, 1000);
+    r = read(hc->hc_fd, mem, 4096);
     if(r > 0) {
       htsbuf_append_prealloc(&hc->hc_input, mem, r);
       if(http_handle_input(hc))
 	return 1;
     } else {
       free(mem);
-      return 1;
+      if(r == 0 || (errno != EWOULDBLOCK && errno != EAGAIN))
+	return 1;
     }
   }
-  r = http_write(hc);
-  return r;
+  return http_service(hs, hc);
 }
 
 
@@ -884,8 +1575,35 @@ http_io(http_connection_t *hc, int revents)
 static void
 http_close(http_server_t *hs, http_connection_t *hc)
 {
+  if(hc->hc_busy) {
+    /* A worker is still running the request, we will get back
+       here once it is done */
+    if(!hc->hc_zombie) {
+      hts_mutex_lock(&hs->hs_mutex);
+      hc->hc_zombie = 1;
+      hts_cond_broadcast(&hs->hs_stream_cond);
+      hts_mutex_unlock(&hs->hs_mutex);
+      http_set_events(hs, hc, 0);
+#if ENABLE_EPOLL
+      epoll_ctl(hs->hs_epfd, EPOLL_CTL_DEL, hc->hc_fd, NULL);
+#endif
+    }
+    return;
+  }
+
+#if ENABLE_EPOLL
+  if(!hc->hc_zombie)
+    epoll_ctl(hs->hs_epfd, EPOLL_CTL_DEL, hc->hc_fd, NULL);
+#endif
+
   htsbuf_queue_flush(&hc->hc_input);
   htsbuf_queue_flush(&hc->hc_output);
+  htsbuf_queue_flush(&hc->hc_reply);
+  htsbuf_queue_flush(&hc->hc_stream);
+  if(hc->hc_file_fd != -1)
+    close(hc->hc_file_fd);
+  if(hc->hc_file_fh != NULL)
+    fa_close(hc->hc_file_fh);
   http_headers_free(&hc->hc_req_args);
   http_headers_free(&hc->hc_request_headers);
   http_headers_free(&hc->hc_response_headers);
@@ -899,6 +1617,61 @@ http_close(http_server_t *hs, http_connection_t *hc)
 }
 
 
+/**
+ * Pick up data streamed by workers and connections whose requests
+ * have been handled
+ */
+static void
+http_done(http_server_t *hs)
+{
+  struct http_connection_queue q, fq;
+  http_connection_t *hc;
+  char buf[32];
+
+  if(read(hs->hs_pipe[0], buf, sizeof(buf)) < 0)
+    return;
+
+  hts_mutex_lock(&hs->hs_mutex);
+  TAILQ_INIT(&fq);
+  while((hc = TAILQ_FIRST(&hs->hs_flush)) != NULL) {
+    TAILQ_REMOVE(&hs->hs_flush, hc, hc_flush_link);
+    hc->hc_stream_queued = 0;
+    htsbuf_appendq(&hc->hc_output, &hc->hc_stream);
+    TAILQ_INSERT_TAIL(&fq, hc, hc_flush_link);
+  }
+
+  TAILQ_INIT(&q);
+  while((hc = TAILQ_FIRST(&hs->hs_done)) != NULL) {
+    TAILQ_REMOVE(&hs->hs_done, hc, hc_work_link);
+    TAILQ_INSERT_TAIL(&q, hc, hc_work_link);
+  }
+  hts_mutex_unlock(&hs->hs_mutex);
+
+  // Flush first, connections may be closed below
+  while((hc = TAILQ_FIRST(&fq)) != NULL) {
+    TAILQ_REMOVE(&fq, hc, hc_flush_link);
+    if(!hc->hc_zombie && http_service(hs, hc))
+      http_close(hs, hc);
+  }
+
+  while((hc = TAILQ_FIRST(&q)) != NULL) {
+    TAILQ_REMOVE(&q, hc, hc_work_link);
+    hc->hc_busy = 0;
+
+    if(hc->hc_zombie) {
+      http_close(hs, hc);
+      continue;
+    }
+
+    http_request_done(hc);
+
+    // Continue with any pipelined requests
+    if(http_handle_input(hc) || http_service(hs, hc))
+      http_close(hs, hc);
+  }
+}
+
+
 /**
  *
  */
@@ -937,17 +1710,26 @@ http_accept(http_server_t *hs)
   }
 
   hc = calloc(1, sizeof(http_connection_t));
+  hc->hc_server = hs;
   hc->hc_fd = fd;
-  hc->hc_events = POLLIN | POLLHUP | POLLERR;
+  hc->hc_events = POLLIN;
   LIST_INSERT_HEAD(&hs->hs_connections, hc, hc_link);
   hs->hs_numcon++;
   htsbuf_queue_init(&hc->hc_input, 0);
   htsbuf_queue_init(&hc->hc_output, 0);
+  htsbuf_queue_init(&hc->hc_reply, 0);
+  htsbuf_queue_init(&hc->hc_stream, 0);
+  hc->hc_file_fd = -1;
 
   fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
 
   val = 1;
   setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &val, sizeof(val));
+
+#ifdef SO_NOSIGPIPE
+  val = 1;
+  setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &val, sizeof(val));
+#endif
   
 #ifdef TCP_KEEPIDLE
   val = 30;
@@ -981,8 +1763,89 @@ http_accept(http_server_t *hs)
   } else {
     hc->hc_myaddr[0] = 0;
   }
+
+#if ENABLE_EPOLL
+  struct epoll_event e = {0};
+  e.events = EPOLLIN;
+  e.data.ptr = hc;
+  epoll_ctl(hs->hs_epfd, EPOLL_CTL_ADD, fd, &e);
+#endif
+}
+
+
+/**
+ * There is no way to ask sendfile(2) not to raise SIGPIPE, so block
+ * it in the server thread. SIGPIPE is delivered to the thread doing
+ * the write so this does not change anything for the rest of the
+ * process. Everything else uses MSG_NOSIGNAL or SO_NOSIGPIPE
+ */
+static void
+http_block_sigpipe(void)
+{
+#if ENABLE_SENDFILE
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+#endif
+}
+
+
+#if ENABLE_EPOLL
+
+/**
+ *
+ */
+static void *
+http_server(void *aux)
+{
+  http_server_t *hs = aux;
+  struct epoll_event ev[64];
+  http_connection_t *hc;
+  int i, n, wakeup;
+
+  http_block_sigpipe();
+
+  while(1) {
+    n = epoll_wait(hs->hs_epfd, ev, 64, -1);
+
+    if(n == -1) {
+      if(errno == EINTR)
+	continue;
+      TRACE(TRACE_ERROR, "HTTPSRV", "epoll_wait: %s", strerror(errno));
+      sleep(1);
+      continue;
+    }
+
+    wakeup = 0;
+    for(i = 0; i < n; i++) {
+      if(ev[i].data.ptr == NULL) {
+	http_accept(hs);
+	continue;
+      }
+
+      if(ev[i].data.ptr == hs) {
+	wakeup = 1;
+	continue;
+      }
+
+      hc = ev[i].data.ptr;
+      if(http_io(hs, hc,
+		 (ev[i].events & EPOLLIN  ? POLLIN  : 0) |
+		 (ev[i].events & EPOLLOUT ? POLLOUT : 0) |
+		 (ev[i].events & EPOLLHUP ? POLLHUP : 0) |
+		 (ev[i].events & EPOLLERR ? POLLERR : 0)))
+	http_close(hs, hc);
+    }
+
+    // Done last, it may free connections referred to by other events
+    if(wakeup)
+      http_done(hs);
+  }
+  return NULL;
 }
 
+#else
 
 /**
  *
@@ -991,11 +1854,13 @@ static void *
 http_server(void *aux)
 {
   http_server_t *hs = aux;
-  int n, r;
+  int n;
   http_connection_t *hc, *nxt;
 
+  http_block_sigpipe();
+
   while(1) {
-    n = hs->hs_numcon + 1;
+    n = hs->hs_numcon + 2;
 
     if(hs->hs_fds_size < n) {
       hs->hs_fds_size = n + 3;
@@ -1005,30 +1870,37 @@ http_server(void *aux)
     n = 0;
     LIST_FOREACH(hc, &hs->hs_connections, hc_link) {
       hs->hs_fds[n].fd = hc->hc_fd;
-      hs->hs_fds[n].events = hc->hc_events;
+      hs->hs_fds[n].events = hc->hc_zombie ? 0 : hc->hc_events;
       n++;
     }
 
     hs->hs_fds[n].fd = hs->hs_fd;
     hs->hs_fds[n].events = POLLIN;
     n++;
-    r = poll(hs->hs_fds, n, -1);
+    hs->hs_fds[n].fd = hs->hs_pipe[0];
+    hs->hs_fds[n].events = POLLIN;
+    n++;
+    if(poll(hs->hs_fds, n, -1) == -1)
+      continue;
 
     n = 0;
     for(hc = LIST_FIRST(&hs->hs_connections); hc != NULL; hc = nxt) {
       nxt = LIST_NEXT(hc, hc_link);
 
-      if(http_io(hc, hs->hs_fds[n].revents)) {
+      if(!hc->hc_zombie && http_io(hs, hc, hs->hs_fds[n].revents))
 	http_close(hs, hc);
-      }
       n++;
     }
     if(hs->hs_fds[n].revents & POLLIN)
       http_accept(hs);
+    n++;
+    if(hs->hs_fds[n].revents & POLLIN)
+      http_done(hs);
   }
   return NULL;
 }
 
+#endif
 
 /**
  *
@@ -1074,10 +1946,45 @@ http_server_init(void)
 
   TRACE(TRACE_INFO, "HTTPSRV", "Listening on port %d", http_server_port);
 
-  listen(fd, 1);
+  listen(fd, 16);
     
   hs = calloc(1, sizeof(http_server_t));
   hs->hs_fd = fd;  
+
+  if(pipe(hs->hs_pipe) == -1) {
+    TRACE(TRACE_ERROR, "HTTPSRV", "Unable to create pipe: %s",
+	  strerror(errno));
+    close(fd);
+    free(hs);
+    return;
+  }
+  fcntl(hs->hs_pipe[0], F_SETFL, fcntl(hs->hs_pipe[0], F_GETFL) | O_NONBLOCK);
+
+#if ENABLE_EPOLL
+  struct epoll_event e = {0};
+
+  hs->hs_epfd = epoll_create(64);
+
+  e.events = EPOLLIN;
+  e.data.ptr = NULL;
+  epoll_ctl(hs->hs_epfd, EPOLL_CTL_ADD, fd, &e);
+
+  e.events = EPOLLIN;
+  e.data.ptr = hs;
+  epoll_ctl(hs->hs_epfd, EPOLL_CTL_ADD, hs->hs_pipe[0], &e);
+#endif
+
+  hts_mutex_init(&hs->hs_mutex);
+  hts_cond_init(&hs->hs_work_cond, &hs->hs_mutex);
+  hts_cond_init(&hs->hs_stream_cond, &hs->hs_mutex);
+  TAILQ_INIT(&hs->hs_work);
+  TAILQ_INIT(&hs->hs_done);
+  TAILQ_INIT(&hs->hs_flush);
+
+  for(i = 0; i < HTTP_WORKERS; i++)
+    hts_thread_create_detached("httpworker", http_worker, hs,
+			       THREAD_PRIO_NORMAL);
+
   hts_thread_create_detached("httpsrv", http_server, hs,
 			     THREAD_PRIO_NORMAL);
 }
@@ -40,6 +40,21 @@ int http_send_reply(http_connection_t *hc, int rc, const char *content,
 
 int http_error(http_connection_t *hc, int error, const char *extra, ...);
 
+struct fa_handle;
+
+int http_send_fd(http_connection_t *hc, int fd, const char *content,
+		 int maxage);
+
+int http_send_fh(http_connection_t *hc, struct fa_handle *fh,
+		 const char *content, int maxage);
+
+int http_stream_begin(http_connection_t *hc, int rc, const char *content);
+
+int http_stream_send(http_connection_t *hc, const void *data, size_t len,
+		     int nonblock);
+
+void http_stream_end(http_connection_t *hc);
+
 int http_redirect(http_connection_t *hc, const char *location);
 
 const char *http_arg_get_req(http_connection_t *hc, const char *name);
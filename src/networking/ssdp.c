@@ -115,6 +115,15 @@ ssdp_maxage(struct http_header_list *args)
 
 
 
+/**
+ * Integer header such as CONFIGID.UPNP.ORG, -1 if not present
+ */
+static int
+ssdp_get_int(struct http_header_list *args, const char *name)
+{
+  const char *s = http_header_get(args, name);
+  return s != NULL ? atoi(s) : -1;
+}
 
 
 /**
@@ -131,7 +140,9 @@ ssdp_recv_notify(struct http_header_list *args)
     return;
   
   if(!strcasecmp(nts, "ssdp:alive") && type != NULL)
-    upnp_add_device(url, type, ssdp_maxage(args));
+    upnp_add_device(url, type, ssdp_maxage(args),
+		    ssdp_get_int(args, "configid.upnp.org"),
+		    ssdp_get_int(args, "bootid.upnp.org"));
 
   if(!strcasecmp(nts, "ssdp:byebye"))
     upnp_del_device(url);
@@ -148,7 +159,9 @@ ssdp_response(struct http_header_list *args)
   const char *type = http_header_get(args, "st");
   
   if(url != NULL && type != NULL)
-    upnp_add_device(url, type, ssdp_maxage(args));
+    upnp_add_device(url, type, ssdp_maxage(args),
+		    ssdp_get_int(args, "configid.upnp.org"),
+		    ssdp_get_int(args, "bootid.upnp.org"));
 }
 
 
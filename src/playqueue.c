@@ -974,10 +974,15 @@ update_pq_meta(void)
 {
   media_pipe_t *mp = playqueue_mp;
   playqueue_entry_t *pqe = pqe_current;
+  playqueue_entry_t *nxt = pqe ? playqueue_advance0(pqe, 0) : NULL;
 
-  int can_skip_next = pqe && playqueue_advance0(pqe, 0);
+  int can_skip_next = nxt != NULL;
   int can_skip_prev = pqe && playqueue_advance0(pqe, 1);
 
+  /* Let the backend open the next track ahead of time for gapless
+     playback */
+  mp_set_preroll_url(mp, nxt ? nxt->pqe_url : NULL);
+
   prop_set_int(mp->mp_prop_canSkipForward,  can_skip_next);
   prop_set_int(mp->mp_prop_canSkipBackward, can_skip_prev);
 
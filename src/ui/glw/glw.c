@@ -285,6 +285,7 @@ void
 glw_unload_universe(glw_root_t *gr)
 {
   glw_view_cache_flush(gr);
+  glw_view_token_pool_flush(gr);
 
   if(gr->gr_universe != NULL)
     glw_destroy(gr->gr_universe);
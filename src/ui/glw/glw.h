@@ -112,6 +112,7 @@ typedef enum {
  */
 #define GTB_PASSWORD      0x1   /* Don't display real contents */
 #define GTB_ELLIPSIZE     0x2
+#define GTB_ATLAS         0x4   /* Draw using shared glyph atlas */
 
 
 #define GLW_MODE_XFADE    0
@@ -544,6 +545,9 @@ typedef struct glw_root {
   struct glw *gr_universe;
 
   LIST_HEAD(, glw_cached_view) gr_views;
+  struct glw_view_file_list *gr_view_files; // Files loaded by current view
+  struct token *gr_token_pool;  // Recycled eval result tokens
+  int gr_token_pool_size;
 
   const char *gr_vpaths[5];
 
@@ -592,6 +596,7 @@ typedef struct glw_root {
   TAILQ_HEAD(, glw_text_bitmap) gr_gtb_render_queue;
   hts_cond_t gr_gtb_render_cond;
   FT_Face gr_gtb_face;
+  struct glw_text_atlas *gr_gta;
   int gr_fontsize;
   int gr_fontsize_px;
 
@@ -600,8 +605,14 @@ typedef struct glw_root {
    */
   hts_mutex_t gr_tex_mutex;
 
-  hts_cond_t gr_tex_load_cond[3];
-  struct glw_loadable_texture_queue gr_tex_load_queue[3];
+  hts_cond_t gr_tex_load_cond;
+  struct glw_loadable_texture_queue gr_tex_load_queue;
+
+  int gr_tex_frame;          // Copy of gr_frames, protected by gr_tex_mutex
+  int gr_tex_threads;        // Number of loader threads running
+  int gr_tex_threads_idle;   // ... of which are waiting for work
+  int gr_tex_threads_io;     // ... of which are blocked fetching data
+  int gr_tex_threads_cpu;    // Max number of threads doing CPU work
 
 
   struct glw_loadable_texture_list gr_tex_active_list;
@@ -613,6 +624,9 @@ typedef struct glw_root {
 
   int gr_normalized_texture_coords;
 
+  int64_t gr_tex_upload_time; // Accumulated time spent in glw_tex_upload()
+  int gr_tex_uploads;
+
   /**
    * Root focus leader
    */
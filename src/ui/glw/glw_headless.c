@@ -0,0 +1,621 @@
+/*
+ *  GL Widgets, Headless offscreen frontend
+ *  Copyright (C) 2011 Andreas Öman
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Renders the UI into an OSMesa buffer without any display.
+ *
+ * Events are read from a script file, one per line as
+ *
+ *   <frame> <action>
+ *
+ * where action is an action name as in event.c (Up, Down, Activate, ...)
+ *
+ * Per frame layout, render and texture upload timings are written
+ * as JSON when done.
+ *
+ * With --eval-bench N all dynamic view expressions of the loaded UI
+ * are evaluated N times after the last frame and the time is added to
+ * the report. --fold-check runs the RPN constant folding checks below
+ * and exits.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <limits.h>
+
+#include <GL/osmesa.h>
+
+#include "glw.h"
+#include "glw_view.h"
+
+#include "showtime.h"
+#include "event.h"
+#include "htsmsg/htsmsg_json.h"
+
+/**
+ *
+ */
+typedef struct glw_headless_event {
+  TAILQ_ENTRY(glw_headless_event) ghe_link;
+  int ghe_frame;
+  action_type_t ghe_action;
+} glw_headless_event_t;
+
+TAILQ_HEAD(glw_headless_event_queue, glw_headless_event);
+
+
+/**
+ *
+ */
+typedef struct glw_frame_stats {
+  int64_t gfs_prepare;
+  int64_t gfs_layout;
+  int64_t gfs_render;
+  int64_t gfs_upload;
+  int gfs_uploads;
+} glw_frame_stats_t;
+
+
+/**
+ *
+ */
+typedef struct glw_headless {
+
+  glw_root_t gr;
+
+  OSMesaContext ctx;
+  void *framebuffer;
+
+  int frames;
+  int fps;
+  const char *output;
+
+  int eval_rounds;
+  int eval_exprs;
+  int64_t eval_time;
+
+  struct glw_headless_event_queue events;
+
+  glw_frame_stats_t *stats;
+
+  int stop;
+
+} glw_headless_t;
+
+
+/**
+ *
+ */
+static int
+load_script(glw_headless_t *gh, const char *path)
+{
+  glw_headless_event_t *ghe;
+  char line[256], name[64];
+  int frame, lineno = 0;
+  action_type_t a;
+  FILE *fp;
+
+  if((fp = fopen(path, "r")) == NULL) {
+    TRACE(TRACE_ERROR, "GLW", "Unable to open script %s", path);
+    return -1;
+  }
+
+  while(fgets(line, sizeof(line), fp) != NULL) {
+    lineno++;
+    if(line[0] == '#' || line[0] == '\n')
+      continue;
+
+    if(sscanf(line, "%d %63s", &frame, name) != 2 ||
+       (a = action_str2code(name)) == -1) {
+      TRACE(TRACE_ERROR, "GLW", "%s:%d: Invalid event", path, lineno);
+      continue;
+    }
+
+    ghe = malloc(sizeof(glw_headless_event_t));
+    ghe->ghe_frame = frame;
+    ghe->ghe_action = a;
+    TAILQ_INSERT_TAIL(&gh->events, ghe, ghe_link);
+  }
+  fclose(fp);
+  return 0;
+}
+
+
+/**
+ *
+ */
+static int
+glw_headless_init(glw_headless_t *gh)
+{
+  glw_root_t *gr = &gh->gr;
+
+  gh->ctx = OSMesaCreateContextExt(OSMESA_BGRA, 24, 0, 0, NULL);
+  if(gh->ctx == NULL) {
+    TRACE(TRACE_ERROR, "GLW", "Unable to create OSMesa context");
+    return -1;
+  }
+
+  gh->framebuffer = malloc(gr->gr_width * gr->gr_height * 4);
+
+  if(!OSMesaMakeCurrent(gh->ctx, gh->framebuffer, GL_UNSIGNED_BYTE,
+			gr->gr_width, gr->gr_height)) {
+    TRACE(TRACE_ERROR, "GLW", "Unable to bind OSMesa buffer");
+    return -1;
+  }
+
+  return glw_opengl_init_context(gr);
+}
+
+
+/**
+ *
+ */
+static void
+dispatch_scripted(glw_headless_t *gh, int frame)
+{
+  glw_headless_event_t *ghe;
+  event_t *e;
+
+  while((ghe = TAILQ_FIRST(&gh->events)) != NULL &&
+	ghe->ghe_frame <= frame) {
+    TAILQ_REMOVE(&gh->events, ghe, ghe_link);
+
+    e = event_create_action(ghe->ghe_action);
+    glw_dispatch_event(&gh->gr.gr_uii, e);
+    event_release(e);
+    free(ghe);
+  }
+}
+
+
+/**
+ *
+ */
+static void
+glw_headless_mainloop(glw_headless_t *gh)
+{
+  glw_root_t *gr = &gh->gr;
+  glw_frame_stats_t *gfs;
+  glw_rctx_t rc;
+  int64_t ts, start = showtime_get_ts();
+  int frame;
+
+  gh->stats = calloc(gh->frames, sizeof(glw_frame_stats_t));
+
+  for(frame = 0; frame < gh->frames && !gh->stop; frame++) {
+    gfs = &gh->stats[frame];
+
+    dispatch_scripted(gh, frame);
+
+    glw_lock(gr);
+
+    gr->gr_tex_upload_time = 0;
+    gr->gr_tex_uploads = 0;
+
+    ts = showtime_get_ts();
+    glw_prepare_frame(gr, 0);
+    gfs->gfs_prepare = showtime_get_ts() - ts;
+
+    glClear(GL_DEPTH_BUFFER_BIT | GL_COLOR_BUFFER_BIT);
+    glw_rctx_init(&rc, gr->gr_width, gr->gr_height);
+
+    ts = showtime_get_ts();
+    glw_layout0(gr->gr_universe, &rc);
+    gfs->gfs_layout = showtime_get_ts() - ts;
+
+    ts = showtime_get_ts();
+    glw_render0(gr->gr_universe, &rc);
+    glFinish();
+    gfs->gfs_render = showtime_get_ts() - ts;
+
+    gfs->gfs_upload  = gr->gr_tex_upload_time;
+    gfs->gfs_uploads = gr->gr_tex_uploads;
+
+    glw_unlock(gr);
+
+    if(gh->fps) {
+      int64_t deadline = start + (frame + 1) * 1000000LL / gh->fps;
+      int64_t now = showtime_get_ts();
+      if(deadline > now)
+	usleep(deadline - now);
+    }
+  }
+  gh->frames = frame;
+}
+
+
+/**
+ * Evaluate all dynamic expressions (the ones re-run on property
+ * changes and every frame) 'eval_rounds' times
+ */
+static void
+glw_headless_eval_bench(glw_headless_t *gh)
+{
+  glw_root_t *gr = &gh->gr;
+  glw_rctx_t rc;
+  int64_t ts;
+  int i;
+
+  glw_lock(gr);
+  glw_rctx_init(&rc, gr->gr_width, gr->gr_height);
+
+  ts = showtime_get_ts();
+  for(i = 0; i < gh->eval_rounds; i++)
+    gh->eval_exprs = glw_view_eval_dynamics(gr->gr_universe, &rc);
+  gh->eval_time = showtime_get_ts() - ts;
+
+  glw_unlock(gr);
+}
+
+
+/**
+ * RPN sequences and what they must fold into. 'x' is a non constant
+ * operand
+ */
+static const struct {
+  const char *rpn;
+  const char *folded;
+} fold_checks[] = {
+  { "1 2 +",                 "3" },
+  { "x 1 2 + *",             "x 3 *" },
+  { "1 0 ! &&",              "1" },        // 1 && !0
+  { "0 1 ! ||",              "0" },        // 0 || !1
+  { "x 0 ! &&",              "x 1 &&" },   // x && !0
+  { "1 x ! &&",              "1 x ! &&" },
+  { "0 ! x &&",              "1 x &&" },
+  { "2 3 ! +",               "2" },        // 2 + !3
+  { "1 2 == ! 3 4 < &&",     "1" },        // !(1 == 2) && 3 < 4
+  { "x 1 ! 2 3 ! || == &&",  "x 0 &&" },   // x && (!1 == (2 || !3))
+  { "5 0 %",                 "5 0 %" },
+};
+
+
+/**
+ *
+ */
+static const struct {
+  const char *str;
+  token_type_t type;
+} fold_check_ops[] = {
+  { "+",  TOKEN_ADD },
+  { "-",  TOKEN_SUB },
+  { "*",  TOKEN_MULTIPLY },
+  { "/",  TOKEN_DIVIDE },
+  { "%",  TOKEN_MODULO },
+  { "&&", TOKEN_BOOLEAN_AND },
+  { "||", TOKEN_BOOLEAN_OR },
+  { "!",  TOKEN_BOOLEAN_NOT },
+  { "==", TOKEN_EQ },
+  { "!=", TOKEN_NEQ },
+  { "<",  TOKEN_LT },
+  { ">",  TOKEN_GT },
+};
+
+
+/**
+ *
+ */
+static token_t *
+fold_check_parse(const char *str)
+{
+  token_t *rpn = calloc(1, sizeof(token_t)), **pp = &rpn->child, *t;
+  char buf[128], *s, *tok, *saveptr = NULL;
+  int i;
+
+  rpn->type = TOKEN_RPN;
+  snprintf(buf, sizeof(buf), "%s", str);
+
+  for(s = buf; (tok = strtok_r(s, " ", &saveptr)) != NULL; s = NULL) {
+    t = calloc(1, sizeof(token_t));
+    if(!strcmp(tok, "x")) {
+      t->type = TOKEN_VOID;
+    } else if(tok[0] >= '0' && tok[0] <= '9') {
+      t->type = TOKEN_INT;
+      t->t_int = atoi(tok);
+    } else {
+      for(i = 0; i < sizeof(fold_check_ops) / sizeof(fold_check_ops[0]); i++)
+	if(!strcmp(tok, fold_check_ops[i].str))
+	  t->type = fold_check_ops[i].type;
+    }
+    *pp = t;
+    pp = &t->next;
+  }
+  return rpn;
+}
+
+
+/**
+ *
+ */
+static void
+fold_check_print(const token_t *t, char *buf, size_t size)
+{
+  const char *str;
+  size_t off = 0;
+  char tmp[32];
+  int i;
+
+  buf[0] = 0;
+  for(; t != NULL && off < size; t = t->next) {
+    str = "?";
+    if(t->type == TOKEN_VOID) {
+      str = "x";
+    } else if(t->type == TOKEN_INT) {
+      snprintf(tmp, sizeof(tmp), "%d", t->t_int);
+      str = tmp;
+    } else {
+      for(i = 0; i < sizeof(fold_check_ops) / sizeof(fold_check_ops[0]); i++)
+	if(t->type == fold_check_ops[i].type)
+	  str = fold_check_ops[i].str;
+    }
+    off += snprintf(buf + off, size - off, "%s%s", off ? " " : "", str);
+  }
+}
+
+
+/**
+ * Returns number of failed checks
+ */
+static int
+glw_headless_fold_check(void)
+{
+  char result[128];
+  token_t *rpn;
+  int i, fails = 0;
+
+  for(i = 0; i < sizeof(fold_checks) / sizeof(fold_checks[0]); i++) {
+    rpn = fold_check_parse(fold_checks[i].rpn);
+    glw_view_rpn_fold(rpn);
+    fold_check_print(rpn->child, result, sizeof(result));
+    glw_view_free_chain(rpn);
+
+    if(strcmp(result, fold_checks[i].folded)) {
+      printf("FAIL: %s -> %s (expected %s)\n",
+	     fold_checks[i].rpn, result, fold_checks[i].folded);
+      fails++;
+    } else {
+      printf("ok:   %s -> %s\n", fold_checks[i].rpn, result);
+    }
+  }
+  return fails;
+}
+
+
+/**
+ *
+ */
+static void
+add_summary(htsmsg_t *m, const char *name, const glw_frame_stats_t *stats,
+	    int frames, size_t offset)
+{
+  htsmsg_t *s = htsmsg_create_map();
+  int64_t v, sum = 0, max = 0;
+  int i;
+
+  for(i = 0; i < frames; i++) {
+    v = *(const int64_t *)((const char *)&stats[i] + offset);
+    sum += v;
+    if(v > max)
+      max = v;
+  }
+  htsmsg_add_s64(s, "total", sum);
+  htsmsg_add_s64(s, "avg", frames ? sum / frames : 0);
+  htsmsg_add_s64(s, "max", max);
+  htsmsg_add_msg(m, name, s);
+}
+
+
+/**
+ *
+ */
+static void
+write_report(glw_headless_t *gh, const char *theme)
+{
+  htsmsg_t *m = htsmsg_create_map();
+  htsmsg_t *l = htsmsg_create_list();
+  htsmsg_t *s;
+  glw_frame_stats_t *gfs;
+  htsbuf_queue_t hq;
+  char *str;
+  FILE *fp;
+  int i;
+
+  htsmsg_add_str(m, "theme", theme);
+  htsmsg_add_u32(m, "width", gh->gr.gr_width);
+  htsmsg_add_u32(m, "height", gh->gr.gr_height);
+  htsmsg_add_u32(m, "frames", gh->frames);
+
+  for(i = 0; i < gh->frames; i++) {
+    gfs = &gh->stats[i];
+    s = htsmsg_create_map();
+    htsmsg_add_s64(s, "prepare", gfs->gfs_prepare);
+    htsmsg_add_s64(s, "layout", gfs->gfs_layout);
+    htsmsg_add_s64(s, "render", gfs->gfs_render);
+    htsmsg_add_s64(s, "upload", gfs->gfs_upload);
+    htsmsg_add_u32(s, "uploads", gfs->gfs_uploads);
+    htsmsg_add_msg(l, NULL, s);
+  }
+
+  s = htsmsg_create_map();
+  add_summary(s, "prepare", gh->stats, gh->frames,
+	      offsetof(glw_frame_stats_t, gfs_prepare));
+  add_summary(s, "layout", gh->stats, gh->frames,
+	      offsetof(glw_frame_stats_t, gfs_layout));
+  add_summary(s, "render", gh->stats, gh->frames,
+	      offsetof(glw_frame_stats_t, gfs_render));
+  add_summary(s, "upload", gh->stats, gh->frames,
+	      offsetof(glw_frame_stats_t, gfs_upload));
+  htsmsg_add_msg(m, "summary", s);
+
+  if(gh->eval_rounds) {
+    s = htsmsg_create_map();
+    htsmsg_add_u32(s, "rounds", gh->eval_rounds);
+    htsmsg_add_u32(s, "expressions", gh->eval_exprs);
+    htsmsg_add_s64(s, "total", gh->eval_time);
+    htsmsg_add_s64(s, "avg_ns", gh->eval_exprs ?
+		   gh->eval_time * 1000 / ((int64_t)gh->eval_rounds *
+					   gh->eval_exprs) : 0);
+    htsmsg_add_msg(m, "eval", s);
+  }
+  htsmsg_add_msg(m, "perframe", l);
+
+  htsbuf_queue_init(&hq, 0);
+  htsmsg_json_serialize(m, &hq, 1);
+  htsmsg_destroy(m);
+  str = htsbuf_to_string(&hq);
+  htsbuf_queue_flush(&hq);
+
+  if(gh->output != NULL) {
+    if((fp = fopen(gh->output, "w")) != NULL) {
+      fputs(str, fp);
+      fclose(fp);
+    } else {
+      TRACE(TRACE_ERROR, "GLW", "Unable to write %s", gh->output);
+    }
+  } else {
+    fputs(str, stdout);
+  }
+  free(str);
+}
+
+
+/**
+ *
+ */
+static int
+glw_headless_start(ui_t *ui, prop_t *root, int argc, char *argv[],
+		   int primary)
+{
+  glw_headless_t *gh = calloc(1, sizeof(glw_headless_t));
+  glw_root_t *gr = &gh->gr;
+  const char *theme_path = SHOWTIME_GLW_DEFAULT_THEME_URL;
+  const char *skin = NULL;
+
+  gr->gr_uii.uii_prop = root;
+  gr->gr_width  = 1280;
+  gr->gr_height = 720;
+  gh->frames = 600;
+  TAILQ_INIT(&gh->events);
+
+  /* Parse options */
+
+  argv++;
+  argc--;
+
+  while(argc > 0) {
+    if(!strcmp(argv[0], "--theme") && argc > 1) {
+      theme_path = argv[1];
+      argc -= 2; argv += 2;
+      continue;
+    } else if(!strcmp(argv[0], "--skin") && argc > 1) {
+      skin = argv[1];
+      argc -= 2; argv += 2;
+      continue;
+    } else if(!strcmp(argv[0], "--width") && argc > 1) {
+      gr->gr_width = atoi(argv[1]);
+      argc -= 2; argv += 2;
+      continue;
+    } else if(!strcmp(argv[0], "--height") && argc > 1) {
+      gr->gr_height = atoi(argv[1]);
+      argc -= 2; argv += 2;
+      continue;
+    } else if(!strcmp(argv[0], "--frames") && argc > 1) {
+      gh->frames = atoi(argv[1]);
+      argc -= 2; argv += 2;
+      continue;
+    } else if(!strcmp(argv[0], "--fps") && argc > 1) {
+      gh->fps = atoi(argv[1]);
+      argc -= 2; argv += 2;
+      continue;
+    } else if(!strcmp(argv[0], "--script") && argc > 1) {
+      if(load_script(gh, argv[1]))
+	return 1;
+      argc -= 2; argv += 2;
+      continue;
+    } else if(!strcmp(argv[0], "--output") && argc > 1) {
+      gh->output = argv[1];
+      argc -= 2; argv += 2;
+      continue;
+    } else if(!strcmp(argv[0], "--eval-bench") && argc > 1) {
+      gh->eval_rounds = atoi(argv[1]);
+      argc -= 2; argv += 2;
+      continue;
+    } else if(!strcmp(argv[0], "--fold-check")) {
+      free(gh);
+      return glw_headless_fold_check() ? 1 : 0;
+    } else {
+      break;
+    }
+  }
+
+  if(glw_headless_init(gh))
+    return 1;
+
+  if(glw_init(gr, theme_path, skin, ui, primary, "glw/headless", NULL))
+    return 1;
+
+  glw_load_universe(gr);
+  glw_headless_mainloop(gh);
+  if(gh->eval_rounds)
+    glw_headless_eval_bench(gh);
+  write_report(gh, theme_path);
+  glw_unload_universe(gr);
+  glw_reap(gr);
+  glw_reap(gr);
+
+  OSMesaDestroyContext(gh->ctx);
+  free(gh->framebuffer);
+  free(gh->stats);
+  return 0;
+}
+
+
+/**
+ *
+ */
+static void
+glw_headless_dispatch_event(uii_t *uii, event_t *e)
+{
+  glw_dispatch_event(uii, e);
+  event_release(e);
+}
+
+
+/**
+ *
+ */
+static void
+glw_headless_stop(uii_t *uii)
+{
+  glw_headless_t *gh = (glw_headless_t *)uii;
+  gh->stop = 1;
+}
+
+
+/**
+ *
+ */
+ui_t glw_ui = {
+  .ui_title = "glw",
+  .ui_start = glw_headless_start,
+  .ui_dispatch_event = glw_headless_dispatch_event,
+  .ui_stop = glw_headless_stop,
+};
@@ -554,6 +554,7 @@ glw_image_layout(glw_t *w, glw_rctx_t *rc)
   glw_loadable_texture_t *glt;
   glw_rctx_t rc0;
   glw_t *c;
+  int prio;
 
   if(gi->gi_pending_filename != NULL) {
     // Request to load
@@ -602,8 +603,10 @@ glw_image_layout(glw_t *w, glw_rctx_t *rc)
     }
   }
 
+  prio = glw_is_focused(w) ? 0 : abs(w->glw_focus_distance);
+
   if((glt = gi->gi_pending) != NULL) {
-    glw_tex_layout(gr, glt);
+    glw_tex_layout_prio(gr, glt, prio);
 
     if(glt->glt_state == GLT_STATE_VALID || 
        glt->glt_state == GLT_STATE_ERROR) {
@@ -621,7 +624,7 @@ glw_image_layout(glw_t *w, glw_rctx_t *rc)
   if((glt = gi->gi_current) == NULL)
     return;
 
-  glw_tex_layout(gr, glt);
+  glw_tex_layout_prio(gr, glt, prio);
 
   if(glt->glt_state == GLT_STATE_ERROR) {
     if(!gi->gi_was_valid) {
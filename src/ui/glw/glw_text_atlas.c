@@ -0,0 +1,507 @@
+/*
+ *  GL Widgets, Shared glyph atlas
+ *  Copyright (C) 2011 Andreas Öman
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Glyphs are rasterized once (per size) into a single texture and
+ * labels using the atlas are drawn as a batch of textured quads.
+ * All functions here must be called from the GL thread with the
+ * glw lock held. The atlas uses its own FT_Face so it does not
+ * race with the font render thread.
+ *
+ * The atlas is split into horizontal shelves, each owned by a single
+ * font size. When we run out of room the size that was least recently
+ * used is evicted and its shelves are handed out again. Sizes that
+ * have been used in the current or previous frame are never evicted,
+ * instead the atlas reports that it is full and the label falls back
+ * to the bitmap renderer.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "glw.h"
+#include "glw_texture.h"
+#include "glw_text_atlas.h"
+
+#define GTA_WIDTH  512
+#define GTA_HEIGHT 512
+#define GTA_BPP    2
+
+#define GTA_HASH_SIZE 256
+#define GTA_HASH_MASK (GTA_HASH_SIZE-1)
+
+LIST_HEAD(gta_glyph_list, gta_glyph);
+LIST_HEAD(gta_size_list, gta_size);
+TAILQ_HEAD(gta_shelf_queue, gta_shelf);
+
+/**
+ * Per font size state. Sizes are the unit of eviction
+ */
+typedef struct gta_size {
+  LIST_ENTRY(gta_size) gs_link;
+  int gs_size;
+  int gs_line_height;  // Height of shelves opened for this size
+  int gs_generation;   // Bumped when glyphs of this size are evicted
+  int gs_last_used;    // gr_frames when last used
+  int gs_shelves;      // Number of shelves owned
+} gta_size_t;
+
+
+/**
+ * A full width band of the atlas, either owned by a size or free
+ */
+typedef struct gta_shelf {
+  TAILQ_ENTRY(gta_shelf) gsh_link;  // Sorted on gsh_y
+  gta_size_t *gsh_owner;
+  int gsh_y;
+  int gsh_h;
+  int gsh_x;                        // Next free x position
+} gta_shelf_t;
+
+
+typedef struct glw_text_atlas {
+  FT_Face gta_face;
+  int gta_face_size;
+
+  uint8_t *gta_bitmap;
+  glw_backend_texture_t gta_texture;
+  int gta_uploaded;
+
+  // Rows that must be uploaded [y1, y2)
+  int gta_dirty_y1;
+  int gta_dirty_y2;
+
+  struct gta_shelf_queue gta_shelves;
+  int gta_top;         // Everything below this is unused
+
+  struct gta_size_list gta_sizes;
+
+  struct gta_glyph_list gta_hash[GTA_HASH_SIZE];
+
+} glw_text_atlas_t;
+
+
+/**
+ *
+ */
+static void
+gta_set_size(glw_text_atlas_t *gta, int size)
+{
+  if(gta->gta_face_size == size)
+    return;
+  FT_Set_Pixel_Sizes(gta->gta_face, 0, size);
+  gta->gta_face_size = size;
+}
+
+
+/**
+ *
+ */
+static void
+gta_dirty(glw_text_atlas_t *gta, int y, int h)
+{
+  if(gta->gta_dirty_y1 >= gta->gta_dirty_y2) {
+    gta->gta_dirty_y1 = y;
+    gta->gta_dirty_y2 = y + h;
+  } else {
+    gta->gta_dirty_y1 = GLW_MIN(gta->gta_dirty_y1, y);
+    gta->gta_dirty_y2 = GLW_MAX(gta->gta_dirty_y2, y + h);
+  }
+}
+
+
+/**
+ *
+ */
+static gta_size_t *
+gta_size_get(glw_text_atlas_t *gta, int size)
+{
+  gta_size_t *gs;
+  FT_Face face = gta->gta_face;
+
+  LIST_FOREACH(gs, &gta->gta_sizes, gs_link)
+    if(gs->gs_size == size)
+      return gs;
+
+  gs = calloc(1, sizeof(gta_size_t));
+  gs->gs_size = size;
+  gta_set_size(gta, size);
+  gs->gs_line_height =
+    ((face->size->metrics.ascender - face->size->metrics.descender) >> 6) + 1;
+  LIST_INSERT_HEAD(&gta->gta_sizes, gs, gs_link);
+  return gs;
+}
+
+
+/**
+ * Throw away all glyphs of the least recently used size that is not
+ * in use right now. Returns -1 if there is no such size
+ */
+static int
+gta_evict(glw_text_atlas_t *gta, int now)
+{
+  gta_size_t *gs, *lru = NULL;
+  gta_shelf_t *sh, *next;
+  gta_glyph_t *gg, *ggn;
+  int i;
+
+  LIST_FOREACH(gs, &gta->gta_sizes, gs_link)
+    if(gs->gs_shelves > 0 && gs->gs_last_used < now - 1 &&
+       (lru == NULL || gs->gs_last_used < lru->gs_last_used))
+      lru = gs;
+
+  if(lru == NULL)
+    return -1;
+
+  for(i = 0; i < GTA_HASH_SIZE; i++) {
+    for(gg = LIST_FIRST(&gta->gta_hash[i]); gg != NULL; gg = ggn) {
+      ggn = LIST_NEXT(gg, gg_link);
+      if(gg->gg_size == lru->gs_size) {
+	LIST_REMOVE(gg, gg_link);
+	free(gg);
+      }
+    }
+  }
+
+  TAILQ_FOREACH(sh, &gta->gta_shelves, gsh_link) {
+    if(sh->gsh_owner != lru)
+      continue;
+    sh->gsh_owner = NULL;
+    sh->gsh_x = 0;
+    memset(gta->gta_bitmap + sh->gsh_y * GTA_WIDTH * GTA_BPP, 0,
+	   sh->gsh_h * GTA_WIDTH * GTA_BPP);
+    gta_dirty(gta, sh->gsh_y, sh->gsh_h);
+  }
+
+  lru->gs_shelves = 0;
+  lru->gs_generation++;
+
+  // Merge adjacent free shelves
+  for(sh = TAILQ_FIRST(&gta->gta_shelves); sh != NULL; sh = next) {
+    next = TAILQ_NEXT(sh, gsh_link);
+    if(next != NULL && sh->gsh_owner == NULL && next->gsh_owner == NULL) {
+      sh->gsh_h += next->gsh_h;
+      TAILQ_REMOVE(&gta->gta_shelves, next, gsh_link);
+      free(next);
+      next = sh;
+    }
+  }
+
+  // Give a free shelf at the end back to unused space
+  sh = TAILQ_LAST(&gta->gta_shelves, gta_shelf_queue);
+  if(sh != NULL && sh->gsh_owner == NULL) {
+    gta->gta_top = sh->gsh_y;
+    TAILQ_REMOVE(&gta->gta_shelves, sh, gsh_link);
+    free(sh);
+  }
+  return 0;
+}
+
+
+/**
+ * Find a shelf that can hold a w * h bitmap for the given size
+ */
+static gta_shelf_t *
+gta_shelf_find(glw_text_atlas_t *gta, gta_size_t *gs, int w, int h)
+{
+  gta_shelf_t *sh, *best = NULL;
+  int lh = GLW_MAX(h, gs->gs_line_height);
+
+  TAILQ_FOREACH(sh, &gta->gta_shelves, gsh_link)
+    if(sh->gsh_owner == gs && sh->gsh_h >= h && sh->gsh_x + w <= GTA_WIDTH)
+      return sh;
+
+  // Tightest free shelf, split off what we don't need
+  TAILQ_FOREACH(sh, &gta->gta_shelves, gsh_link)
+    if(sh->gsh_owner == NULL && sh->gsh_h >= h &&
+       (best == NULL || sh->gsh_h < best->gsh_h))
+      best = sh;
+
+  if(best != NULL) {
+    if(best->gsh_h > lh) {
+      sh = calloc(1, sizeof(gta_shelf_t));
+      sh->gsh_y = best->gsh_y + lh;
+      sh->gsh_h = best->gsh_h - lh;
+      TAILQ_INSERT_AFTER(&gta->gta_shelves, best, sh, gsh_link);
+      best->gsh_h = lh;
+    }
+    sh = best;
+
+  } else {
+    // Open new shelf in unused space
+    lh = GLW_MIN(lh, GTA_HEIGHT - gta->gta_top);
+    if(lh < h)
+      return NULL;
+    sh = calloc(1, sizeof(gta_shelf_t));
+    sh->gsh_y = gta->gta_top;
+    sh->gsh_h = lh;
+    gta->gta_top += lh;
+    TAILQ_INSERT_TAIL(&gta->gta_shelves, sh, gsh_link);
+  }
+
+  sh->gsh_owner = gs;
+  sh->gsh_x = 0;
+  gs->gs_shelves++;
+  return sh;
+}
+
+
+/**
+ * Find room for a w * h bitmap (1 pixel spacing to avoid bleeding when
+ * filtering), evicting other sizes if needed. Returns -1 if the atlas
+ * is full
+ */
+static int
+gta_alloc(glw_text_atlas_t *gta, gta_size_t *gs, int w, int h,
+	  int *xp, int *yp, int now)
+{
+  gta_shelf_t *sh;
+
+  w++;
+  h++;
+
+  while((sh = gta_shelf_find(gta, gs, w, h)) == NULL)
+    if(gta_evict(gta, now))
+      return -1;
+
+  *xp = sh->gsh_x;
+  *yp = sh->gsh_y;
+  sh->gsh_x += w;
+  return 0;
+}
+
+
+/**
+ * Copy glyph into atlas, same Luma + Alpha layout as glw_text_bitmap.c
+ */
+static void
+gta_blit(glw_text_atlas_t *gta, const FT_Bitmap *bmp, int x0, int y0)
+{
+  const uint8_t *src = bmp->buffer;
+  uint8_t *dst = gta->gta_bitmap + (y0 * GTA_WIDTH + x0) * GTA_BPP;
+  int x, y;
+
+  for(y = 0; y < bmp->rows; y++) {
+    for(x = 0; x < bmp->width; x++) {
+      dst[x * 2 + 0] = src[x] ? 0xff : 0;
+      dst[x * 2 + 1] = src[x];
+    }
+    src += bmp->pitch;
+    dst += GTA_WIDTH * GTA_BPP;
+  }
+  gta_dirty(gta, y0, bmp->rows);
+}
+
+
+/**
+ * Render glyph into the atlas.
+ *
+ * Returns 0 on success, 1 if the atlas is out of space and -1 if the
+ * glyph can not be rendered at all (FreeType error or too big to ever
+ * fit in the atlas)
+ */
+static int
+gta_rasterize(glw_text_atlas_t *gta, gta_size_t *gs, gta_glyph_t *gg,
+	      int now)
+{
+  FT_Face face = gta->gta_face;
+  FT_GlyphSlot slot;
+  int x = 0, y = 0;
+
+  gta_set_size(gta, gg->gg_size);
+
+  gg->gg_gi = FT_Get_Char_Index(face, gg->gg_uc);
+
+  if(FT_Load_Glyph(face, gg->gg_gi, FT_LOAD_DEFAULT))
+    return -1;
+
+  slot = face->glyph;
+  if(FT_Render_Glyph(slot, FT_RENDER_MODE_NORMAL))
+    return -1;
+
+  if(slot->bitmap.width >= GTA_WIDTH || slot->bitmap.rows >= GTA_HEIGHT)
+    return -1;
+
+  if(slot->bitmap.width > 0 && slot->bitmap.rows > 0) {
+    if(gta_alloc(gta, gs, slot->bitmap.width, slot->bitmap.rows,
+		 &x, &y, now))
+      return 1;
+    gta_blit(gta, &slot->bitmap, x, y);
+  }
+
+  gg->gg_x = x;
+  gg->gg_y = y;
+  gg->gg_w = slot->bitmap.width;
+  gg->gg_h = slot->bitmap.rows;
+  gg->gg_left = slot->bitmap_left;
+  gg->gg_top = slot->bitmap_top;
+  gg->gg_adv_x = slot->advance.x;
+  return 0;
+}
+
+
+/**
+ * Get glyph, rasterizing it into the atlas if it's not already there.
+ * Returns NULL if the glyph can not be rendered. Such misses are
+ * remembered so we don't try again on every layout.
+ *
+ * If there is no room for the glyph, NULL is returned and *fullp is
+ * set. Glyphs of the requested size are never evicted here so
+ * glyphs fetched earlier in the same layout stay valid.
+ */
+const gta_glyph_t *
+glw_text_atlas_get(glw_root_t *gr, int uc, int size, int *fullp)
+{
+  glw_text_atlas_t *gta = gr->gr_gta;
+  int hash = (uc ^ (size << 8)) & GTA_HASH_MASK;
+  gta_size_t *gs = gta_size_get(gta, size);
+  gta_glyph_t *gg;
+  int r;
+
+  gs->gs_last_used = gr->gr_frames;
+
+  LIST_FOREACH(gg, &gta->gta_hash[hash], gg_link)
+    if(gg->gg_uc == uc && gg->gg_size == size)
+      return gg->gg_miss ? NULL : gg;
+
+  gg = calloc(1, sizeof(gta_glyph_t));
+  gg->gg_uc = uc;
+  gg->gg_size = size;
+
+  if((r = gta_rasterize(gta, gs, gg, gr->gr_frames)) == 1) {
+    free(gg);
+    *fullp = 1;
+    return NULL;
+  }
+
+  if(r)
+    gg->gg_miss = 1;
+
+  LIST_INSERT_HEAD(&gta->gta_hash[hash], gg, gg_link);
+  return gg->gg_miss ? NULL : gg;
+}
+
+
+/**
+ * Return kerning (26.6) between two glyphs of the same size
+ */
+int
+glw_text_atlas_kerning(glw_root_t *gr, const gta_glyph_t *prev,
+		       const gta_glyph_t *g)
+{
+  glw_text_atlas_t *gta = gr->gr_gta;
+  FT_Vector delta;
+
+  if(prev == NULL || !prev->gg_gi || !g->gg_gi ||
+     !FT_HAS_KERNING(gta->gta_face))
+    return 0;
+
+  gta_set_size(gta, g->gg_size);
+  if(FT_Get_Kerning(gta->gta_face, prev->gg_gi, g->gg_gi,
+		    FT_KERNING_DEFAULT, &delta))
+    return 0;
+  return delta.x;
+}
+
+
+/**
+ * Return descender in pixels (negative) for the given size
+ */
+int
+glw_text_atlas_descender(glw_root_t *gr, int size)
+{
+  return gr->gr_gta->gta_face->descender * size / 2048;
+}
+
+
+/**
+ * Mark size as used in this frame and return its generation.
+ * The generation changes when glyphs of the size have been evicted
+ * and quads referring to them must be rebuilt
+ */
+int
+glw_text_atlas_use(glw_root_t *gr, int size)
+{
+  gta_size_t *gs = gta_size_get(gr->gr_gta, size);
+
+  gs->gs_last_used = gr->gr_frames;
+  return gs->gs_generation;
+}
+
+
+/**
+ * Convert atlas pixel position to texture coordinates
+ */
+void
+glw_text_atlas_tex_coords(glw_root_t *gr, float *s, float *t, int x, int y)
+{
+  if(gr->gr_normalized_texture_coords) {
+    *s = x / (float)GTA_WIDTH;
+    *t = y / (float)GTA_HEIGHT;
+  } else {
+    *s = x;
+    *t = y;
+  }
+}
+
+
+/**
+ * Return the atlas texture, uploading the rows that have changed since
+ * last time first. Must be called from render context
+ */
+struct glw_backend_texture *
+glw_text_atlas_texture(glw_root_t *gr)
+{
+  glw_text_atlas_t *gta = gr->gr_gta;
+
+  if(!gta->gta_uploaded) {
+    glw_tex_upload(gr, &gta->gta_texture, gta->gta_bitmap,
+		   GLW_TEXTURE_FORMAT_I8A8, GTA_WIDTH, GTA_HEIGHT, 0);
+    gta->gta_uploaded = 1;
+  } else if(gta->gta_dirty_y1 < gta->gta_dirty_y2) {
+    glw_tex_upload_rows(gr, &gta->gta_texture, gta->gta_bitmap,
+			GLW_TEXTURE_FORMAT_I8A8, GTA_WIDTH, GTA_HEIGHT,
+			gta->gta_dirty_y1,
+			gta->gta_dirty_y2 - gta->gta_dirty_y1);
+  }
+  gta->gta_dirty_y1 = gta->gta_dirty_y2 = 0;
+  return &gta->gta_texture;
+}
+
+
+/**
+ *
+ */
+int
+glw_text_atlas_init(glw_root_t *gr, FT_Library lib,
+		    const void *data, size_t size)
+{
+  glw_text_atlas_t *gta = calloc(1, sizeof(glw_text_atlas_t));
+
+  if(FT_New_Memory_Face(lib, data, size, 0, &gta->gta_face)) {
+    free(gta);
+    return -1;
+  }
+
+  FT_Select_Charmap(gta->gta_face, FT_ENCODING_UNICODE);
+
+  gta->gta_bitmap = calloc(1, GTA_WIDTH * GTA_HEIGHT * GTA_BPP);
+  TAILQ_INIT(&gta->gta_shelves);
+  gr->gr_gta = gta;
+  return 0;
+}
@@ -0,0 +1,58 @@
+/*
+ *  GL Widgets, Shared glyph atlas
+ *  Copyright (C) 2011 Andreas Öman
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GLW_TEXT_ATLAS_H
+#define GLW_TEXT_ATLAS_H
+
+/**
+ * A glyph rasterized into the atlas
+ */
+typedef struct gta_glyph {
+  LIST_ENTRY(gta_glyph) gg_link;
+  int gg_uc;
+  int gg_size;
+  FT_UInt gg_gi;
+
+  int16_t gg_x, gg_y;        // Position in atlas
+  int16_t gg_w, gg_h;        // Bitmap size
+  int16_t gg_left, gg_top;   // Bearing
+  int gg_adv_x;              // Advance (26.6)
+  char gg_miss;              // Can't be rendered, never returned
+
+} gta_glyph_t;
+
+
+int glw_text_atlas_init(glw_root_t *gr, FT_Library lib,
+			const void *data, size_t size);
+
+const gta_glyph_t *glw_text_atlas_get(glw_root_t *gr, int uc, int size,
+				       int *fullp);
+
+int glw_text_atlas_kerning(glw_root_t *gr, const gta_glyph_t *prev,
+			   const gta_glyph_t *g);
+
+int glw_text_atlas_descender(glw_root_t *gr, int size);
+
+int glw_text_atlas_use(glw_root_t *gr, int size);
+
+void glw_text_atlas_tex_coords(glw_root_t *gr, float *s, float *t,
+			       int x, int y);
+
+struct glw_backend_texture *glw_text_atlas_texture(glw_root_t *gr);
+
+#endif /* GLW_TEXT_ATLAS_H */
@@ -32,6 +32,7 @@
 #include "glw_texture.h"
 #include "glw_renderer.h"
 #include "glw_text_bitmap.h"
+#include "glw_text_atlas.h"
 #include "glw_unicode.h"
 #include "fileaccess/fileaccess.h"
 #include "misc/string.h"
@@ -135,6 +136,9 @@ typedef struct glw_text_bitmap {
 
   int gtb_flags;
 
+  uint8_t gtb_atlas;   // Set if drawn using the glyph atlas
+  uint8_t gtb_atlas_failed; // Did not fit in atlas, cleared on new caption
+  int gtb_atlas_gen;   // Atlas generation of our size when laid out
 
 } glw_text_bitmap_t;
 
@@ -146,6 +150,10 @@ static glw_class_t glw_text, glw_label, glw_integer;
 
 static void gtb_notify(glw_text_bitmap_t *gtb);
 
+static void gtb_set_constraints(glw_root_t *gr, glw_text_bitmap_t *gtb);
+
+static void gtb_flush(glw_text_bitmap_t *gtb);
+
 
 static FT_Library glw_text_library;
 
@@ -686,6 +694,239 @@ gtb_make_tex(glw_root_t *gr, glw_text_bitmap_data_t *gtbd, FT_Face face,
 }
 
 
+/**
+ * Position a text_width * text_height box inside left,top,right,bottom
+ * according to widget alignment. Oversized text is cut
+ */
+static void
+gtb_align(glw_t *w, int *text_width, int *text_height,
+	  int *left, int *top, int *right, int *bottom)
+{
+  // Horizontal 
+  if(*text_width > *right - *left) {
+    // Oversized, must cut
+    *text_width = *right - *left;
+  } else { 
+    switch(w->glw_alignment) {
+    case GLW_ALIGN_CENTER:
+    case GLW_ALIGN_BOTTOM:
+    case GLW_ALIGN_TOP:
+      *left = (*left + *right - *text_width) / 2;
+      *right = *left + *text_width;
+      break;
+
+    case GLW_ALIGN_LEFT:
+    case GLW_ALIGN_TOP_LEFT:
+    case GLW_ALIGN_BOTTOM_LEFT:
+      *right = *left + *text_width;
+      break;
+
+    case GLW_ALIGN_RIGHT:
+    case GLW_ALIGN_TOP_RIGHT:
+    case GLW_ALIGN_BOTTOM_RIGHT:
+      *left = *right - *text_width;
+      break;
+    }
+  }
+
+  // Vertical 
+  if(*text_height > *top - *bottom) {
+    // Oversized, must cut
+    *text_height = *top - *bottom;
+  } else { 
+    switch(w->glw_alignment) {
+    case GLW_ALIGN_CENTER:
+    case GLW_ALIGN_LEFT:
+    case GLW_ALIGN_RIGHT:
+      *bottom = (*bottom + *top - *text_height) / 2;
+      *top = *bottom + *text_height;
+      break;
+
+    case GLW_ALIGN_TOP_LEFT:
+    case GLW_ALIGN_TOP_RIGHT:
+    case GLW_ALIGN_TOP:
+      *bottom = *top - *text_height;
+      break;
+
+    case GLW_ALIGN_BOTTOM:
+    case GLW_ALIGN_BOTTOM_LEFT:
+    case GLW_ALIGN_BOTTOM_RIGHT:
+      *top = *bottom + *text_height;
+      break;
+    }
+  }
+}
+
+
+/**
+ * Return non-zero if the widget should be drawn using the glyph atlas.
+ * Editable, rich and multi line texts always go via the bitmap renderer
+ * and so does text that the atlas could not make room for
+ */
+static int
+gtb_use_atlas(glw_text_bitmap_t *gtb)
+{
+  return gtb->gtb_flags & GTB_ATLAS && !gtb->gtb_atlas_failed &&
+    gtb->w.glw_class != &glw_text &&
+    gtb->gtb_type == PROP_STR_UTF8 && gtb->gtb_maxlines == 1;
+}
+
+
+/**
+ * Font size in pixels used when drawing via the glyph atlas
+ */
+static int
+gtb_atlas_size(glw_text_bitmap_t *gtb)
+{
+  glw_root_t *gr = gtb->w.glw_root;
+  return gr->gr_fontsize * gtb->gtb_size_scale + gtb->gtb_size_bias;
+}
+
+
+/**
+ * Layout text as a batch of quads referring to glyphs in the shared
+ * atlas. No rasterization or texture upload unless we encounter a
+ * glyph (or size) we have not seen before.
+ *
+ * Returns -1 if the atlas does not have room for all our glyphs
+ */
+static int
+gtb_atlas_layout(glw_text_bitmap_t *gtb, glw_rctx_t *rc)
+{
+  glw_t *w = &gtb->w;
+  glw_root_t *gr = w->glw_root;
+  glw_text_bitmap_data_t *gtbd = &gtb->gtb_data;
+  glw_renderer_t *r = &gtb->gtb_text_renderer;
+  int size     = gtb_atlas_size(gtb);
+  int pxheight = gr->gr_fontsize_px * gtb->gtb_size_scale + gtb->gtb_size_bias;
+  int len = gtb->gtb_uc_len;
+  const gta_glyph_t **glyphs, *g, *prev, *ellipsis;
+  int *pen;
+  int i, n, q, c, x, width, avail;
+  int ellipsized = 0, full = 0;
+
+  if(size < 3)
+    len = 0;
+
+  glyphs = alloca((len + 1) * sizeof(gta_glyph_t *));
+  pen    = alloca((len + 1) * sizeof(int));
+
+  ellipsis = gtb->gtb_flags & GTB_ELLIPSIZE ?
+    glw_text_atlas_get(gr, HORIZONTAL_ELLIPSIS_UNICODE, size, &full) : NULL;
+
+  n = 0;
+  x = 0;
+  prev = NULL;
+
+  for(i = 0; i < len; i++) {
+    c = gtb->gtb_flags & GTB_PASSWORD ? '*' : gtb->gtb_uc_buffer[i];
+    if(c == '\n' || c > 0x7f000000)
+      continue;
+    g = glw_text_atlas_get(gr, c, size, &full);
+    if(g == NULL)
+      continue;
+    x += glw_text_atlas_kerning(gr, prev, g);
+    pen[n] = x;
+    glyphs[n++] = g;
+    x += g->gg_adv_x;
+    prev = g;
+  }
+
+  if(full)
+    return -1;
+
+  width = (x + 63) / 64;
+  avail = rc->rc_width - gtb->gtb_padding_left - gtb->gtb_padding_right;
+
+  if(width > avail && n > 0) {
+    if(ellipsis != NULL) {
+      while(n > 0 && pen[n - 1] + ellipsis->gg_adv_x > avail * 64)
+	n--;
+      while(n > 0 && glyphs[n - 1]->gg_uc == ' ')
+	n--;
+      pen[n] = n > 0 ? pen[n - 1] + glyphs[n - 1]->gg_adv_x : 0;
+      glyphs[n++] = ellipsis;
+      ellipsized = 1;
+    } else {
+      while(n > 0 && pen[n - 1] / 64 + glyphs[n - 1]->gg_left +
+	    glyphs[n - 1]->gg_w > avail)
+	n--;
+    }
+  }
+
+  // Build quads
+
+  int text_width  = n > 0 ? (pen[n - 1] + glyphs[n - 1]->gg_adv_x + 63) / 64:0;
+  int text_height = pxheight;
+  int left   =                 gtb->gtb_padding_left;
+  int top    = rc->rc_height - gtb->gtb_padding_top;
+  int right  = rc->rc_width  - gtb->gtb_padding_right;
+  int bottom =                 gtb->gtb_padding_bottom;
+
+  gtb_align(w, &text_width, &text_height, &left, &top, &right, &bottom);
+
+  int baseline = bottom - glw_text_atlas_descender(gr, size);
+
+  for(q = 0, i = 0; i < n; i++)
+    if(glyphs[i]->gg_w > 0)
+      q++;
+
+  glw_renderer_free(r);
+
+  if(q > 0) {
+    glw_renderer_init(r, q * 4, q * 2, NULL);
+
+    for(q = 0, i = 0; i < n; i++) {
+      float x1, y1, x2, y2, s1, t1, s2, t2;
+      int v = q * 4;
+
+      g = glyphs[i];
+      if(g->gg_w == 0)
+	continue;
+
+      x1 = left + pen[i] / 64 + g->gg_left;
+      y2 = baseline + g->gg_top;
+
+      x2 = -1.0f + 2.0f * (x1 + g->gg_w) / (float)rc->rc_width;
+      y1 = -1.0f + 2.0f * (y2 - g->gg_h) / (float)rc->rc_height;
+      x1 = -1.0f + 2.0f * x1             / (float)rc->rc_width;
+      y2 = -1.0f + 2.0f * y2             / (float)rc->rc_height;
+
+      glw_text_atlas_tex_coords(gr, &s1, &t1, g->gg_x, g->gg_y);
+      glw_text_atlas_tex_coords(gr, &s2, &t2,
+				g->gg_x + g->gg_w, g->gg_y + g->gg_h);
+
+      glw_renderer_vtx_pos(r, v + 0, x1, y1, 0.0);
+      glw_renderer_vtx_st (r, v + 0, s1, t2);
+
+      glw_renderer_vtx_pos(r, v + 1, x2, y1, 0.0);
+      glw_renderer_vtx_st (r, v + 1, s2, t2);
+
+      glw_renderer_vtx_pos(r, v + 2, x2, y2, 0.0);
+      glw_renderer_vtx_st (r, v + 2, s2, t1);
+
+      glw_renderer_vtx_pos(r, v + 3, x1, y2, 0.0);
+      glw_renderer_vtx_st (r, v + 3, s1, t1);
+
+      glw_renderer_triangle(r, q * 2 + 0, v + 0, v + 1, v + 2);
+      glw_renderer_triangle(r, q * 2 + 1, v + 0, v + 2, v + 3);
+      q++;
+    }
+  }
+
+  gtb->gtb_atlas_gen = glw_text_atlas_use(gr, size);
+  gtbd->gtbd_ellipsized = ellipsized;
+  gtbd->gtbd_height = pxheight;
+  gtbd->gtbd_lines = 1;
+
+  if(gtbd->gtbd_width != width) {
+    gtbd->gtbd_width = width;
+    gtb_set_constraints(gr, gtb);
+  }
+  return 0;
+}
+
+
 /**
  *
  */
@@ -695,6 +936,53 @@ glw_text_bitmap_layout(glw_t *w, glw_rctx_t *rc)
   glw_text_bitmap_t *gtb = (void *)w;
   glw_root_t *gr = w->glw_root;
   glw_text_bitmap_data_t *gtbd = &gtb->gtb_data;
+  int atlas = gtb_use_atlas(gtb);
+
+  if(gtb->gtb_atlas != atlas) {
+    // Atlas quads and bitmap texture are not compatible, start over
+    glw_renderer_free(&gtb->gtb_text_renderer);
+    gtb_flush(gtb);
+    gtb->gtb_atlas = atlas;
+  }
+
+  if(atlas) {
+
+    if(gtb->gtb_status == GTB_ON_QUEUE || gtb->gtb_status == GTB_RENDERING)
+      return; // Let bitmap rendering that was already started finish
+
+    if(gtbd->gtbd_data != NULL) {
+      free(gtbd->gtbd_data);
+      gtbd->gtbd_data = NULL;
+      gtb->gtb_status = GTB_NEED_RERENDER;
+    }
+
+    if(gtb->gtb_status == GTB_NEED_RERENDER || gtb->gtb_need_layout ||
+       gtb->gtb_saved_width  != rc->rc_width || 
+       gtb->gtb_saved_height != rc->rc_height ||
+       gtb->gtb_atlas_gen != glw_text_atlas_use(gr, gtb_atlas_size(gtb))) {
+
+      if(!gtb_atlas_layout(gtb, rc)) {
+	gtb->gtb_saved_width  = rc->rc_width;
+	gtb->gtb_saved_height = rc->rc_height;
+	gtb->gtb_need_layout = 0;
+	gtb->gtb_status = GTB_VALID;
+	return;
+      }
+
+      /*
+       * Not enough room in the atlas. Render a bitmap instead (until
+       * the caption changes) so we don't evict glyphs for this text
+       * on every frame
+       */
+      gtb->gtb_atlas_failed = 1;
+      gtb->gtb_atlas = 0;
+      glw_renderer_free(&gtb->gtb_text_renderer);
+      gtb_flush(gtb);
+
+    } else {
+      return;
+    }
+  }
 
   // Initialize renderers
 
@@ -763,59 +1051,7 @@ glw_text_bitmap_layout(glw_t *w, glw_rctx_t *rc)
     
     float x1, y1, x2, y2;
 
-    // Horizontal 
-    if(text_width > right - left) {
-      // Oversized, must cut
-      text_width = right - left;
-    } else { 
-      switch(w->glw_alignment) {
-      case GLW_ALIGN_CENTER:
-      case GLW_ALIGN_BOTTOM:
-      case GLW_ALIGN_TOP:
-	left = (left + right - text_width) / 2;
-	right = left + text_width;
-	break;
-
-      case GLW_ALIGN_LEFT:
-      case GLW_ALIGN_TOP_LEFT:
-      case GLW_ALIGN_BOTTOM_LEFT:
-	right = left + gtbd->gtbd_width;
-	break;
-
-      case GLW_ALIGN_RIGHT:
-      case GLW_ALIGN_TOP_RIGHT:
-      case GLW_ALIGN_BOTTOM_RIGHT:
-	left = right - gtbd->gtbd_width;
-	break;
-      }
-    }
-
-    // Vertical 
-    if(text_height > top - bottom) {
-      // Oversized, must cut
-      text_height = top - bottom;
-    } else { 
-      switch(w->glw_alignment) {
-      case GLW_ALIGN_CENTER:
-      case GLW_ALIGN_LEFT:
-      case GLW_ALIGN_RIGHT:
-	bottom = (bottom + top - text_height) / 2;
-	top = bottom + text_height;
-	break;
-
-      case GLW_ALIGN_TOP_LEFT:
-      case GLW_ALIGN_TOP_RIGHT:
-      case GLW_ALIGN_TOP:
-	bottom = top - gtbd->gtbd_height;
-	break;
-
-      case GLW_ALIGN_BOTTOM:
-      case GLW_ALIGN_BOTTOM_LEFT:
-      case GLW_ALIGN_BOTTOM_RIGHT:
-	top = bottom + gtbd->gtbd_height;
-	break;
-      }
-    }
+    gtb_align(w, &text_width, &text_height, &left, &top, &right, &bottom);
 
     x1 = -1.0f + 2.0f * left   / (float)rc->rc_width;
     y1 = -1.0f + 2.0f * bottom / (float)rc->rc_height;
@@ -885,6 +1121,31 @@ glw_text_bitmap_layout(glw_t *w, glw_rctx_t *rc)
 }
 
 
+/**
+ *
+ */
+static void
+gtb_draw(glw_t *w, glw_rctx_t *rc, glw_backend_texture_t *tex, float alpha)
+{
+  glw_text_bitmap_t *gtb = (void *)w;
+
+  if(w->glw_flags & GLW_SHADOW && !rc->rc_inhibit_shadows) {
+    float xd =  2.0f / rc->rc_width;
+    float yd = -2.0f / rc->rc_height;
+    glw_rctx_t rc0 = *rc;
+
+    glw_Translatef(&rc0, xd, yd, 0.0);
+      
+    const static glw_rgb_t black = {0,0,0};
+      
+    glw_renderer_draw(&gtb->gtb_text_renderer, w->glw_root, &rc0, 
+		      tex, &black, NULL, alpha * 0.75f);
+  }
+  glw_renderer_draw(&gtb->gtb_text_renderer, w->glw_root, rc, 
+		    tex, &gtb->gtb_color, NULL, alpha);
+}
+
+
 /**
  *
  */
@@ -905,22 +1166,15 @@ glw_text_bitmap_render(glw_t *w, glw_rctx_t *rc)
   if(w->glw_flags & GLW_DEBUG)
     glw_wirebox(w->glw_root, rc);
 
-  if(glw_is_tex_inited(&gtb->gtb_texture) && gtb->gtb_data.gtbd_width > 0) {
+  if(gtb->gtb_atlas) {
 
-    if(w->glw_flags & GLW_SHADOW && !rc->rc_inhibit_shadows) {
-      float xd =  2.0f / rc->rc_width;
-      float yd = -2.0f / rc->rc_height;
-      glw_rctx_t rc0 = *rc;
+    if(gtb->gtb_status == GTB_VALID &&
+       glw_renderer_initialized(&gtb->gtb_text_renderer))
+      gtb_draw(w, rc, glw_text_atlas_texture(w->glw_root), alpha);
 
-      glw_Translatef(&rc0, xd, yd, 0.0);
-      
-      const static glw_rgb_t black = {0,0,0};
-      
-      glw_renderer_draw(&gtb->gtb_text_renderer, w->glw_root, &rc0, 
-			&gtb->gtb_texture, &black, NULL, alpha * 0.75f);
-    }
-    glw_renderer_draw(&gtb->gtb_text_renderer, w->glw_root, rc, 
-		      &gtb->gtb_texture, &gtb->gtb_color, NULL, alpha);
+  } else if(glw_is_tex_inited(&gtb->gtb_texture) &&
+	    gtb->gtb_data.gtbd_width > 0) {
+    gtb_draw(w, rc, &gtb->gtb_texture, alpha);
   }
 
   if(gtb->gtb_paint_cursor) {
@@ -1300,6 +1554,7 @@ gtb_caption_has_changed(glw_text_bitmap_t *gtb)
   
   gtb->gtb_uc_size = l;
   gtb->gtb_uc_buffer = realloc(gtb->gtb_uc_buffer, l * sizeof(int));
+  gtb->gtb_atlas_failed = 0;
   
   if(str != NULL) {
 
@@ -1804,6 +2059,12 @@ glw_text_bitmap_init(glw_root_t *gr)
 
   FT_Select_Charmap(gr->gr_gtb_face, FT_ENCODING_UNICODE);
 
+  if(glw_text_atlas_init(gr, glw_text_library, r, fs.fs_size)) {
+    TRACE(TRACE_ERROR, "glw", 
+	  "Unable to create glyph atlas: %s\n", font_variable);
+    return -1;
+  }
+
   hts_cond_init(&gr->gr_gtb_render_cond, &gr->gr_mutex);
 
   glw_font_change_size(gr, 20);
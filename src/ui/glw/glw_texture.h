@@ -39,6 +39,9 @@ typedef struct glw_loadable_texture {
 
   unsigned int glt_refcnt;
 
+  int glt_prio;        // Load priority, lower is more urgent
+  int glt_last_frame;  // gr_frames when last laid out
+
   float glt_aspect;
 
   glw_backend_texture_t glt_texture;
@@ -79,6 +82,9 @@ void glw_tex_deref(glw_root_t *gr, glw_loadable_texture_t *ht);
 
 void glw_tex_layout(glw_root_t *gr, glw_loadable_texture_t *glt);
 
+void glw_tex_layout_prio(glw_root_t *gr, glw_loadable_texture_t *glt,
+			 int prio);
+
 void glw_tex_purge(glw_root_t *gr);
 
 void glw_tex_is_active(glw_root_t *gr, glw_loadable_texture_t *glt);
@@ -111,6 +117,10 @@ void glw_tex_upload(glw_root_t *gr, glw_backend_texture_t *tex,
 		    const void *src, int format, int width, int height,
 		    int flags);
 
+void glw_tex_upload_rows(glw_root_t *gr, glw_backend_texture_t *tex,
+			 const void *src, int format, int width, int height,
+			 int y, int rows);
+
 void glw_tex_destroy(glw_root_t *gr, glw_backend_texture_t *tex);
 
 #endif /* GLW_TEXTURE_H */
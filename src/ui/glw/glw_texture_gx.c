@@ -408,6 +408,18 @@ glw_tex_upload(const glw_root_t *gr, glw_backend_texture_t *tex,
 }
 
 
+/**
+ * Textures are tiled so just convert the whole image again
+ */
+void
+glw_tex_upload_rows(glw_root_t *gr, glw_backend_texture_t *tex,
+		    const void *src, int fmt, int width, int height,
+		    int y, int rows)
+{
+  glw_tex_upload(gr, tex, src, fmt, width, height, 0);
+}
+
+
 /**
  *
  */
@@ -27,9 +27,28 @@
 
 #include "backend/backend.h"
 
-#define LQ_ALL_OTHER 0
-#define LQ_THEME     1
-#define LQ_THUMBS    2
+/**
+ * Extra loader threads we allow to be blocked on I/O (remote URLs, etc)
+ * on top of the ones doing CPU bound decoding work
+ */
+#define GLW_TEX_IO_THREADS 4
+
+/**
+ * Idle time (in ms) after which surplus loader threads exit
+ */
+#define GLW_TEX_IDLE_TIMEOUT 10000
+
+/**
+ * If a queued texture has not been laid out for this many frames it is
+ * no longer on screen and the request is cancelled. If it shows up again
+ * glw_tex_layout() will simply requeue it
+ */
+#define GLW_TEX_CANCEL_FRAMES 30
+
+/**
+ * Return codes from glw_tex_load() (besides 0 and -1)
+ */
+#define GLW_TEX_LOAD_CANCELLED 1
 
 static void glw_tex_deref_locked(glw_root_t *gr, glw_loadable_texture_t *glt);
 
@@ -63,20 +82,93 @@ glw_tex_autoflush(glw_root_t *gr)
   LIST_MOVE(&gr->gr_tex_flush_list, &gr->gr_tex_active_list, glt_flush_link);
   LIST_INIT(&gr->gr_tex_active_list);
 
+  gr->gr_tex_frame = gr->gr_frames;
+
   hts_mutex_unlock(&gr->gr_tex_mutex);
 }
 
 
 /**
+ * Return non-zero if the texture is no longer wanted by anyone.
+ * Must be called with gr_tex_mutex held
+ */
+static int
+glw_tex_is_stale(glw_root_t *gr, glw_loadable_texture_t *glt)
+{
+  return glt->glt_refcnt <= 1 ||
+    gr->gr_tex_frame - glt->glt_last_frame > GLW_TEX_CANCEL_FRAMES;
+}
+
+
+/**
+ * Sort key for queued textures, lower is loaded first.
  *
+ * Textures laid out in the current frame (ie, visible) always go before
+ * those that are not. Then comes distance from focus and finally
+ * theme graphics before thumbnails before other images
  */
-typedef struct loaderaux {
-  glw_root_t *gr;
-  struct glw_loadable_texture_queue *q;
-  hts_cond_t *cond;
-} loaderaux_t;
+static int
+glw_tex_sort_key(glw_root_t *gr, const glw_loadable_texture_t *glt)
+{
+  int key = GLW_CLAMP(glt->glt_prio, 0, 255) * 4;
+
+  if(glt->glt_filename == NULL || !strncmp(glt->glt_filename, "theme://", 8))
+    key += 0;
+  else if(!strncmp(glt->glt_filename, "thumb://", 8))
+    key += 1;
+  else
+    key += 2;
+
+  if(gr->gr_tex_frame - glt->glt_last_frame > 1)
+    key += 0x10000;
+  return key;
+}
 
 
+/**
+ * Cancel a queued load request.
+ * Must be called with gr_tex_mutex held
+ */
+static void
+glw_tex_cancel(glw_root_t *gr, glw_loadable_texture_t *glt)
+{
+  TAILQ_REMOVE(&gr->gr_tex_load_queue, glt, glt_work_link);
+  glt->glt_state = GLT_STATE_INACTIVE;
+  glw_tex_deref_locked(gr, glt);
+}
+
+
+/**
+ * Pick the most urgent texture from the load queue, cancelling stale
+ * requests on the way. Returns NULL if there is nothing to do.
+ * Must be called with gr_tex_mutex held
+ */
+static glw_loadable_texture_t *
+glw_tex_pick(glw_root_t *gr)
+{
+  glw_loadable_texture_t *glt, *next, *best = NULL;
+  int key, bestkey = 0;
+
+  for(glt = TAILQ_FIRST(&gr->gr_tex_load_queue); glt != NULL; glt = next) {
+    next = TAILQ_NEXT(glt, glt_work_link);
+
+    if(glw_tex_is_stale(gr, glt)) {
+      glw_tex_cancel(gr, glt);
+      continue;
+    }
+
+    key = glw_tex_sort_key(gr, glt);
+    if(best == NULL || key < bestkey) {
+      best = glt;
+      bestkey = key;
+    }
+  }
+
+  if(best != NULL)
+    TAILQ_REMOVE(&gr->gr_tex_load_queue, best, glt_work_link);
+  return best;
+}
+
 
 /**
  *
@@ -84,81 +176,86 @@ typedef struct loaderaux {
 static void *
 loader_thread(void *aux)
 {
-  loaderaux_t *la = aux;
-  glw_root_t *gr = la->gr;
+  glw_root_t *gr = aux;
   glw_loadable_texture_t *glt;
   int r;
 
   hts_mutex_lock(&gr->gr_tex_mutex);
 
   while(1) {
-    
-    if((glt = TAILQ_FIRST(la->q)) == NULL) {
-      hts_cond_wait(la->cond, &gr->gr_tex_mutex);
+
+    if((glt = glw_tex_pick(gr)) == NULL) {
+      gr->gr_tex_threads_idle++;
+      r = hts_cond_wait_timeout(&gr->gr_tex_load_cond, &gr->gr_tex_mutex,
+				GLW_TEX_IDLE_TIMEOUT);
+      gr->gr_tex_threads_idle--;
+
+      if(r && TAILQ_FIRST(&gr->gr_tex_load_queue) == NULL &&
+	 gr->gr_tex_threads > gr->gr_tex_threads_cpu)
+	break;
       continue;
     }
 
-    TAILQ_REMOVE(la->q, glt, glt_work_link);
+    hts_mutex_unlock(&gr->gr_tex_mutex);
+    r = glw_tex_load(gr, glt);
+    hts_mutex_lock(&gr->gr_tex_mutex);
 
-    if(glt->glt_refcnt > 1) {
-      hts_mutex_unlock(&gr->gr_tex_mutex);
-      r = glw_tex_load(gr, glt);
-      hts_mutex_lock(&gr->gr_tex_mutex);
+    if(r == GLW_TEX_LOAD_CANCELLED) {
+      glt->glt_state = GLT_STATE_INACTIVE;
     } else {
-      r = 0;
+      glt->glt_state = r < 0 ? GLT_STATE_ERROR : GLT_STATE_VALID;
+      LIST_INSERT_HEAD(&gr->gr_tex_active_list, glt, glt_flush_link);
     }
-    
-    glt->glt_state =  r < 0 ? GLT_STATE_ERROR : GLT_STATE_VALID;
-
-    LIST_INSERT_HEAD(&gr->gr_tex_active_list, glt, glt_flush_link);
-
     glw_tex_deref_locked(gr, glt);
   }
- 
+
+  gr->gr_tex_threads--;
+  hts_mutex_unlock(&gr->gr_tex_mutex);
   return NULL;
 }
 
-static loaderaux_t *
-lacreate(glw_root_t *gr, int i)
+
+/**
+ * Wakeup an idle loader thread or, if all threads are busy and some
+ * of them are just waiting for I/O, start a new one.
+ * Must be called with gr_tex_mutex held
+ */
+static void
+glw_tex_kick_loader(glw_root_t *gr)
 {
-  loaderaux_t *la = malloc(sizeof(loaderaux_t));
-  la->gr = gr;
+  int cpu;
 
-  la->q = &gr->gr_tex_load_queue[i];
-  TAILQ_INIT(la->q);
+  if(gr->gr_tex_threads_idle > 0) {
+    hts_cond_signal(&gr->gr_tex_load_cond);
+    return;
+  }
+
+  cpu = gr->gr_tex_threads - gr->gr_tex_threads_io;
 
-  la->cond = &gr->gr_tex_load_cond[i];
-  hts_cond_init(la->cond, &gr->gr_tex_mutex);
-  return la;
+  if(cpu >= gr->gr_tex_threads_cpu ||
+     gr->gr_tex_threads >= gr->gr_tex_threads_cpu + GLW_TEX_IO_THREADS)
+    return;
+
+  gr->gr_tex_threads++;
+  hts_thread_create_detached("GLW texture loader", loader_thread, gr,
+			     THREAD_PRIO_NORMAL);
 }
 
+
 /**
  *
  */
 void
 glw_tex_init(glw_root_t *gr)
 {
-  int i;
   extern int concurrency;
-  loaderaux_t *la;
 
   hts_mutex_init(&gr->gr_tex_mutex);
   TAILQ_INIT(&gr->gr_tex_rel_queue);
+  TAILQ_INIT(&gr->gr_tex_load_queue);
+  hts_cond_init(&gr->gr_tex_load_cond, &gr->gr_tex_mutex);
 
-  la = lacreate(gr, LQ_ALL_OTHER);
-
-  for(i = 0; i < GLW_MAX(concurrency / 2, 2); i++)
-    hts_thread_create_detached("GLW texture loader", loader_thread, la,
-			       THREAD_PRIO_NORMAL);
-
-  la = lacreate(gr, LQ_THEME);
-  hts_thread_create_detached("texture theme loader", loader_thread, la,
-			     THREAD_PRIO_NORMAL);
-
-  la = lacreate(gr, LQ_THUMBS);
-  for(i = 0; i < 2; i++)
-    hts_thread_create_detached("texture thumbs", loader_thread, la,
-			       THREAD_PRIO_NORMAL);
+  gr->gr_tex_threads_cpu = GLW_MAX(concurrency / 2, 2);
 }
 
 /**
@@ -213,8 +310,25 @@ glw_tex_load(glw_root_t *gr, glw_loadable_texture_t *glt)
     want_thumb = 0;
   }
 
+  hts_mutex_lock(&gr->gr_tex_mutex);
+  gr->gr_tex_threads_io++;
+  hts_mutex_unlock(&gr->gr_tex_mutex);
+
   pixmap_t *pm = backend_imageloader(url, want_thumb, gr->gr_vpaths, errbuf, 
 				     sizeof(errbuf));
+
+  hts_mutex_lock(&gr->gr_tex_mutex);
+  gr->gr_tex_threads_io--;
+  r = glw_tex_is_stale(gr, glt);
+  hts_mutex_unlock(&gr->gr_tex_mutex);
+
+  if(r) {
+    // Scrolled out of view while we were fetching, don't bother decoding
+    if(pm != NULL)
+      pixmap_release(pm);
+    return GLW_TEX_LOAD_CANCELLED;
+  }
+
   if(pm == NULL) {
     TRACE(TRACE_ERROR, "GLW", "Unable to load %s -- %s", url, errbuf);
     return -1;
@@ -451,40 +565,51 @@ glw_tex_create_from_pixmap(glw_root_t *gr, pixmap_t *pm)
  *
  */
 static void
-gl_tex_req_load(glw_root_t *gr, glw_loadable_texture_t *glt)
+gl_tex_req_load(glw_root_t *gr, glw_loadable_texture_t *glt, int prio)
 {
   hts_mutex_lock(&gr->gr_tex_mutex);
   glt->glt_refcnt++;
+  glt->glt_prio = prio;
+  glt->glt_last_frame = gr->gr_frames;
 
-  int q = LQ_ALL_OTHER;
+  TAILQ_INSERT_TAIL(&gr->gr_tex_load_queue, glt, glt_work_link);
+  glt->glt_state = GLT_STATE_LOADING;
 
-  if(glt->glt_filename != NULL) {
-    if(!strncmp(glt->glt_filename, "thumb://", 8))
-      q = LQ_THUMBS;
-    else if(!strncmp(glt->glt_filename, "theme://", 8))
-      q  = LQ_THEME;
-  }
+  glw_tex_kick_loader(gr);
+  hts_mutex_unlock(&gr->gr_tex_mutex);
+}
 
-  TAILQ_INSERT_TAIL(&gr->gr_tex_load_queue[q], glt, glt_work_link);
-  glt->glt_state = GLT_STATE_LOADING;
 
-  hts_cond_signal(&gr->gr_tex_load_cond[q]);
+/**
+ * Keep a queued request alive and update its priority.
+ * If several widgets share the texture, the most urgent one wins
+ */
+static void
+gl_tex_touch(glw_root_t *gr, glw_loadable_texture_t *glt, int prio)
+{
+  hts_mutex_lock(&gr->gr_tex_mutex);
+  if(glt->glt_last_frame != gr->gr_frames || prio < glt->glt_prio)
+    glt->glt_prio = prio;
+  glt->glt_last_frame = gr->gr_frames;
   hts_mutex_unlock(&gr->gr_tex_mutex);
 }
 
 
 /**
- *
+ * Layout texture. 'prio' is a hint to the loader about how urgent the
+ * texture is, typically the distance from focus of the widget
+ * displaying it
  */
 void
-glw_tex_layout(glw_root_t *gr, glw_loadable_texture_t *glt)
+glw_tex_layout_prio(glw_root_t *gr, glw_loadable_texture_t *glt, int prio)
 {
   switch(glt->glt_state) {
   case GLT_STATE_INACTIVE:
-    gl_tex_req_load(gr, glt);
+    gl_tex_req_load(gr, glt, prio);
     return;
     
   case GLT_STATE_LOADING:
+    gl_tex_touch(gr, glt, prio);
     return;
 
   case GLT_STATE_VALID:
@@ -496,3 +621,13 @@ glw_tex_layout(glw_root_t *gr, glw_loadable_texture_t *glt)
     break;
   }
 }
+
+
+/**
+ *
+ */
+void
+glw_tex_layout(glw_root_t *gr, glw_loadable_texture_t *glt)
+{
+  glw_tex_layout_prio(gr, glt, 0);
+}
@@ -406,6 +406,7 @@ glw_tex_upload(glw_root_t *gr, glw_backend_texture_t *tex,
   int ext_format;
   int ext_type;
   int m = gr->gr_be.gbr_primary_texture_mode;
+  int64_t ts = showtime_get_ts();
 
   if(tex->tex == 0) {
     glGenTextures(1, &tex->tex);
@@ -450,6 +451,53 @@ glw_tex_upload(glw_root_t *gr, glw_backend_texture_t *tex,
   tex->height = height;
 
   glTexImage2D(m, 0, format, width, height, 0, ext_format, ext_type, src);
+
+  gr->gr_tex_upload_time += showtime_get_ts() - ts;
+  gr->gr_tex_uploads++;
+}
+
+
+/**
+ * Update rows [y, y + rows) of a texture previously uploaded with
+ * glw_tex_upload() using the same format and dimensions.
+ * 'src' points to the full image
+ */
+void
+glw_tex_upload_rows(glw_root_t *gr, glw_backend_texture_t *tex,
+		    const void *src, int fmt, int width, int height,
+		    int y, int rows)
+{
+  int ext_format;
+  int bpp;
+  int m = gr->gr_be.gbr_primary_texture_mode;
+  int64_t ts = showtime_get_ts();
+
+  switch(fmt) {
+  case GLW_TEXTURE_FORMAT_RGBA:
+    ext_format = GL_RGBA;
+    bpp = 4;
+    break;
+
+  case GLW_TEXTURE_FORMAT_RGB:
+    ext_format = GL_RGB;
+    bpp = 3;
+    break;
+
+  case GLW_TEXTURE_FORMAT_I8A8:
+    ext_format = GL_LUMINANCE_ALPHA;
+    bpp = 2;
+    break;
+
+  default:
+    return;
+  }
+
+  glBindTexture(m, tex->tex);
+  glTexSubImage2D(m, 0, 0, y, width, rows, ext_format, GL_UNSIGNED_BYTE,
+		  (const uint8_t *)src + y * width * bpp);
+
+  gr->gr_tex_upload_time += showtime_get_ts() - ts;
+  gr->gr_tex_uploads++;
 }
 
 
@@ -373,6 +373,35 @@ glw_tex_upload(glw_root_t *gr, glw_backend_texture_t *tex,
 }
 
 
+/**
+ * Update rows [y, y + rows) of a texture previously uploaded with
+ * glw_tex_upload() using the same format and dimensions.
+ * 'src' points to the full image
+ */
+void
+glw_tex_upload_rows(glw_root_t *gr, glw_backend_texture_t *tex,
+		    const void *src, int fmt, int width, int height,
+		    int y, int rows)
+{
+  const uint8_t *s;
+  uint16_t *dst;
+  int i;
+
+  if(fmt != GLW_TEXTURE_FORMAT_I8A8 || tex->size != width * height * 2) {
+    glw_tex_upload(gr, tex, src, fmt, width, height, 0);
+    return;
+  }
+
+  s = (const uint8_t *)src + y * width * 2;
+  dst = (uint16_t *)rsx_to_ppu(gr, tex->tex.offset) + y * width;
+
+  for(i = 0; i < rows * width; i++) {
+    dst[i] = (s[1] << 8) | s[0];
+    s += 2;
+  }
+}
+
+
 /**
  *
  */
@@ -22,6 +22,7 @@
 #include "showtime.h"
 #include "media.h"
 #include "video/video_playback.h"
+#include "video/video_timing.h"
 
 #include "glw.h"
 #include "glw_video_common.h"
@@ -214,6 +215,59 @@ glw_video_dtor(glw_t *w)
 }
 
 
+/**
+ * Record a frame timing sample for the frame we just laid out
+ */
+static void
+glw_video_record_timing(glw_video_t *gv, video_decoder_t *vd,
+			int depth, int64_t pts)
+{
+  glw_root_t *gr = gv->w.glw_root;
+  video_timing_sample_t vts;
+  int64_t delta;
+  int est = vd->vd_estimated_duration;
+
+  if(gv->gv_cfg_cur.gvc_engine == &glw_video_blank || vd->vd_hold) {
+    /* Nothing playing, start over once we are */
+    gv->gv_timing_last_start = 0;
+    gv->gv_timing_last_pts = AV_NOPTS_VALUE;
+    return;
+  }
+
+  memset(&vts, 0, sizeof(vts));
+  vts.vts_time = gr->gr_frame_start;
+  vts.vts_pts = pts;
+  vts.vts_output_duration =
+    glw_video_compute_output_duration(vd, gr->gr_frameduration);
+  vts.vts_decode_time = vd->vd_decode_time.samples[vd->vd_decode_time.ptr];
+  vts.vts_avdiff = vd->vd_avdiff;
+  vts.vts_avdiff_x = vd->vd_avdiff_x;
+  vts.vts_queue_depth = MIN(depth, 255);
+  vts.vts_repeated = pts == AV_NOPTS_VALUE && depth == 0;
+
+  if(gv->gv_timing_last_start) {
+    vts.vts_interval = gr->gr_frame_start - gv->gv_timing_last_start;
+    vts.vts_vsync_error = vts.vts_interval - gr->gr_frameduration;
+  }
+
+  if(pts != AV_NOPTS_VALUE && gv->gv_timing_last_pts != AV_NOPTS_VALUE &&
+     est > 0) {
+    delta = pts - gv->gv_timing_last_pts;
+    /* Anything beyond a second is a seek or a clock discontinuity */
+    if(delta > 0 && delta < 1000000) {
+      delta = (delta - vts.vts_output_duration + est / 2) / est;
+      vts.vts_dropped = delta < 0 ? 0 : MIN(delta, 255);
+    }
+  }
+
+  gv->gv_timing_last_start = gr->gr_frame_start;
+  if(pts != AV_NOPTS_VALUE)
+    gv->gv_timing_last_pts = pts;
+
+  video_timing_record(&vts);
+}
+
+
 /**
  *
  */
@@ -222,17 +276,24 @@ glw_video_newframe(glw_t *w, int flags)
 {
   glw_video_t *gv = (glw_video_t *)w;
   video_decoder_t *vd = gv->gv_vd;
+  glw_video_surface_t *s;
   int64_t pts;
+  int depth = 0;
 
   hts_mutex_lock(&gv->gv_surface_mutex);
 
   if(memcmp(&gv->gv_cfg_cur, &gv->gv_cfg_req, sizeof(glw_video_config_t)))
     glw_video_surface_reconfigure(gv);
 
+  TAILQ_FOREACH(s, &gv->gv_decoded_queue, gvs_link)
+    depth++;
+
   hts_mutex_unlock(&gv->gv_surface_mutex);
 
   pts = gv->gv_cfg_cur.gvc_engine->gve_newframe(gv, vd, flags);
 
+  glw_video_record_timing(gv, vd, depth, pts);
+
   glw_video_overlay_layout(gv, pts, vd);
 }
 
@@ -300,6 +361,8 @@ glw_video_ctor(glw_t *w)
   hts_cond_init(&gv->gv_avail_queue_cond, &gv->gv_surface_mutex);
   hts_cond_init(&gv->gv_reconf_cond, &gv->gv_surface_mutex);
 
+  gv->gv_timing_last_pts = AV_NOPTS_VALUE;
+
   gv->gv_mp = mp_create("Video decoder", MP_VIDEO | MP_PRIMABLE, NULL);
 #if CONFIG_GLW_BACKEND_OPENGL
   if(gr->gr_be.gbr_enable_vdpau)
@@ -639,6 +702,9 @@ glw_video_reset(glw_root_t *gr)
 
     hts_mutex_lock(&gv->gv_surface_mutex);
 
+    while(gv->gv_surface_busy)
+      hts_cond_wait(&gv->gv_reconf_cond, &gv->gv_surface_mutex);
+
     glw_video_surfaces_cleanup(gv);
     gv->gv_cfg_cur.gvc_engine = &glw_video_blank;
 
@@ -161,6 +161,18 @@ typedef struct glw_video {
   
   hts_mutex_t gv_surface_mutex;
 
+  /**
+   * Set while the decoder writes into a surface without holding
+   * gv_surface_mutex. Cleared with a broadcast on gv_reconf_cond
+   */
+  int gv_surface_busy;
+
+  /**
+   * Frame timing telemetry, only accessed from the UI thread
+   */
+  int64_t gv_timing_last_start;
+  int64_t gv_timing_last_pts;
+
   /**
    * Frames available for decoder
    * Once we push frames here we also notify via gv_avail_queue_cond
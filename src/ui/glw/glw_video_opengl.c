@@ -82,12 +82,27 @@ yuvp_reset(glw_video_t *gv)
 
 
 /**
- *
+ *  Texture loader
+ */
+static void
+gv_set_tex_meta(int textype)
+{
+  glTexParameteri(textype, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(textype, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexParameteri(textype, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(textype, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+}
+
+
+/**
+ * Texture storage is allocated once here, uploads only replace
+ * the contents
  */
 static void
 surface_init(glw_video_t *gv, glw_video_surface_t *gvs,
 	     const glw_video_config_t *gvc)
 {
+  int textype = gv->w.glw_root->gr_be.gbr_primary_texture_mode;
   int i;
 
   glGenBuffers(3, gvs->gvs_pbo);
@@ -95,6 +110,11 @@ surface_init(glw_video_t *gv, glw_video_surface_t *gvs,
   gvs->gvs_uploaded = 0;
   for(i = 0; i < 3; i++) {
 
+    glBindTexture(textype, gvs->gvs_textures[i]);
+    gv_set_tex_meta(textype);
+    glTexImage2D(textype, 0, 1, gvc->gvc_width[i], gvc->gvc_height[i],
+		 0, GL_LUMINANCE, GL_UNSIGNED_BYTE, NULL);
+
     glBindBuffer(GL_PIXEL_UNPACK_BUFFER, gvs->gvs_pbo[i]);
 	
     glBufferData(GL_PIXEL_UNPACK_BUFFER,
@@ -128,19 +148,6 @@ yuvp_init(glw_video_t *gv)
 
 
 
-/**
- *  Texture loader
- */
-static void
-gv_set_tex_meta(int textype)
-{
-  glTexParameteri(textype, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-  glTexParameteri(textype, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-  glTexParameteri(textype, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-  glTexParameteri(textype, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-}
-
-
 /**
  *
  */
@@ -152,43 +159,30 @@ gv_tex_get(glw_video_surface_t *gvs, int plane)
 
 
 /**
- *
+ * Unmap the PBOs and start the transfer into the textures. This is
+ * asynchronous so we try to do it well before the surface is displayed
  */
 static void
 gv_surface_pixmap_upload(glw_video_surface_t *gvs,
 			 const glw_video_config_t *gvc, int textype)
 {
+  int i;
+
   if(gvs->gvs_uploaded || gvs->gvs_pbo[0] == 0)
     return;
 
   gvs->gvs_uploaded = 1;
 
-  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, gvs->gvs_pbo[0]);
-  glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
-  glBindTexture(textype, gv_tex_get(gvs, GVF_TEX_L));
-  gv_set_tex_meta(textype);
-  glTexImage2D(textype, 0, 1, gvc->gvc_width[0], gvc->gvc_height[0],
-	       0, GL_LUMINANCE, GL_UNSIGNED_BYTE, NULL);
-
-  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, gvs->gvs_pbo[1]);
-  glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
-  glBindTexture(textype, gv_tex_get(gvs, GVF_TEX_Cr));
-  gv_set_tex_meta(textype);
-  glTexImage2D(textype, 0, 1, gvc->gvc_width[1], gvc->gvc_height[1],
-	       0, GL_LUMINANCE, GL_UNSIGNED_BYTE, NULL);
-
-  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, gvs->gvs_pbo[2]);
-  glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
-  glBindTexture(textype, gv_tex_get(gvs, GVF_TEX_Cb));
-  gv_set_tex_meta(textype);
-  glTexImage2D(textype, 0, 1, gvc->gvc_width[2], gvc->gvc_height[2],
-	       0, GL_LUMINANCE, GL_UNSIGNED_BYTE, NULL);
+  for(i = 0; i < 3; i++) {
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, gvs->gvs_pbo[i]);
+    glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+    glBindTexture(textype, gv_tex_get(gvs, i));
+    glTexSubImage2D(textype, 0, 0, 0, gvc->gvc_width[i], gvc->gvc_height[i],
+		    GL_LUMINANCE, GL_UNSIGNED_BYTE, NULL);
+    gvs->gvs_pbo_ptr[i] = NULL;
+  }
 
   glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
-
-  gvs->gvs_pbo_ptr[0] = NULL;
-  gvs->gvs_pbo_ptr[1] = NULL;
-  gvs->gvs_pbo_ptr[2] = NULL;
 }
 
 
@@ -405,6 +399,14 @@ yuvp_newframe(glw_video_t *gv, video_decoder_t *vd, int flags)
       glw_video_enqueue_for_display(gv, sb, &gv->gv_decoded_queue);
   }
 
+  /* Kick off transfers for everything the decoder has delivered so
+     far. The PBO -> texture copy then runs while we render this frame */
+  hts_mutex_lock(&gv->gv_surface_mutex);
+  TAILQ_FOREACH(s, &gv->gv_decoded_queue, gvs_link)
+    gv_surface_pixmap_upload(s, &gv->gv_cfg_cur,
+			     gr->gr_be.gbr_primary_texture_mode);
+  hts_mutex_unlock(&gv->gv_surface_mutex);
+
   if(pts != AV_NOPTS_VALUE) {
     pts -= frame_duration * 2;
     glw_video_compute_avdiff(gr, vd, mp, pts, epoch);
@@ -606,9 +608,34 @@ static glw_video_engine_t glw_video_opengl = {
 };
 
 
+/**
+ * Copying a frame into the PBOs takes a while, so we release
+ * gv_surface_mutex meanwhile. The surface sits on no queue so nobody
+ * else will touch it, except glw_video_reset() which waits for us
+ */
+static void
+surface_copy_begin(glw_video_t *gv)
+{
+  gv->gv_surface_busy = 1;
+  hts_mutex_unlock(&gv->gv_surface_mutex);
+}
+
+
 /**
  *
  */
+static void
+surface_copy_end(glw_video_t *gv)
+{
+  hts_mutex_lock(&gv->gv_surface_mutex);
+  gv->gv_surface_busy = 0;
+  hts_cond_broadcast(&gv->gv_reconf_cond);
+}
+
+
+/**
+ * gv_surface_mutex must be held
+ */
 void
 glw_video_input_yuvp(glw_video_t *gv,
 		     uint8_t * const data[], const int pitch[],
@@ -633,7 +660,9 @@ glw_video_input_yuvp(glw_video_t *gv,
   hvec[1] = fi->height >> (vshift + fi->interlaced);
   hvec[2] = fi->height >> (vshift + fi->interlaced);
 
-  if(glw_video_configure(gv, &glw_video_opengl, wvec, hvec, 3,
+  /* One more surface than strictly needed so there is always a
+     decoded frame in flight to the GPU */
+  if(glw_video_configure(gv, &glw_video_opengl, wvec, hvec, 4,
 			 fi->interlaced ? (GVC_YHALF | GVC_CUTBORDER) : 0))
     return;
   
@@ -644,6 +673,8 @@ glw_video_input_yuvp(glw_video_t *gv,
 
   if(!fi->interlaced) {
 
+    surface_copy_begin(gv);
+
     for(i = 0; i < 3; i++) {
       w = wvec[i];
       h = hvec[i];
@@ -657,6 +688,8 @@ glw_video_input_yuvp(glw_video_t *gv,
       }
     }
 
+    surface_copy_end(gv);
+
     glw_video_put_surface(gv, s, pts, fi->epoch, fi->duration, 0);
 
   } else {
@@ -665,6 +698,8 @@ glw_video_input_yuvp(glw_video_t *gv,
 
     tff = fi->tff ^ parity;
 
+    surface_copy_begin(gv);
+
     for(i = 0; i < 3; i++) {
       w = wvec[i];
       h = hvec[i];
@@ -678,12 +713,16 @@ glw_video_input_yuvp(glw_video_t *gv,
 	src += pitch[i] * 2;
       }
     }
+
+    surface_copy_end(gv);
     
     glw_video_put_surface(gv, s, pts, fi->epoch, duration, !tff);
 
     if((s = glw_video_get_surface(gv)) == NULL)
       return;
 
+    surface_copy_begin(gv);
+
     for(i = 0; i < 3; i++) {
       w = wvec[i];
       h = hvec[i];
@@ -697,6 +736,8 @@ glw_video_input_yuvp(glw_video_t *gv,
 	src += pitch[i] * 2;
       }
     }
+
+    surface_copy_end(gv);
     
     if(pts != AV_NOPTS_VALUE)
       pts += duration;
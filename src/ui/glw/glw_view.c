@@ -147,26 +147,44 @@ glw_view_create(glw_root_t *gr, const char *src,
   }
 
   if(gcv == NULL) {
-    token_t *sof = calloc(1, sizeof(token_t));
-    sof->type = TOKEN_START;
+    token_t *sof = glw_view_cache_load(gr, src);
+
+    if(sof == NULL) {
+      struct glw_view_file_list files;
+      int err;
+
+      sof = calloc(1, sizeof(token_t));
+      sof->type = TOKEN_START;
 #ifdef GLW_VIEW_ERRORINFO
-    sof->file = rstr_alloc(src);
+      sof->file = rstr_alloc(src);
 #endif
 
-    if((l = glw_view_load1(gr, src, &ei, sof)) == NULL) {
-      glw_view_free_chain(sof);
-      return glw_view_error(gr, &ei, parent);
-    }
-    eof = calloc(1, sizeof(token_t));
-    eof->type = TOKEN_END;
+      LIST_INIT(&files);
+      gr->gr_view_files = &files;
+
+      if((l = glw_view_load1(gr, src, &ei, sof)) != NULL) {
+	eof = calloc(1, sizeof(token_t));
+	eof->type = TOKEN_END;
 #ifdef GLW_VIEW_ERRORINFO
-    eof->file = rstr_alloc(src);
+	eof->file = rstr_alloc(src);
 #endif
-    l->next = eof;
-  
-    if(glw_view_preproc(gr, sof, &ei) || glw_view_parse(sof, &ei)) {
-      glw_view_free_chain(sof);
-      return glw_view_error(gr, &ei, parent);
+	l->next = eof;
+	err = glw_view_preproc(gr, sof, &ei) || glw_view_parse(sof, &ei);
+      } else {
+	err = 1;
+      }
+
+      gr->gr_view_files = NULL;
+
+      if(!err)
+	glw_view_cache_save(gr, src, sof, &files);
+
+      glw_view_cache_free_files(&files);
+
+      if(err) {
+	glw_view_free_chain(sof);
+	return glw_view_error(gr, &ei, parent);
+      }
     }
 
     if(cache) {
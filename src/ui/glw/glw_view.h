@@ -256,6 +256,8 @@ typedef struct token_attrib {
 
 
 
+void glw_view_token_clear(token_t *t);
+
 void glw_view_token_free(token_t *t);
 
 token_t *glw_view_token_copy(token_t *src);
@@ -287,8 +289,35 @@ int glw_view_preproc(glw_root_t *gr, token_t *p, errorinfo_t *ei);
 
 token_t *glw_view_clone_chain(token_t *src);
 
+void glw_view_rpn_fold(token_t *rpn);
+
+int glw_view_eval_dynamics(struct glw *w, struct glw_rctx *rc);
+
+void glw_view_token_pool_flush(glw_root_t *gr);
+
 void glw_view_cache_flush(glw_root_t *gr);
 
+/**
+ * A file that was loaded while building a view
+ */
+typedef struct glw_view_file {
+  LIST_ENTRY(glw_view_file) gvf_link;
+  char *gvf_url;
+  time_t gvf_mtime;
+  uint64_t gvf_size;
+} glw_view_file_t;
+
+LIST_HEAD(glw_view_file_list, glw_view_file);
+
+void glw_view_cache_add_file(glw_root_t *gr, const char *url);
+
+void glw_view_cache_free_files(struct glw_view_file_list *l);
+
+void glw_view_cache_save(glw_root_t *gr, const char *src, token_t *sof,
+			 struct glw_view_file_list *files);
+
+token_t *glw_view_cache_load(glw_root_t *gr, const char *src);
+
 struct glw_prop_sub_list;
 void glw_prop_subscription_destroy_list(struct glw_prop_sub_list *l);
 
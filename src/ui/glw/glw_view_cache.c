@@ -0,0 +1,578 @@
+/*
+ *  GL Widgets, Precompiled view cache
+ *  Copyright (C) 2011 Andreas Öman
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Parsed (preprocessed) views are serialized into the blobcache
+ * together with a list of every file that went into them.
+ * On next load the cached tree is used directly if none of those
+ * files has changed, skipping lexer, preprocessor and parser.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "showtime.h"
+#include "blobcache.h"
+#include "fileaccess/fileaccess.h"
+#include "htsmsg/htsbuf.h"
+
+#include "glw.h"
+#include "glw_view.h"
+
+#define GLW_VIEW_CACHE_MAGIC   0x47564331 // 'GVC1'
+#define GLW_VIEW_CACHE_VERSION 2
+#define GLW_VIEW_CACHE_MAXAGE  (86400 * 30)
+
+#define GVC_END_OF_CHAIN 0xff
+
+/**
+ * Serialization state
+ */
+typedef struct gvc_writer {
+  htsbuf_queue_t gw_hq;
+  rstr_t **gw_files;
+  int gw_nfiles;
+} gvc_writer_t;
+
+
+/**
+ * Deserialization state
+ */
+typedef struct gvc_reader {
+  const uint8_t *rd_ptr;
+  const uint8_t *rd_end;
+  rstr_t **rd_files;
+  int rd_nfiles;
+  int rd_error;
+} gvc_reader_t;
+
+
+/**
+ *
+ */
+static void
+gvc_cache_key(glw_root_t *gr, const char *src, char *buf, size_t len)
+{
+  snprintf(buf, len, "%s|%s|%s", src, gr->gr_vpaths[1], gr->gr_vpaths[3]);
+}
+
+
+/**
+ * Called from glw_view_load1() for every file that goes into a view
+ */
+void
+glw_view_cache_add_file(glw_root_t *gr, const char *url)
+{
+  glw_view_file_t *gvf;
+  struct fa_stat fs;
+
+  if(gr->gr_view_files == NULL)
+    return;
+
+  LIST_FOREACH(gvf, gr->gr_view_files, gvf_link)
+    if(!strcmp(gvf->gvf_url, url))
+      return;
+
+  // A file we can't stat will just make the cached view fail validation
+  memset(&fs, 0, sizeof(fs));
+  fa_stat_vpaths(url, gr->gr_vpaths, &fs, NULL, 0);
+
+  gvf = malloc(sizeof(glw_view_file_t));
+  gvf->gvf_url = strdup(url);
+  gvf->gvf_mtime = fs.fs_mtime;
+  gvf->gvf_size = fs.fs_size;
+  LIST_INSERT_HEAD(gr->gr_view_files, gvf, gvf_link);
+}
+
+
+/**
+ *
+ */
+void
+glw_view_cache_free_files(struct glw_view_file_list *l)
+{
+  glw_view_file_t *gvf;
+
+  while((gvf = LIST_FIRST(l)) != NULL) {
+    LIST_REMOVE(gvf, gvf_link);
+    free(gvf->gvf_url);
+    free(gvf);
+  }
+}
+
+
+/**
+ *
+ */
+static void
+gw_u8(gvc_writer_t *gw, uint8_t v)
+{
+  htsbuf_append(&gw->gw_hq, &v, 1);
+}
+
+static void
+gw_u32(gvc_writer_t *gw, uint32_t v)
+{
+  htsbuf_append(&gw->gw_hq, &v, sizeof(v));
+}
+
+static void
+gw_u64(gvc_writer_t *gw, uint64_t v)
+{
+  htsbuf_append(&gw->gw_hq, &v, sizeof(v));
+}
+
+static void
+gw_str(gvc_writer_t *gw, const char *s)
+{
+  int len = s ? strlen(s) : 0;
+  gw_u32(gw, len);
+  htsbuf_append(&gw->gw_hq, s, len);
+}
+
+
+#ifdef GLW_VIEW_ERRORINFO
+/**
+ *
+ */
+static int
+gw_file_index(gvc_writer_t *gw, rstr_t *f)
+{
+  int i;
+
+  for(i = 0; i < gw->gw_nfiles; i++)
+    if(gw->gw_files[i] == f ||
+       !strcmp(rstr_get(gw->gw_files[i]), rstr_get(f)))
+      return i;
+
+  gw->gw_files = realloc(gw->gw_files, sizeof(rstr_t *) * (i + 1));
+  gw->gw_files[i] = f;
+  gw->gw_nfiles++;
+  return i;
+}
+#endif
+
+
+/**
+ * Returns -1 if the chain contains tokens that can not be serialized
+ */
+static int
+gw_chain(gvc_writer_t *gw, token_t *t)
+{
+  for(; t != NULL; t = t->next) {
+
+    gw_u8(gw, t->type);
+#ifdef GLW_VIEW_ERRORINFO
+    gw_u32(gw, t->file ? gw_file_index(gw, t->file) : UINT32_MAX);
+    gw_u32(gw, t->line);
+#endif
+
+    switch(t->type) {
+    case TOKEN_FLOAT:
+      htsbuf_append(&gw->gw_hq, &t->t_float, sizeof(float));
+      break;
+
+    case TOKEN_INT:
+      gw_u32(gw, t->t_int);
+      break;
+
+    case TOKEN_FUNCTION:
+      gw_str(gw, t->t_func->name);
+      gw_u32(gw, t->t_num_args);
+      break;
+
+    case TOKEN_LEFT_BRACKET:
+      gw_u32(gw, t->t_num_args);
+      break;
+
+    case TOKEN_OBJECT_ATTRIBUTE:
+      gw_str(gw, t->t_attrib->name);
+      break;
+
+    case TOKEN_STRING:
+    case TOKEN_IDENTIFIER:
+    case TOKEN_PROPERTY_VALUE_NAME:
+    case TOKEN_PROPERTY_CANONICAL_NAME:
+      gw_u8(gw, t->t_rstrtype);
+      gw_str(gw, rstr_get(t->t_rstring));
+      break;
+
+    case TOKEN_PROPERTY_REF:
+    case TOKEN_PROPERTY_OWNER:
+    case TOKEN_PROPERTY_SUBSCRIPTION:
+    case TOKEN_DIRECTORY:
+    case TOKEN_VECTOR_FLOAT:
+    case TOKEN_VECTOR_STRING:
+    case TOKEN_VECTOR_INT:
+    case TOKEN_EVENT:
+    case TOKEN_PIXMAP:
+    case TOKEN_LINK:
+    case TOKEN_num:
+      return -1;
+
+    default:
+      break;
+    }
+
+    if(gw_chain(gw, t->child))
+      return -1;
+  }
+  gw_u8(gw, GVC_END_OF_CHAIN);
+  return 0;
+}
+
+
+/**
+ * Store a parsed view in the blobcache
+ */
+void
+glw_view_cache_save(glw_root_t *gr, const char *src, token_t *sof,
+		    struct glw_view_file_list *files)
+{
+  gvc_writer_t tokens, hdr;
+  glw_view_file_t *gvf;
+  char key[URL_MAX];
+  uint8_t *data;
+  int i, cnt = 0;
+  size_t size;
+
+  memset(&tokens, 0, sizeof(tokens));
+  htsbuf_queue_init(&tokens.gw_hq, 0);
+
+  if(gw_chain(&tokens, sof)) {
+    htsbuf_queue_flush(&tokens.gw_hq);
+    free(tokens.gw_files);
+    return;
+  }
+
+  memset(&hdr, 0, sizeof(hdr));
+  htsbuf_queue_init(&hdr.gw_hq, 0);
+
+  gw_u32(&hdr, GLW_VIEW_CACHE_MAGIC);
+  gw_u32(&hdr, GLW_VIEW_CACHE_VERSION);
+  gw_u32(&hdr, TOKEN_num);
+  gw_str(&hdr, htsversion_full);
+
+  LIST_FOREACH(gvf, files, gvf_link)
+    cnt++;
+  gw_u32(&hdr, cnt);
+  LIST_FOREACH(gvf, files, gvf_link) {
+    gw_str(&hdr, gvf->gvf_url);
+    gw_u64(&hdr, gvf->gvf_mtime);
+    gw_u64(&hdr, gvf->gvf_size);
+  }
+
+  gw_u32(&hdr, tokens.gw_nfiles);
+  for(i = 0; i < tokens.gw_nfiles; i++)
+    gw_str(&hdr, rstr_get(tokens.gw_files[i]));
+  free(tokens.gw_files);
+
+  htsbuf_appendq(&hdr.gw_hq, &tokens.gw_hq);
+
+  size = hdr.gw_hq.hq_size;
+  data = malloc(size);
+  htsbuf_read(&hdr.gw_hq, data, size);
+
+  gvc_cache_key(gr, src, key, sizeof(key));
+  blobcache_put(key, "glwview", data, size, GLW_VIEW_CACHE_MAXAGE);
+  free(data);
+}
+
+
+/**
+ *
+ */
+static int
+rd_need(gvc_reader_t *rd, size_t len)
+{
+  if(rd->rd_error || rd->rd_end - rd->rd_ptr < len) {
+    rd->rd_error = 1;
+    return 1;
+  }
+  return 0;
+}
+
+static uint8_t
+rd_u8(gvc_reader_t *rd)
+{
+  if(rd_need(rd, 1))
+    return GVC_END_OF_CHAIN;
+  return *rd->rd_ptr++;
+}
+
+static uint32_t
+rd_u32(gvc_reader_t *rd)
+{
+  uint32_t v;
+  if(rd_need(rd, sizeof(v)))
+    return 0;
+  memcpy(&v, rd->rd_ptr, sizeof(v));
+  rd->rd_ptr += sizeof(v);
+  return v;
+}
+
+static uint64_t
+rd_u64(gvc_reader_t *rd)
+{
+  uint64_t v;
+  if(rd_need(rd, sizeof(v)))
+    return 0;
+  memcpy(&v, rd->rd_ptr, sizeof(v));
+  rd->rd_ptr += sizeof(v);
+  return v;
+}
+
+/**
+ * Returned string is not zero terminated, length in *lenp
+ */
+static const char *
+rd_str(gvc_reader_t *rd, uint32_t *lenp)
+{
+  const char *r;
+  uint32_t len = rd_u32(rd);
+  if(rd_need(rd, len))
+    return NULL;
+  r = (const char *)rd->rd_ptr;
+  rd->rd_ptr += len;
+  *lenp = len;
+  return r;
+}
+
+
+/**
+ * Function and attribute pointers are stored by name and resolved
+ * again using the regular lookup (which also runs function ctors)
+ */
+static int
+rd_resolve(gvc_reader_t *rd, token_t *t, int (*resolve)(token_t *t))
+{
+  const char *s;
+  uint32_t len;
+
+  if((s = rd_str(rd, &len)) == NULL) {
+    t->type = TOKEN_NOP;
+    return -1;
+  }
+
+  t->type = TOKEN_IDENTIFIER;
+  t->t_rstring = rstr_allocl(s, len);
+  return resolve(t);
+}
+
+
+/**
+ *
+ */
+static token_t *
+rd_chain(gvc_reader_t *rd)
+{
+  token_t *r = NULL, *t;
+  token_t **pp = &r;
+  const char *s;
+  uint32_t len, fi;
+  int type;
+
+  while((type = rd_u8(rd)) != GVC_END_OF_CHAIN) {
+
+    if(type >= TOKEN_num) {
+      rd->rd_error = 1;
+      break;
+    }
+
+    t = calloc(1, sizeof(token_t));
+    *pp = t;
+    pp = &t->next;
+
+#ifdef GLW_VIEW_ERRORINFO
+    fi = rd_u32(rd);
+    if(fi < rd->rd_nfiles)
+      t->file = rstr_dup(rd->rd_files[fi]);
+    t->line = rd_u32(rd);
+#endif
+
+    t->type = type;
+
+    switch(type) {
+    case TOKEN_FLOAT:
+      if(rd_need(rd, sizeof(float)))
+	break;
+      memcpy(&t->t_float, rd->rd_ptr, sizeof(float));
+      rd->rd_ptr += sizeof(float);
+      break;
+
+    case TOKEN_INT:
+      t->t_int = rd_u32(rd);
+      break;
+
+    case TOKEN_FUNCTION:
+      if(rd_resolve(rd, t, glw_view_function_resolve)) {
+	rd->rd_error = 1;
+	break;
+      }
+      t->t_num_args = rd_u32(rd);
+      break;
+
+    case TOKEN_LEFT_BRACKET:
+      t->t_num_args = rd_u32(rd);
+      break;
+
+    case TOKEN_OBJECT_ATTRIBUTE:
+      if(rd_resolve(rd, t, glw_view_attrib_resolve))
+	rd->rd_error = 1;
+      break;
+
+    case TOKEN_STRING:
+    case TOKEN_IDENTIFIER:
+    case TOKEN_PROPERTY_VALUE_NAME:
+    case TOKEN_PROPERTY_CANONICAL_NAME:
+      t->t_rstrtype = rd_u8(rd);
+      if((s = rd_str(rd, &len)) != NULL)
+	t->t_rstring = rstr_allocl(s, len);
+      else
+	t->type = TOKEN_NOP;
+      break;
+
+    case TOKEN_PROPERTY_REF:
+    case TOKEN_PROPERTY_OWNER:
+    case TOKEN_PROPERTY_SUBSCRIPTION:
+    case TOKEN_DIRECTORY:
+    case TOKEN_VECTOR_FLOAT:
+    case TOKEN_VECTOR_STRING:
+    case TOKEN_VECTOR_INT:
+    case TOKEN_EVENT:
+    case TOKEN_PIXMAP:
+    case TOKEN_LINK:
+      t->type = TOKEN_NOP;
+      rd->rd_error = 1;
+      break;
+
+    default:
+      break;
+    }
+
+    if(rd->rd_error)
+      break;
+
+    t->child = rd_chain(rd);
+    if(rd->rd_error)
+      break;
+  }
+
+  if(rd->rd_error) {
+    glw_view_free_chain(r);
+    return NULL;
+  }
+  return r;
+}
+
+
+/**
+ * Check that the files the view was built from are unchanged
+ */
+static int
+rd_files_valid(glw_root_t *gr, gvc_reader_t *rd)
+{
+  struct fa_stat fs;
+  char url[URL_MAX];
+  const char *s;
+  uint32_t i, cnt, len;
+  uint64_t mtime, size;
+
+  cnt = rd_u32(rd);
+
+  for(i = 0; i < cnt; i++) {
+    if((s = rd_str(rd, &len)) == NULL)
+      return 0;
+    snprintf(url, sizeof(url), "%.*s", (int)len, s);
+    mtime = rd_u64(rd);
+    size  = rd_u64(rd);
+
+    if(rd->rd_error)
+      return 0;
+
+    memset(&fs, 0, sizeof(fs));
+    if(fa_stat_vpaths(url, gr->gr_vpaths, &fs, NULL, 0))
+      return 0;
+    if(fs.fs_mtime != mtime || fs.fs_size != size)
+      return 0;
+  }
+  return 1;
+}
+
+
+/**
+ * Load a parsed view from the blobcache.
+ * Returns NULL if no valid entry exist
+ */
+token_t *
+glw_view_cache_load(glw_root_t *gr, const char *src)
+{
+  gvc_reader_t rd;
+  char key[URL_MAX];
+  token_t *r = NULL;
+  const char *s;
+  uint32_t len, i;
+  size_t size;
+  void *data;
+
+  gvc_cache_key(gr, src, key, sizeof(key));
+
+  if((data = blobcache_get(key, "glwview", &size, 0)) == NULL)
+    return NULL;
+
+  memset(&rd, 0, sizeof(rd));
+  rd.rd_ptr = data;
+  rd.rd_end = rd.rd_ptr + size;
+
+  if(rd_u32(&rd) != GLW_VIEW_CACHE_MAGIC ||
+     rd_u32(&rd) != GLW_VIEW_CACHE_VERSION ||
+     rd_u32(&rd) != TOKEN_num)
+    goto out;
+
+  if((s = rd_str(&rd, &len)) == NULL ||
+     len != strlen(htsversion_full) || memcmp(s, htsversion_full, len))
+    goto out;
+
+  if(!rd_files_valid(gr, &rd))
+    goto out;
+
+  rd.rd_nfiles = rd_u32(&rd);
+  if(rd.rd_error || rd.rd_nfiles > rd.rd_end - rd.rd_ptr)
+    goto out;
+
+  rd.rd_files = calloc(rd.rd_nfiles, sizeof(rstr_t *));
+  for(i = 0; i < rd.rd_nfiles; i++)
+    if((s = rd_str(&rd, &len)) != NULL)
+      rd.rd_files[i] = rstr_allocl(s, len);
+
+  if(!rd.rd_error) {
+    r = rd_chain(&rd);
+    if(r != NULL && r->type != TOKEN_START) {
+      glw_view_free_chain(r);
+      r = NULL;
+    }
+  }
+
+  for(i = 0; i < rd.rd_nfiles; i++)
+    rstr_release(rd.rd_files[i]);
+  free(rd.rd_files);
+ out:
+  free(data);
+  return r;
+}
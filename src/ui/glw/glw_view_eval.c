@@ -37,6 +37,8 @@ static token_t t_zero = {
   .type = TOKEN_INT,
 };
 
+#define GLW_TOKEN_POOL_MAX 1024
+
 /**
  *
  */
@@ -263,7 +265,17 @@ static token_t *
 eval_alloc_sized(token_t *src, glw_view_eval_context_t *ec, 
 		 token_type_t type, size_t size)
 {
-  token_t *r = calloc(1, size);
+  glw_root_t *gr = ec->gr;
+  token_t *r;
+
+  if(size == sizeof(token_t) && gr != NULL && gr->gr_token_pool != NULL) {
+    r = gr->gr_token_pool;
+    gr->gr_token_pool = r->next;
+    gr->gr_token_pool_size--;
+    memset(r, 0, sizeof(token_t));
+  } else {
+    r = calloc(1, size);
+  }
 
 #ifdef GLW_VIEW_ERRORINFO
   if(src->file != NULL)
@@ -287,6 +299,53 @@ eval_alloc(token_t *src, glw_view_eval_context_t *ec, token_type_t type)
 }
 
 
+/**
+ * Release all tokens allocated during evaluation.
+ *
+ * Any token is at least sizeof(token_t) so all of them can be
+ * recycled as plain tokens
+ */
+static void
+eval_free_alloc(glw_view_eval_context_t *ec)
+{
+  glw_root_t *gr = ec->gr;
+  token_t *t, *n;
+
+  for(t = ec->alloc; t != NULL; t = n) {
+    n = t->next;
+
+    if(t->child != NULL)
+      glw_view_free_chain(t->child);
+
+    if(gr == NULL || gr->gr_token_pool_size >= GLW_TOKEN_POOL_MAX) {
+      glw_view_token_free(t);
+      continue;
+    }
+    glw_view_token_clear(t);
+    t->next = gr->gr_token_pool;
+    gr->gr_token_pool = t;
+    gr->gr_token_pool_size++;
+  }
+  ec->alloc = NULL;
+}
+
+
+/**
+ *
+ */
+void
+glw_view_token_pool_flush(glw_root_t *gr)
+{
+  token_t *t;
+
+  while((t = gr->gr_token_pool) != NULL) {
+    gr->gr_token_pool = t->next;
+    free(t);
+  }
+  gr->gr_token_pool_size = 0;
+}
+
+
 /**
  *
  */
@@ -951,7 +1010,7 @@ eval_dynamic(glw_t *w, token_t *rpn, struct glw_rctx *rc)
 
   glw_view_eval_rpn0(rpn, &ec);
 
-  glw_view_free_chain(ec.alloc);
+  eval_free_alloc(&ec);
 
   if(ec.dynamic_eval & GLW_VIEW_DYNAMIC_EVAL_EVERY_FRAME)
     glw_signal_handler_register(w, eval_dynamic_every_frame_sig, rpn, 1000);
@@ -978,6 +1037,27 @@ eval_dynamic(glw_t *w, token_t *rpn, struct glw_rctx *rc)
 
 
 
+/**
+ * Re-evaluate all dynamic expressions in the widget tree below 'w'.
+ * Returns the number of expressions evaluated
+ */
+int
+glw_view_eval_dynamics(glw_t *w, struct glw_rctx *rc)
+{
+  token_t *t;
+  glw_t *c;
+  int n = 0;
+
+  for(t = w->glw_dynamic_expressions; t != NULL; t = t->next, n++)
+    eval_dynamic(w, t, rc);
+
+  TAILQ_FOREACH(c, &w->glw_childs, glw_parent_link)
+    n += glw_view_eval_dynamics(c, rc);
+  return n;
+}
+
+
+
 static void cloner_resequence(sub_cloner_t *sc);
 
 /**
@@ -1920,6 +2000,127 @@ glw_view_eval_rpn0(token_t *t0, glw_view_eval_context_t *ec)
 }
 
 
+/**
+ *
+ */
+static int
+token_is_const(const token_t *t)
+{
+  return t != NULL &&
+    (t->type == TOKEN_INT || t->type == TOKEN_FLOAT ||
+     t->type == TOKEN_STRING);
+}
+
+
+/**
+ * Evaluate 'op' on constant operands 'a' and 'b' (NULL for unary ops).
+ * Returns a new token or NULL if the expression can't be folded
+ */
+static token_t *
+fold_op(token_t *a, token_t *b, token_t *op)
+{
+  glw_view_eval_context_t ec;
+  errorinfo_t ei;
+  token_t *r = NULL;
+  int err;
+
+  memset(&ec, 0, sizeof(ec));
+  ec.ei = &ei;
+
+  eval_push(&ec, a);
+  if(b != NULL)
+    eval_push(&ec, b);
+
+  switch(op->type) {
+  case TOKEN_ADD:
+  case TOKEN_SUB:
+  case TOKEN_MULTIPLY:
+  case TOKEN_DIVIDE:
+    err = eval_op(&ec, op);
+    break;
+  case TOKEN_MODULO:
+    if(token2int(b) == 0)
+      return NULL;
+    err = eval_op(&ec, op);
+    break;
+  case TOKEN_BOOLEAN_OR:
+  case TOKEN_BOOLEAN_XOR:
+  case TOKEN_BOOLEAN_AND:
+    err = eval_bool_op(&ec, op);
+    break;
+  case TOKEN_BOOLEAN_NOT:
+    err = eval_bool_not(&ec, op);
+    break;
+  case TOKEN_NULL_COALESCE:
+    err = eval_null_coalesce(&ec, op);
+    break;
+  case TOKEN_EQ:
+  case TOKEN_NEQ:
+    err = eval_eq(&ec, op, op->type == TOKEN_NEQ);
+    break;
+  case TOKEN_LT:
+  case TOKEN_GT:
+    err = eval_lt(&ec, op, op->type == TOKEN_GT);
+    break;
+  default:
+    return NULL;
+  }
+
+  if(!err && token_is_const(ec.stack)) {
+    r = glw_view_token_copy(ec.stack);
+    if(r->type == TOKEN_STRING)
+      r->t_rstrtype = ec.stack->t_rstrtype;
+  }
+
+  glw_view_free_chain(ec.alloc);
+  return r;
+}
+
+
+/**
+ * Constant folding of RPN expressions.
+ *
+ * In RPN two constants directly followed by a binary operator (or one
+ * constant directly followed by an unary operator) are the operands of
+ * that operator, so such sequences can be replaced by their result.
+ * An unary operator only consumes the token right before it, so in
+ * 'C1 C2 !' only 'C2 !' is folded (C1 belongs to some later operator).
+ * The eval functions themselves are used to get identical semantics.
+ */
+void
+glw_view_rpn_fold(token_t *rpn)
+{
+  token_t **pp, *a, *b, *op, *r;
+  int again;
+
+  do {
+    again = 0;
+
+    for(pp = &rpn->child; (a = *pp) != NULL; pp = &(*pp)->next) {
+      if(!token_is_const(a) || (b = a->next) == NULL)
+	continue;
+
+      if(b->type == TOKEN_BOOLEAN_NOT) {
+	op = b;
+	b = NULL;
+      } else if(!token_is_const(b) || (op = b->next) == NULL ||
+		op->type == TOKEN_BOOLEAN_NOT) {
+	continue;
+      }
+
+      if((r = fold_op(a, b, op)) == NULL)
+	continue;
+
+      r->next = op->next;
+      op->next = NULL;
+      glw_view_free_chain(a);
+      *pp = r;
+      again = 1;
+    }
+  } while(again);
+}
+
+
 /**
  *
  */
@@ -1949,7 +2150,7 @@ glw_view_eval_rpn(token_t *t, glw_view_eval_context_t *pec, int *copyp)
   r = glw_view_eval_rpn0(t, &ec);
 
   *copyp = ec.dynamic_eval;
-  glw_view_free_chain(ec.alloc);
+  eval_free_alloc(&ec);
   return r;
 }
 
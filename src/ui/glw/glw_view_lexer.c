@@ -382,6 +382,8 @@ glw_view_load1(glw_root_t *gr, const char *filename,
     return NULL;
   }
 
+  glw_view_cache_add_file(gr, filename);
+
   f = rstr_alloc(filename);
   last = lexer(src, ei, f, prev);
   rstr_release(f);
@@ -249,6 +249,7 @@ parse_shunting_yard(token_t *expr, errorinfo_t *ei)
 
   expr->child = outq.head;
   expr->type = TOKEN_RPN;
+  glw_view_rpn_fold(expr);
   return 0;
 
  err:
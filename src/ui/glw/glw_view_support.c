@@ -32,11 +32,10 @@
 #include "misc/pixmap.h"
 
 /**
- * Free a token.
- * It must be delinked for all lists before
+ * Release everything a token holds, but not the token itself
  */
 void
-glw_view_token_free(token_t *t)
+glw_view_token_clear(token_t *t)
 {
   int i;
 
@@ -133,6 +132,17 @@ glw_view_token_free(token_t *t)
     abort();
 
   }
+}
+
+
+/**
+ * Free a token.
+ * It must be delinked for all lists before
+ */
+void
+glw_view_token_free(token_t *t)
+{
+  glw_view_token_clear(t);
   free(t);
 }
 
@@ -23,6 +23,7 @@
 #include "networking/http_server.h"
 #include "networking/ssdp.h"
 #include "htsmsg/htsmsg_xml.h"
+#include "htsmsg/htsmsg_json.h"
 #include "event.h"
 #include "playqueue.h"
 #include "fileaccess/fileaccess.h"
@@ -34,12 +35,41 @@
 #include "settings.h"
 #include "service.h"
 #include "backend/backend.h"
+#include "blobcache.h"
 
 hts_mutex_t upnp_lock;
 
 static char *upnp_uuid;
 struct upnp_device_list upnp_devices;
 
+/**
+ * Device descriptions are fetched and parsed by a small pool of
+ * threads so a slow device does not hold up discovery of the others.
+ * upnp_lock is only held while the result is applied to the device.
+ *
+ * Parsed descriptions are kept in the blobcache along with the
+ * CONFIGID.UPNP.ORG the device announced. As long as a device keeps
+ * announcing the same CONFIGID its description is not fetched again,
+ * not even across restarts.
+ *
+ * A device that changes its CONFIGID while a job is being processed
+ * is flagged and queued again once the job is done.
+ */
+#define UPNP_INTROSPECT_WORKERS 4
+
+TAILQ_HEAD(upnp_introspect_job_queue, upnp_introspect_job);
+
+typedef struct upnp_introspect_job {
+  TAILQ_ENTRY(upnp_introspect_job) uij_link;
+  char *uij_url;
+  int uij_configid;
+} upnp_introspect_job_t;
+
+static struct upnp_introspect_job_queue upnp_introspect_jobs;
+static hts_cond_t upnp_introspect_cond;
+static int upnp_introspect_workers;
+static int upnp_introspect_idle;
+
 
 /**
  *
@@ -264,6 +294,8 @@ upnp_init(void)
   htsmsg_destroy(conf);
 
   hts_mutex_init(&upnp_lock);
+  hts_cond_init(&upnp_introspect_cond, &upnp_lock);
+  TAILQ_INIT(&upnp_introspect_jobs);
 
   upnp_avtransport_init();
 
@@ -499,7 +531,8 @@ introspect_service(upnp_device_t *ud, htsmsg_t *svc)
   switch(us->us_type) {
   case UPNP_SERVICE_CONTENT_DIRECTORY_1:
   case UPNP_SERVICE_CONTENT_DIRECTORY_2:
-    add_content_directory(us);
+    if(us->us_service == NULL)
+      add_content_directory(us);
     break;
   default:
     break;
@@ -563,42 +596,22 @@ device_get_icon(htsmsg_t *dev)
 
 
 /**
- *
+ * Apply a parsed device description, upnp_lock must be held
  */
 static void
-introspect_device(upnp_device_t *ud)
+introspect_device(upnp_device_t *ud, htsmsg_t *m)
 {
-  char *xmldata;
-  size_t xmlsize;
-  char errbuf[200];
-  htsmsg_t *m, *svclist, *dev;
+  htsmsg_t *svclist, *dev;
   const char *uuid;
 
-  if(http_request(ud->ud_url, NULL, &xmldata, &xmlsize, errbuf, sizeof(errbuf),
-		  NULL, NULL, 0, NULL, NULL, NULL)) {
-    TRACE(TRACE_INFO, "UPNP", "Unable to introspect %s -- %s",
-	  ud->ud_url, errbuf);
-    return;
-  }
-
-  if((m = htsmsg_xml_deserialize(xmldata, errbuf, sizeof(errbuf))) == NULL) {
-    TRACE(TRACE_INFO, "UPNP", "Unable to introspect %s XML -- %s",
-	  ud->ud_url, errbuf);
-    return;
-  }
-
   dev = htsmsg_get_map_multi(m, "tags", "root", "tags", "device", NULL);
-  if(dev == NULL) {
-    htsmsg_destroy(m);
+  if(dev == NULL)
     return;
-  }
 
   uuid = htsmsg_get_str_multi(dev, "tags", "UDN", "cdata", NULL);
 
-  if(uuid == NULL) {
-    htsmsg_destroy(m);
+  if(uuid == NULL)
     return;
-  }
 
   mystrset(&ud->ud_uuid, uuid);
 
@@ -612,7 +625,8 @@ introspect_device(upnp_device_t *ud)
   mystrset(&ud->ud_modelDescription, 
 	   htsmsg_get_str_multi(dev, "tags", "modelDescription", "cdata", NULL));
 
-  mystrset(&ud->ud_icon, device_get_icon(dev));
+  free(ud->ud_icon);
+  ud->ud_icon = device_get_icon(dev);
 
   svclist = htsmsg_get_map_multi(dev,
 				 "tags", "serviceList",
@@ -633,16 +647,189 @@ introspect_device(upnp_device_t *ud)
       introspect_service(ud, svc);
     }
   }
+}
 
-  htsmsg_destroy(m);
+
+/**
+ * Parsed description is stored as {"configid": .., "description": ..}
+ */
+static htsmsg_t *
+description_load(const char *url, int configid)
+{
+  htsmsg_t *m;
+  char *data;
+  size_t size;
+
+  if(configid == -1 ||
+     (data = blobcache_get(url, "upnp.description", &size, 1)) == NULL)
+    return NULL;
+
+  m = htsmsg_json_deserialize(data);
+  free(data);
+
+  if(m != NULL &&
+     (htsmsg_get_s32_or_default(m, "configid", -1) != configid ||
+      htsmsg_get_map(m, "description") == NULL)) {
+    htsmsg_destroy(m);
+    m = NULL;
+  }
+  return m;
 }
-    
+
 
 /**
  *
  */
+static void
+description_store(const char *url, int configid, htsmsg_t *m)
+{
+  htsbuf_queue_t q;
+  char *data;
+  size_t len;
+
+  htsmsg_add_s32(m, "configid", configid);
+
+  htsbuf_queue_init(&q, 0);
+  htsmsg_json_serialize(m, &q, 0);
+  len = q.hq_size;
+  data = malloc(len);
+  htsbuf_read(&q, data, len);
+  blobcache_put(url, "upnp.description", data, len, 86400 * 30);
+  free(data);
+}
+
+
+/**
+ * Get description from cache or from the device
+ */
+static htsmsg_t *
+description_get(const char *url, int configid)
+{
+  char *xmldata;
+  size_t xmlsize;
+  char errbuf[200];
+  htsmsg_t *m, *xml;
+
+  if((m = description_load(url, configid)) != NULL)
+    return m;
+
+  // The HTTP cache knows nothing about CONFIGID, always ask the device
+  if(http_request(url, NULL, &xmldata, &xmlsize, errbuf, sizeof(errbuf),
+		  NULL, NULL, 0, NULL, NULL, NULL)) {
+    TRACE(TRACE_INFO, "UPNP", "Unable to introspect %s -- %s",
+	  url, errbuf);
+    return NULL;
+  }
+
+  if((xml = htsmsg_xml_deserialize(xmldata, errbuf, sizeof(errbuf))) == NULL) {
+    TRACE(TRACE_INFO, "UPNP", "Unable to introspect %s XML -- %s",
+	  url, errbuf);
+    return NULL;
+  }
+
+  m = htsmsg_create_map();
+  htsmsg_add_msg(m, "description", xml);
+
+  if(configid != -1)
+    description_store(url, configid, m);
+  return m;
+}
+
+
+static void introspect_enqueue(upnp_device_t *ud);
+
+/**
+ *
+ */
+static void *
+introspect_thread(void *aux)
+{
+  upnp_introspect_job_t *uij;
+  upnp_device_t *ud;
+  htsmsg_t *m;
+
+  hts_mutex_lock(&upnp_lock);
+
+  while(1) {
+
+    if((uij = TAILQ_FIRST(&upnp_introspect_jobs)) == NULL) {
+      upnp_introspect_idle++;
+      hts_cond_wait(&upnp_introspect_cond, &upnp_lock);
+      upnp_introspect_idle--;
+      continue;
+    }
+
+    TAILQ_REMOVE(&upnp_introspect_jobs, uij, uij_link);
+
+    // Pick up any change made while we were in the queue
+    if((ud = dev_find(uij->uij_url)) != NULL) {
+      uij->uij_configid = ud->ud_configid;
+      ud->ud_introspect_again = 0;
+    }
+    hts_mutex_unlock(&upnp_lock);
+
+    m = description_get(uij->uij_url, uij->uij_configid);
+
+    hts_mutex_lock(&upnp_lock);
+
+    // Device may have said byebye while we were busy
+    if((ud = dev_find(uij->uij_url)) != NULL) {
+      ud->ud_introspecting = 0;
+      if(m != NULL)
+	introspect_device(ud, htsmsg_get_map(m, "description"));
+
+      if(ud->ud_introspect_again) {
+	ud->ud_introspect_again = 0;
+	introspect_enqueue(ud);
+      }
+    }
+
+    if(m != NULL)
+      htsmsg_destroy(m);
+    free(uij->uij_url);
+    free(uij);
+  }
+  return NULL;
+}
+
+
+/**
+ * upnp_lock must be held
+ */
+static void
+introspect_enqueue(upnp_device_t *ud)
+{
+  upnp_introspect_job_t *uij;
+
+  if(ud->ud_introspecting) {
+    ud->ud_introspect_again = 1;
+    return;
+  }
+
+  ud->ud_introspecting = 1;
+
+  uij = malloc(sizeof(upnp_introspect_job_t));
+  uij->uij_url = strdup(ud->ud_url);
+  uij->uij_configid = ud->ud_configid;
+  TAILQ_INSERT_TAIL(&upnp_introspect_jobs, uij, uij_link);
+
+  if(upnp_introspect_idle > 0) {
+    hts_cond_signal(&upnp_introspect_cond);
+  } else if(upnp_introspect_workers < UPNP_INTROSPECT_WORKERS) {
+    upnp_introspect_workers++;
+    hts_thread_create_detached("upnp introspect", introspect_thread, NULL,
+			       THREAD_PRIO_LOW);
+  }
+}
+    
+
+/**
+ * 'configid' and 'bootid' are CONFIGID.UPNP.ORG and BOOTID.UPNP.ORG
+ * from the announcement or -1 if not present (UPnP 1.0 devices)
+ */
 void
-upnp_add_device(const char *url, const char *type, int maxage)
+upnp_add_device(const char *url, const char *type, int maxage,
+		int configid, int bootid)
 {
   upnp_device_t *ud;
   hts_mutex_lock(&upnp_lock);
@@ -650,15 +837,26 @@ upnp_add_device(const char *url, const char *type, int maxage)
   if((ud = dev_find(url)) == NULL) {
     ud = calloc(1, sizeof(upnp_device_t));
     ud->ud_url = strdup(url);
+    ud->ud_configid = -1;
+    ud->ud_bootid = -1;
     LIST_INSERT_HEAD(&upnp_devices, ud, ud_link);
   }
 
   if(!strcmp(type, "urn:schemas-upnp-org:service:ContentDirectory:1") ||
      !strcmp(type, "urn:schemas-upnp-org:service:ContentDirectory:2")) {
 
-    if(ud->ud_interesting == 0) {
+    /*
+     * Refreshes of a device we already know about only cause a new
+     * introspection if the device says its description has changed
+     * (or, if it doesn't tell, when it has rebooted)
+     */
+    if(ud->ud_interesting == 0 ||
+       (configid != -1 && configid != ud->ud_configid) ||
+       (configid == -1 && bootid != -1 && bootid != ud->ud_bootid)) {
       ud->ud_interesting = 1;
-      introspect_device(ud);
+      ud->ud_configid = configid;
+      ud->ud_bootid = bootid;
+      introspect_enqueue(ud);
     }
   }
 
@@ -84,6 +84,11 @@ typedef struct upnp_device {
   struct upnp_service_list ud_services;
 
   char ud_interesting;
+  char ud_introspecting;  // Queued for, or being, introspected
+  char ud_introspect_again; // Changed while being introspected
+
+  int ud_configid;  // CONFIGID.UPNP.ORG, -1 if unknown
+  int ud_bootid;    // BOOTID.UPNP.ORG, -1 if unknown
 
 } upnp_device_t;
 
@@ -132,7 +137,8 @@ typedef struct upnp_local_service {
 
 void upnp_init(void);
 
-void upnp_add_device(const char *url, const char *type, int maxage);
+void upnp_add_device(const char *url, const char *type, int maxage,
+		     int configid, int bootid);
 
 void upnp_del_device(const char *url);
 
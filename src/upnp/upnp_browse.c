@@ -27,6 +27,11 @@
 #include "prop/prop_nodefilter.h"
 #include "upnp.h"
 
+/**
+ * The first page is kept small so something shows up quickly
+ */
+#define UPNP_BROWSE_FIRST_PAGE_SIZE 50
+#define UPNP_BROWSE_PAGE_SIZE       500
 
 
 /**
@@ -245,57 +250,83 @@ nodes_from_meta(htsmsg_t *meta, prop_t *root, const char *trackid,
 
 
 /**
- *
+ * Fetch one page of children. Returns the parsed DIDL-Lite document
+ * and the number of entries it contains
  */
-int
-upnp_browse_children(const char *uri, const char *id, prop_t *nodes,
-		     const char *trackid, prop_t **trackptr)
+static htsmsg_t *
+browse_page(const char *uri, const char *id, int start, int count,
+	    int *returnedp, int *totalp, char *errbuf, size_t errlen)
 {
+  htsmsg_t *in = htsmsg_create_map(), *out, *meta;
+  const char *result, *str;
   int r;
-  htsmsg_t *in = htsmsg_create_map(), *out;
-  char errbuf[200];
-  const char *result;
-  htsmsg_t *meta;
-
-  if(trackptr != NULL)
-    *trackptr = NULL;
 
   htsmsg_add_str(in, "ObjectID", id);
   htsmsg_add_str(in, "BrowseFlag", "BrowseDirectChildren");
   htsmsg_add_str(in, "Filter", "*");
-  htsmsg_add_u32(in, "StartingIndex", 0);
-  htsmsg_add_u32(in, "RequestedCount", 0);
+  htsmsg_add_u32(in, "StartingIndex", start);
+  htsmsg_add_u32(in, "RequestedCount", count);
   htsmsg_add_str(in, "SortCriteria", "");
   r = soap_exec(uri, "ContentDirectory", 1, "Browse", in, &out,
-		errbuf, sizeof(errbuf));
+		errbuf, errlen);
   htsmsg_destroy(in);
-  if(r) {
-    TRACE(TRACE_ERROR, "UPNP", 
-	  "Browse %s via %s -- %s", id, uri, errbuf);
-    return -1;
-  }
+  if(r)
+    return NULL;
 
   if(out == NULL) {
-    TRACE(TRACE_ERROR, "UPNP", 
-	  "Browse %s via %s -- No returned varibles", uri, id);
-    return -1;
+    snprintf(errbuf, errlen, "Malformed SOAP response, no returned variables");
+    return NULL;
   }
-  
+
+  str = htsmsg_get_str(out, "NumberReturned");
+  *returnedp = str != NULL ? atoi(str) : 0;
+
+  /* Some servers don't know, zero means "unknown" */
+  str = htsmsg_get_str(out, "TotalMatches");
+  *totalp = str != NULL ? atoi(str) : 0;
+
   if((result = htsmsg_get_str(out, "Result")) == NULL) {
-    TRACE(TRACE_ERROR, "UPNP", 
-	  "Browse %s via %s -- No returned result", uri, id);
-    return -1;
+    snprintf(errbuf, errlen, "No SOAP result");
+    htsmsg_destroy(out);
+    return NULL;
   }
 
-  meta = htsmsg_xml_deserialize(strdup(result), errbuf, sizeof(errbuf));
-  if(meta == NULL) {
-    TRACE(TRACE_ERROR, "UPNP", 
-	  "Browse %s via %s -- XML error %s", uri, id, errbuf);
-    return -1;
-  }
+  meta = htsmsg_xml_deserialize(strdup(result), errbuf, errlen);
+  htsmsg_destroy(out);
+  return meta;
+}
 
-  nodes_from_meta(meta, nodes, trackid, trackptr, NULL, NULL);
-  htsmsg_destroy(meta);
+
+/**
+ * Loads all children, one page at a time to keep the size of each
+ * response (and its parsed form) bounded
+ */
+int
+upnp_browse_children(const char *uri, const char *id, prop_t *nodes,
+		     const char *trackid, prop_t **trackptr)
+{
+  char errbuf[200];
+  htsmsg_t *meta;
+  int start = 0, returned, total;
+
+  if(trackptr != NULL)
+    *trackptr = NULL;
+
+  do {
+    meta = browse_page(uri, id, start, UPNP_BROWSE_PAGE_SIZE,
+		       &returned, &total, errbuf, sizeof(errbuf));
+    if(meta == NULL) {
+      TRACE(TRACE_ERROR, "UPNP", 
+	    "Browse %s via %s -- %s", id, uri, errbuf);
+      return start ? 0 : -1;
+    }
+
+    nodes_from_meta(meta, nodes, trackid, trackptr, NULL, NULL);
+    htsmsg_destroy(meta);
+    start += returned;
+
+  } while(returned > 0 && (total ? start < total :
+			   returned == UPNP_BROWSE_PAGE_SIZE));
   return 0;
 }
 
@@ -327,8 +358,16 @@ typedef struct upnp_browse {
 
   prop_sub_t *ub_itemsub;
 
-  int ub_loaded_entries;
-  int ub_total_entries;
+  int ub_loaded_entries;  // Entries added to ub_items
+  int ub_total_entries;   // As reported by server, 0 if unknown
+  int ub_eof;             // Server has no more entries
+
+  /**
+   * Next page, fetched ahead while the user looks at the previous
+   * one. Never more than one page is kept around
+   */
+  htsmsg_t *ub_prefetch;
+  int ub_prefetch_count;
 
 } upnp_browse_t;
 
@@ -417,55 +456,63 @@ browse_self(upnp_browse_t *ub)
 /**
  *
  */
-static void 
-browse_items(upnp_browse_t *ub)
+static void
+browse_prefetch(upnp_browse_t *ub)
 {
-  int r;
-  htsmsg_t *in = htsmsg_create_map(), *out;
   char errbuf[200];
-  const char *result, *str;
-  htsmsg_t *meta;
+  int count, total, start = ub->ub_loaded_entries;
 
-  htsmsg_add_str(in, "ObjectID", ub->ub_id);
-  htsmsg_add_str(in, "BrowseFlag", "BrowseDirectChildren");
-  htsmsg_add_str(in, "Filter", "*");
-  htsmsg_add_u32(in, "StartingIndex", ub->ub_loaded_entries);
-  htsmsg_add_u32(in, "RequestedCount", 500);
-  htsmsg_add_str(in, "SortCriteria", "");
+  if(ub->ub_eof || ub->ub_prefetch != NULL)
+    return;
 
-  r = soap_exec(ub->ub_control_url, "ContentDirectory", 1, "Browse", in, &out,
-		errbuf, sizeof(errbuf));
+  count = start ? UPNP_BROWSE_PAGE_SIZE : UPNP_BROWSE_FIRST_PAGE_SIZE;
+
+  ub->ub_prefetch = browse_page(ub->ub_control_url, ub->ub_id, start, count,
+				&ub->ub_prefetch_count, &total,
+				errbuf, sizeof(errbuf));
+  if(ub->ub_prefetch == NULL) {
+    ub->ub_eof = 1;
+    if(start == 0)
+      browse_fail(ub, "%s", errbuf);
+    else
+      TRACE(TRACE_ERROR, "UPNP", "Browse %s via %s -- %s",
+	    ub->ub_id, ub->ub_control_url, errbuf);
+    return;
+  }
 
-  if(r)
-    return browse_fail(ub, "%s", errbuf);
+  ub->ub_total_entries = total;
 
-  if(out == NULL)
-    return browse_fail(ub, "Malformed SOAP response, no returned variabled");
-  
-  str = htsmsg_get_str(out, "TotalMatches");
-  if(str != NULL) {
-    ub->ub_total_entries = atoi(str);
-  } else {
-    ub->ub_run = 0;
-  }
+  if(ub->ub_prefetch_count <= 0 ||
+     (total ? start + ub->ub_prefetch_count >= total :
+      ub->ub_prefetch_count < count))
+    ub->ub_eof = 1;
+}
 
-  str = htsmsg_get_str(out, "NumberReturned");
-  if(str != NULL) {
-    ub->ub_loaded_entries = atoi(str) + ub->ub_loaded_entries;
-  } else {
-    ub->ub_run = 0;
-  }
 
-  if((result = htsmsg_get_str(out, "Result")) == NULL)
-    return browse_fail(ub, "No SOAP result");
-  meta = htsmsg_xml_deserialize(strdup(result), errbuf, sizeof(errbuf));
-  if(meta == NULL)
-    return browse_fail(ub, "Malformed XML: %s", errbuf);
+/**
+ * Add the prefetched page to the item list (fetching it first if
+ * needed) and then go get the next one
+ */
+static void 
+browse_items(upnp_browse_t *ub)
+{
+  browse_prefetch(ub);
 
-  nodes_from_meta(meta, ub->ub_items, NULL, NULL, 
+  if(ub->ub_prefetch == NULL)
+    return;
+
+  nodes_from_meta(ub->ub_prefetch, ub->ub_items, NULL, NULL, 
 		  ub->ub_base_url, ub->ub_itemsub);
-  htsmsg_destroy(meta);
+  htsmsg_destroy(ub->ub_prefetch);
+  ub->ub_prefetch = NULL;
+  ub->ub_loaded_entries += ub->ub_prefetch_count;
+
+  if(ub->ub_eof)
+    return;
+
   prop_have_more_childs(ub->ub_items);
+  prop_set_int(ub->ub_loading, 0);
+  browse_prefetch(ub);
 }
 
 
@@ -489,6 +536,10 @@ ub_destroy(upnp_browse_t *ub)
   prop_ref_dec(ub->ub_contents);
   prop_ref_dec(ub->ub_filter);
   prop_ref_dec(ub->ub_canFilter);
+
+  if(ub->ub_prefetch != NULL)
+    htsmsg_destroy(ub->ub_prefetch);
+  free(ub);
 }
 
 
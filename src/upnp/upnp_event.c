@@ -206,6 +206,8 @@ upnp_subscribe(http_connection_t *hc, const char *remain, void *opaque,
 			  "Misformated callback");
       *d = 0;
 
+      hts_mutex_lock(&upnp_lock);
+
       sid_tally++;
       
       us = calloc(1, sizeof(upnp_subscription_t));
@@ -216,7 +218,6 @@ upnp_subscribe(http_connection_t *hc, const char *remain, void *opaque,
       us->us_myhost = strdup(http_get_my_host(hc));
       us->us_myport = http_get_my_port(hc);
 
-      hts_mutex_lock(&upnp_lock);
       LIST_INSERT_HEAD(&uls->uls_subscriptions, us, us_link);
 
       snprintf(sidtxt, sizeof(sidtxt), "%d", us->us_sid);
@@ -17,6 +17,7 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -30,16 +31,19 @@
 
 
 /**
- *
+ * Order on start time. Entries with the same start keep file order,
+ * which is also the order of their texts in the arena
  */
 static int
-se_cmp(const subtitle_entry_t *a, const subtitle_entry_t *b)
+se_cmp(const void *A, const void *B)
 {
+  const subtitle_entry_t *a = A, *b = B;
+
   if(a->se_start > b->se_start)
     return 1;
   if(a->se_start < b->se_start)
     return -1;
-  return 0;
+  return a->se_text > b->se_text ? 1 : a->se_text < b->se_text ? -1 : 0;
 }
 
 typedef struct {
@@ -181,19 +185,20 @@ is_srt(const char *buf, size_t len)
 
 
 /**
- *
+ * All texts go into one arena. It never needs to be larger than the
+ * source since we only drop the counter and timestamp lines
  */
-static subtitles_t *
-load_srt(const char *buf, size_t len)
+static void
+load_srt(subtitles_t *s, const char *buf, size_t len)
 {
-  int n;
-  size_t tlen;
+  int n, num = 0, cap = 0, i, j;
+  size_t tlen, used = 0;
   int64_t start, stop;
   linereader_t lr;
-  subtitles_t *s = calloc(1, sizeof(subtitles_t));
+  subtitle_entry_t *entries = NULL, *se;
+  char *arena = malloc(len + 1);
   char *txt;
 
-  RB_INIT(&s->s_entries);
   linereader_init(&lr, buf, len);
   
   while(1) {
@@ -207,36 +212,47 @@ load_srt(const char *buf, size_t len)
       break;
 
     tlen = 0;
-    txt = NULL;
+    txt = arena + used;
     // Text lines
     while(lr.ll != -1) {
       if(linereader_next(&lr) < 1)
 	break;
 
-      txt = realloc(txt, tlen + lr.ll + 1);
       memcpy(txt + tlen, lr.buf, lr.ll);
       txt[tlen + lr.ll] = 10;
 
       tlen += lr.ll + 1;
     }
 
-    if(txt != NULL) {
-      subtitle_entry_t *se = malloc(sizeof(subtitle_entry_t));
-      se->se_start = start;
-      se->se_stop = stop;
-      se->se_text = txt;
+    if(tlen > 0) {
       txt[tlen - 1] = 0;
+      used += tlen;
 
-      if(RB_INSERT_SORTED(&s->s_entries, se, se_link, se_cmp)) {
-	// Collision
-	free(se);
-	free(txt);
+      if(num == cap) {
+	cap = cap ? cap * 2 : 256;
+	entries = realloc(entries, cap * sizeof(subtitle_entry_t));
       }
+      se = &entries[num++];
+      se->se_start = start;
+      se->se_stop = stop;
+      se->se_text = txt;
     }
     if(lr.ll < 0)
       break;
   }
-  return s;
+
+  /* Files are almost always in order already, but make sure and
+     drop entries colliding on start time (first one wins) */
+  qsort(entries, num, sizeof(subtitle_entry_t), se_cmp);
+  for(i = j = 0; i < num; i++)
+    if(j == 0 || entries[j - 1].se_start != entries[i].se_start)
+      entries[j++] = entries[i];
+
+  hts_mutex_lock(&s->s_mutex);
+  s->s_text = arena;
+  s->s_entries = entries;
+  s->s_num_entries = j;
+  hts_mutex_unlock(&s->s_mutex);
 }
 
 #if 0
@@ -246,26 +262,27 @@ load_srt(const char *buf, size_t len)
 static void
 dump_subtitles(subtitles_t *s)
 {
-  subtitle_entry_t *se;
+  int i;
 
-  RB_FOREACH(se, &s->s_entries, se_link) {
-    printf("PAGE: %lld -> %lld\n--\n%s\n--\n", se->se_start, se->se_stop, se->se_text);
+  for(i = 0; i < s->s_num_entries; i++) {
+    const subtitle_entry_t *se = &s->s_entries[i];
+    printf("PAGE: %lld -> %lld\n--\n%s\n--\n",
+	   se->se_start, se->se_stop, se->se_text);
   }
 }
 #endif
 
+
 /**
  *
  */
-subtitles_t *
-subtitles_create(const char *buf, size_t len)
+static subtitles_t *
+subtitles_alloc(void)
 {
-  subtitles_t *s;
-  if(is_srt(buf, len)) 
-    s = load_srt(buf, len);
-  else
-    s = NULL;
-
+  subtitles_t *s = calloc(1, sizeof(subtitles_t));
+  hts_mutex_init(&s->s_mutex);
+  s->s_refcount = 1;
+  s->s_cur = -1;
   return s;
 }
 
@@ -274,17 +291,34 @@ subtitles_create(const char *buf, size_t len)
  *
  */
 static void
-subtitle_entry_destroy(subtitle_entry_t *se)
+subtitles_release(subtitles_t *s)
 {
-  if(se->se_link.left != NULL)
-    subtitle_entry_destroy(se->se_link.left);
-  if(se->se_link.right != NULL)
-    subtitle_entry_destroy(se->se_link.right);
-  free(se->se_text);
-  free(se);
+  if(atomic_add(&s->s_refcount, -1) > 1)
+    return;
+
+  hts_mutex_destroy(&s->s_mutex);
+  free(s->s_entries);
+  free(s->s_text);
+  free(s);
 }
 
 
+/**
+ *
+ */
+subtitles_t *
+subtitles_create(const char *buf, size_t len)
+{
+  subtitles_t *s;
+
+  if(!is_srt(buf, len))
+    return NULL;
+
+  s = subtitles_alloc();
+  load_srt(s, buf, len);
+  return s;
+}
+
 
 /**
  *
@@ -292,51 +326,90 @@ subtitle_entry_destroy(subtitle_entry_t *se)
 void
 subtitles_destroy(subtitles_t *s)
 {
-  if(s->s_entries.root != NULL)
-    subtitle_entry_destroy(s->s_entries.root);
+  subtitles_release(s);
+}
 
-  free(s);
+
+/**
+ * Last entry starting at or before pts, -1 if none
+ */
+static int
+subtitles_find(const subtitles_t *s, int64_t pts)
+{
+  int lo = 0, hi = s->s_num_entries, mid;
+
+  while(lo < hi) {
+    mid = (lo + hi) / 2;
+    if(s->s_entries[mid].se_start <= pts)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo - 1;
 }
 
 
 /**
  *
  */
-subtitle_entry_t *
-subtitles_pick(subtitles_t *s, int64_t pts)
+static subtitle_entry_t *
+subtitles_pick_locked(subtitles_t *s, int64_t pts)
 {
-  subtitle_entry_t skel, *se = s->s_cur;
+  subtitle_entry_t *se;
+  int i = s->s_cur;
 
-  if(se != NULL && se->se_start <= pts && se->se_stop > pts)
-    return NULL; // Already sent
-  
-  if(se != NULL) {
-    se = RB_NEXT(se, se_link);
-    if(se != NULL && se->se_start <= pts && se->se_stop > pts)
-      return s->s_cur = se;
+  if(s->s_entries == NULL)
+    return NULL; // Still loading
+
+  if(i != -1) {
+    se = &s->s_entries[i];
+    if(se->se_start <= pts && se->se_stop > pts)
+      return NULL; // Already sent
+
+    if(i + 1 < s->s_num_entries) {
+      se = &s->s_entries[i + 1];
+      if(se->se_start <= pts && se->se_stop > pts) {
+	s->s_cur = i + 1;
+	return se;
+      }
+    }
   }
-  
-  skel.se_start = pts;
-  se = RB_FIND_LE(&s->s_entries, &skel, se_link, se_cmp);
-  if(se == NULL || se->se_stop <= pts) {
-    s->s_cur = NULL;
+
+  i = subtitles_find(s, pts);
+  if(i == -1 || s->s_entries[i].se_stop <= pts) {
+    s->s_cur = -1;
     return NULL;
   }
 
-  return s->s_cur = se;
+  s->s_cur = i;
+  return &s->s_entries[i];
+}
+
+
+/**
+ * Entries never change once published so the returned pointer stays
+ * valid until subtitles_destroy()
+ */
+subtitle_entry_t *
+subtitles_pick(subtitles_t *s, int64_t pts)
+{
+  subtitle_entry_t *se;
+
+  hts_mutex_lock(&s->s_mutex);
+  se = subtitles_pick_locked(s, pts);
+  hts_mutex_unlock(&s->s_mutex);
+  return se;
 }
 
 
 /**
  *
  */
-subtitles_t *
-subtitles_load(const char *url)
+static char *
+subtitles_load_data(const char *url, size_t *lenp)
 {
-  subtitles_t *sub;
   char errbuf[256];
   struct fa_stat fs;
-  int datalen;
   char *data = fa_quickload(url, &fs, NULL, errbuf, sizeof(errbuf));
 
   if(data == NULL) {
@@ -361,19 +434,69 @@ subtitles_load(const char *url)
       return NULL;
     }
     data = inflated;
-    datalen = inflatedlen;
+    *lenp = inflatedlen;
   } else {
-    datalen = fs.fs_size;
+    *lenp = fs.fs_size;
+  }
+  return data;
+}
+
+
+/**
+ *
+ */
+typedef struct subtitles_loader {
+  subtitles_t *sl_sub;
+  char *sl_url;
+} subtitles_loader_t;
+
+
+/**
+ *
+ */
+static void *
+subtitles_load_thread(void *aux)
+{
+  subtitles_loader_t *sl = aux;
+  subtitles_t *s = sl->sl_sub;
+  size_t len;
+  char *data;
+
+  /* No point in loading if the player already is done with us */
+  if(s->s_refcount > 1 &&
+     (data = subtitles_load_data(sl->sl_url, &len)) != NULL) {
+
+    if(is_srt(data, len))
+      load_srt(s, data, len);
+    else
+      TRACE(TRACE_ERROR, "Subtitles", "Unable to load %s -- Unknown format", 
+	    sl->sl_url);
+    free(data);
   }
 
-  sub = subtitles_create(data, datalen);
+  subtitles_release(s);
+  free(sl->sl_url);
+  free(sl);
+  return NULL;
+}
 
-  free(data);
 
-  if(sub == NULL)
-    TRACE(TRACE_ERROR, "Subtitles", "Unable to load %s -- Unknown format", 
-	  url);
-  return sub;
+/**
+ * Loading and parsing is done in the background so a large (or
+ * remote) file does not delay playback
+ */
+subtitles_t *
+subtitles_load(const char *url)
+{
+  subtitles_loader_t *sl = malloc(sizeof(subtitles_loader_t));
+  subtitles_t *s = subtitles_alloc();
+
+  s->s_refcount++;
+  sl->sl_sub = s;
+  sl->sl_url = strdup(url);
+  hts_thread_create_detached("subtitles", subtitles_load_thread, sl,
+			     THREAD_PRIO_LOW);
+  return s;
 }
 
 
@@ -20,23 +20,31 @@
 #define SUBTITLES_H_
 
 #include "arch/atomic.h"
-#include "misc/redblack.h"
+#include "arch/threads.h"
 
 struct media_buf;
 
-RB_HEAD(subtitle_entry_tree, subtitle_entry);
-
 typedef struct subtitle_entry {
-  char *se_text;
   int64_t se_start;
   int64_t se_stop;
-  RB_ENTRY(subtitle_entry) se_link;
+  const char *se_text;  // Points into s_text of the owning subtitles_t
 } subtitle_entry_t;
 
 
+/**
+ * Entries are kept sorted on se_start in a single array. When loaded
+ * via subtitles_load() the array is filled in by a background thread,
+ * until then subtitles_pick() just returns NULL
+ */
 typedef struct subtitles {
-  struct subtitle_entry_tree s_entries;
-  subtitle_entry_t *s_cur;
+  hts_mutex_t s_mutex;
+  int s_refcount;
+
+  subtitle_entry_t *s_entries;
+  int s_num_entries;
+  char *s_text;
+
+  int s_cur;  // Index of entry last returned by subtitles_pick()
 } subtitles_t;
 
 subtitles_t *subtitles_create(const char *buf, size_t len);
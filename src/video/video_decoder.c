@@ -124,8 +124,8 @@ vd_decode_video(video_decoder_t *vd, media_queue_t *mq, media_buf_t *mb)
   if(mb->mb_skip == 2)
     vd->vd_skip = 1;
 
-  if(mp->mp_stats)
-    avgtime_start(&vd->vd_decode_time);
+  /* Always measured, the frame timing telemetry wants it too */
+  avgtime_start(&vd->vd_decode_time);
 
   avcodec_decode_video(ctx, frame, &got_pic, mb->mb_data, mb->mb_size);
 
@@ -133,6 +133,8 @@ vd_decode_video(video_decoder_t *vd, media_queue_t *mq, media_buf_t *mb)
     avgtime_stop(&vd->vd_decode_time, mq->mq_prop_decode_avg,
 		 mq->mq_prop_decode_peak);
     mp_set_mq_meta(mq, cw->codec, cw->codec_ctx);
+  } else {
+    avgtime_stop(&vd->vd_decode_time, NULL, NULL);
   }
 
   if(got_pic == 0 || mb->mb_skip == 1) 
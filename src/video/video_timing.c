@@ -0,0 +1,192 @@
+/*
+ *  Video frame timing telemetry
+ *  Copyright (C) 2011 Andreas Öman
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#include <libavutil/avutil.h>
+
+#include "showtime.h"
+#include "arch/threads.h"
+#include "htsmsg/htsbuf.h"
+#include "video_timing.h"
+
+/* About half a minute at 60Hz */
+#define VT_RING_SIZE 2048
+
+static hts_mutex_t vt_mutex;
+static video_timing_sample_t vt_ring[VT_RING_SIZE];
+static unsigned int vt_head;  // Total number of samples recorded
+
+
+/**
+ *
+ */
+void
+video_timing_init(void)
+{
+  hts_mutex_init(&vt_mutex);
+}
+
+
+/**
+ * Called from the UI thread once per rendered video frame
+ */
+void
+video_timing_record(const video_timing_sample_t *vts)
+{
+  hts_mutex_lock(&vt_mutex);
+  vt_ring[vt_head & (VT_RING_SIZE - 1)] = *vts;
+  vt_head++;
+  hts_mutex_unlock(&vt_mutex);
+}
+
+
+/**
+ *
+ */
+void
+video_timing_clear(void)
+{
+  hts_mutex_lock(&vt_mutex);
+  vt_head = 0;
+  hts_mutex_unlock(&vt_mutex);
+}
+
+
+/**
+ * Copy out the ring, oldest sample first
+ */
+static video_timing_sample_t *
+vt_snapshot(int *nump)
+{
+  video_timing_sample_t *v;
+  int i, n, first;
+
+  hts_mutex_lock(&vt_mutex);
+
+  n = vt_head < VT_RING_SIZE ? vt_head : VT_RING_SIZE;
+  first = vt_head - n;
+  v = n > 0 ? malloc(n * sizeof(video_timing_sample_t)) : NULL;
+  for(i = 0; i < n; i++)
+    v[i] = vt_ring[(first + i) & (VT_RING_SIZE - 1)];
+
+  hts_mutex_unlock(&vt_mutex);
+  *nump = n;
+  return v;
+}
+
+
+/**
+ * Summary followed by one tab separated line per frame
+ */
+void
+video_timing_format(htsbuf_queue_t *q)
+{
+  video_timing_sample_t *v, *s;
+  int i, n, dropped = 0, repeated = 0, late = 0, maxerr = 0, maxavd = 0;
+  double sum = 0, sum2 = 0, mean = 0, sd = 0;
+
+  v = vt_snapshot(&n);
+
+  for(i = 0; i < n; i++) {
+    s = &v[i];
+    dropped  += s->vts_dropped;
+    repeated += s->vts_repeated;
+    if(abs(s->vts_vsync_error) > maxerr)
+      maxerr = abs(s->vts_vsync_error);
+    if(abs(s->vts_avdiff) > maxavd)
+      maxavd = abs(s->vts_avdiff);
+    /* Missed at least one vsync */
+    if(s->vts_vsync_error > (s->vts_interval - s->vts_vsync_error) / 2)
+      late++;
+    sum  += s->vts_interval;
+    sum2 += (double)s->vts_interval * s->vts_interval;
+  }
+
+  if(n > 0) {
+    mean = sum / n;
+    sd = sqrt(fmax(sum2 / n - mean * mean, 0));
+  }
+
+  htsbuf_qprintf(q,
+		 "# frames:%d dropped:%d repeated:%d late:%d\n"
+		 "# interval mean:%.0f stddev:%.0f max_vsync_error:%d\n"
+		 "# max_avdiff:%d\n",
+		 n, dropped, repeated, late, mean, sd, maxerr, maxavd);
+
+  htsbuf_qprintf(q, "#time\tpts\tinterval\tvsync_error\toutput_duration\t"
+		 "decode_time\tqueue\tdropped\trepeated\tavdiff\tavdiff_x\n");
+
+  for(i = 0; i < n; i++) {
+    s = &v[i];
+    htsbuf_qprintf(q, "%"PRId64"\t", s->vts_time);
+    if(s->vts_pts == AV_NOPTS_VALUE)
+      htsbuf_qprintf(q, "-\t");
+    else
+      htsbuf_qprintf(q, "%"PRId64"\t", s->vts_pts);
+
+    htsbuf_qprintf(q, "%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%f\n",
+		   s->vts_interval, s->vts_vsync_error,
+		   s->vts_output_duration, s->vts_decode_time,
+		   s->vts_queue_depth, s->vts_dropped, s->vts_repeated,
+		   s->vts_avdiff, s->vts_avdiff_x);
+  }
+  free(v);
+}
+
+
+/**
+ *
+ */
+int
+video_timing_dump(const char *path, char *errbuf, size_t errlen)
+{
+  htsbuf_queue_t q;
+  htsbuf_data_t *hd;
+  FILE *fp;
+  int r = 0;
+
+  if((fp = fopen(path, "w")) == NULL) {
+    snprintf(errbuf, errlen, "%s", strerror(errno));
+    return -1;
+  }
+
+  htsbuf_queue_init(&q, 0);
+  video_timing_format(&q);
+
+  TAILQ_FOREACH(hd, &q.hq_q, hd_link)
+    if(fwrite(hd->hd_data + hd->hd_data_off,
+	      hd->hd_data_len - hd->hd_data_off, 1, fp) != 1)
+      r = -1;
+
+  if(fclose(fp))
+    r = -1;
+
+  htsbuf_queue_flush(&q);
+
+  if(r)
+    snprintf(errbuf, errlen, "Write error");
+  else
+    TRACE(TRACE_INFO, "Video", "Frame timing written to %s", path);
+  return r;
+}
@@ -0,0 +1,54 @@
+/*
+ *  Video frame timing telemetry
+ *  Copyright (C) 2011 Andreas Öman
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef VIDEO_TIMING_H__
+#define VIDEO_TIMING_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct htsbuf_queue;
+
+/**
+ * One sample per rendered video frame. All times are in µs
+ */
+typedef struct video_timing_sample {
+  int64_t vts_time;            // Frame start (gr_frame_start)
+  int64_t vts_pts;             // PTS presented, AV_NOPTS_VALUE if none
+  int vts_interval;            // Time since previous frame start
+  int vts_vsync_error;         // vts_interval - nominal frame duration
+  int vts_output_duration;     // Video time advanced this frame
+  int vts_decode_time;         // Time for most recent decode
+  int vts_avdiff;              // Raw A/V difference
+  float vts_avdiff_x;          // .. and after the kalman filter
+  uint8_t vts_queue_depth;     // Decoded surfaces waiting for display
+  uint8_t vts_dropped;         // Frames skipped since previous sample
+  uint8_t vts_repeated;        // No new frame, last one shown again
+} video_timing_sample_t;
+
+void video_timing_init(void);
+
+void video_timing_record(const video_timing_sample_t *vts);
+
+void video_timing_clear(void);
+
+void video_timing_format(struct htsbuf_queue *q);
+
+int video_timing_dump(const char *path, char *errbuf, size_t errlen);
+
+#endif // VIDEO_TIMING_H__